@@ -493,6 +493,27 @@ rpmostree_container_builtin_upgrade (int argc, char **argv,
   if (!roc_context_prepare_for_root (rocctx, treespec, cancellable, error))
     goto out;
 
+  /* If we solved the same inputs before, we can tell whether anything changed
+   * without loading the sack */
+  { gboolean solved = FALSE;
+
+    if (!rpmostree_context_lookup_cached_solution (rocctx->ctx, NULL, &solved,
+                                                   cancellable, error))
+      goto out;
+
+    if (solved)
+      {
+        g_autofree char *new_state_sha512 = rpmostree_context_get_state_sha512 (rocctx->ctx);
+
+        if (strcmp (new_state_sha512, previous_state_sha512) == 0)
+          {
+            g_print ("No changes in inputs to %s (%s)\n", name, commit_checksum);
+            exit_status = EXIT_SUCCESS;
+            goto out;
+          }
+      }
+  }
+
   if (!rpmostree_context_prepare (rocctx->ctx, cancellable, error))
     goto out;
 
@@ -42,6 +42,8 @@
 static gboolean opt_selinux = FALSE;
 static gboolean opt_ostree_convention = FALSE;
 
+#define UNPACK_MAX_THREADS 8
+
 static GOptionEntry option_entries[] = {
   { "selinux", 0, 0, G_OPTION_ARG_NONE, &opt_selinux,
       "Enable setting SELinux labels", NULL },
@@ -50,6 +52,186 @@ static GOptionEntry option_entries[] = {
   { NULL }
 };
 
+typedef struct {
+  char *path;
+  guint64 size;
+  guint64 bytes_read;
+  char *branch;
+  char *checksum; /* NULL if the branch was already up to date */
+} UnpackItem;
+
+static void
+unpack_item_free (UnpackItem *item)
+{
+  g_free (item->path);
+  g_free (item->branch);
+  g_free (item->checksum);
+  g_free (item);
+}
+
+typedef struct {
+  OstreeRepo *repo;
+  /* With --selinux, idle policies for the workers to take; see
+   * take_sepolicy() */
+  GAsyncQueue *sepolicies;
+  int rootfs_dfd;
+  GMutex sepolicy_lock;
+  RpmOstreeUnpackerFlags flags;
+  GHashTable *refs; /* rpmostree/pkg refs -> commit, from before we started */
+  GPtrArray *items;
+} UnpackData;
+
+static gboolean
+add_item (GPtrArray   *items,
+          int          dfd,
+          const char  *name,
+          const char  *path,
+          GError     **error)
+{
+  struct stat stbuf;
+
+  if (fstatat (dfd, name, &stbuf, 0) < 0)
+    return glnx_throw_errno_prefix (error, "fstatat(%s)", path);
+
+  UnpackItem *item = g_new0 (UnpackItem, 1);
+  item->path = g_strdup (path);
+  item->size = stbuf.st_size;
+  g_ptr_array_add (items, item);
+  return TRUE;
+}
+
+/* Add @path, or all the RPMs in it if it's a directory */
+static gboolean
+collect_rpms (const char   *path,
+              GPtrArray    *items,
+              GCancellable *cancellable,
+              GError      **error)
+{
+  struct stat stbuf;
+
+  if (stat (path, &stbuf) < 0)
+    return glnx_throw_errno_prefix (error, "stat(%s)", path);
+
+  if (!S_ISDIR (stbuf.st_mode))
+    return add_item (items, AT_FDCWD, path, path, error);
+
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  if (!glnx_dirfd_iterator_init_at (AT_FDCWD, path, TRUE, &dfd_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct dirent *dent = NULL;
+
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent,
+                                                       cancellable, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+
+      if (dent->d_type != DT_REG || !g_str_has_suffix (dent->d_name, ".rpm"))
+        continue;
+
+      g_autofree char *subpath = g_build_filename (path, dent->d_name, NULL);
+      if (!add_item (items, dfd_iter.fd, dent->d_name, subpath, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Whether @branch already points to a commit of the exact same RPM */
+static gboolean
+branch_is_up_to_date (UnpackData  *data,
+                      const char  *branch,
+                      const char  *header_sha256,
+                      gboolean    *out_up_to_date,
+                      GError     **error)
+{
+  const char *rev = g_hash_table_lookup (data->refs, branch);
+  g_autoptr(GVariant) commit = NULL;
+  const char *commit_sha256 = NULL;
+
+  *out_up_to_date = FALSE;
+
+  if (!rev)
+    return TRUE;
+
+  if (!ostree_repo_load_commit (data->repo, rev, &commit, NULL, error))
+    return FALSE;
+
+  g_autoptr(GVariant) metadata = g_variant_get_child_value (commit, 0);
+  *out_up_to_date =
+    g_variant_lookup (metadata, "rpmostree.metadata_sha256", "&s", &commit_sha256) &&
+    g_str_equal (commit_sha256, header_sha256);
+  return TRUE;
+}
+
+/* An OstreeSePolicy's label lookups aren't thread-safe, so each worker labels
+ * with its own policy, taking an idle one or loading a new one; there are thus
+ * at most as many as there are workers. Loading is serialized, since it sets
+ * libselinux's process-wide policy root.
+ */
+static gboolean
+take_sepolicy (UnpackData      *data,
+               OstreeSePolicy **out_sepolicy,
+               GCancellable    *cancellable,
+               GError         **error)
+{
+  OstreeSePolicy *sepolicy = g_async_queue_try_pop (data->sepolicies);
+  if (!sepolicy)
+    {
+      g_mutex_lock (&data->sepolicy_lock);
+      gboolean success =
+        rpmostree_prepare_rootfs_get_sepolicy (data->rootfs_dfd, &sepolicy,
+                                               cancellable, error);
+      g_mutex_unlock (&data->sepolicy_lock);
+      if (!success)
+        return FALSE;
+    }
+
+  *out_sepolicy = sepolicy;
+  return TRUE;
+}
+
+static gboolean
+unpack_one (guint          i,
+            gpointer       user_data,
+            GCancellable  *cancellable,
+            GError       **error)
+{
+  UnpackData *data = user_data;
+  UnpackItem *item = data->items->pdata[i];
+  g_autoptr(RpmOstreeUnpacker) unpacker =
+    rpmostree_unpacker_new_at (AT_FDCWD, item->path, NULL, data->flags, error);
+  if (!unpacker)
+    return FALSE;
+
+  const char *header_sha256 = rpmostree_unpacker_get_header_sha256 (unpacker);
+  item->branch = g_strdup (rpmostree_unpacker_get_ostree_branch (unpacker));
+
+  gboolean up_to_date = FALSE;
+  if (!branch_is_up_to_date (data, item->branch, header_sha256, &up_to_date, error))
+    return FALSE;
+
+  if (!up_to_date)
+    {
+      glnx_unref_object OstreeSePolicy *sepolicy = NULL;
+      if (data->sepolicies && !take_sepolicy (data, &sepolicy, cancellable, error))
+        return FALSE;
+
+      if (!rpmostree_unpacker_write_commit (unpacker, data->repo, sepolicy,
+                                            &item->checksum, cancellable, error))
+        return glnx_prefix_error (error, "Unpacking %s", item->path);
+
+      if (sepolicy)
+        g_async_queue_push (data->sepolicies, g_steal_pointer (&sepolicy));
+    }
+
+  item->bytes_read = rpmostree_unpacker_get_bytes_read (unpacker);
+  return TRUE;
+}
+
 int
 rpmostree_ex_builtin_unpack (int             argc,
                              char          **argv,
@@ -58,13 +240,17 @@ rpmostree_ex_builtin_unpack (int             argc,
                              GError        **error)
 {
   int exit_status = EXIT_FAILURE;
-  g_autoptr(GOptionContext) context = g_option_context_new ("REPO RPM");
+  g_autoptr(GOptionContext) context = g_option_context_new ("REPO RPM|DIR...");
   RpmOstreeUnpackerFlags flags = 0;
-  glnx_unref_object RpmOstreeUnpacker *unpacker = NULL;
   const char *target;
-  const char *rpmpath;
   glnx_unref_object OstreeRepo *ostree_repo = NULL;
   glnx_unref_object OstreeSePolicy *sepolicy = NULL;
+  glnx_fd_close int rootfs_dfd = -1;
+  g_autoptr(GAsyncQueue) sepolicies = NULL;
+  g_autoptr(GPtrArray) items =
+    g_ptr_array_new_with_free_func ((GDestroyNotify)unpack_item_free);
+  g_autoptr(GHashTable) refs = NULL;
+  gboolean in_transaction = FALSE;
 
   if (!rpmostree_option_context_parse (context,
                                        option_entries,
@@ -82,7 +268,6 @@ rpmostree_ex_builtin_unpack (int             argc,
     }
 
   target = argv[1];
-  rpmpath = argv[2];
 
   {
     g_autoptr(GFile) ostree_repo_file = g_file_new_for_path (target);
@@ -95,33 +280,97 @@ rpmostree_ex_builtin_unpack (int             argc,
   if (opt_ostree_convention)
     flags |= RPMOSTREE_UNPACKER_FLAGS_OSTREE_CONVENTION;
 
-  unpacker = rpmostree_unpacker_new_at (AT_FDCWD, rpmpath, NULL, flags, error);
-  if (!unpacker)
+  for (int i = 2; i < argc; i++)
+    {
+      if (!collect_rpms (argv[i], items, cancellable, error))
+        goto out;
+    }
+
+  if (items->len == 0)
+    {
+      exit_status = EXIT_SUCCESS;
+      goto out;
+    }
+
+  if (!ostree_repo_list_refs_ext (ostree_repo, "rpmostree/pkg", &refs,
+                                  OSTREE_REPO_LIST_REFS_EXT_NONE, cancellable,
+                                  error))
     goto out;
 
-  /* just use current policy */
+  /* just use current policy; load it once up front to fail early */
   if (opt_selinux)
     {
-      glnx_fd_close int rootfs_dfd = -1;
       if (!glnx_opendirat (AT_FDCWD, "/", TRUE, &rootfs_dfd, error))
         goto out;
       if (!rpmostree_prepare_rootfs_get_sepolicy (rootfs_dfd, &sepolicy,
                                                   cancellable, error))
         goto out;
+      sepolicies = g_async_queue_new_full (g_object_unref);
+      g_async_queue_push (sepolicies, g_steal_pointer (&sepolicy));
     }
 
   {
-    const char *branch = rpmostree_unpacker_get_ostree_branch (unpacker);
-    g_autofree char *checksum = NULL;
+    UnpackData data = { .repo = ostree_repo, .sepolicies = sepolicies,
+                        .rootfs_dfd = rootfs_dfd, .flags = flags,
+                        .refs = refs, .items = items, };
+    const gint64 start_time = g_get_monotonic_time ();
+    guint n_imported = 0;
+    guint64 bytes_imported = 0;
+    guint64 bytes_read = 0;
+
+    /* All the RPMs go into one transaction */
+    if (!ostree_repo_prepare_transaction (ostree_repo, NULL, cancellable, error))
+      goto out;
+    in_transaction = TRUE;
+
+    g_mutex_init (&data.sepolicy_lock);
+    gboolean unpacked =
+      rpmostree_run_parallel ("unpack", items->len, UNPACK_MAX_THREADS,
+                              unpack_one, &data, cancellable, error);
+    g_mutex_clear (&data.sepolicy_lock);
+    if (!unpacked)
+      goto out;
+
+    for (guint i = 0; i < items->len; i++)
+      {
+        UnpackItem *item = items->pdata[i];
+
+        bytes_read += item->bytes_read;
+
+        if (!item->checksum)
+          {
+            g_print ("Skipped %s: %s is up to date\n", item->path, item->branch);
+            continue;
+          }
+
+        ostree_repo_transaction_set_ref (ostree_repo, NULL, item->branch,
+                                         item->checksum);
+        g_print ("Imported %s to %s -> %s\n", item->path, item->branch,
+                 item->checksum);
+        n_imported++;
+        bytes_imported += item->size;
+      }
 
-    if (!rpmostree_unpacker_unpack_to_ostree (unpacker, ostree_repo, sepolicy,
-                                              &checksum, cancellable, error))
+    if (!ostree_repo_commit_transaction (ostree_repo, NULL, cancellable, error))
       goto out;
+    in_transaction = FALSE;
 
-    g_print ("Imported %s to %s -> %s\n", rpmpath, branch, checksum);
+    if (items->len > 1)
+      {
+        const double elapsed_secs =
+          MAX ((g_get_monotonic_time () - start_time) / (double)G_USEC_PER_SEC, 0.001);
+        g_autofree char *size = g_format_size (bytes_imported);
+        g_autofree char *rate = g_format_size ((guint64)(bytes_imported / elapsed_secs));
+        g_autofree char *read = g_format_size (bytes_read);
+        g_print ("Imported %u RPM%s (%s) in %.1fs: %.1f RPMs/s, %s/s; %u skipped; %s read\n",
+                 n_imported, n_imported == 1 ? "" : "s", size, elapsed_secs,
+                 n_imported / elapsed_secs, rate, items->len - n_imported, read);
+      }
   }
 
   exit_status = EXIT_SUCCESS;
  out:
+  if (in_transaction)
+    (void) ostree_repo_abort_transaction (ostree_repo, cancellable, NULL);
   return exit_status;
 }
@@ -160,9 +160,540 @@ add_package_refs_to_set (RpmOstreeRefSack *rsack,
   return TRUE;
 }
 
+/* Add the pkgcache branches @deployment needs to @referenced_pkgs. Layers
+ * record them in their commit metadata; for older ones, we have to go through
+ * the rpmdb.
+ */
+static gboolean
+add_deployment_package_refs (OstreeSysroot    *sysroot,
+                             OstreeRepo       *repo,
+                             OstreeDeployment *deployment,
+                             GHashTable       *referenced_pkgs,
+                             GCancellable     *cancellable,
+                             GError          **error)
+{
+  g_autoptr(GVariant) commit = NULL;
+  if (!ostree_repo_load_commit (repo, ostree_deployment_get_csum (deployment),
+                                &commit, NULL, error))
+    return FALSE;
+
+  g_autoptr(GVariant) metadata = g_variant_get_child_value (commit, 0);
+  g_autofree char **cache_refs = NULL;
+  if (g_variant_lookup (metadata, "rpmostree.pkgcache-refs", "^a&s", &cache_refs))
+    {
+      for (char **it = cache_refs; it && *it; it++)
+        g_hash_table_add (referenced_pkgs, g_strdup (*it));
+      return TRUE;
+    }
+
+  g_autoptr(RpmOstreeRefSack) rsack = NULL;
+  g_autofree char *deployment_dirpath =
+    ostree_sysroot_get_deployment_dirpath (sysroot, deployment);
+
+  /* We could do this via the commit object, but it's faster
+   * to reuse the existing rpmdb checkout.
+   */
+  rsack = rpmostree_get_refsack_for_root (ostree_sysroot_get_fd (sysroot),
+                                          deployment_dirpath,
+                                          cancellable, error);
+  if (rsack == NULL)
+    return FALSE;
+
+  return add_package_refs_to_set (rsack, referenced_pkgs, cancellable, error);
+}
+
+/* A prune has to know which objects the remaining pkgcache branches still
+ * reach, and walking all of them each time costs nearly as much as a full
+ * prune. So we keep an index in the pkgcache: its branches as of the last
+ * prune, and for each object reachable from them, how many of those branches
+ * reach it. A prune then only walks the branches added or dropped since.
+ */
+#define PKGCACHE_INDEX "rpmostree-prune-index"
+#define PKGCACHE_INDEX_TYPE "(a{ss}a((su)u))"
+
+/* Returns %FALSE if there is no index, or it's unreadable; the caller then
+ * rebuilds it with a full prune. */
+static gboolean
+pkgcache_index_load (OstreeRepo  *pkgcache_repo,
+                     GHashTable **out_branches,
+                     GHashTable **out_refcounts)
+{
+  g_autofree char *abspath =
+    glnx_fdrel_abspath (ostree_repo_get_dfd (pkgcache_repo), PKGCACHE_INDEX);
+  g_autoptr(GError) local_error = NULL;
+  char *contents;
+  gsize len;
+
+  if (!g_file_get_contents (abspath, &contents, &len, &local_error))
+    {
+      if (!g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        sd_journal_print (LOG_WARNING, "Ignoring pkgcache index: %s",
+                          local_error->message);
+      return FALSE;
+    }
+
+  g_autoptr(GVariant) v =
+    g_variant_ref_sink (g_variant_new_from_data (G_VARIANT_TYPE (PKGCACHE_INDEX_TYPE),
+                                                 contents, len, FALSE, g_free, contents));
+  if (!g_variant_is_normal_form (v))
+    {
+      sd_journal_print (LOG_WARNING, "Ignoring corrupted pkgcache index");
+      return FALSE;
+    }
+
+  g_autoptr(GHashTable) branches =
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_autoptr(GHashTable) refcounts = ostree_repo_traverse_new_reachable ();
+  g_autoptr(GVariant) branches_v = g_variant_get_child_value (v, 0);
+  g_autoptr(GVariant) refcounts_v = g_variant_get_child_value (v, 1);
+  GVariantIter iter;
+  const char *ref;
+  const char *commit;
+  GVariant *object;
+  guint32 count;
+
+  g_variant_iter_init (&iter, branches_v);
+  while (g_variant_iter_next (&iter, "{&s&s}", &ref, &commit))
+    g_hash_table_insert (branches, g_strdup (ref), g_strdup (commit));
+
+  g_variant_iter_init (&iter, refcounts_v);
+  while (g_variant_iter_next (&iter, "(@(su)u)", &object, &count))
+    g_hash_table_insert (refcounts, object, GUINT_TO_POINTER (count));
+
+  *out_branches = g_steal_pointer (&branches);
+  *out_refcounts = g_steal_pointer (&refcounts);
+  return TRUE;
+}
+
+static gboolean
+pkgcache_index_save (OstreeRepo   *pkgcache_repo,
+                     GHashTable   *branches,
+                     GHashTable   *refcounts,
+                     GCancellable *cancellable,
+                     GError      **error)
+{
+  GVariantBuilder builder;
+  GHashTableIter it;
+  gpointer key, value;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE (PKGCACHE_INDEX_TYPE));
+
+  g_variant_builder_open (&builder, G_VARIANT_TYPE ("a{ss}"));
+  g_hash_table_iter_init (&it, branches);
+  while (g_hash_table_iter_next (&it, &key, &value))
+    g_variant_builder_add (&builder, "{ss}", key, value);
+  g_variant_builder_close (&builder);
+
+  g_variant_builder_open (&builder, G_VARIANT_TYPE ("a((su)u)"));
+  g_hash_table_iter_init (&it, refcounts);
+  while (g_hash_table_iter_next (&it, &key, &value))
+    g_variant_builder_add (&builder, "(@(su)u)", key, GPOINTER_TO_UINT (value));
+  g_variant_builder_close (&builder);
+
+  g_autoptr(GVariant) v = g_variant_ref_sink (g_variant_builder_end (&builder));
+  return glnx_file_replace_contents_at (ostree_repo_get_dfd (pkgcache_repo),
+                                        PKGCACHE_INDEX,
+                                        g_variant_get_data (v),
+                                        g_variant_get_size (v),
+                                        0, cancellable, error);
+}
+
+/* Add @delta (1 or -1) to the refcounts of the objects reachable from
+ * @commit. If @candidates is given, the objects are also added to it, as
+ * objects that may now be unreferenced.
+ */
+static gboolean
+pkgcache_index_adjust (OstreeRepo   *pkgcache_repo,
+                       const char   *commit,
+                       int           delta,
+                       GHashTable   *refcounts,
+                       GHashTable   *candidates,
+                       GCancellable *cancellable,
+                       GError      **error)
+{
+  g_autoptr(GHashTable) reachable = ostree_repo_traverse_new_reachable ();
+  GHashTableIter it;
+  gpointer key;
+
+  if (!ostree_repo_traverse_commit_union (pkgcache_repo, commit, 0, reachable,
+                                          cancellable, error))
+    return FALSE;
+
+  g_hash_table_iter_init (&it, reachable);
+  while (g_hash_table_iter_next (&it, &key, NULL))
+    {
+      GVariant *object = key;
+      guint count = GPOINTER_TO_UINT (g_hash_table_lookup (refcounts, object));
+
+      if (delta > 0)
+        count++;
+      else if (count > 0)
+        count--;
+
+      if (count > 0)
+        g_hash_table_replace (refcounts, g_variant_ref (object), GUINT_TO_POINTER (count));
+      else
+        g_hash_table_remove (refcounts, object);
+
+      if (candidates)
+        g_hash_table_add (candidates, g_variant_ref (object));
+    }
+
+  return TRUE;
+}
+
+/* With no usable index, do a full prune of the pkgcache, and index all of its
+ * branches from scratch.
+ */
+static gboolean
+prune_pkgcache_full (OstreeRepo   *pkgcache_repo,
+                     GHashTable   *current_refs,
+                     guint        *out_n_pruned,
+                     guint64      *out_freed_space,
+                     GCancellable *cancellable,
+                     GError      **error)
+{
+  g_autoptr(GHashTable) refcounts = ostree_repo_traverse_new_reachable ();
+  GHashTableIter it;
+  gpointer value;
+  gint n_objects_total;
+  gint n_objects_pruned;
+
+  if (!ostree_repo_prune (pkgcache_repo, OSTREE_REPO_PRUNE_FLAGS_REFS_ONLY, 0,
+                          &n_objects_total, &n_objects_pruned, out_freed_space,
+                          cancellable, error))
+    return FALSE;
+  *out_n_pruned = n_objects_pruned;
+
+  g_hash_table_iter_init (&it, current_refs);
+  while (g_hash_table_iter_next (&it, NULL, &value))
+    {
+      if (!pkgcache_index_adjust (pkgcache_repo, value, 1, refcounts, NULL,
+                                  cancellable, error))
+        return FALSE;
+    }
+
+  return pkgcache_index_save (pkgcache_repo, current_refs, refcounts,
+                              cancellable, error);
+}
+
+/* Bring @refcounts up to date with @current_refs, adding the objects that may
+ * now be unreferenced to @candidates; see prune_pkgcache().
+ */
+static gboolean
+pkgcache_index_update (OstreeRepo   *pkgcache_repo,
+                       GHashTable   *indexed_branches,
+                       GHashTable   *refcounts,
+                       GHashTable   *current_refs,
+                       GHashTable   *evicted,
+                       GHashTable   *candidates,
+                       gboolean     *out_changed,
+                       GCancellable *cancellable,
+                       GError      **error)
+{
+  gboolean changed = FALSE;
+  GHashTableIter it;
+  gpointer key, value;
+
+  /* Branches imported since the last prune */
+  g_hash_table_iter_init (&it, current_refs);
+  while (g_hash_table_iter_next (&it, &key, &value))
+    {
+      if (g_strcmp0 (g_hash_table_lookup (indexed_branches, key), value) == 0)
+        continue;
+      if (!pkgcache_index_adjust (pkgcache_repo, value, 1, refcounts, NULL,
+                                  cancellable, error))
+        return FALSE;
+      changed = TRUE;
+    }
+
+  /* Indexed branches that are gone, or point to another commit now */
+  g_hash_table_iter_init (&it, indexed_branches);
+  while (g_hash_table_iter_next (&it, &key, &value))
+    {
+      if (g_strcmp0 (g_hash_table_lookup (current_refs, key), value) == 0)
+        continue;
+      if (!pkgcache_index_adjust (pkgcache_repo, value, -1, refcounts, candidates,
+                                  cancellable, error))
+        return FALSE;
+      changed = TRUE;
+    }
+
+  /* Branches imported and dropped since the last prune, which the index never
+   * counted */
+  g_hash_table_iter_init (&it, evicted);
+  while (g_hash_table_iter_next (&it, &key, &value))
+    {
+      if (g_strcmp0 (g_hash_table_lookup (indexed_branches, key), value) == 0)
+        continue;
+      if (!ostree_repo_traverse_commit_union (pkgcache_repo, value, 0, candidates,
+                                              cancellable, error))
+        return FALSE;
+      changed = TRUE;
+    }
+
+  *out_changed = changed;
+  return TRUE;
+}
+
+/* Delete the objects that no pkgcache branch reaches anymore. @current_refs
+ * are the branches left, and @evicted the ones we just dropped, both mapping
+ * ref to commit. Only the branches that were added, dropped or changed since
+ * the last prune are walked; see PKGCACHE_INDEX.
+ */
+static gboolean
+prune_pkgcache (OstreeRepo   *pkgcache_repo,
+                GHashTable   *current_refs,
+                GHashTable   *evicted,
+                guint        *out_n_pruned,
+                guint64      *out_freed_space,
+                GCancellable *cancellable,
+                GError      **error)
+{
+  g_autoptr(GHashTable) indexed_branches = NULL;
+  g_autoptr(GHashTable) refcounts = NULL;
+  g_autoptr(GHashTable) candidates = ostree_repo_traverse_new_reachable ();
+  g_autoptr(GError) local_error = NULL;
+  gboolean changed = FALSE;
+  GHashTableIter it;
+  gpointer key;
+  guint n_pruned = 0;
+  guint64 freed_space = 0;
+
+  *out_n_pruned = 0;
+  *out_freed_space = 0;
+
+  if (!pkgcache_index_load (pkgcache_repo, &indexed_branches, &refcounts))
+    return prune_pkgcache_full (pkgcache_repo, current_refs, out_n_pruned,
+                                out_freed_space, cancellable, error);
+
+  if (!pkgcache_index_update (pkgcache_repo, indexed_branches, refcounts,
+                              current_refs, evicted, candidates, &changed,
+                              cancellable, &local_error))
+    {
+      /* E.g. someone pruned the pkgcache behind our back */
+      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
+        }
+      sd_journal_print (LOG_WARNING, "Rebuilding pkgcache index: %s",
+                        local_error->message);
+      return prune_pkgcache_full (pkgcache_repo, current_refs, out_n_pruned,
+                                  out_freed_space, cancellable, error);
+    }
+
+  if (!changed)
+    return TRUE;
+
+  /* From here on, the index may refer to objects we deleted; if we're
+   * interrupted, rebuild it next time rather than trust it. */
+  if (unlinkat (ostree_repo_get_dfd (pkgcache_repo), PKGCACHE_INDEX, 0) < 0)
+    return glnx_throw_errno_prefix (error, "unlinkat(%s)", PKGCACHE_INDEX);
+
+  g_hash_table_iter_init (&it, candidates);
+  while (g_hash_table_iter_next (&it, &key, NULL))
+    {
+      GVariant *object = key;
+      const char *checksum;
+      OstreeObjectType objtype;
+      guint64 storage_size = 0;
+
+      if (g_hash_table_contains (refcounts, object))
+        continue;
+
+      ostree_object_name_deserialize (object, &checksum, &objtype);
+
+      if (!ostree_repo_query_object_storage_size (pkgcache_repo, objtype, checksum,
+                                                  &storage_size, cancellable, error))
+        return FALSE;
+      if (!ostree_repo_delete_object (pkgcache_repo, objtype, checksum,
+                                      cancellable, error))
+        return FALSE;
+
+      n_pruned++;
+      freed_space += storage_size;
+    }
+
+  *out_n_pruned = n_pruned;
+  *out_freed_space = freed_space;
+  return pkgcache_index_save (pkgcache_repo, current_refs, refcounts,
+                              cancellable, error);
+}
+
+/* Load the optional pkgcache budget from the "rpmostree" group of the system
+ * repo config. Zero means unlimited; if neither is set, orphaned branches are
+ * always evicted.
+ */
+static gboolean
+get_pkgcache_budget (OstreeRepo  *repo,
+                     guint64     *out_max_size,
+                     guint64     *out_max_packages,
+                     GError     **error)
+{
+  GKeyFile *config = ostree_repo_get_config (repo); /* borrowed */
+  const char *keys[] = { "pkgcache-max-size", "pkgcache-max-packages" };
+  guint64 *values[] = { out_max_size, out_max_packages };
+
+  for (guint i = 0; i < G_N_ELEMENTS (keys); i++)
+    {
+      g_autofree char *value = g_key_file_get_value (config, "rpmostree", keys[i], NULL);
+      char *end = NULL;
+      *values[i] = 0;
+      if (!value)
+        continue;
+      *values[i] = g_ascii_strtoull (value, &end, 10);
+      if (end == value || *end != '\0')
+        return glnx_throw (error, "Invalid value '%s' for rpmostree.%s", value, keys[i]);
+    }
+
+  return TRUE;
+}
+
+/* Returns the last-use timestamp of pkgcache branch @ref; see
+ * touch_pkgcache_branch() in rpmostree-core.c.
+ */
+static gint64
+get_pkgcache_ref_mtime (OstreeRepo *pkgcache_repo,
+                        const char *ref)
+{
+  g_autofree char *refpath = g_strconcat ("refs/heads/", ref, NULL);
+  struct stat stbuf;
+
+  if (fstatat (ostree_repo_get_dfd (pkgcache_repo), refpath, &stbuf, 0) < 0)
+    return 0;
+  return stbuf.st_mtim.tv_sec;
+}
+
+/* Add to @out_size the storage size of the objects of @commit which aren't
+ * already in @accounted, and add them to it. This makes objects shared
+ * between branches count only once.
+ */
+static gboolean
+add_unaccounted_commit_size (OstreeRepo   *pkgcache_repo,
+                             const char   *commit,
+                             GHashTable   *accounted,
+                             guint64      *out_size,
+                             GCancellable *cancellable,
+                             GError      **error)
+{
+  g_autoptr(GHashTable) reachable = ostree_repo_traverse_new_reachable ();
+  GHashTableIter it;
+  gpointer key;
+  guint64 size = 0;
+
+  if (!ostree_repo_traverse_commit_union (pkgcache_repo, commit, 0, reachable,
+                                          cancellable, error))
+    return FALSE;
+
+  g_hash_table_iter_init (&it, reachable);
+  while (g_hash_table_iter_next (&it, &key, NULL))
+    {
+      GVariant *object = key;
+      const char *checksum;
+      OstreeObjectType objtype;
+      guint64 storage_size = 0;
+
+      if (g_hash_table_contains (accounted, object))
+        continue;
+
+      ostree_object_name_deserialize (object, &checksum, &objtype);
+      if (!ostree_repo_query_object_storage_size (pkgcache_repo, objtype, checksum,
+                                                  &storage_size, cancellable, error))
+        return FALSE;
+
+      g_hash_table_add (accounted, g_variant_ref (object));
+      size += storage_size;
+    }
+
+  *out_size += size;
+  return TRUE;
+}
+
+typedef struct {
+  const char *ref;
+  const char *commit;
+  gint64 last_used;
+} PkgcacheOrphan;
+
+static int
+compare_orphans_most_recent_first (gconstpointer a,
+                                   gconstpointer b)
+{
+  const PkgcacheOrphan *oa = a;
+  const PkgcacheOrphan *ob = b;
+
+  if (oa->last_used != ob->last_used)
+    return oa->last_used > ob->last_used ? -1 : 1;
+  return strcmp (oa->ref, ob->ref);
+}
+
+/* Given the pkgcache branches that no deployment references, figure out which
+ * ones to evict. With no budget, that's all of them. Otherwise, keep the most
+ * recently used ones for as long as the cache (including the referenced
+ * branches, which are never evicted) stays within budget.
+ */
+static gboolean
+select_pkgcache_evictions (OstreeRepo   *repo,
+                           OstreeRepo   *pkgcache_repo,
+                           GArray       *orphans,
+                           GPtrArray    *remaining_commits,
+                           gboolean     *out_have_budget,
+                           guint        *out_n_retained,
+                           GCancellable *cancellable,
+                           GError      **error)
+{
+  guint64 max_size, max_packages;
+  if (!get_pkgcache_budget (repo, &max_size, &max_packages, error))
+    return FALSE;
+
+  *out_n_retained = 0;
+  *out_have_budget = (max_size > 0 || max_packages > 0);
+  if (!*out_have_budget)
+    return TRUE;
+
+  g_array_sort (orphans, compare_orphans_most_recent_first);
+
+  guint64 n_packages = remaining_commits->len;
+  guint64 size = 0;
+  g_autoptr(GHashTable) accounted = ostree_repo_traverse_new_reachable ();
+  if (max_size > 0)
+    {
+      for (guint i = 0; i < remaining_commits->len; i++)
+        {
+          if (!add_unaccounted_commit_size (pkgcache_repo, remaining_commits->pdata[i],
+                                            accounted, &size, cancellable, error))
+            return FALSE;
+        }
+    }
+
+  guint n_retained = 0;
+  for (; n_retained < orphans->len; n_retained++)
+    {
+      PkgcacheOrphan *orphan = &g_array_index (orphans, PkgcacheOrphan, n_retained);
+
+      if (max_packages > 0 && n_packages + 1 > max_packages)
+        break;
+      if (max_size > 0)
+        {
+          if (!add_unaccounted_commit_size (pkgcache_repo, orphan->commit,
+                                            accounted, &size, cancellable, error))
+            return FALSE;
+          if (size > max_size)
+            break;
+        }
+
+      n_packages++;
+    }
+
+  *out_n_retained = n_retained;
+  return TRUE;
+}
+
 /* Loop over all deployments, gathering all referenced NEVRAs for
  * layered packages.  Then delete any cached pkg refs that aren't in
- * that set.
+ * that set (or, if a pkgcache budget is configured, the least recently
+ * used ones that don't fit), along with the objects only they used.
  */
 static gboolean
 clean_pkgcache_orphans (OstreeSysroot            *sysroot,
@@ -176,12 +707,16 @@ clean_pkgcache_orphans (OstreeSysroot            *sysroot,
   g_autoptr(GHashTable) current_refs = NULL;
   g_autoptr(GHashTable) referenced_pkgs = /* cache refs of packages we want to keep */
     g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(GHashTable) evicted = /* ref -> commit */
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_autoptr(GPtrArray) remaining_commits = g_ptr_array_new ();
+  g_autoptr(GArray) orphans = g_array_new (FALSE, FALSE, sizeof (PkgcacheOrphan));
+  gboolean have_budget = FALSE;
+  guint n_retained = 0;
   GHashTableIter hiter;
   gpointer hkey, hvalue;
-  gint n_objects_total;
-  gint n_objects_pruned;
-  guint64 freed_space;
-  guint n_freed = 0;
+  guint n_objects_pruned = 0;
+  guint64 freed_space = 0;
 
   if (!rpmostree_get_pkgcache_repo (repo, &pkgcache_repo, cancellable, error))
     return FALSE;
@@ -197,22 +732,8 @@ clean_pkgcache_orphans (OstreeSysroot            *sysroot,
 
       if (is_layered)
         {
-          g_autoptr(RpmOstreeRefSack) rsack = NULL;
-          g_autofree char *deployment_dirpath = NULL;
-
-          deployment_dirpath = ostree_sysroot_get_deployment_dirpath (sysroot, deployment);
-
-          /* We could do this via the commit object, but it's faster
-           * to reuse the existing rpmdb checkout.
-           */
-          rsack = rpmostree_get_refsack_for_root (ostree_sysroot_get_fd (sysroot),
-                                                  deployment_dirpath,
-                                                  cancellable, error);
-          if (rsack == NULL)
-            return FALSE;
-
-          if (!add_package_refs_to_set (rsack, referenced_pkgs,
-                                        cancellable, error))
+          if (!add_deployment_package_refs (sysroot, repo, deployment, referenced_pkgs,
+                                            cancellable, error))
             return FALSE;
         }
     }
@@ -227,23 +748,57 @@ clean_pkgcache_orphans (OstreeSysroot            *sysroot,
     {
       const char *ref = hkey;
       if (g_hash_table_contains (referenced_pkgs, ref))
-        continue;
+        g_ptr_array_add (remaining_commits, hvalue);
+      else
+        {
+          PkgcacheOrphan orphan = { ref, hvalue, get_pkgcache_ref_mtime (pkgcache_repo, ref) };
+          g_array_append_val (orphans, orphan);
+        }
+    }
 
-      if (!ostree_repo_set_ref_immediate (pkgcache_repo, NULL, ref, NULL,
-                                          cancellable, error))
-        return FALSE;
-      n_freed++;
+  if (!select_pkgcache_evictions (repo, pkgcache_repo, orphans, remaining_commits,
+                                  &have_budget, &n_retained, cancellable, error))
+    return FALSE;
+
+  if (!ostree_repo_prepare_transaction (pkgcache_repo, NULL, cancellable, error))
+    return FALSE;
+
+  for (guint i = n_retained; i < orphans->len; i++)
+    {
+      PkgcacheOrphan *orphan = &g_array_index (orphans, PkgcacheOrphan, i);
+      ostree_repo_transaction_set_refspec (pkgcache_repo, orphan->ref, NULL);
+      g_hash_table_insert (evicted, g_strdup (orphan->ref), g_strdup (orphan->commit));
     }
 
-  if (!ostree_repo_prune (pkgcache_repo, OSTREE_REPO_PRUNE_FLAGS_REFS_ONLY, 0,
-                          &n_objects_total, &n_objects_pruned, &freed_space,
-                          cancellable, error))
+  if (!ostree_repo_commit_transaction (pkgcache_repo, NULL, cancellable, error))
+    {
+      ostree_repo_abort_transaction (pkgcache_repo, cancellable, NULL);
+      return FALSE;
+    }
+
+  /* Leave @current_refs with just the branches that are left; note this frees
+   * the orphans' strings */
+  g_hash_table_iter_init (&hiter, evicted);
+  while (g_hash_table_iter_next (&hiter, &hkey, NULL))
+    g_hash_table_remove (current_refs, hkey);
+  g_array_set_size (orphans, 0);
+  g_ptr_array_set_size (remaining_commits, 0);
+
+  const guint n_evicted = g_hash_table_size (evicted);
+  if (have_budget && n_evicted > 0)
+    rpmostree_output_task_begin ("Evicting least recently used pkgcache branches");
+
+  if (!prune_pkgcache (pkgcache_repo, current_refs, evicted,
+                       &n_objects_pruned, &freed_space, cancellable, error))
     return FALSE;
 
-  if (n_freed > 0 || freed_space > 0)
+  if (n_evicted > 0 || freed_space > 0)
     {
-      char *freed_space_str = g_format_size_full (freed_space, 0);
-      g_print ("Freed pkgcache branches: %u size: %s\n", n_freed, freed_space_str);
+      g_autofree char *freed_space_str = g_format_size_full (freed_space, 0);
+      if (have_budget && n_evicted > 0)
+        rpmostree_output_task_end ("%u evicted (%s), %u unused retained",
+                                   n_evicted, freed_space_str, n_retained);
+      g_print ("Freed pkgcache branches: %u size: %s\n", n_evicted, freed_space_str);
     }
 
   return TRUE;
@@ -38,6 +38,12 @@
 #define RPMOSTREE_TMP_BASE_REF "rpmostree/base/tmp"
 #define RPMOSTREE_TMP_ROOTFS_DIR "extensions/rpmostree/commit"
 
+/* Maps input hashes (see rpmostree_context_get_input_hash()) to the client
+ * layers assembled from them, newest first, so that we don't assemble the
+ * same commit twice. */
+#define RPMOSTREE_ASSEMBLED_INDEX "extensions/rpmostree/assembled-index"
+#define RPMOSTREE_ASSEMBLED_INDEX_MAX_ENTRIES 16
+
 /**
  * SECTION:rpmostree-sysroot-upgrader
  * @title: Simple upgrade class
@@ -731,6 +737,220 @@ prepare_context_for_assembly (RpmOstreeSysrootUpgrader *self,
   return TRUE;
 }
 
+/* Returns the a(ss) index, or %NULL if there is none (or it's unreadable; it's
+ * just a cache). */
+static GVariant *
+assembled_index_load (OstreeRepo *repo)
+{
+  g_autofree char *abspath =
+    glnx_fdrel_abspath (ostree_repo_get_dfd (repo), RPMOSTREE_ASSEMBLED_INDEX);
+  g_autoptr(GError) local_error = NULL;
+  char *contents;
+  gsize len;
+
+  if (!g_file_get_contents (abspath, &contents, &len, &local_error))
+    {
+      if (!g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_debug ("Ignoring assembled index: %s", local_error->message);
+      return NULL;
+    }
+
+  g_autoptr(GVariant) v =
+    g_variant_ref_sink (g_variant_new_from_data (G_VARIANT_TYPE ("a(ss)"),
+                                                 contents, len, FALSE, g_free, contents));
+  if (!g_variant_is_normal_form (v))
+    {
+      g_debug ("Ignoring corrupted assembled index");
+      return NULL;
+    }
+
+  return g_steal_pointer (&v);
+}
+
+/* Look for a previously assembled client layer on top of @base_revision with
+ * the same @input_hash. The commit metadata is double-checked, and the commit
+ * may of course have been pruned since. */
+static gboolean
+assembled_index_lookup (OstreeRepo  *repo,
+                        const char  *base_revision,
+                        const char  *input_hash,
+                        char       **out_commit,
+                        GError     **error)
+{
+  g_autoptr(GVariant) index = assembled_index_load (repo);
+  const char *hash, *commit;
+  GVariantIter iter;
+
+  *out_commit = NULL;
+
+  if (!index)
+    return TRUE;
+
+  g_variant_iter_init (&iter, index);
+  while (g_variant_iter_next (&iter, "(&s&s)", &hash, &commit))
+    {
+      g_autoptr(GVariant) commit_v = NULL;
+      g_autoptr(GError) local_error = NULL;
+
+      if (!g_str_equal (hash, input_hash))
+        continue;
+
+      if (!ostree_repo_load_commit (repo, commit, &commit_v, NULL, &local_error))
+        {
+          if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+            {
+              g_propagate_error (error, g_steal_pointer (&local_error));
+              return FALSE;
+            }
+          return TRUE;
+        }
+
+      g_autoptr(GVariant) metadata = g_variant_get_child_value (commit_v, 0);
+      g_autofree char *parent = ostree_commit_get_parent (commit_v);
+      const char *commit_hash = NULL;
+      if (g_strcmp0 (parent, base_revision) == 0 &&
+          g_variant_lookup (metadata, "rpmostree.inputhash", "&s", &commit_hash) &&
+          g_str_equal (commit_hash, input_hash))
+        *out_commit = g_strdup (commit);
+      return TRUE;
+    }
+
+  return TRUE;
+}
+
+/* Record @commit for @input_hash, dropping entries for pruned commits and
+ * anything beyond the newest few. */
+static gboolean
+assembled_index_add (OstreeRepo   *repo,
+                     const char   *input_hash,
+                     const char   *commit,
+                     GCancellable *cancellable,
+                     GError      **error)
+{
+  g_autoptr(GVariant) index = assembled_index_load (repo);
+  GVariantBuilder builder;
+  guint n_entries = 1;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ss)"));
+  g_variant_builder_add (&builder, "(ss)", input_hash, commit);
+
+  if (index)
+    {
+      const char *hash, *csum;
+      GVariantIter iter;
+
+      g_variant_iter_init (&iter, index);
+      while (n_entries < RPMOSTREE_ASSEMBLED_INDEX_MAX_ENTRIES &&
+             g_variant_iter_next (&iter, "(&s&s)", &hash, &csum))
+        {
+          gboolean exists = FALSE;
+
+          if (g_str_equal (hash, input_hash))
+            continue;
+          if (!ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_COMMIT, csum,
+                                       &exists, cancellable, error))
+            return FALSE;
+          if (!exists)
+            continue;
+
+          g_variant_builder_add (&builder, "(ss)", hash, csum);
+          n_entries++;
+        }
+    }
+
+  g_autoptr(GVariant) v = g_variant_ref_sink (g_variant_builder_end (&builder));
+  return glnx_file_replace_contents_at (ostree_repo_get_dfd (repo),
+                                        RPMOSTREE_ASSEMBLED_INDEX,
+                                        g_variant_get_data (v),
+                                        g_variant_get_size (v),
+                                        GLNX_FILE_REPLACE_NODATASYNC,
+                                        cancellable, error);
+}
+
+/* The input hash doesn't cover the host /etc that goes into a regenerated
+ * initramfs, nor whether scripts were skipped. */
+static gboolean
+assembled_commit_is_cacheable (RpmOstreeSysrootUpgrader *self)
+{
+  return !rpmostree_origin_get_regenerate_initramfs (self->origin) &&
+         !(self->flags & RPMOSTREE_SYSROOT_UPGRADER_FLAGS_PKGOVERLAY_NOSCRIPTS);
+}
+
+/* Use the previously assembled client layer for @input_hash, if any, as our
+ * final revision. */
+static gboolean
+reuse_assembled_commit (RpmOstreeSysrootUpgrader *self,
+                        const char               *input_hash,
+                        gboolean                 *out_reused,
+                        GError                  **error)
+{
+  g_autofree char *assembled = NULL;
+
+  *out_reused = FALSE;
+
+  if (!assembled_index_lookup (self->repo, self->base_revision, input_hash,
+                               &assembled, error))
+    return FALSE;
+
+  if (assembled)
+    {
+      rpmostree_output_task_begin ("Reusing assembled commit %.7s", assembled);
+      g_free (self->final_revision);
+      self->final_revision = g_steal_pointer (&assembled);
+      rpmostree_output_task_end ("done");
+      *out_reused = TRUE;
+    }
+
+  return TRUE;
+}
+
+/* Summarize how the files we had to modify were copied out of the repo;
+ * on reflink-capable filesystems this should be all reflinks. */
+static void
+print_copyup_stats (const RpmOstreeCopyupStats *stats)
+{
+  const guint n_total = stats->n_reflinked + stats->n_copy_range + stats->n_copied;
+  if (n_total == 0)
+    return;
+
+  g_autofree char *reflinked = g_format_size (stats->bytes_reflinked);
+  g_autofree char *copied = g_format_size (stats->bytes_copy_range + stats->bytes_copied);
+  rpmostree_output_task_begin ("Copied up %u files", n_total);
+  rpmostree_output_task_end ("%u reflinked (%s not written), %u copy_file_range, %u copied (%s written)",
+                             stats->n_reflinked, reflinked, stats->n_copy_range,
+                             stats->n_copied, copied);
+  sd_journal_print (LOG_INFO, "Copied up %u files: %u reflinked (%s not written), "
+                    "%u copy_file_range, %u copied (%s written)", n_total, stats->n_reflinked,
+                    reflinked, stats->n_copy_range, stats->n_copied, copied);
+}
+
+/* If the merge deployment is layered, try to carry its package layer over to
+ * the new base rather than assembling it from scratch; see
+ * rpmostree_context_rebase_layer().
+ */
+static gboolean
+rebase_previous_layer (RpmOstreeSysrootUpgrader *self,
+                       RpmOstreeContext         *ctx,
+                       gboolean                 *out_rebased,
+                       GCancellable             *cancellable,
+                       GError                  **error)
+{
+  gboolean is_layered = FALSE;
+
+  *out_rebased = FALSE;
+
+  if (!rpmostree_deployment_get_layered_info (self->repo, self->origin_merge_deployment,
+                                              &is_layered, NULL, NULL, NULL, error))
+    return FALSE;
+  if (!is_layered)
+    return TRUE;
+
+  return rpmostree_context_rebase_layer (ctx, self->tmprootfs_dfd, self->devino_cache,
+                                         self->base_revision,
+                                         ostree_deployment_get_csum (self->origin_merge_deployment),
+                                         out_rebased, cancellable, error);
+}
+
 static gboolean
 do_local_assembly (RpmOstreeSysrootUpgrader *self,
                    GCancellable             *cancellable,
@@ -772,6 +992,41 @@ do_local_assembly (RpmOstreeSysrootUpgrader *self,
                                   g_hash_table_size (local_pkgs) > 0 ||
                                   g_hash_table_size (overrides_remove) > 0);
 
+  const gboolean dry_run =
+    (self->flags & RPMOSTREE_SYSROOT_UPGRADER_FLAGS_DRY_RUN) > 0;
+  const gboolean cacheable = have_packages && assembled_commit_is_cacheable (self);
+  g_autofree char *input_hash = NULL;
+  gboolean reused = FALSE;
+
+  /* If we solved the same inputs before, we might have assembled them too; in
+   * that case we don't need to load the sack at all. Likewise for a dry run,
+   * where the solution is all we need. */
+  if (cacheable)
+    {
+      gboolean solved = FALSE;
+      if (!rpmostree_context_lookup_cached_solution (ctx, self->base_revision, &solved,
+                                                     cancellable, error))
+        return FALSE;
+
+      if (solved && dry_run)
+        {
+          rpmostree_output_task_begin ("Resolving dependencies");
+          rpmostree_output_task_end ("done (cache hit)");
+          rpmostree_context_print_cached_solution (ctx);
+          return TRUE; /* Note early return */
+        }
+      else if (solved)
+        {
+          input_hash = rpmostree_context_get_input_hash (ctx, self->base_revision, error);
+          if (!input_hash)
+            return FALSE;
+          if (!reuse_assembled_commit (self, input_hash, &reused, error))
+            return FALSE;
+          if (reused)
+            return TRUE; /* Note early return */
+        }
+    }
+
   if (have_packages)
     {
       if (!rpmostree_context_prepare (ctx, cancellable, error))
@@ -780,31 +1035,53 @@ do_local_assembly (RpmOstreeSysrootUpgrader *self,
   else
     rpmostree_context_set_is_empty (ctx);
 
-  if (self->flags & RPMOSTREE_SYSROOT_UPGRADER_FLAGS_DRY_RUN)
+  if (dry_run)
     {
       if (have_packages)
         rpmostree_print_transaction (rpmostree_context_get_hif (ctx));
       return TRUE; /* Note early return */
     }
 
-  if (have_packages)
+  if (cacheable && input_hash == NULL)
     {
-      if (!rpmostree_context_download (ctx, cancellable, error))
-        return FALSE;
-      if (!rpmostree_context_import (ctx, cancellable, error))
+      input_hash = rpmostree_context_get_input_hash (ctx, self->base_revision, error);
+      if (!input_hash)
         return FALSE;
-      if (!rpmostree_context_relabel (ctx, cancellable, error))
+      if (!reuse_assembled_commit (self, input_hash, &reused, error))
         return FALSE;
+      if (reused)
+        return TRUE; /* Note early return */
+    }
 
+  if (have_packages)
+    {
       g_clear_pointer (&self->final_revision, g_free);
-      gboolean noscripts =
-        (self->flags & RPMOSTREE_SYSROOT_UPGRADER_FLAGS_PKGOVERLAY_NOSCRIPTS) > 0;
 
-      /* --- override/overlay and commit --- */
-      if (!rpmostree_context_assemble_tmprootfs (ctx, self->tmprootfs_dfd,
-                                                 self->devino_cache, noscripts,
-                                                 cancellable, error))
+      gboolean rebased = FALSE;
+      if (!rebase_previous_layer (self, ctx, &rebased, cancellable, error))
         return FALSE;
+
+      if (!rebased)
+        {
+          if (!rpmostree_context_download (ctx, cancellable, error))
+            return FALSE;
+          if (!rpmostree_context_import (ctx, cancellable, error))
+            return FALSE;
+          if (!rpmostree_context_relabel (ctx, cancellable, error))
+            return FALSE;
+
+          gboolean noscripts =
+            (self->flags & RPMOSTREE_SYSROOT_UPGRADER_FLAGS_PKGOVERLAY_NOSCRIPTS) > 0;
+
+          /* --- override/overlay and commit --- */
+          if (!rpmostree_context_assemble_tmprootfs (ctx, self->tmprootfs_dfd,
+                                                     self->devino_cache, noscripts,
+                                                     cancellable, error))
+            return FALSE;
+        }
+
+      /* Both paths may copy up files, e.g. to regenerate the rpmdb */
+      print_copyup_stats (rpmostree_context_get_copyup_stats (ctx));
     }
 
   if (!rpmostree_rootfs_postprocess_common (self->tmprootfs_dfd, cancellable, error))
@@ -832,17 +1109,47 @@ do_local_assembly (RpmOstreeSysrootUpgrader *self,
                      &kernel_path, &initramfs_path);
       g_assert (initramfs_path);
 
-      if (!rpmostree_run_dracut (self->tmprootfs_dfd, add_dracut_argv, kver,
-                                 initramfs_path, &initramfs_tmpf,
-                                 cancellable, error))
+      g_autofree char *cache_key =
+        rpmostree_initramfs_cache_compute_key (self->tmprootfs_dfd, kver, kernel_path,
+                                               initramfs_path, add_dracut_argv,
+                                               cancellable, error);
+      if (!cache_key)
+        return FALSE;
+
+      gboolean cache_hit = FALSE;
+      if (!rpmostree_initramfs_cache_lookup (self->repo, cache_key, self->tmprootfs_dfd,
+                                             &cache_hit, &initramfs_tmpf,
+                                             cancellable, error))
         return FALSE;
 
+      if (cache_hit)
+        {
+          /* rpmostree_run_dracut() would have dropped it after the rebuild */
+          if (unlinkat (self->tmprootfs_dfd, initramfs_path, 0) < 0)
+            return glnx_throw_errno_prefix (error, "unlinkat(%s)", initramfs_path);
+        }
+      else
+        {
+          if (!rpmostree_run_dracut (self->tmprootfs_dfd, add_dracut_argv, kver,
+                                     initramfs_path, &initramfs_tmpf,
+                                     cancellable, error))
+            return FALSE;
+
+          /* The cache is just an optimization; don't fail the deployment over it */
+          g_autoptr(GError) local_error = NULL;
+          if (!rpmostree_initramfs_cache_store (self->repo, cache_key, kver,
+                                                &initramfs_tmpf, cancellable,
+                                                &local_error))
+            sd_journal_print (LOG_WARNING, "Failed to cache initramfs: %s",
+                              local_error->message);
+        }
+
       if (!rpmostree_finalize_kernel (self->tmprootfs_dfd, bootdir, kver, kernel_path,
                                       &initramfs_tmpf,
                                       cancellable, error))
         return FALSE;
 
-      rpmostree_output_task_end ("done");
+      rpmostree_output_task_end ("done (cache %s)", cache_hit ? "hit" : "miss");
     }
 
   if (!rpmostree_context_commit_tmprootfs (ctx, self->tmprootfs_dfd, self->devino_cache,
@@ -852,6 +1159,16 @@ do_local_assembly (RpmOstreeSysrootUpgrader *self,
                                            cancellable, error))
     return FALSE;
 
+  if (input_hash)
+    {
+      /* The index is just an optimization; don't fail the deployment over it */
+      g_autoptr(GError) local_error = NULL;
+      if (!assembled_index_add (self->repo, input_hash, self->final_revision,
+                                cancellable, &local_error))
+        sd_journal_print (LOG_WARNING, "Failed to update assembled commit index: %s",
+                          local_error->message);
+    }
+
   return TRUE;
 }
 
@@ -26,6 +26,156 @@
 
 #include <libglnx.h>
 
+/* Generating the variants below means loading commits and their
+ * layering metadata, and doing GPG verification; and we regenerate
+ * them for every deployment on each sysroot change.  Memoize the
+ * results per "slot" (a deployment, or a cached update for a
+ * deployment/refspec pair), and only regenerate a slot when the
+ * digest of the inputs it was generated from changes.
+ */
+typedef struct {
+  char *deployid;
+  char *key;
+  GVariant *variant;
+} VariantCacheEntry;
+
+G_LOCK_DEFINE_STATIC (variant_cache);
+static GHashTable *variant_cache; /* slot -> VariantCacheEntry */
+
+static void
+variant_cache_entry_free (VariantCacheEntry *entry)
+{
+  g_free (entry->deployid);
+  g_free (entry->key);
+  g_variant_unref (entry->variant);
+  g_slice_free (VariantCacheEntry, entry);
+}
+
+/* Returns a new reference to the cached variant for @slot if it was
+ * generated from inputs matching @key, %NULL otherwise. */
+static GVariant *
+variant_cache_lookup (const char *slot,
+                      const char *key)
+{
+  GVariant *ret = NULL;
+
+  G_LOCK (variant_cache);
+  if (variant_cache)
+    {
+      VariantCacheEntry *entry = g_hash_table_lookup (variant_cache, slot);
+      if (entry && g_str_equal (entry->key, key))
+        ret = g_variant_ref (entry->variant);
+    }
+  G_UNLOCK (variant_cache);
+
+  return ret;
+}
+
+static void
+variant_cache_insert (const char *slot,
+                      const char *deployid,
+                      const char *key,
+                      GVariant   *variant)
+{
+  VariantCacheEntry *entry = g_slice_new0 (VariantCacheEntry);
+
+  entry->deployid = g_strdup (deployid);
+  entry->key = g_strdup (key);
+  entry->variant = g_variant_ref (variant);
+
+  G_LOCK (variant_cache);
+  if (!variant_cache)
+    variant_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                           (GDestroyNotify)variant_cache_entry_free);
+  g_hash_table_replace (variant_cache, g_strdup (slot), entry);
+  G_UNLOCK (variant_cache);
+}
+
+/**
+ * rpmostreed_deployment_variant_cache_prune:
+ * @deployments: (element-type OstreeDeployment): Current deployments
+ *
+ * Drop memoized variants for deployments which are not in @deployments
+ * anymore.
+ */
+void
+rpmostreed_deployment_variant_cache_prune (GPtrArray *deployments)
+{
+  g_autoptr(GHashTable) live_ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  for (guint i = 0; deployments != NULL && i < deployments->len; i++)
+    g_hash_table_add (live_ids, rpmostreed_deployment_generate_id (deployments->pdata[i]));
+
+  G_LOCK (variant_cache);
+  if (variant_cache)
+    {
+      GHashTableIter iter;
+      gpointer value;
+
+      g_hash_table_iter_init (&iter, variant_cache);
+      while (g_hash_table_iter_next (&iter, NULL, &value))
+        {
+          VariantCacheEntry *entry = value;
+          if (!g_hash_table_contains (live_ids, entry->deployid))
+            g_hash_table_iter_remove (&iter);
+        }
+    }
+  G_UNLOCK (variant_cache);
+}
+
+static void
+checksum_update_str (GChecksum  *checksum,
+                     const char *str)
+{
+  /* Include the trailing NUL so consecutive fields can't run together */
+  if (str == NULL)
+    str = "";
+  g_checksum_update (checksum, (const guint8*)str, strlen (str) + 1);
+}
+
+/* Add the state that the GPG results for @csum depend on: whether the
+ * remote requires verification, the repo config/keyrings (approximated
+ * by the repo dir mtime, since they're replaced atomically there), and
+ * the detached metadata carrying the signatures.
+ */
+static gboolean
+checksum_update_sig_state (GChecksum    *checksum,
+                           OstreeRepo   *repo,
+                           const char   *origin_refspec,
+                           const char   *csum,
+                           GError      **error)
+{
+  g_autofree char *remote = NULL;
+  gboolean gpg_verify = FALSE;
+  g_autoptr(GVariant) detached_meta = NULL;
+  struct stat stbuf;
+
+  if (!ostree_parse_refspec (origin_refspec, &remote, NULL, error))
+    return FALSE;
+
+  if (remote)
+    {
+      if (!ostree_repo_remote_get_gpg_verify (repo, remote, &gpg_verify, error))
+        return FALSE;
+    }
+
+  checksum_update_str (checksum, gpg_verify ? "gpg-verify" : "no-gpg-verify");
+  if (!gpg_verify)
+    return TRUE;
+
+  if (fstat (ostree_repo_get_dfd (repo), &stbuf) < 0)
+    return glnx_throw_errno (error);
+  g_checksum_update (checksum, (const guint8*)&stbuf.st_mtim, sizeof (stbuf.st_mtim));
+
+  if (!ostree_repo_read_commit_detached_metadata (repo, csum, &detached_meta, NULL, error))
+    return FALSE;
+  if (detached_meta)
+    g_checksum_update (checksum, g_variant_get_data (detached_meta),
+                       g_variant_get_size (detached_meta));
+
+  return TRUE;
+}
+
 /* Get a currently unique (for this host) identifier for the
  * deployment; TODO - adding the deployment timestamp would make it
  * persistently unique, needs API in libostree.
@@ -167,12 +317,12 @@ variant_add_from_hash_table (GVariantDict *dict,
   g_variant_dict_insert (dict, key, "^as", values);
 }
 
-GVariant *
-rpmostreed_deployment_generate_variant (OstreeSysroot *sysroot,
-                                        OstreeDeployment *deployment,
-                                        const char *booted_id,
-                                        OstreeRepo *repo,
-                                        GError **error)
+static GVariant *
+deployment_generate_variant_uncached (OstreeSysroot *sysroot,
+                                      OstreeDeployment *deployment,
+                                      const char *booted_id,
+                                      OstreeRepo *repo,
+                                      GError **error)
 {
   g_autoptr(GVariant) commit = NULL;
   g_autoptr(RpmOstreeOrigin) origin = NULL;
@@ -300,18 +450,17 @@ rpmostreed_deployment_generate_variant (OstreeSysroot *sysroot,
   if (booted_id != NULL)
     g_variant_dict_insert (&dict, "booted", "b", g_strcmp0 (booted_id, id) == 0);
 
-  return g_variant_dict_end (&dict);
+  return g_variant_ref_sink (g_variant_dict_end (&dict));
 }
 
-GVariant *
-rpmostreed_commit_generate_cached_details_variant (OstreeDeployment *deployment,
-                                                   OstreeRepo *repo,
-                                                   const gchar *refspec,
-						   GError **error)
+static GVariant *
+commit_generate_cached_details_variant_uncached (OstreeDeployment *deployment,
+                                                 OstreeRepo *repo,
+                                                 const gchar *origin_refspec,
+                                                 const gchar *head,
+                                                 GError **error)
 {
   g_autoptr(GVariant) commit = NULL;
-  g_autofree gchar *origin_refspec = NULL;
-  g_autofree gchar *head = NULL;
   gboolean gpg_enabled;
   const gchar *osname;
   GVariant *sigs = NULL; /* floating variant */
@@ -319,6 +468,110 @@ rpmostreed_commit_generate_cached_details_variant (OstreeDeployment *deployment,
 
   osname = ostree_deployment_get_osname (deployment);
 
+  if (!ostree_repo_load_variant (repo,
+				 OSTREE_OBJECT_TYPE_COMMIT,
+				 head,
+				 &commit,
+				 error))
+    return NULL;
+
+  sigs = rpmostreed_deployment_gpg_results (repo, origin_refspec, head, &gpg_enabled);
+
+  g_variant_dict_init (&dict, NULL);
+  if (osname != NULL)
+    g_variant_dict_insert (&dict, "osname", "s", osname);
+  g_variant_dict_insert (&dict, "checksum", "s", head);
+  variant_add_commit_details (&dict, NULL, commit);
+  g_variant_dict_insert (&dict, "origin", "s", origin_refspec);
+  if (sigs != NULL)
+    g_variant_dict_insert_value (&dict, "signatures", sigs);
+  g_variant_dict_insert (&dict, "gpg-enabled", "b", gpg_enabled);
+  return g_variant_ref_sink (g_variant_dict_end (&dict));
+}
+
+/* Returns: (transfer full): A non-floating reference; the variant may
+ * be shared with the memoization cache.
+ */
+GVariant *
+rpmostreed_deployment_generate_variant (OstreeSysroot *sysroot,
+                                        OstreeDeployment *deployment,
+                                        const char *booted_id,
+                                        OstreeRepo *repo,
+                                        GError **error)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(RpmOstreeOrigin) origin = NULL;
+  g_autofree char *id = rpmostreed_deployment_generate_id (deployment);
+  g_autofree char *origin_data = NULL;
+  g_autofree char *base_checksum = NULL;
+  g_autofree char *pending_base_commitrev = NULL;
+  const char *refspec;
+  GKeyFile *origin_kf = ostree_deployment_get_origin (deployment);
+  GVariant *variant;
+
+  origin = rpmostree_origin_parse_deployment (deployment, error);
+  if (!origin)
+    return NULL;
+  refspec = rpmostree_origin_get_refspec (origin);
+
+  /* The origin carries the requested packages, live state and
+   * initramfs config; the rest of the variant is derived from the
+   * (immutable) deployment commit, the ref, and the GPG state. */
+  checksum_update_str (checksum, id);
+  checksum_update_str (checksum, booted_id);
+  checksum_update_str (checksum, ostree_deployment_unlocked_state_to_string (ostree_deployment_get_unlocked (deployment)));
+  if (origin_kf)
+    origin_data = g_key_file_to_data (origin_kf, NULL, NULL);
+  checksum_update_str (checksum, origin_data);
+
+  if (!rpmostree_deployment_get_layered_info (repo, deployment, NULL, &base_checksum,
+                                              NULL, NULL, error))
+    return NULL;
+  if (!ostree_repo_resolve_rev (repo, refspec, TRUE,
+                                &pending_base_commitrev, error))
+    return NULL;
+  checksum_update_str (checksum, pending_base_commitrev);
+
+  /* Failing to compute the signature state isn't fatal; we just don't
+   * memoize.  The uncached path reports such errors as it always has. */
+  if (!checksum_update_sig_state (checksum, repo, refspec,
+                                  base_checksum ?: ostree_deployment_get_csum (deployment),
+                                  &local_error))
+    {
+      g_debug ("Not caching variant for %s: %s", id, local_error->message);
+      return deployment_generate_variant_uncached (sysroot, deployment, booted_id, repo, error);
+    }
+
+  variant = variant_cache_lookup (id, g_checksum_get_string (checksum));
+  if (variant)
+    return variant;
+
+  variant = deployment_generate_variant_uncached (sysroot, deployment, booted_id, repo, error);
+  if (!variant)
+    return NULL;
+
+  variant_cache_insert (id, id, g_checksum_get_string (checksum), variant);
+  return variant;
+}
+
+/* Returns: (transfer full): A non-floating reference; the variant may
+ * be shared with the memoization cache.
+ */
+GVariant *
+rpmostreed_commit_generate_cached_details_variant (OstreeDeployment *deployment,
+                                                   OstreeRepo *repo,
+                                                   const gchar *refspec,
+						   GError **error)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autoptr(GError) local_error = NULL;
+  g_autofree gchar *origin_refspec = NULL;
+  g_autofree gchar *head = NULL;
+  g_autofree char *id = rpmostreed_deployment_generate_id (deployment);
+  g_autofree char *slot = NULL;
+  GVariant *variant;
+
   if (refspec)
     origin_refspec = g_strdup (refspec);
   else
@@ -343,23 +596,24 @@ rpmostreed_commit_generate_cached_details_variant (OstreeDeployment *deployment,
   if (head == NULL)
     head = g_strdup (ostree_deployment_get_csum (deployment));
 
-  if (!ostree_repo_load_variant (repo,
-				 OSTREE_OBJECT_TYPE_COMMIT,
-				 head,
-				 &commit,
-				 error))
-    return NULL;
+  if (!checksum_update_sig_state (checksum, repo, origin_refspec, head, &local_error))
+    {
+      g_debug ("Not caching update variant for %s: %s", id, local_error->message);
+      return commit_generate_cached_details_variant_uncached (deployment, repo, origin_refspec,
+                                                              head, error);
+    }
+  checksum_update_str (checksum, head);
 
-  sigs = rpmostreed_deployment_gpg_results (repo, origin_refspec, head, &gpg_enabled);
+  slot = g_strconcat ("cached-update:", id, ":", origin_refspec, NULL);
+  variant = variant_cache_lookup (slot, g_checksum_get_string (checksum));
+  if (variant)
+    return variant;
 
-  g_variant_dict_init (&dict, NULL);
-  if (osname != NULL)
-    g_variant_dict_insert (&dict, "osname", "s", osname);
-  g_variant_dict_insert (&dict, "checksum", "s", head);
-  variant_add_commit_details (&dict, NULL, commit);
-  g_variant_dict_insert (&dict, "origin", "s", origin_refspec);
-  if (sigs != NULL)
-    g_variant_dict_insert_value (&dict, "signatures", sigs);
-  g_variant_dict_insert (&dict, "gpg-enabled", "b", gpg_enabled);
-  return g_variant_dict_end (&dict);
+  variant = commit_generate_cached_details_variant_uncached (deployment, repo, origin_refspec,
+                                                             head, error);
+  if (!variant)
+    return NULL;
+
+  variant_cache_insert (slot, id, g_checksum_get_string (checksum), variant);
+  return variant;
 }
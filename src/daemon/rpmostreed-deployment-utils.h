@@ -36,6 +36,8 @@ GVariant *      rpmostreed_deployment_generate_variant (OstreeSysroot    *sysroo
                                                         OstreeRepo       *repo,
                                                         GError          **error);
 
+void            rpmostreed_deployment_variant_cache_prune (GPtrArray *deployments);
+
 GVariant *      rpmostreed_commit_generate_cached_details_variant (OstreeDeployment *deployment,
                                                                    OstreeRepo       *repo,
                                                                    const gchar      *refspec,
@@ -140,12 +140,12 @@ new_variant_diff_result (GVariant *diff,
 
 /* ---------------------------------------------------------------------------------------------------- */
 
-static gboolean
-os_handle_get_deployments_rpm_diff (RPMOSTreeOS *interface,
-                                    GDBusMethodInvocation *invocation,
-                                    const char *arg_deployid0,
-                                    const char *arg_deployid1)
+static void
+os_query_deployments_rpm_diff (RPMOSTreeOS *interface,
+                               GDBusMethodInvocation *invocation)
 {
+  const char *arg_deployid0;
+  const char *arg_deployid1;
   g_autoptr(GCancellable) cancellable = NULL;
   RpmostreedSysroot *global_sysroot;
   glnx_unref_object OstreeDeployment *deployment0 = NULL;
@@ -157,6 +157,9 @@ os_handle_get_deployments_rpm_diff (RPMOSTreeOS *interface,
   const gchar *ref0;
   const gchar *ref1;
 
+  g_variant_get (g_dbus_method_invocation_get_parameters (invocation),
+                 "(&s&s)", &arg_deployid0, &arg_deployid1);
+
   global_sysroot = rpmostreed_sysroot_get ();
 
   ot_sysroot = rpmostreed_sysroot_get_root (global_sysroot);
@@ -200,15 +203,13 @@ out:
       g_dbus_method_invocation_return_value (invocation,
                                              g_variant_new ("(@a(sua{sv}))", value));
     }
-
-  return TRUE;
 }
 
-static gboolean
-os_handle_get_cached_update_rpm_diff (RPMOSTreeOS *interface,
-                                      GDBusMethodInvocation *invocation,
-                                      const char *arg_deployid)
+static void
+os_query_cached_update_rpm_diff (RPMOSTreeOS *interface,
+                                 GDBusMethodInvocation *invocation)
 {
+  const char *arg_deployid;
   RpmostreedSysroot *global_sysroot;
   const gchar *name;
   g_autoptr(RpmOstreeOrigin) origin = NULL;
@@ -217,9 +218,12 @@ os_handle_get_cached_update_rpm_diff (RPMOSTreeOS *interface,
   glnx_unref_object OstreeDeployment *base_deployment = NULL;
   GCancellable *cancellable = NULL;
   GVariant *value = NULL; /* freed when invoked */
-  GVariant *details = NULL; /* freed when invoked */
+  g_autoptr(GVariant) details = NULL;
   GError *local_error = NULL;
 
+  g_variant_get (g_dbus_method_invocation_get_parameters (invocation),
+                 "(&s)", &arg_deployid);
+
   global_sysroot = rpmostreed_sysroot_get ();
 
   ot_sysroot = rpmostreed_sysroot_get_root (global_sysroot);
@@ -278,8 +282,6 @@ out:
       g_dbus_method_invocation_return_value (invocation,
                                              new_variant_diff_result (value, details));
     }
-
-  return TRUE;
 }
 
 static RpmostreedTransaction *
@@ -943,12 +945,11 @@ out:
   return TRUE;
 }
 
-static gboolean
-os_handle_get_cached_rebase_rpm_diff (RPMOSTreeOS *interface,
-                                      GDBusMethodInvocation *invocation,
-                                      const char *arg_refspec,
-                                      const char * const *arg_packages)
+static void
+os_query_cached_rebase_rpm_diff (RPMOSTreeOS *interface,
+                                 GDBusMethodInvocation *invocation)
 {
+  const char *arg_refspec;
   RpmostreedSysroot *global_sysroot;
   g_autoptr(GCancellable) cancellable = NULL;
   OstreeSysroot *ot_sysroot = NULL;
@@ -959,9 +960,11 @@ os_handle_get_cached_rebase_rpm_diff (RPMOSTreeOS *interface,
   g_autofree gchar *comp_ref = NULL;
   GError *local_error = NULL;
   GVariant *value = NULL; /* freed when invoked */
-  GVariant *details = NULL; /* freed when invoked */
+  g_autoptr(GVariant) details = NULL;
 
   /* TODO: Totally ignoring packages for now */
+  g_variant_get_child (g_dbus_method_invocation_get_parameters (invocation),
+                       0, "&s", &arg_refspec);
 
   global_sysroot = rpmostreed_sysroot_get ();
 
@@ -1011,8 +1014,6 @@ out:
     {
       g_dbus_method_invocation_take_error (invocation, local_error);
     }
-
-  return TRUE;
 }
 
 static gboolean
@@ -1070,12 +1071,11 @@ out:
   return TRUE;
 }
 
-static gboolean
-os_handle_get_cached_deploy_rpm_diff (RPMOSTreeOS *interface,
-                                      GDBusMethodInvocation *invocation,
-                                      const char *arg_revision,
-                                      const char * const *arg_packages)
+static void
+os_query_cached_deploy_rpm_diff (RPMOSTreeOS *interface,
+                                 GDBusMethodInvocation *invocation)
 {
+  const char *arg_revision;
   const char *base_checksum;
   const char *osname;
   OstreeSysroot *ot_sysroot = NULL;
@@ -1086,11 +1086,13 @@ os_handle_get_cached_deploy_rpm_diff (RPMOSTreeOS *interface,
   g_autofree char *version = NULL;
   g_autoptr(GCancellable) cancellable = NULL;
   GVariant *value = NULL;
-  GVariant *details = NULL;
+  g_autoptr(GVariant) details = NULL;
   GError *local_error = NULL;
   GError **error = &local_error;
 
   /* XXX Ignoring arg_packages for now. */
+  g_variant_get_child (g_dbus_method_invocation_get_parameters (invocation),
+                       0, "&s", &arg_revision);
 
   ot_sysroot = rpmostreed_sysroot_get_root (rpmostreed_sysroot_get ());
   ot_repo = rpmostreed_sysroot_get_repo (rpmostreed_sysroot_get ());
@@ -1152,8 +1154,6 @@ out:
       g_dbus_method_invocation_return_value (invocation,
 					     new_variant_diff_result (value, details));
     }
-
-  return TRUE;
 }
 
 static gboolean
@@ -1223,10 +1223,10 @@ rpmostreed_os_load_internals (RpmostreedOS *self, GError **error)
   g_autoptr(GPtrArray) deployments = NULL;
   OstreeSysroot *ot_sysroot;
   OstreeRepo *ot_repo;
-  GVariant *booted_variant = NULL;
-  GVariant *default_variant = NULL;
-  GVariant *rollback_variant = NULL;
-  GVariant *cached_update = NULL;
+  g_autoptr(GVariant) booted_variant = NULL;
+  g_autoptr(GVariant) default_variant = NULL;
+  g_autoptr(GVariant) rollback_variant = NULL;
+  g_autoptr(GVariant) cached_update = NULL;
   gboolean has_cached_updates = FALSE;
 
   name = rpmostree_os_get_name (RPMOSTREE_OS (self));
@@ -1238,11 +1238,11 @@ rpmostreed_os_load_internals (RpmostreedOS *self, GError **error)
   booted = ostree_sysroot_get_booted_deployment (ot_sysroot);
   if (booted && g_strcmp0 (ostree_deployment_get_osname (booted), name) == 0)
     {
+      booted_id = rpmostreed_deployment_generate_id (booted);
       booted_variant = rpmostreed_deployment_generate_variant (ot_sysroot, booted, booted_id,
                                                                ot_repo, error);
       if (!booted_variant)
         return FALSE;
-      booted_id = rpmostreed_deployment_generate_id (booted);
     }
 
   deployments = ostree_sysroot_get_deployments (ot_sysroot);
@@ -1296,17 +1296,17 @@ rpmostreed_os_load_internals (RpmostreedOS *self, GError **error)
    }
 
   if (!booted_variant)
-    booted_variant = rpmostreed_deployment_generate_blank_variant ();
+    booted_variant = g_variant_ref_sink (rpmostreed_deployment_generate_blank_variant ());
   rpmostree_os_set_booted_deployment (RPMOSTREE_OS (self),
                                       booted_variant);
 
   if (!default_variant)
-    default_variant = rpmostreed_deployment_generate_blank_variant ();
+    default_variant = g_variant_ref_sink (rpmostreed_deployment_generate_blank_variant ());
   rpmostree_os_set_default_deployment (RPMOSTREE_OS (self),
                                        default_variant);
 
   if (!rollback_variant)
-    rollback_variant = rpmostreed_deployment_generate_blank_variant ();
+    rollback_variant = g_variant_ref_sink (rpmostreed_deployment_generate_blank_variant ());
   rpmostree_os_set_rollback_deployment (RPMOSTREE_OS (self),
                                         rollback_variant);
 
@@ -1318,6 +1318,107 @@ rpmostreed_os_load_internals (RpmostreedOS *self, GError **error)
   return TRUE;
 }
 
+/* ---------------------------------------------------------------------------------------------------- */
+
+/* The read-only diff methods below can do a lot of rpmdb work; rather
+ * than block the main loop (and with it, transaction progress and every
+ * other client), we run them in worker threads holding a reader lock on
+ * the sysroot.  They may run concurrently with each other and with a
+ * transaction (which uses its own OstreeSysroot instance); the sysroot
+ * only takes the writer lock when reloading its state.  Reading each rpmdb
+ * into a sack goes through librpm, which isn't documented as thread-safe;
+ * that step is serialized by rpmostree_librpm_lock().
+ */
+typedef void (*OsQueryFunc) (RPMOSTreeOS           *interface,
+                             GDBusMethodInvocation *invocation);
+
+typedef struct {
+  GDBusMethodInvocation *invocation;
+  OsQueryFunc func;
+} OsQuery;
+
+static void
+os_query_free (OsQuery *query)
+{
+  g_object_unref (query->invocation);
+  g_slice_free (OsQuery, query);
+}
+
+static void
+os_query_thread (GTask        *task,
+                 gpointer      source_object,
+                 gpointer      task_data,
+                 GCancellable *cancellable)
+{
+  OsQuery *query = task_data;
+  RpmostreedSysroot *sysroot = rpmostreed_sysroot_get ();
+  g_autoptr(GMainContext) mctx = g_main_context_new ();
+
+  /* Same as for transactions; don't iterate the daemon's main context */
+  g_main_context_push_thread_default (mctx);
+
+  rpmostreed_sysroot_reader_lock (sysroot);
+  query->func (RPMOSTREE_OS (source_object), query->invocation);
+  rpmostreed_sysroot_reader_unlock (sysroot);
+
+  g_main_context_pop_thread_default (mctx);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+os_run_query_in_thread (RPMOSTreeOS           *interface,
+                        GDBusMethodInvocation *invocation,
+                        OsQueryFunc            func)
+{
+  g_autoptr(GTask) task = g_task_new (interface, NULL, NULL, NULL);
+  OsQuery *query = g_slice_new0 (OsQuery);
+
+  query->invocation = g_object_ref (invocation);
+  query->func = func;
+  g_task_set_task_data (task, query, (GDestroyNotify) os_query_free);
+  g_task_run_in_thread (task, os_query_thread);
+}
+
+static gboolean
+os_handle_get_deployments_rpm_diff (RPMOSTreeOS *interface,
+                                    GDBusMethodInvocation *invocation,
+                                    const char *arg_deployid0,
+                                    const char *arg_deployid1)
+{
+  os_run_query_in_thread (interface, invocation, os_query_deployments_rpm_diff);
+  return TRUE;
+}
+
+static gboolean
+os_handle_get_cached_update_rpm_diff (RPMOSTreeOS *interface,
+                                      GDBusMethodInvocation *invocation,
+                                      const char *arg_deployid)
+{
+  os_run_query_in_thread (interface, invocation, os_query_cached_update_rpm_diff);
+  return TRUE;
+}
+
+static gboolean
+os_handle_get_cached_rebase_rpm_diff (RPMOSTreeOS *interface,
+                                      GDBusMethodInvocation *invocation,
+                                      const char *arg_refspec,
+                                      const char * const *arg_packages)
+{
+  os_run_query_in_thread (interface, invocation, os_query_cached_rebase_rpm_diff);
+  return TRUE;
+}
+
+static gboolean
+os_handle_get_cached_deploy_rpm_diff (RPMOSTreeOS *interface,
+                                      GDBusMethodInvocation *invocation,
+                                      const char *arg_revision,
+                                      const char * const *arg_packages)
+{
+  os_run_query_in_thread (interface, invocation, os_query_cached_deploy_rpm_diff);
+  return TRUE;
+}
+
 static void
 rpmostreed_os_iface_init (RPMOSTreeOSIface *iface)
 {
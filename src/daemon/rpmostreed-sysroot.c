@@ -65,15 +65,22 @@ struct _RpmostreedSysroot {
   GHashTable *os_interfaces;
   GHashTable *osexperimental_interfaces;
 
-  /* The OS interface's various diff methods can run concurrently with
-   * transactions, which is safe except when the transaction is writing
-   * new deployments to disk or downloading RPM package details.  The
-   * writer lock protects these critical sections so the diff methods
-   * (holding reader locks) can run safely. */
+  /* The OS interface's various diff methods run in worker threads,
+   * concurrently with each other and with transactions; they hold reader
+   * locks while accessing @ot_sysroot and @repo.  The writer lock is
+   * taken when those are reloaded from the main thread. */
   GRWLock method_rw_lock;
+  /* While a reload waits for the writer lock, new readers wait for it to
+   * finish instead of taking reader locks, so a steady stream of queries
+   * can't starve it. */
+  GMutex reload_gate_lock;
+  GCond reload_gate_cond;
+  guint n_reloads_pending;
 
   GFileMonitor *monitor;
   guint sig_changed;
+  guint reload_delay_ms;
+  guint reload_source_id;
 
   guint stdout_source_id;
 };
@@ -98,6 +105,17 @@ G_DEFINE_TYPE_WITH_CODE (RpmostreedSysroot,
 
 static RpmostreedSysroot *_sysroot_instance;
 
+/* A single ostree admin operation results in a burst of events on
+ * /ostree/deploy; we coalesce those into one reload done this many
+ * milliseconds after the first event.  This can be overridden with the
+ * RPMOSTREED_RELOAD_DELAY_MS environment variable (see HACKING.md); 0 means
+ * reload synchronously on each event.
+ */
+#define SYSROOT_RELOAD_DELAY_MS_DEFAULT 250
+
+/* How often an explicit reload retries taking the writer lock */
+#define SYSROOT_RELOAD_RETRY_MS 10
+
 /* ---------------------------------------------------------------------------------------------------- */
 
 typedef struct {
@@ -449,6 +467,8 @@ sysroot_populate_deployments_unlocked (RpmostreedSysroot *self,
   g_autofree gchar *booted_id = NULL;
   g_autoptr(GPtrArray) deployments = NULL;
   g_autoptr(GHashTable) seen_osnames = NULL;
+  g_autoptr(GVariant) new_deployments = NULL;
+  g_autoptr(GVariant) published_deployments = NULL;
   GHashTableIter iter;
   gpointer hashkey;
   gpointer value;
@@ -456,6 +476,7 @@ sysroot_populate_deployments_unlocked (RpmostreedSysroot *self,
   guint i;
   gboolean sysroot_changed;
   gboolean repo_changed;
+  gboolean deployments_changed;
   struct stat repo_new_stat;
 
   if (!ostree_sysroot_load_if_changed (self->ot_sysroot, &sysroot_changed, self->cancellable, error))
@@ -505,7 +526,7 @@ sysroot_populate_deployments_unlocked (RpmostreedSysroot *self,
 
   for (i = 0; deployments != NULL && i < deployments->len; i++)
     {
-      GVariant *variant;
+      g_autoptr(GVariant) variant = NULL;
       OstreeDeployment *deployment = deployments->pdata[i];
       const char *deployment_os;
 
@@ -537,6 +558,8 @@ sysroot_populate_deployments_unlocked (RpmostreedSysroot *self,
       g_hash_table_add (seen_osnames, (char*)deployment_os);
     }
 
+  rpmostreed_deployment_variant_cache_prune (deployments);
+
   /* Remove dead os paths */
   g_hash_table_iter_init (&iter, self->os_interfaces);
   while (g_hash_table_iter_next (&iter, &hashkey, &value))
@@ -550,13 +573,24 @@ sysroot_populate_deployments_unlocked (RpmostreedSysroot *self,
         }
     }
 
-  rpmostree_sysroot_set_deployments (RPMOSTREE_SYSROOT (self),
-                                     g_variant_builder_end (&builder));
-  g_debug ("finished deployments");
+  /* Only touch the published property (and have the OS objects reload)
+   * if what we expose actually changed; most events in a burst are from
+   * intermediate states or bootloader churn we don't care about.  Note
+   * the per-deployment variants are memoized, so only the deployments
+   * which changed were regenerated above. */
+  new_deployments = g_variant_ref_sink (g_variant_builder_end (&builder));
+  published_deployments = rpmostree_sysroot_dup_deployments (RPMOSTREE_SYSROOT (self));
+  deployments_changed = !(published_deployments &&
+                          g_variant_equal (published_deployments, new_deployments));
+  if (deployments_changed)
+    rpmostree_sysroot_set_deployments (RPMOSTREE_SYSROOT (self), new_deployments);
+  g_debug ("finished deployments (%s)", deployments_changed ? "changed" : "unchanged");
 
   ret = TRUE;
+  /* The OS objects also expose the cached update, which depends on the
+   * repo refs rather than the deployment list. */
   if (out_changed)
-    *out_changed = TRUE;
+    *out_changed = deployments_changed || repo_changed;
  out:
   return ret;
 }
@@ -592,22 +626,29 @@ handle_unregister_client (RPMOSTreeSysroot *object,
   return TRUE;
 }
 
+static void
+reload_config_cb (GObject      *source_object,
+                  GAsyncResult *result,
+                  gpointer      user_data)
+{
+  RpmostreedSysroot *self = RPMOSTREED_SYSROOT (source_object);
+  g_autoptr(GDBusMethodInvocation) invocation = user_data;
+  GError *local_error = NULL;
+
+  if (!rpmostreed_sysroot_reload_finish (self, result, &local_error))
+    g_dbus_method_invocation_take_error (invocation, local_error);
+  else
+    rpmostree_sysroot_complete_reload_config (RPMOSTREE_SYSROOT (self), invocation);
+}
+
 static gboolean
 handle_reload_config (RPMOSTreeSysroot *object,
                       GDBusMethodInvocation *invocation)
 {
   RpmostreedSysroot *self = RPMOSTREED_SYSROOT (object);
-  g_autoptr(GError) local_error = NULL;
-  GError **error = &local_error;
-
-  if (!rpmostreed_sysroot_reload (self, error))
-    goto out;
-
-  rpmostree_sysroot_complete_reload_config (object, invocation);
-out:
-  if (local_error)
-    g_dbus_method_invocation_take_error (invocation, g_steal_pointer (&local_error));
 
+  rpmostreed_sysroot_reload_async (self, reload_config_cb,
+                                   g_object_ref (invocation));
   return TRUE;
 }
 
@@ -620,6 +661,12 @@ sysroot_dispose (GObject *object)
 
   g_cancellable_cancel (self->cancellable);
 
+  if (self->reload_source_id > 0)
+    {
+      g_source_remove (self->reload_source_id);
+      self->reload_source_id = 0;
+    }
+
   if (self->monitor)
     {
       if (self->sig_changed)
@@ -668,6 +715,10 @@ sysroot_finalize (GObject *object)
   g_hash_table_unref (self->os_interfaces);
   g_hash_table_unref (self->osexperimental_interfaces);
 
+  g_rw_lock_clear (&self->method_rw_lock);
+  g_mutex_clear (&self->reload_gate_lock);
+  g_cond_clear (&self->reload_gate_cond);
+
   g_clear_object (&self->cancellable);
   g_clear_object (&self->monitor);
 
@@ -687,6 +738,10 @@ rpmostreed_sysroot_init (RpmostreedSysroot *self)
 
   self->cancellable = g_cancellable_new ();
 
+  g_rw_lock_init (&self->method_rw_lock);
+  g_mutex_init (&self->reload_gate_lock);
+  g_cond_init (&self->reload_gate_cond);
+
   self->os_interfaces = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
                                                (GDestroyNotify) g_object_unref);
   self->osexperimental_interfaces = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
@@ -694,6 +749,11 @@ rpmostreed_sysroot_init (RpmostreedSysroot *self)
 
   self->monitor = NULL;
 
+  { const char *delay = g_getenv ("RPMOSTREED_RELOAD_DELAY_MS");
+    self->reload_delay_ms = delay ? g_ascii_strtoull (delay, NULL, 10)
+                                  : SYSROOT_RELOAD_DELAY_MS_DEFAULT;
+  }
+
   self->transaction_monitor = rpmostreed_transaction_monitor_new ();
 
   rpmostree_output_set_callback (sysroot_output_cb, self);
@@ -757,9 +817,13 @@ rpmostreed_sysroot_class_init (RpmostreedSysrootClass *klass)
                                    G_TYPE_NONE, 0);
 }
 
-gboolean
-rpmostreed_sysroot_reload (RpmostreedSysroot *self,
-			   GError **error)
+/* Must be called with the writer lock held; releases it before
+ * emitting "updated" (the OS objects reload from the main thread,
+ * which is the only writer).
+ */
+static gboolean
+sysroot_reload_and_unlock (RpmostreedSysroot *self,
+                           GError           **error)
 {
   gboolean ret = FALSE;
   gboolean did_change;
@@ -771,11 +835,105 @@ rpmostreed_sysroot_reload (RpmostreedSysroot *self,
 
   ret = TRUE;
  out:
+  g_rw_lock_writer_unlock (&self->method_rw_lock);
   if (ret && did_change)
     g_signal_emit (self, signals[UPDATED], 0);
   return ret;
 }
 
+static void
+reload_gate_close (RpmostreedSysroot *self)
+{
+  g_mutex_lock (&self->reload_gate_lock);
+  self->n_reloads_pending++;
+  g_mutex_unlock (&self->reload_gate_lock);
+}
+
+static void
+reload_gate_open (RpmostreedSysroot *self)
+{
+  g_mutex_lock (&self->reload_gate_lock);
+  g_assert_cmpuint (self->n_reloads_pending, >, 0);
+  if (--self->n_reloads_pending == 0)
+    g_cond_broadcast (&self->reload_gate_cond);
+  g_mutex_unlock (&self->reload_gate_lock);
+}
+
+static void reload_task_try (GTask *task);
+
+static gboolean
+on_reload_retry (gpointer user_data)
+{
+  reload_task_try (user_data);
+  return G_SOURCE_REMOVE;
+}
+
+/* Diff queries hold the reader lock from worker threads; rather than
+ * stall the main loop waiting for them, poll for the writer lock.  The
+ * reload gate is closed meanwhile, so only the queries already running
+ * hold us up.
+ */
+static void
+reload_task_try (GTask *task)
+{
+  RpmostreedSysroot *self = g_task_get_source_object (task);
+  GError *local_error = NULL;
+
+  if (!g_rw_lock_writer_trylock (&self->method_rw_lock))
+    {
+      g_timeout_add (SYSROOT_RELOAD_RETRY_MS, on_reload_retry, task);
+      return;
+    }
+
+  gboolean success = sysroot_reload_and_unlock (self, &local_error);
+  reload_gate_open (self);
+  if (!success)
+    g_task_return_error (task, local_error);
+  else
+    g_task_return_boolean (task, TRUE);
+  g_object_unref (task);
+}
+
+void
+rpmostreed_sysroot_reload_async (RpmostreedSysroot  *self,
+                                 GAsyncReadyCallback callback,
+                                 gpointer            user_data)
+{
+  reload_gate_close (self);
+  reload_task_try (g_task_new (self, NULL, callback, user_data));
+}
+
+gboolean
+rpmostreed_sysroot_reload_finish (RpmostreedSysroot *self,
+                                  GAsyncResult      *result,
+                                  GError           **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+reload_or_warn_cb (GObject      *source_object,
+                   GAsyncResult *result,
+                   gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (!rpmostreed_sysroot_reload_finish (RPMOSTREED_SYSROOT (source_object),
+                                         result, &error))
+    g_critical ("Unable to update state: %s", error->message);
+}
+
+static gboolean
+on_reload_timeout (gpointer user_data)
+{
+  RpmostreedSysroot *self = RPMOSTREED_SYSROOT (user_data);
+
+  self->reload_source_id = 0;
+  rpmostreed_sysroot_reload_async (self, reload_or_warn_cb, NULL);
+  return G_SOURCE_REMOVE;
+}
+
 static void
 on_deploy_changed (GFileMonitor *monitor,
 		   GFile *file,
@@ -784,17 +942,19 @@ on_deploy_changed (GFileMonitor *monitor,
 		   gpointer user_data)
 {
   RpmostreedSysroot *self = RPMOSTREED_SYSROOT (user_data);
-  g_autoptr(GError) error = NULL;
-  
-  if (event_type == G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED)
-    {
-      if (!rpmostreed_sysroot_reload (self, &error))
-	goto out;
-    }
 
- out:
-  if (error)
-    g_critical ("Unable to update state: %s", error->message);
+  if (event_type != G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED)
+    return;
+
+  /* If a reload is already pending, it'll pick this change up too */
+  if (self->reload_source_id > 0)
+    return;
+
+  if (self->reload_delay_ms == 0)
+    rpmostreed_sysroot_reload_async (self, reload_or_warn_cb, NULL);
+  else
+    self->reload_source_id = g_timeout_add (self->reload_delay_ms,
+                                            on_reload_timeout, self);
 }
 
 static void
@@ -875,6 +1035,25 @@ rpmostreed_sysroot_load_state (RpmostreedSysroot *self,
   return TRUE;
 }
 
+/* Not to be called from the main thread, which may be waiting for the
+ * writer lock. */
+void
+rpmostreed_sysroot_reader_lock (RpmostreedSysroot *self)
+{
+  g_mutex_lock (&self->reload_gate_lock);
+  while (self->n_reloads_pending > 0)
+    g_cond_wait (&self->reload_gate_cond, &self->reload_gate_lock);
+  g_mutex_unlock (&self->reload_gate_lock);
+
+  g_rw_lock_reader_lock (&self->method_rw_lock);
+}
+
+void
+rpmostreed_sysroot_reader_unlock (RpmostreedSysroot *self)
+{
+  g_rw_lock_reader_unlock (&self->method_rw_lock);
+}
+
 OstreeSysroot *
 rpmostreed_sysroot_get_root (RpmostreedSysroot *self)
 {
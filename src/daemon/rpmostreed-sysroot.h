@@ -34,7 +34,11 @@ RpmostreedSysroot * rpmostreed_sysroot_get              (void);
 gboolean            rpmostreed_sysroot_populate         (RpmostreedSysroot *self,
                                                          GCancellable *cancellable,
                                                          GError **error);
-gboolean            rpmostreed_sysroot_reload           (RpmostreedSysroot *self,
+void                rpmostreed_sysroot_reload_async     (RpmostreedSysroot *self,
+                                                         GAsyncReadyCallback callback,
+                                                         gpointer user_data);
+gboolean            rpmostreed_sysroot_reload_finish    (RpmostreedSysroot *self,
+                                                         GAsyncResult *result,
                                                          GError **error);
 
 OstreeSysroot *     rpmostreed_sysroot_get_root         (RpmostreedSysroot *self);
@@ -47,3 +51,6 @@ gboolean            rpmostreed_sysroot_load_state       (RpmostreedSysroot *self
                                                          GError **error);
 
 void                rpmostreed_sysroot_emit_update      (RpmostreedSysroot *self);
+
+void                rpmostreed_sysroot_reader_lock      (RpmostreedSysroot *self);
+void                rpmostreed_sysroot_reader_unlock    (RpmostreedSysroot *self);
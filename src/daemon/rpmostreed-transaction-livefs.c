@@ -21,6 +21,7 @@
 
 #include <sys/types.h>
 #include <sys/xattr.h>
+#include <libgen.h>
 #include <systemd/sd-journal.h>
 #include <libglnx.h>
 
@@ -77,10 +78,13 @@ typedef struct {
   char *from;
   char *to;
 
-  /* Files */
-  GPtrArray *added; /* Set<GFile> */
-  GPtrArray *modified; /* Set<OstreeDiffItem> */
-  GPtrArray *removed; /* Set<GFile> */
+  /* Files; these are absolute paths. Added and removed directories are
+   * single entries, their contents aren't listed separately.
+   */
+  GPtrArray *added; /* Set<char*> */
+  GPtrArray *added_dirs; /* Set<char*> */
+  GPtrArray *modified; /* Set<char*> */
+  GPtrArray *removed; /* Set<char*> */
 
   /* Package view */
   GPtrArray *removed_pkgs;
@@ -98,6 +102,7 @@ commit_diff_unref (CommitDiff *diff)
   g_free (diff->from);
   g_free (diff->to);
   g_clear_pointer (&diff->added, g_ptr_array_unref);
+  g_clear_pointer (&diff->added_dirs, g_ptr_array_unref);
   g_clear_pointer (&diff->modified, g_ptr_array_unref);
   g_clear_pointer (&diff->removed, g_ptr_array_unref);
   g_clear_pointer (&diff->removed_pkgs, g_ptr_array_unref);
@@ -111,19 +116,23 @@ static gboolean
 path_is_boot (const char *path)
 {
   return g_str_has_prefix (path, "/boot/") ||
-    g_str_has_prefix (path, "/usr/lib/ostree-boot/");
+    strcmp (path, "/boot") == 0 ||
+    g_str_has_prefix (path, "/usr/lib/ostree-boot/") ||
+    strcmp (path, "/usr/lib/ostree-boot") == 0;
 }
 
 static gboolean
 path_is_usretc (const char *path)
 {
-  return g_str_has_prefix (path, "/usr/etc/");
+  return g_str_has_prefix (path, "/usr/etc/") ||
+    strcmp (path, "/usr/etc") == 0;
 }
 
 static gboolean
 path_is_rpmdb (const char *path)
 {
-  return g_str_has_prefix (path, "/usr/share/rpm/");
+  return g_str_has_prefix (path, "/usr/share/rpm/") ||
+    strcmp (path, "/usr/share/rpm") == 0;
 }
 
 static gboolean
@@ -169,103 +178,607 @@ diff_one_path (CommitDiff        *diff,
   return FILE_DIFF_RESULT_KEEP;
 }
 
+#define LIVEFS_APPLY_MAX_THREADS 8
+
+typedef struct {
+  const char *path;
+  gboolean is_dir;
+} LiveFsApplyItem;
+
+typedef struct _LiveFsApply LiveFsApply;
+typedef gboolean (*LiveFsApplyFunc) (LiveFsApply           *apply,
+                                     const LiveFsApplyItem *item,
+                                     GError               **error);
+
+/* State shared by the workers applying one stage of the livefs changes */
+struct _LiveFsApply {
+  OstreeRepo *repo;
+  const char *target_csum;
+  int deployment_dfd;
+  OstreeSePolicy *sepolicy; /* NULL if none is loaded */
+  LiveFsApplyFunc func;
+  GPtrArray *groups; /* Array<GArray<LiveFsApplyItem>> */
+  GCancellable *cancellable;
+
+  volatile gint n_applied;
+  volatile gint n_reflinked;
+  volatile gint n_copied;
+
+  GMutex label_lock; /* selabel lookups aren't necessarily thread-safe */
+};
+
+/* Batch the added paths under @prefix in @diff by their top-level subtree (e.g.
+ * /usr/lib, /usr/bin), so that each batch can be applied independently. The
+ * diff has no nested entries for added directories, so the parent of each
+ * item already exists.
+ */
+static GPtrArray *
+group_added_paths (CommitDiff *diff,
+                   const char *prefix)
+{
+  g_autoptr(GHashTable) groups_by_subtree =
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(GPtrArray) groups =
+    g_ptr_array_new_with_free_func ((GDestroyNotify)g_array_unref);
+  GPtrArray *added_sets[] = { diff->added, diff->added_dirs };
+
+  for (guint i = 0; i < G_N_ELEMENTS (added_sets); i++)
+    {
+      for (guint j = 0; j < added_sets[i]->len; j++)
+        {
+          const char *path = added_sets[i]->pdata[j];
+          if (!g_str_has_prefix (path, prefix))
+            continue;
+
+          const char *subtree = path + strlen (prefix);
+          const char *slash = strchr (subtree, '/');
+          g_autofree char *key = slash ? g_strndup (subtree, slash - subtree) : g_strdup (subtree);
+          GArray *group = g_hash_table_lookup (groups_by_subtree, key);
+          if (!group)
+            {
+              group = g_array_new (FALSE, FALSE, sizeof (LiveFsApplyItem));
+              g_ptr_array_add (groups, group);
+              g_hash_table_insert (groups_by_subtree, g_steal_pointer (&key), group);
+            }
+
+          LiveFsApplyItem item = { path, added_sets[i] == diff->added_dirs };
+          g_array_append_val (group, item);
+        }
+    }
+
+  return g_steal_pointer (&groups);
+}
+
 static gboolean
-copy_new_config_files (OstreeRepo          *repo,
-                       OstreeDeployment    *merge_deployment,
-                       int                  new_deployment_dfd,
-                       OstreeSePolicy      *sepolicy,
-                       CommitDiff          *diff,
-                       GCancellable        *cancellable,
-                       GError             **error)
+livefs_apply_group (guint          i,
+                    gpointer       user_data,
+                    GCancellable  *cancellable,
+                    GError       **error)
 {
-  rpmostree_output_task_begin ("Copying new config files");
+  LiveFsApply *apply = user_data;
+  GArray *group = apply->groups->pdata[i];
+
+  for (guint j = 0; j < group->len; j++)
+    {
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+      if (!apply->func (apply, &g_array_index (group, LiveFsApplyItem, j), error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Run @apply->func on all items, one group per worker at a time */
+static gboolean
+livefs_apply_run (LiveFsApply  *apply,
+                  GError      **error)
+{
+  g_mutex_init (&apply->label_lock);
+  gboolean ret = rpmostree_run_parallel ("livefs-apply", apply->groups->len,
+                                         LIVEFS_APPLY_MAX_THREADS, livefs_apply_group,
+                                         apply, apply->cancellable, error);
+  g_mutex_clear (&apply->label_lock);
+  return ret;
+}
+
+/* Check out one added path from the target commit into the deployment's /usr.
+ * /usr is read-only at runtime, so we can just hardlink from the repo.
+ */
+static gboolean
+checkout_one_usr_path (LiveFsApply           *apply,
+                       const LiveFsApplyItem *item,
+                       GError               **error)
+{
+  OstreeRepoCheckoutAtOptions usr_checkout_opts = { .mode = OSTREE_REPO_CHECKOUT_MODE_NONE,
+                                                    .overwrite_mode = OSTREE_REPO_CHECKOUT_OVERWRITE_ADD_FILES,
+                                                    .no_copy_fallback = TRUE,
+                                                    .subpath = item->path };
 
-  /* Initialize checkout options; we want to make copies, and don't replace any
-   * existing files.
+  /* Like in copy_one_config_path(), files get checked out into their parent
+   * directory directly, and directories under their own name.
    */
-  OstreeRepoCheckoutAtOptions etc_co_opts = { .force_copy = TRUE,
-                                              .overwrite_mode = OSTREE_REPO_CHECKOUT_OVERWRITE_ADD_FILES };
-  /* Use SELinux policy if it's initialized */
-  if (ostree_sepolicy_get_name (sepolicy) != NULL)
-    etc_co_opts.sepolicy = sepolicy;
+  glnx_fd_close int dest_dfd = -1;
+  g_autofree char *dnbuf = g_strdup (item->path + 1);
+  if (!glnx_opendirat (apply->deployment_dfd, dirname (dnbuf), TRUE, &dest_dfd, error))
+    return FALSE;
+  const char *dest_path = item->is_dir ? glnx_basename (item->path) : ".";
+
+  if (!ostree_repo_checkout_at (apply->repo, &usr_checkout_opts, dest_dfd, dest_path,
+                                apply->target_csum, apply->cancellable, error))
+    return g_prefix_error (error, "Checking out %s: ", item->path), FALSE;
+
+  g_atomic_int_inc (&apply->n_applied);
+  return TRUE;
+}
+
+static gboolean
+checkout_add_usr (OstreeRepo   *repo,
+                  int           deployment_dfd,
+                  CommitDiff   *diff,
+                  const char   *target_csum,
+                  guint        *out_n_applied,
+                  GCancellable *cancellable,
+                  GError      **error)
+{
+  g_autoptr(GPtrArray) groups = group_added_paths (diff, "/usr/");
+  LiveFsApply apply = { .repo = repo, .target_csum = target_csum,
+                        .deployment_dfd = deployment_dfd,
+                        .func = checkout_one_usr_path, .groups = groups,
+                        .cancellable = cancellable, };
+
+  if (!livefs_apply_run (&apply, error))
+    return FALSE;
+
+  *out_n_applied = apply.n_applied;
+  return TRUE;
+}
 
-  glnx_fd_close int deployment_etc_dfd = -1;
-  if (!glnx_opendirat (new_deployment_dfd, "etc", TRUE, &deployment_etc_dfd, error))
+/* Return the xattrs of @name with the SELinux label replaced by the one for
+ * @etc_path, if we have a policy.
+ */
+static gboolean
+get_config_xattrs (LiveFsApply  *apply,
+                   int           src_dfd,
+                   const char   *name,
+                   const char   *etc_path,
+                   mode_t        mode,
+                   GVariant    **out_xattrs,
+                   GError      **error)
+{
+  g_autoptr(GVariant) xattrs = NULL;
+  if (!glnx_dfd_name_get_all_xattrs (src_dfd, name, &xattrs, apply->cancellable, error))
     return FALSE;
 
-  guint n_added = 0;
-  /* Avoid checking out added subdirs recursively */
-  g_autoptr(GPtrArray) added_subdirs = g_ptr_array_new_with_free_func (g_free);
-  for (guint i = 0; i < diff->added->len; i++)
+  if (!apply->sepolicy)
     {
-      GFile *added_f = diff->added->pdata[i];
-      const char *path = gs_file_get_path_cached (added_f);
-      if (!g_str_has_prefix (path, "/usr/etc/"))
-        continue;
-      const char *etc_path = path + strlen ("/usr");
-
-      etc_co_opts.subpath = path;
-      /* Strip off /usr for selinux labeling */
-      etc_co_opts.sepolicy_prefix = etc_path;
-
-      const char *sub_etc_relpath = etc_path + strlen ("/etc/");
-      /* We keep track of added subdirectories and skip children of it, since
-       * both the diff and checkout are recursive, but we only need to checkout
-       * the directory, which will get all children. To do better I'd say we
-       * should add an option to ostree_repo_diff() to avoid recursing into
-       * changed subdirectories.  But at the scale we're dealing with here the
-       * constants for this O(N²) algorithm are tiny.
-       */
-      if (rpmostree_str_has_prefix_in_ptrarray (sub_etc_relpath, added_subdirs))
+      *out_xattrs = g_steal_pointer (&xattrs);
+      return TRUE;
+    }
+
+  g_autofree char *label = NULL;
+  g_mutex_lock (&apply->label_lock);
+  gboolean labeled = ostree_sepolicy_get_label (apply->sepolicy, etc_path, mode, &label,
+                                                apply->cancellable, error);
+  g_mutex_unlock (&apply->label_lock);
+  if (!labeled)
+    return FALSE;
+
+  g_autoptr(GVariantBuilder) builder = g_variant_builder_new (G_VARIANT_TYPE ("a(ayay)"));
+  const guint n = g_variant_n_children (xattrs);
+  for (guint i = 0; i < n; i++)
+    {
+      const guint8 *xattr_name;
+      g_autoptr(GVariant) value = NULL;
+      g_variant_get_child (xattrs, i, "(^&ay@ay)", &xattr_name, &value);
+      if (strcmp ((const char*)xattr_name, "security.selinux") == 0)
         continue;
+      g_variant_builder_add (builder, "(@ay@ay)",
+                             g_variant_new_bytestring ((const char*)xattr_name), value);
+    }
+  if (label)
+    g_variant_builder_add (builder, "(@ay@ay)",
+                           g_variant_new_bytestring ("security.selinux"),
+                           g_variant_new_bytestring (label));
 
-      g_autoptr(GFileInfo) finfo = g_file_query_info (added_f, "standard::type",
-                                                      G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                                      cancellable, error);
-      if (!finfo)
-        return FALSE;
+  *out_xattrs = g_variant_ref_sink (g_variant_builder_end (builder));
+  return TRUE;
+}
+
+/* Copy the regular file @name, reflinking the data if the filesystem
+ * supports it (see rpmostree_copy_regfile_data()).
+ */
+static gboolean
+copy_config_regfile (LiveFsApply *apply,
+                     int          src_dfd,
+                     int          dest_dfd,
+                     const char  *name,
+                     struct stat *stbuf,
+                     GVariant    *xattrs,
+                     GError     **error)
+{
+  glnx_fd_close int src_fd = -1;
+  if (!glnx_openat_rdonly (src_dfd, name, FALSE, &src_fd, error))
+    return FALSE;
+
+  g_auto(GLnxTmpfile) tmpf = { 0, };
+  if (!glnx_open_tmpfile_linkable_at (dest_dfd, ".", O_WRONLY | O_CLOEXEC,
+                                      &tmpf, error))
+    return FALSE;
 
-      /* If this is a directory, add it to our "added subdirs" set. See above.  Add
-       * a trailing / to ensure we don't match other file prefixes.
-       */
-      const gboolean is_dir = g_file_info_get_file_type (finfo) == G_FILE_TYPE_DIRECTORY;
-      if (is_dir)
-        g_ptr_array_add (added_subdirs, g_strconcat (sub_etc_relpath, "/", NULL));
-
-      /* And now, to deal with ostree semantics around subpath checkouts,
-       * we want '.' for files, otherwise get the real dir name.  See also
-       * the comment in ostree-repo-checkout.c:checkout_tree_at().
-       */
-      /* First, get the destination parent dfd */
-      glnx_fd_close int dest_dfd = -1;
-      g_autofree char *dnbuf = g_strdup (sub_etc_relpath);
-      const char *dn = dirname (dnbuf);
-      if (!glnx_opendirat (deployment_etc_dfd, dn, TRUE, &dest_dfd, error))
+  RpmOstreeCopyMethod method;
+  if (!rpmostree_copy_regfile_data (src_fd, tmpf.fd, stbuf->st_size, &method, error))
+    return glnx_prefix_error (error, "Copying %s", name);
+  if (method == RPMOSTREE_COPY_METHOD_REFLINK)
+    g_atomic_int_inc (&apply->n_reflinked);
+  else
+    g_atomic_int_inc (&apply->n_copied);
+
+  /* chown first since it drops setuid bits */
+  if (fchown (tmpf.fd, stbuf->st_uid, stbuf->st_gid) < 0)
+    return glnx_throw_errno_prefix (error, "fchown");
+  if (fchmod (tmpf.fd, stbuf->st_mode & 07777) < 0)
+    return glnx_throw_errno_prefix (error, "fchmod");
+  if (!glnx_fd_set_all_xattrs (tmpf.fd, xattrs, apply->cancellable, error))
+    return FALSE;
+
+  /* Like the checkout's ADD_FILES, we never replace existing config */
+  if (!glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_NOREPLACE_IGNORE_EXIST,
+                             dest_dfd, name, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Recursively copy @name from @src_dfd (in /usr/etc) to @dest_dfd (in /etc),
+ * relabeling for @etc_path. Existing files are left alone.
+ */
+static gboolean
+copy_config_recurse (LiveFsApply *apply,
+                     int          src_dfd,
+                     int          dest_dfd,
+                     const char  *name,
+                     GString     *etc_path,
+                     GError     **error)
+{
+  struct stat stbuf;
+  if (fstatat (src_dfd, name, &stbuf, AT_SYMLINK_NOFOLLOW) < 0)
+    return glnx_throw_errno_prefix (error, "fstatat(%s)", etc_path->str);
+
+  g_autoptr(GVariant) xattrs = NULL;
+  if (!get_config_xattrs (apply, src_dfd, name, etc_path->str, stbuf.st_mode,
+                          &xattrs, error))
+    return FALSE;
+
+  if (S_ISDIR (stbuf.st_mode))
+    {
+      gboolean did_exist = FALSE;
+      if (mkdirat (dest_dfd, name, 0700) < 0)
+        {
+          if (errno != EEXIST)
+            return glnx_throw_errno_prefix (error, "mkdirat(%s)", etc_path->str);
+          did_exist = TRUE;
+        }
+
+      glnx_fd_close int dest_subdfd = -1;
+      if (!glnx_opendirat (dest_dfd, name, FALSE, &dest_subdfd, error))
         return FALSE;
-      const char *dest_path;
-      /* Is it a non-directory?  OK, we check out into the parent directly */
-      if (!is_dir)
+      if (!did_exist)
         {
-          dest_path = ".";
+          if (fchown (dest_subdfd, stbuf.st_uid, stbuf.st_gid) < 0)
+            return glnx_throw_errno_prefix (error, "fchown");
+          if (fchmod (dest_subdfd, stbuf.st_mode & 07777) < 0)
+            return glnx_throw_errno_prefix (error, "fchmod");
+          if (!glnx_fd_set_all_xattrs (dest_subdfd, xattrs, apply->cancellable, error))
+            return FALSE;
         }
-      else
+
+      g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+      if (!glnx_dirfd_iterator_init_at (src_dfd, name, FALSE, &dfd_iter, error))
+        return FALSE;
+
+      const gsize path_len = etc_path->len;
+      while (TRUE)
         {
-          /* For directories, we need to match the target's name and hence
-           * create a new directory. */
-          dest_path = glnx_basename (sub_etc_relpath);
+          struct dirent *dent = NULL;
+          if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, apply->cancellable, error))
+            return FALSE;
+          if (!dent)
+            break;
+
+          g_string_append_c (etc_path, '/');
+          g_string_append (etc_path, dent->d_name);
+          if (!copy_config_recurse (apply, dfd_iter.fd, dest_subdfd, dent->d_name,
+                                    etc_path, error))
+            return FALSE;
+          g_string_truncate (etc_path, path_len);
         }
 
-      if (!ostree_repo_checkout_at (repo, &etc_co_opts,
-                                    dest_dfd, dest_path,
-                                    ostree_deployment_get_csum (merge_deployment),
-                                    cancellable, error))
-        return g_prefix_error (error, "Copying %s: ", path), FALSE;
-      n_added++;
+      return TRUE;
+    }
+
+  /* Never replace existing config */
+  struct stat dest_stbuf;
+  if (fstatat (dest_dfd, name, &dest_stbuf, AT_SYMLINK_NOFOLLOW) == 0)
+    return TRUE;
+  else if (errno != ENOENT)
+    return glnx_throw_errno_prefix (error, "fstatat(%s)", etc_path->str);
+
+  if (S_ISREG (stbuf.st_mode))
+    return copy_config_regfile (apply, src_dfd, dest_dfd, name, &stbuf, xattrs, error);
+  else if (S_ISLNK (stbuf.st_mode))
+    {
+      if (!glnx_file_copy_at (src_dfd, name, &stbuf, dest_dfd, name,
+                              GLNX_FILE_COPY_NOXATTRS, apply->cancellable, error))
+        return FALSE;
+      if (!glnx_dfd_name_set_all_xattrs (dest_dfd, name, xattrs, apply->cancellable, error))
+        return FALSE;
+      g_atomic_int_inc (&apply->n_copied);
+    }
+
+  return TRUE;
+}
+
+/* Copy one added /usr/etc path from the freshly overlaid /usr into /etc */
+static gboolean
+copy_one_config_path (LiveFsApply           *apply,
+                      const LiveFsApplyItem *item,
+                      GError               **error)
+{
+  const char *usretc_relpath = item->path + 1;
+  const char *etc_relpath = item->path + strlen ("/usr/");
+
+  glnx_fd_close int src_dfd = -1;
+  g_autofree char *src_dnbuf = g_strdup (usretc_relpath);
+  if (!glnx_opendirat (apply->deployment_dfd, dirname (src_dnbuf), TRUE, &src_dfd, error))
+    return FALSE;
+  glnx_fd_close int dest_dfd = -1;
+  g_autofree char *dest_dnbuf = g_strdup (etc_relpath);
+  if (!glnx_opendirat (apply->deployment_dfd, dirname (dest_dnbuf), TRUE, &dest_dfd, error))
+    return FALSE;
+
+  /* Strip off /usr for selinux labeling */
+  g_autoptr(GString) etc_path = g_string_new (item->path + strlen ("/usr"));
+  if (!copy_config_recurse (apply, src_dfd, dest_dfd, glnx_basename (item->path),
+                            etc_path, error))
+    return g_prefix_error (error, "Copying %s: ", item->path), FALSE;
+
+  g_atomic_int_inc (&apply->n_applied);
+  return TRUE;
+}
+
+/* Copy the config files added in /usr/etc to /etc. This needs to run after
+ * checkout_add_usr(), as it uses /usr/etc as the source; since this is a
+ * copy, we can reflink from there.
+ */
+static gboolean
+copy_new_config_files (int                  deployment_dfd,
+                       OstreeSePolicy      *sepolicy,
+                       CommitDiff          *diff,
+                       GCancellable        *cancellable,
+                       GError             **error)
+{
+  rpmostree_output_task_begin ("Copying new config files");
+
+  g_autoptr(GPtrArray) groups = group_added_paths (diff, "/usr/etc/");
+  LiveFsApply apply = { .deployment_dfd = deployment_dfd,
+                        .func = copy_one_config_path, .groups = groups,
+                        .cancellable = cancellable, };
+  /* Use SELinux policy if it's initialized */
+  if (ostree_sepolicy_get_name (sepolicy) != NULL)
+    apply.sepolicy = sepolicy;
+
+  if (!livefs_apply_run (&apply, error))
+    return FALSE;
+
+  rpmostree_output_task_end ("%u (%u reflinked, %u copied)", (guint)apply.n_applied,
+                             (guint)apply.n_reflinked, (guint)apply.n_copied);
+  return TRUE;
+}
+
+/* Record @path in @set, unless it's something we don't care about. */
+static void
+diff_add_path (CommitDiff *diff,
+               GPtrArray  *set,
+               const char *path)
+{
+  if (diff_one_path (diff, path) == FILE_DIFF_RESULT_KEEP)
+    g_ptr_array_add (set, g_strdup (path));
+}
+
+/* Add the number of files in the dirtree @contents, recursively, to
+ * @n_files */
+static gboolean
+count_dirtree_files (OstreeRepo    *repo,
+                     const char    *contents,
+                     guint         *n_files,
+                     GCancellable  *cancellable,
+                     GError       **error)
+{
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  g_autoptr(GVariant) tree = NULL;
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_TREE, contents,
+                                 &tree, error))
+    return FALSE;
+
+  g_autoptr(GVariant) files = g_variant_get_child_value (tree, 0);
+  *n_files += g_variant_n_children (files);
+
+  g_autoptr(GVariant) dirs = g_variant_get_child_value (tree, 1);
+  const gsize n_dirs = g_variant_n_children (dirs);
+  for (gsize i = 0; i < n_dirs; i++)
+    {
+      g_autoptr(GVariant) csum = NULL;
+      g_variant_get_child (dirs, i, "(&s@ay@ay)", NULL, &csum, NULL);
+      g_autofree char *subdir = ostree_checksum_from_bytes_v (csum);
+      if (!count_dirtree_files (repo, subdir, n_files, cancellable, error))
+        return FALSE;
     }
-  rpmostree_output_task_end ("%u", n_added);
+
   return TRUE;
 }
 
+/* Walk the dirtree objects @from_contents and @to_contents (for the directory
+ * at @path) in parallel, recording the differences in @diff. Both sides are
+ * sorted by name, so each level is a simple merge. Subdirectories with the
+ * same contents checksum are skipped without loading them, as are the ones we
+ * ignore anyway (like the rpmdb), and added or removed subdirectories are
+ * recorded as a whole. So the cost is proportional to the changed paths
+ * rather than the size of the trees.
+ *
+ * Like ostree_diff_dirs(), we don't report changes only to directory
+ * metadata. A path which changes between a file and a directory shows up as
+ * a removal and an addition.
+ */
+static gboolean
+diff_dirtrees (OstreeRepo    *repo,
+               GString       *path,
+               const char    *from_contents,
+               const char    *to_contents,
+               CommitDiff    *diff,
+               GCancellable  *cancellable,
+               GError       **error)
+{
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  g_autoptr(GVariant) from_tree = NULL;
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_TREE, from_contents,
+                                 &from_tree, error))
+    return FALSE;
+  g_autoptr(GVariant) to_tree = NULL;
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_TREE, to_contents,
+                                 &to_tree, error))
+    return FALSE;
+
+  const gsize path_len = path->len;
+
+  /* First the files; (name, content checksum) */
+  {
+    g_autoptr(GVariant) from_files = g_variant_get_child_value (from_tree, 0);
+    g_autoptr(GVariant) to_files = g_variant_get_child_value (to_tree, 0);
+    const gsize n_from = g_variant_n_children (from_files);
+    const gsize n_to = g_variant_n_children (to_files);
+    gsize i = 0, j = 0;
+
+    while (i < n_from || j < n_to)
+      {
+        const char *from_name = NULL;
+        const char *to_name = NULL;
+        g_autoptr(GVariant) from_csum = NULL;
+        g_autoptr(GVariant) to_csum = NULL;
+        if (i < n_from)
+          g_variant_get_child (from_files, i, "(&s@ay)", &from_name, &from_csum);
+        if (j < n_to)
+          g_variant_get_child (to_files, j, "(&s@ay)", &to_name, &to_csum);
+
+        const int cmp = !to_name ? -1 : !from_name ? 1 : strcmp (from_name, to_name);
+        g_string_append_c (path, '/');
+        g_string_append (path, cmp <= 0 ? from_name : to_name);
+
+        if (cmp < 0)
+          {
+            diff_add_path (diff, diff->removed, path->str);
+            i++;
+          }
+        else if (cmp > 0)
+          {
+            diff_add_path (diff, diff->added, path->str);
+            j++;
+          }
+        else
+          {
+            if (!g_variant_equal (from_csum, to_csum))
+              diff_add_path (diff, diff->modified, path->str);
+            i++;
+            j++;
+          }
+
+        g_string_truncate (path, path_len);
+      }
+  }
+
+  /* And now the subdirectories; (name, contents checksum, metadata checksum) */
+  {
+    g_autoptr(GVariant) from_dirs = g_variant_get_child_value (from_tree, 1);
+    g_autoptr(GVariant) to_dirs = g_variant_get_child_value (to_tree, 1);
+    const gsize n_from = g_variant_n_children (from_dirs);
+    const gsize n_to = g_variant_n_children (to_dirs);
+    gsize i = 0, j = 0;
+
+    while (i < n_from || j < n_to)
+      {
+        const char *from_name = NULL;
+        const char *to_name = NULL;
+        g_autoptr(GVariant) from_csum = NULL;
+        g_autoptr(GVariant) to_csum = NULL;
+        if (i < n_from)
+          g_variant_get_child (from_dirs, i, "(&s@ay@ay)", &from_name, &from_csum, NULL);
+        if (j < n_to)
+          g_variant_get_child (to_dirs, j, "(&s@ay@ay)", &to_name, &to_csum, NULL);
+
+        const int cmp = !to_name ? -1 : !from_name ? 1 : strcmp (from_name, to_name);
+        g_string_append_c (path, '/');
+        g_string_append (path, cmp <= 0 ? from_name : to_name);
+
+        if (cmp < 0)
+          {
+            diff_add_path (diff, diff->removed, path->str);
+            i++;
+          }
+        else if (cmp > 0)
+          {
+            diff_add_path (diff, diff->added_dirs, path->str);
+            /* Its contents are added too, even if not listed separately */
+            if (path_is_usretc (path->str))
+              {
+                g_autofree char *to_subdir = ostree_checksum_from_bytes_v (to_csum);
+                if (!count_dirtree_files (repo, to_subdir, &diff->n_usretc,
+                                          cancellable, error))
+                  return FALSE;
+              }
+            j++;
+          }
+        else
+          {
+            if (!g_variant_equal (from_csum, to_csum) &&
+                !path_is_ignored_for_diff (path->str) &&
+                !path_is_rpmdb (path->str))
+              {
+                g_autofree char *from_subdir = ostree_checksum_from_bytes_v (from_csum);
+                g_autofree char *to_subdir = ostree_checksum_from_bytes_v (to_csum);
+                if (!diff_dirtrees (repo, path, from_subdir, to_subdir, diff,
+                                    cancellable, error))
+                  return FALSE;
+              }
+            i++;
+            j++;
+          }
+
+        g_string_truncate (path, path_len);
+      }
+  }
+
+  return TRUE;
+}
+
+/* Returns the checksum of the root dirtree of @rev */
+static char *
+get_commit_root_contents (OstreeRepo  *repo,
+                          const char  *rev,
+                          GError     **error)
+{
+  g_autoptr(GVariant) commit = NULL;
+  if (!ostree_repo_load_commit (repo, rev, &commit, NULL, error))
+    return NULL;
+
+  g_autoptr(GVariant) contents_csum = NULL;
+  g_variant_get_child (commit, 6, "@ay", &contents_csum);
+  return ostree_checksum_from_bytes_v (contents_csum);
+}
+
 /* Generate a CommitDiff */
 static gboolean
 analyze_commit_diff (OstreeRepo      *repo,
@@ -281,55 +794,25 @@ analyze_commit_diff (OstreeRepo      *repo,
   diff->from = g_strdup (from_rev);
   diff->to = g_strdup (to_rev);
 
-  /* Read the "from" and "to" commits */
-  glnx_unref_object GFile *from_tree = NULL;
-  if (!ostree_repo_read_commit (repo, from_rev, &from_tree, NULL,
-                                cancellable, error))
-    return FALSE;
-  glnx_unref_object GFile *to_tree = NULL;
-  if (!ostree_repo_read_commit (repo, to_rev, &to_tree, NULL,
-                                cancellable, error))
-    return FALSE;
+  diff->added = g_ptr_array_new_with_free_func (g_free);
+  diff->added_dirs = g_ptr_array_new_with_free_func (g_free);
+  diff->modified = g_ptr_array_new_with_free_func (g_free);
+  diff->removed = g_ptr_array_new_with_free_func (g_free);
 
-  /* Diff the two commits at the filesystem level */
-  g_autoptr(GPtrArray) modified = g_ptr_array_new_with_free_func ((GDestroyNotify) ostree_diff_item_unref);
-  g_autoptr(GPtrArray) removed = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-  g_autoptr(GPtrArray) added = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-  if (!ostree_diff_dirs (0, from_tree, to_tree, modified, removed, added,
-                         cancellable, error))
+  /* Diff the two commits at the dirtree level */
+  g_autofree char *from_contents = get_commit_root_contents (repo, from_rev, error);
+  if (!from_contents)
+    return FALSE;
+  g_autofree char *to_contents = get_commit_root_contents (repo, to_rev, error);
+  if (!to_contents)
     return FALSE;
 
-  /* We'll filter these arrays below. */
-  diff->modified = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-  diff->removed = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-  diff->added = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-
-  /* Analyze the differences */
-  for (guint i = 0; i < modified->len; i++)
-    {
-      OstreeDiffItem *diffitem = modified->pdata[i];
-      const char *path = gs_file_get_path_cached (diffitem->src);
-
-      if (diff_one_path (diff, path) == FILE_DIFF_RESULT_KEEP)
-        g_ptr_array_add (diff->modified, g_object_ref (diffitem->src));
-    }
-
-  for (guint i = 0; i < removed->len; i++)
-    {
-      GFile *gfpath = removed->pdata[i];
-      const char *path = gs_file_get_path_cached (gfpath);
-
-      if (diff_one_path (diff, path) == FILE_DIFF_RESULT_KEEP)
-        g_ptr_array_add (diff->removed, g_object_ref (gfpath));
-    }
-
-  for (guint i = 0; i < added->len; i++)
+  if (strcmp (from_contents, to_contents) != 0)
     {
-      GFile *added_f = added->pdata[i];
-      const char *path = gs_file_get_path_cached (added_f);
-
-      if (diff_one_path (diff, path) == FILE_DIFF_RESULT_KEEP)
-        g_ptr_array_add (diff->added, g_object_ref (added_f));
+      g_autoptr(GString) path = g_string_new ("");
+      if (!diff_dirtrees (repo, path, from_contents, to_contents, diff,
+                          cancellable, error))
+        return FALSE;
     }
 
   /* And gather the RPM level changes */
@@ -349,8 +832,9 @@ print_commit_diff (CommitDiff *diff)
 {
   /* Print out the results of the two diffs */
   g_print ("Diff Analysis: %s => %s\n", diff->from, diff->to);
-  g_print ("Files:\n modified: %u\n removed: %u\n added: %u\n",
-           diff->modified->len, diff->removed->len, diff->added->len);
+  g_print ("Files:\n modified: %u\n removed: %u\n added: %u (%u directories)\n",
+           diff->modified->len, diff->removed->len,
+           diff->added->len + diff->added_dirs->len, diff->added_dirs->len);
   g_print ("Packages:\n modified: %u\n removed: %u\n added: %u\n",
            diff->modified_pkgs_new->len, diff->removed_pkgs->len, diff->added_pkgs->len);
 
@@ -432,26 +916,6 @@ prepare_rollback_deployment (OstreeSysroot  *sysroot,
   return TRUE;
 }
 
-static gboolean
-checkout_add_usr (OstreeRepo *repo,
-                  int deployment_dfd,
-                  CommitDiff *diff,
-                  const char *target_csum,
-                  GCancellable *cancellable,
-                  GError **error)
-{
-  OstreeRepoCheckoutAtOptions usr_checkout_opts = { .mode = OSTREE_REPO_CHECKOUT_MODE_NONE,
-                                                    .overwrite_mode = OSTREE_REPO_CHECKOUT_OVERWRITE_ADD_FILES,
-                                                    .no_copy_fallback = TRUE,
-                                                    .subpath = "/usr" };
-
-  if (!ostree_repo_checkout_at (repo, &usr_checkout_opts, deployment_dfd, "usr",
-                                target_csum, cancellable, error))
-    return FALSE;
-
-  return TRUE;
-}
-
 /* Update the origin for @booted with new livefs state */
 static gboolean
 write_livefs_state (OstreeSysroot    *sysroot,
@@ -583,12 +1047,12 @@ livefs_transaction_execute_inner (LiveFsTransaction *self,
   if (resuming_overlay)
     g_string_append (journal_msg, " (resuming)");
   if (!replacing)
-    g_string_append_printf (journal_msg, " addition; %u pkgs, %u files",
-                            diff->added_pkgs->len, diff->added->len);
+    g_string_append_printf (journal_msg, " addition; %u pkgs, %u files, %u dirs",
+                            diff->added_pkgs->len, diff->added->len, diff->added_dirs->len);
   else
     g_string_append_printf (journal_msg, " replacement; %u/%u/%u pkgs (added, removed, modified); %u/%u/%u files",
                             diff->added_pkgs->len, diff->removed_pkgs->len, diff->modified_pkgs_old->len,
-                            diff->added->len, diff->removed->len, diff->modified->len);
+                            diff->added->len + diff->added_dirs->len, diff->removed->len, diff->modified->len);
   if (replacing_overlay)
     g_string_append_printf (journal_msg, "; replacing %s", replacing_overlay);
   sd_journal_send ("MESSAGE_ID=" SD_ID128_FORMAT_STR, SD_ID128_FORMAT_VAL(RPMOSTREE_MESSAGE_LIVEFS_BEGIN),
@@ -630,9 +1094,13 @@ livefs_transaction_execute_inner (LiveFsTransaction *self,
 
   rpmostree_output_task_begin ("Overlaying /usr");
 
-  if (!checkout_add_usr (repo, deployment_dfd, diff, target_csum, cancellable, error))
+  const gint64 usr_start_time = g_get_monotonic_time ();
+  guint n_usr_applied = 0;
+  if (!checkout_add_usr (repo, deployment_dfd, diff, target_csum, &n_usr_applied,
+                         cancellable, error))
     return FALSE;
 
+  const gint64 rpmdb_start_time = g_get_monotonic_time ();
   /* Start replacing the rpmdb. First, ensure the temporary dir for the new
      version doesn't exist */
   if (!glnx_shutil_rm_rf_at (deployment_dfd, orig_rpmdb_path, cancellable, error))
@@ -656,13 +1124,14 @@ livefs_transaction_execute_inner (LiveFsTransaction *self,
 
   rpmostree_output_task_end ("done");
 
+  const gint64 etc_start_time = g_get_monotonic_time ();
   if (requires_etc_merge)
     {
-      if (!copy_new_config_files (repo, origin_merge_deployment,
-                                  deployment_dfd, sepolicy, diff,
+      if (!copy_new_config_files (deployment_dfd, sepolicy, diff,
                                   cancellable, error))
         return FALSE;
     }
+  const gint64 end_time = g_get_monotonic_time ();
 
   /* Write out the origin as having completed this */
   if (!write_livefs_state (sysroot, booted_deployment, NULL, target_csum, error))
@@ -674,9 +1143,16 @@ livefs_transaction_execute_inner (LiveFsTransaction *self,
     return g_prefix_error (error, "Setting deployment mutable: "), FALSE;
 
   sd_journal_send ("MESSAGE_ID=" SD_ID128_FORMAT_STR, SD_ID128_FORMAT_VAL(RPMOSTREE_MESSAGE_LIVEFS_END),
-                   "MESSAGE=Completed livefs for commit %s", target_csum,
+                   "MESSAGE=Completed livefs for commit %s in %.1fs (/usr: %u paths in %.1fs, rpmdb: %.1fs, /etc: %.1fs)",
+                   target_csum, (end_time - usr_start_time) / (double) G_USEC_PER_SEC,
+                   n_usr_applied, (rpmdb_start_time - usr_start_time) / (double) G_USEC_PER_SEC,
+                   (etc_start_time - rpmdb_start_time) / (double) G_USEC_PER_SEC,
+                   (end_time - etc_start_time) / (double) G_USEC_PER_SEC,
                    "BOOTED_COMMIT=%s", booted_csum,
                    "TARGET_COMMIT=%s", target_csum,
+                   "USR_APPLY_USEC=%" G_GINT64_FORMAT, rpmdb_start_time - usr_start_time,
+                   "RPMDB_APPLY_USEC=%" G_GINT64_FORMAT, etc_start_time - rpmdb_start_time,
+                   "ETC_APPLY_USEC=%" G_GINT64_FORMAT, end_time - etc_start_time,
                    NULL);
 
   return TRUE;
@@ -312,27 +312,14 @@ transaction_execute_thread (GTask *task,
   g_main_context_pop_thread_default (mctx);
 }
 
+/* Takes ownership of @local_error */
 static void
-transaction_execute_done_cb (GObject *source_object,
-                             GAsyncResult *result,
-                             gpointer user_data)
+transaction_finish (RpmostreedTransaction *self,
+                    GError                *local_error)
 {
-  RpmostreedTransaction *self = RPMOSTREED_TRANSACTION (source_object);
   RpmostreedTransactionPrivate *priv = rpmostreed_transaction_get_private (self);
   const char *error_message = NULL;
-  gboolean success;
-  GError *local_error = NULL;
-
-  success = g_task_propagate_boolean (G_TASK (result), &local_error);
-  if (success)
-    {
-      if (!rpmostreed_sysroot_reload (rpmostreed_sysroot_get (), &local_error))
-	success = FALSE;
-    }
-
-  /* Sanity check */
-  g_warn_if_fail ((success && local_error == NULL) ||
-                  (!success && local_error != NULL));
+  gboolean success = (local_error == NULL);
 
   if (local_error != NULL)
     error_message = local_error->message;
@@ -354,11 +341,49 @@ transaction_execute_done_cb (GObject *source_object,
   priv->finished_params = g_variant_new ("(bs)", success, error_message);
   g_variant_ref_sink (priv->finished_params);
 
+  g_clear_error (&local_error);
+
   g_object_notify (G_OBJECT (self), "active");
 
   transaction_maybe_emit_closed (self);
 }
 
+static void
+transaction_reload_done_cb (GObject *source_object,
+                            GAsyncResult *result,
+                            gpointer user_data)
+{
+  RpmostreedTransaction *self = RPMOSTREED_TRANSACTION (user_data);
+  GError *local_error = NULL;
+
+  (void) rpmostreed_sysroot_reload_finish (RPMOSTREED_SYSROOT (source_object),
+                                           result, &local_error);
+  transaction_finish (self, local_error);
+  g_object_unref (self);
+}
+
+static void
+transaction_execute_done_cb (GObject *source_object,
+                             GAsyncResult *result,
+                             gpointer user_data)
+{
+  RpmostreedTransaction *self = RPMOSTREED_TRANSACTION (source_object);
+  GError *local_error = NULL;
+
+  if (!g_task_propagate_boolean (G_TASK (result), &local_error))
+    {
+      transaction_finish (self, local_error);
+      return;
+    }
+
+  /* Pick up the new deployments before announcing we're done; the
+   * reload waits for in-flight diff queries without blocking the
+   * main loop. */
+  rpmostreed_sysroot_reload_async (rpmostreed_sysroot_get (),
+                                   transaction_reload_done_cb,
+                                   g_object_ref (self));
+}
+
 static void
 transaction_set_property (GObject *object,
                           guint property_id,
@@ -229,33 +229,19 @@ rpmostreed_reboot (GCancellable *cancellable, GError **error)
 		       NULL, NULL, NULL, NULL, NULL, NULL);
 }
 
-/**
- * rpmostreed_repo_pull_ancestry:
- * @repo: Repo
- * @refspec: Repository branch
- * @visitor: (allow-none): Visitor function to call on each commit
- * @visitor_data: (allow-none): User data for @visitor
- * @progress: (allow-none): Progress
- * @cancellable: Cancellable
- * @error: Error
- *
- * Downloads an ancestry of commit objects starting from @refspec.
- *
- * If a @visitor function pointer is given, commit objects are downloaded
- * in batches and the @visitor function is called for each commit object.
- * The @visitor function can stop the recursion, such as when looking for
- * a particular commit.
- *
- * Returns: %TRUE on success, %FALSE on failure
+/* Like rpmostreed_repo_pull_ancestry(), but if @from_checksum is given,
+ * start from that commit (which must be in the history of @refspec)
+ * rather than from the latest commit on the remote.
  */
-gboolean
-rpmostreed_repo_pull_ancestry (OstreeRepo               *repo,
-                               const char               *refspec,
-                               RpmostreedCommitVisitor   visitor,
-                               gpointer                  visitor_data,
-                               OstreeAsyncProgress      *progress,
-                               GCancellable             *cancellable,
-                               GError                  **error)
+static gboolean
+pull_ancestry_from (OstreeRepo               *repo,
+                    const char               *refspec,
+                    const char               *from_checksum,
+                    RpmostreedCommitVisitor   visitor,
+                    gpointer                  visitor_data,
+                    OstreeAsyncProgress      *progress,
+                    GCancellable             *cancellable,
+                    GError                  **error)
 {
   OstreeRepoPullFlags flags;
   GVariantDict options;
@@ -263,7 +249,7 @@ rpmostreed_repo_pull_ancestry (OstreeRepo               *repo,
   const char *refs_array[] = { NULL, NULL };
   g_autofree char *remote = NULL;
   g_autofree char *ref = NULL;
-  g_autofree char *checksum = NULL;
+  g_autofree char *checksum = g_strdup (from_checksum);
   int depth, ii;
   gboolean ret = FALSE;
 
@@ -288,7 +274,7 @@ rpmostreed_repo_pull_ancestry (OstreeRepo               *repo,
    * pass because we want to search from the latest available commit on the
    * remote server, which is not necessarily what the ref name is currently
    * pointing at in our local repo. */
-  refs_array[0] = ref;
+  refs_array[0] = from_checksum ?: ref;
 
   while (TRUE)
     {
@@ -356,9 +342,323 @@ out:
   return ret;
 }
 
+/**
+ * rpmostreed_repo_pull_ancestry:
+ * @repo: Repo
+ * @refspec: Repository branch
+ * @visitor: (allow-none): Visitor function to call on each commit
+ * @visitor_data: (allow-none): User data for @visitor
+ * @progress: (allow-none): Progress
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Downloads an ancestry of commit objects starting from @refspec.
+ *
+ * If a @visitor function pointer is given, commit objects are downloaded
+ * in batches and the @visitor function is called for each commit object.
+ * The @visitor function can stop the recursion, such as when looking for
+ * a particular commit.
+ *
+ * Returns: %TRUE on success, %FALSE on failure
+ */
+gboolean
+rpmostreed_repo_pull_ancestry (OstreeRepo               *repo,
+                               const char               *refspec,
+                               RpmostreedCommitVisitor   visitor,
+                               gpointer                  visitor_data,
+                               OstreeAsyncProgress      *progress,
+                               GCancellable             *cancellable,
+                               GError                  **error)
+{
+  return pull_ancestry_from (repo, refspec, NULL, visitor, visitor_data,
+                             progress, cancellable, error);
+}
+
+/* Looking up a version means walking (and possibly pulling) the commit
+ * ancestry of a ref, which gets slow for older versions.  So we keep a
+ * persistent per-refspec index of the versions we've come across.  It
+ * covers a contiguous segment of the history, from @head back to @tail
+ * (a root commit if @complete is set).  Lookups walk from the latest
+ * commit until they reach @head, and only go past @tail if the version
+ * isn't in the index.
+ *
+ * On disk, it's a (sssba(ss)) variant of refspec, head, tail, complete
+ * and (version, checksum) entries, newest first.
+ *
+ * Indexes are only written from transactions, i.e. with the sysroot
+ * lock held.  Each save drops the indexes of refspecs that no longer
+ * exist and keeps at most RPMOSTREED_VERSION_INDEX_MAX_ENTRIES of the
+ * most recently updated ones.
+ */
+#define RPMOSTREED_VERSION_INDEX_DIR "extensions/rpmostree/version-index"
+#define RPMOSTREED_VERSION_INDEX_MAX_ENTRIES 16
+
+typedef struct {
+  char *head;
+  char *tail;
+  gboolean complete;
+  GPtrArray *versions;
+  GPtrArray *checksums;
+} VersionIndex;
+
+static VersionIndex *
+version_index_new (void)
+{
+  VersionIndex *index = g_slice_new0 (VersionIndex);
+  index->versions = g_ptr_array_new_with_free_func (g_free);
+  index->checksums = g_ptr_array_new_with_free_func (g_free);
+  return index;
+}
+
+static void
+version_index_free (VersionIndex *index)
+{
+  g_free (index->head);
+  g_free (index->tail);
+  g_ptr_array_unref (index->versions);
+  g_ptr_array_unref (index->checksums);
+  g_slice_free (VersionIndex, index);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(VersionIndex, version_index_free);
+
+static char *
+version_index_path (const char *refspec)
+{
+  g_autofree char *digest = g_compute_checksum_for_string (G_CHECKSUM_SHA256, refspec, -1);
+  return g_build_filename (RPMOSTREED_VERSION_INDEX_DIR, digest, NULL);
+}
+
+/* Returns %NULL if @path doesn't exist or isn't a valid index. */
+static GVariant *
+version_index_load_variant (OstreeRepo *repo,
+                            const char *path)
+{
+  g_autofree char *abspath = glnx_fdrel_abspath (ostree_repo_get_dfd (repo), path);
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(GVariant) v = NULL;
+  char *contents;
+  gsize len;
+
+  if (!g_file_get_contents (abspath, &contents, &len, &local_error))
+    {
+      if (!g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_debug ("Ignoring version index %s: %s", path, local_error->message);
+      return NULL;
+    }
+
+  v = g_variant_ref_sink (g_variant_new_from_data (G_VARIANT_TYPE ("(sssba(ss))"),
+                                                   contents, len, FALSE, g_free, contents));
+  if (!g_variant_is_normal_form (v))
+    {
+      g_debug ("Ignoring corrupted version index %s", path);
+      return NULL;
+    }
+
+  return g_steal_pointer (&v);
+}
+
+/* Returns %NULL if there is no (valid) index for @refspec. */
+static VersionIndex *
+version_index_load (OstreeRepo *repo,
+                    const char *refspec)
+{
+  g_autofree char *path = version_index_path (refspec);
+  g_autoptr(GVariant) v = version_index_load_variant (repo, path);
+  g_autoptr(GVariantIter) iter = NULL;
+  VersionIndex *index = NULL;
+  const char *index_refspec, *head, *tail, *version, *checksum;
+  gboolean complete;
+
+  if (v == NULL)
+    return NULL;
+
+  g_variant_get (v, "(&s&s&sba(ss))", &index_refspec, &head, &tail, &complete, &iter);
+  if (!g_str_equal (index_refspec, refspec))
+    return NULL;
+
+  index = version_index_new ();
+  index->head = g_strdup (head);
+  index->tail = g_strdup (tail);
+  index->complete = complete;
+  while (g_variant_iter_next (iter, "(&s&s)", &version, &checksum))
+    {
+      g_ptr_array_add (index->versions, g_strdup (version));
+      g_ptr_array_add (index->checksums, g_strdup (checksum));
+    }
+
+  return index;
+}
+
+typedef struct {
+  char *name;
+  gint64 mtime;
+} VersionIndexFile;
+
+static void
+version_index_file_free (gpointer data)
+{
+  VersionIndexFile *file = data;
+  g_free (file->name);
+  g_free (file);
+}
+
+static gint
+cmp_version_index_file_newest_first (gconstpointer a,
+                                     gconstpointer b)
+{
+  const VersionIndexFile *file_a = *(VersionIndexFile**)a;
+  const VersionIndexFile *file_b = *(VersionIndexFile**)b;
+
+  if (file_a->mtime == file_b->mtime)
+    return 0;
+  return file_a->mtime > file_b->mtime ? -1 : 1;
+}
+
+/* Delete the indexes of refspecs which no longer exist, and then all
+ * but the most recently updated RPMOSTREED_VERSION_INDEX_MAX_ENTRIES. */
+static gboolean
+version_index_prune (OstreeRepo *repo,
+                     GError    **error)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  g_autoptr(GPtrArray) files = g_ptr_array_new_with_free_func (version_index_file_free);
+
+  if (!glnx_dirfd_iterator_init_at (ostree_repo_get_dfd (repo),
+                                    RPMOSTREED_VERSION_INDEX_DIR, FALSE,
+                                    &dfd_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      g_autofree char *path = NULL;
+      g_autoptr(GVariant) v = NULL;
+      g_autofree char *rev = NULL;
+      const char *refspec = NULL;
+      struct stat stbuf;
+
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, NULL, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+
+      /* Skip any in-progress replace_contents() temp files */
+      if (dent->d_name[0] == '.')
+        continue;
+
+      path = g_build_filename (RPMOSTREED_VERSION_INDEX_DIR, dent->d_name, NULL);
+      v = version_index_load_variant (repo, path);
+      if (v != NULL)
+        {
+          g_variant_get_child (v, 0, "&s", &refspec);
+          if (!ostree_repo_resolve_rev (repo, refspec, TRUE, &rev, error))
+            return FALSE;
+        }
+
+      if (rev == NULL)
+        {
+          if (!glnx_shutil_rm_rf_at (dfd_iter.fd, dent->d_name, NULL, error))
+            return FALSE;
+          continue;
+        }
+
+      if (fstatat (dfd_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+        return glnx_throw_errno_prefix (error, "fstatat(%s)", dent->d_name);
+
+      { VersionIndexFile *file = g_new0 (VersionIndexFile, 1);
+        file->name = g_strdup (dent->d_name);
+        file->mtime = stbuf.st_mtim.tv_sec * G_USEC_PER_SEC + stbuf.st_mtim.tv_nsec / 1000;
+        g_ptr_array_add (files, file);
+      }
+    }
+
+  g_ptr_array_sort (files, cmp_version_index_file_newest_first);
+  for (guint i = RPMOSTREED_VERSION_INDEX_MAX_ENTRIES; i < files->len; i++)
+    {
+      VersionIndexFile *file = files->pdata[i];
+      if (!glnx_shutil_rm_rf_at (dfd_iter.fd, file->name, NULL, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+version_index_save (OstreeRepo   *repo,
+                    const char   *refspec,
+                    VersionIndex *index,
+                    GError      **error)
+{
+  int repo_dfd = ostree_repo_get_dfd (repo);
+  g_autofree char *path = version_index_path (refspec);
+  g_autoptr(GVariant) v = NULL;
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ss)"));
+  for (guint i = 0; i < index->versions->len; i++)
+    g_variant_builder_add (&builder, "(ss)", index->versions->pdata[i],
+                           index->checksums->pdata[i]);
+
+  v = g_variant_ref_sink (g_variant_new ("(sssba(ss))", refspec, index->head,
+                                         index->tail, index->complete, &builder));
+
+  if (!glnx_shutil_mkdir_p_at (repo_dfd, RPMOSTREED_VERSION_INDEX_DIR, 0755, NULL, error))
+    return FALSE;
+
+  if (!glnx_file_replace_contents_at (repo_dfd, path,
+                                      g_variant_get_data (v),
+                                      g_variant_get_size (v),
+                                      GLNX_FILE_REPLACE_NODATASYNC,
+                                      NULL, error))
+    return FALSE;
+
+  return version_index_prune (repo, error);
+}
+
+static const char *
+version_index_lookup (VersionIndex *index,
+                      const char   *version)
+{
+  for (guint i = 0; i < index->versions->len; i++)
+    {
+      if (g_str_equal (index->versions->pdata[i], version))
+        return index->checksums->pdata[i];
+    }
+  return NULL;
+}
+
+/* Extend @index with @older, whose head is the parent of @index's tail;
+ * takes ownership of @older. */
+static void
+version_index_append (VersionIndex *index,
+                      VersionIndex *older)
+{
+  g_autoptr(VersionIndex) owned_older = older;
+
+  if (older->head == NULL)
+    return;
+
+  for (guint i = 0; i < older->versions->len; i++)
+    {
+      g_ptr_array_add (index->versions, g_strdup (older->versions->pdata[i]));
+      g_ptr_array_add (index->checksums, g_strdup (older->checksums->pdata[i]));
+    }
+
+  g_free (index->tail);
+  index->tail = g_steal_pointer (&older->tail);
+  index->complete = older->complete;
+}
+
 typedef struct {
   const char *version;
+  const char *stop_at;  /* stop when reaching this commit, without recording it */
+  const char *skip;     /* don't record this commit */
+  gboolean stop_on_found;
+
   char *checksum;
+  gboolean reached_stop_at;
+  VersionIndex *segment;
 } VersionVisitorClosure;
 
 static gboolean
@@ -370,22 +670,192 @@ version_visitor (OstreeRepo  *repo,
                  GError     **error)
 {
   VersionVisitorClosure *closure = user_data;
+  VersionIndex *segment = closure->segment;
   g_autoptr(GVariant) metadict = NULL;
+  g_autofree char *parent = NULL;
   const char *version = NULL;
 
+  if (closure->stop_at && g_str_equal (checksum, closure->stop_at))
+    {
+      closure->reached_stop_at = TRUE;
+      *out_stop = TRUE;
+      return TRUE;
+    }
+
+  if (closure->skip && g_str_equal (checksum, closure->skip))
+    return TRUE;
+
+  if (segment->head == NULL)
+    segment->head = g_strdup (checksum);
+  g_free (segment->tail);
+  segment->tail = g_strdup (checksum);
+  parent = ostree_commit_get_parent (commit);
+  segment->complete = (parent == NULL);
+
   metadict = g_variant_get_child_value (commit, 0);
   if (g_variant_lookup (metadict, "version", "&s", &version))
     {
-      if (g_str_equal (version, closure->version))
+      g_ptr_array_add (segment->versions, g_strdup (version));
+      g_ptr_array_add (segment->checksums, g_strdup (checksum));
+
+      if (closure->checksum == NULL && g_str_equal (version, closure->version))
         {
           closure->checksum = g_strdup (checksum);
-          *out_stop = TRUE;
+          if (closure->stop_on_found)
+            *out_stop = TRUE;
         }
     }
 
   return TRUE;
 }
 
+/* Walk the history of @refspec from @from_checksum (or the latest
+ * commit); pulling commits from the remote if @pull is set, otherwise
+ * only traversing what's available locally. */
+static gboolean
+walk_version_ancestry (OstreeRepo            *repo,
+                       const char            *refspec,
+                       const char            *from_checksum,
+                       gboolean               pull,
+                       VersionVisitorClosure *closure,
+                       OstreeAsyncProgress   *progress,
+                       GCancellable          *cancellable,
+                       GError               **error)
+{
+  g_autofree char *checksum = NULL;
+
+  if (pull)
+    return pull_ancestry_from (repo, refspec, from_checksum, version_visitor, closure,
+                               progress, cancellable, error);
+
+  if (from_checksum)
+    checksum = g_strdup (from_checksum);
+  else if (!ostree_repo_resolve_rev (repo, refspec, FALSE, &checksum, error))
+    return FALSE;
+
+  while (checksum != NULL)
+    {
+      g_autoptr(GVariant) commit = NULL;
+      gboolean stop = FALSE;
+
+      if (!ostree_repo_load_commit (repo, checksum, &commit, NULL, error))
+        return FALSE;
+
+      if (!version_visitor (repo, checksum, commit, closure, &stop, error))
+        return FALSE;
+
+      g_clear_pointer (&checksum, g_free);
+
+      if (!stop)
+        checksum = ostree_commit_get_parent (commit);
+    }
+
+  return TRUE;
+}
+
+/* Shared implementation of the version lookups.  Sets @out_checksum to
+ * %NULL if @version wasn't found.  If @update_index is set (the caller
+ * must hold the sysroot lock), updates the version index of @refspec
+ * with the commits traversed.
+ */
+static gboolean
+lookup_version_indexed (OstreeRepo           *repo,
+                        const char           *refspec,
+                        const char           *version,
+                        gboolean              pull,
+                        gboolean              update_index,
+                        OstreeAsyncProgress  *progress,
+                        GCancellable         *cancellable,
+                        char                **out_checksum,
+                        GError              **error)
+{
+  g_autoptr(VersionIndex) index = version_index_load (repo, refspec);
+  g_autoptr(VersionIndex) segment = version_index_new ();
+  g_autofree char *checksum = NULL;
+  gboolean index_changed = FALSE;
+
+  /* First, walk from the latest commit back to the head of the index; or
+   * if we don't have one yet, until we find the version. */
+  { VersionVisitorClosure closure = { version, };
+    closure.stop_at = index ? index->head : NULL;
+    closure.stop_on_found = (index == NULL);
+    closure.segment = segment;
+
+    gboolean ok = walk_version_ancestry (repo, refspec, NULL, pull, &closure,
+                                         progress, cancellable, error);
+    checksum = closure.checksum;
+    if (!ok)
+      return FALSE;
+
+    if (index && closure.reached_stop_at)
+      {
+        if (segment->head != NULL)
+          {
+            version_index_append (segment, g_steal_pointer (&index));
+            index = g_steal_pointer (&segment);
+            index_changed = TRUE;
+          }
+      }
+    else
+      {
+        /* No index yet, or the history was rewritten and we never met
+         * its head; start over from what we just walked. */
+        g_clear_pointer (&index, version_index_free);
+        index = g_steal_pointer (&segment);
+        index_changed = TRUE;
+      }
+  }
+
+  if (checksum == NULL)
+    {
+      const char *indexed = version_index_lookup (index, version);
+
+      /* For cached lookups, the commit may have been pruned since */
+      if (indexed && !pull)
+        {
+          gboolean have_commit;
+          if (!ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_COMMIT, indexed,
+                                       &have_commit, cancellable, error))
+            return FALSE;
+          if (!have_commit)
+            indexed = NULL;
+        }
+
+      checksum = g_strdup (indexed);
+    }
+
+  /* Only go past the end of the index if we really have to */
+  if (checksum == NULL && !index->complete)
+    {
+      g_autoptr(VersionIndex) older = version_index_new ();
+      VersionVisitorClosure closure = { version, };
+      closure.skip = index->tail;
+      closure.stop_on_found = TRUE;
+      closure.segment = older;
+
+      gboolean ok = walk_version_ancestry (repo, refspec, index->tail, pull, &closure,
+                                           progress, cancellable, error);
+      checksum = closure.checksum;
+      if (!ok)
+        return FALSE;
+
+      version_index_append (index, g_steal_pointer (&older));
+      index_changed = TRUE;
+    }
+
+  if (index_changed && update_index)
+    {
+      /* It's just a cache; don't fail the lookup over it */
+      g_autoptr(GError) local_error = NULL;
+      if (!version_index_save (repo, refspec, index, &local_error))
+        g_warning ("Failed to update version index for %s: %s",
+                   refspec, local_error->message);
+    }
+
+  *out_checksum = g_steal_pointer (&checksum);
+  return TRUE;
+}
+
 /**
  * rpmostreed_repo_lookup_version:
  * @repo: Repo
@@ -397,7 +867,10 @@ version_visitor (OstreeRepo  *repo,
  * @error: Error
  *
  * Tries to determine the commit checksum for @version on @refspec.
- * This may require pulling commit objects from a remote repository.
+ * This may require pulling commit objects from a remote repository,
+ * though only for the part of the history not already in the version
+ * index of @refspec.  The caller must hold the sysroot lock, as the
+ * index is updated with what was pulled.
  *
  * Returns: %TRUE on success, %FALSE on failure
  */
@@ -410,34 +883,27 @@ rpmostreed_repo_lookup_version (OstreeRepo           *repo,
                                 char                **out_checksum,
                                 GError              **error)
 {
-  VersionVisitorClosure closure = { version, NULL };
-  gboolean ret = FALSE;
+  g_autofree char *checksum = NULL;
 
   g_return_val_if_fail (OSTREE_IS_REPO (repo), FALSE);
   g_return_val_if_fail (refspec != NULL, FALSE);
   g_return_val_if_fail (version != NULL, FALSE);
 
-  if (!rpmostreed_repo_pull_ancestry (repo, refspec,
-                                      version_visitor, &closure,
-                                      progress, cancellable, error))
-    goto out;
+  if (!lookup_version_indexed (repo, refspec, version, TRUE, TRUE, progress,
+                               cancellable, &checksum, error))
+    return FALSE;
 
-  if (closure.checksum == NULL)
+  if (checksum == NULL)
     {
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
                    "Version %s not found in %s", version, refspec);
-      goto out;
+      return FALSE;
     }
 
   if (out_checksum != NULL)
-    *out_checksum = g_steal_pointer (&closure.checksum);
-
-  g_free (closure.checksum);
-
-  ret = TRUE;
+    *out_checksum = g_steal_pointer (&checksum);
 
-out:
-  return ret;
+  return TRUE;
 }
 
 typedef struct {
@@ -513,7 +979,8 @@ rpmostreed_repo_lookup_checksum (OstreeRepo           *repo,
  *
  * Similar to rpmostreed_repo_lookup_version(), except without pulling
  * from a remote repository.  It traverses whatever commits are available
- * locally in @repo.
+ * locally in @repo (again, only those not in the version index).
+ * This doesn't take the sysroot lock, so it only reads the index.
  *
  * Returns: %TRUE on success, %FALSE on failure
  */
@@ -525,50 +992,27 @@ rpmostreed_repo_lookup_cached_version (OstreeRepo    *repo,
                                        char         **out_checksum,
                                        GError       **error)
 {
-  VersionVisitorClosure closure = { version, NULL };
   g_autofree char *checksum = NULL;
-  gboolean ret = FALSE;
 
   g_return_val_if_fail (OSTREE_IS_REPO (repo), FALSE);
   g_return_val_if_fail (refspec != NULL, FALSE);
   g_return_val_if_fail (version != NULL, FALSE);
 
-  if (!ostree_repo_resolve_rev (repo, refspec, FALSE, &checksum, error))
-    goto out;
-
-  while (checksum != NULL)
-    {
-      g_autoptr(GVariant) commit = NULL;
-      gboolean stop = FALSE;
-
-      if (!ostree_repo_load_commit (repo, checksum, &commit, NULL, error))
-        goto out;
-
-      if (!version_visitor (repo, checksum, commit, &closure, &stop, error))
-        goto out;
-
-      g_clear_pointer (&checksum, g_free);
-
-      if (!stop)
-        checksum = ostree_commit_get_parent (commit);
-    }
+  if (!lookup_version_indexed (repo, refspec, version, FALSE, FALSE, NULL,
+                               cancellable, &checksum, error))
+    return FALSE;
 
-  if (closure.checksum == NULL)
+  if (checksum == NULL)
     {
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
                    "Version %s not cached in %s", version, refspec);
-      goto out;
+      return FALSE;
     }
 
   if (out_checksum != NULL)
-    *out_checksum = g_steal_pointer (&closure.checksum);
-
-  g_free (closure.checksum);
-
-  ret = TRUE;
+    *out_checksum = g_steal_pointer (&checksum);
 
-out:
-  return ret;
+  return TRUE;
 }
 
 /**
@@ -23,6 +23,9 @@
 
 #include <err.h>
 #include <stdio.h>
+#include <sys/mount.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
 #include <systemd/sd-journal.h>
 
 void
@@ -47,6 +50,12 @@ struct RpmOstreeBwrap {
   GPtrArray *argv;
   const char *child_argv0;
   char *rofiles_mnt;
+  /* If we're using overlayfs for /usr instead of rofiles-fuse; the
+   * upper and work dirs live in overlay_tmpdir, relative to
+   * overlay_parent_dfd (the rootfs' parent dir). */
+  char *overlay_mnt;
+  int overlay_parent_dfd;
+  char *overlay_tmpdir;
 
   GSpawnChildSetupFunc child_setup_func;
   gpointer child_setup_data;
@@ -98,8 +107,22 @@ rpmostree_bwrap_unref (RpmOstreeBwrap *bwrap)
         sd_journal_print (LOG_WARNING, "%s", tmp_error->message);
     }
 
+  /* Normally rpmostree_bwrap_run() tears the overlay down; this is only
+   * hit if we never ran, or failed. */
+  if (bwrap->overlay_mnt)
+    {
+      (void) umount2 (bwrap->overlay_mnt, MNT_DETACH);
+      (void) unlinkat (AT_FDCWD, bwrap->overlay_mnt, AT_REMOVEDIR);
+    }
+  if (bwrap->overlay_tmpdir)
+    (void) glnx_shutil_rm_rf_at (bwrap->overlay_parent_dfd, bwrap->overlay_tmpdir, NULL, NULL);
+  if (bwrap->overlay_parent_dfd != -1)
+    (void) close (bwrap->overlay_parent_dfd);
+
   g_ptr_array_unref (bwrap->argv);
   g_free (bwrap->rofiles_mnt);
+  g_free (bwrap->overlay_mnt);
+  g_free (bwrap->overlay_tmpdir);
   g_free (bwrap);
 }
 
@@ -146,8 +169,8 @@ child_setup_fchdir (gpointer user_data)
 }
 
 static gboolean
-setup_rofiles_usr (RpmOstreeBwrap *bwrap,
-                   GError **error)
+setup_rofiles_fuse_usr (RpmOstreeBwrap *bwrap,
+                        GError **error)
 {
   gboolean ret = FALSE;
   int estatus;
@@ -177,6 +200,421 @@ setup_rofiles_usr (RpmOstreeBwrap *bwrap,
   return ret;
 }
 
+/* Copy the ownership, mode and xattrs of directory @src_dfd to @dest_dfd.
+ * Note xattrs are only ever added or updated; any which @dest_dfd has but
+ * @src_dfd doesn't are kept.
+ */
+static gboolean
+copy_dir_metadata (int            src_dfd,
+                   int            dest_dfd,
+                   const char    *name,
+                   GCancellable  *cancellable,
+                   GError       **error)
+{
+  struct stat stbuf;
+  if (fstat (src_dfd, &stbuf) < 0)
+    return glnx_throw_errno_prefix (error, "fstat(%s)", name);
+
+  /* chown first since it drops setuid bits */
+  if (fchown (dest_dfd, stbuf.st_uid, stbuf.st_gid) < 0)
+    return glnx_throw_errno_prefix (error, "fchown(%s)", name);
+  if (fchmod (dest_dfd, stbuf.st_mode & 07777) < 0)
+    return glnx_throw_errno_prefix (error, "fchmod(%s)", name);
+  g_autoptr(GVariant) xattrs = NULL;
+  if (!glnx_fd_get_all_xattrs (src_dfd, &xattrs, cancellable, error))
+    return FALSE;
+  if (!glnx_fd_set_all_xattrs (dest_dfd, xattrs, cancellable, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Mount an overlayfs over the rootfs' /usr, with the upper and work dirs in
+ * a scratch directory next to the rootfs.  It has to be on the same
+ * filesystem so that merge_overlay_usr() can rename files into place, but it
+ * must not be inside the rootfs, where anything left behind would end up in
+ * the commit.  Like rofiles-fuse, this means
+ * scripts can't mutate the hardlinked files shared with the repo; unlike it,
+ * we don't pay for a FUSE round trip on every file operation.  The upper dir
+ * is merged back into the rootfs by merge_overlay_usr() after the script has
+ * run.
+ *
+ * This needs CAP_SYS_ADMIN, a filesystem that can hold an overlay upper dir,
+ * and a rootfs that isn't a mount point; otherwise, unless @required is set we
+ * set @out_mounted to %FALSE and the caller falls back to rofiles-fuse.
+ */
+static gboolean
+setup_overlay_usr (RpmOstreeBwrap *bwrap,
+                   gboolean        required,
+                   gboolean       *out_mounted,
+                   GError        **error)
+{
+  glnx_fd_close int parent_dfd = -1;
+  struct stat rootfs_stbuf;
+  struct stat parent_stbuf;
+
+  if (!glnx_opendirat (bwrap->rootfs_fd, "..", TRUE, &parent_dfd, error))
+    return FALSE;
+  if (fstat (bwrap->rootfs_fd, &rootfs_stbuf) < 0)
+    return glnx_throw_errno_prefix (error, "fstat(rootfs)");
+  if (fstat (parent_dfd, &parent_stbuf) < 0)
+    return glnx_throw_errno_prefix (error, "fstat(rootfs/..)");
+  if (rootfs_stbuf.st_dev != parent_stbuf.st_dev)
+    {
+      if (required)
+        return glnx_throw (error, "Can't use overlayfs on /usr: rootfs is a mount point");
+      *out_mounted = FALSE;
+      return TRUE;
+    }
+
+  g_autofree char *tmpdir = g_strdup ("rpmostree-usr-overlay.XXXXXX");
+  if (!glnx_mkdtempat (parent_dfd, tmpdir, 0700, error))
+    return FALSE;
+  bwrap->overlay_parent_dfd = glnx_steal_fd (&parent_dfd);
+  bwrap->overlay_tmpdir = g_strdup (tmpdir);
+
+  const char *upperdir = glnx_strjoina (tmpdir, "/upper");
+  const char *workdir = glnx_strjoina (tmpdir, "/work");
+  if (mkdirat (bwrap->overlay_parent_dfd, upperdir, 0755) < 0)
+    return glnx_throw_errno_prefix (error, "mkdirat(%s)", upperdir);
+  if (mkdirat (bwrap->overlay_parent_dfd, workdir, 0700) < 0)
+    return glnx_throw_errno_prefix (error, "mkdirat(%s)", workdir);
+
+  /* The upper dir becomes /usr, so it has to look like it; that way any
+   * metadata changes a script makes to /usr itself can be merged back too */
+  { glnx_fd_close int usr_dfd = -1;
+    glnx_fd_close int upper_dfd = -1;
+    if (!glnx_opendirat (bwrap->rootfs_fd, "usr", FALSE, &usr_dfd, error))
+      return FALSE;
+    if (!glnx_opendirat (bwrap->overlay_parent_dfd, upperdir, FALSE, &upper_dfd, error))
+      return FALSE;
+    if (!copy_dir_metadata (usr_dfd, upper_dfd, "usr", NULL, error))
+      return FALSE;
+  }
+
+  bwrap->overlay_mnt = g_strdup ("/tmp/rpmostree-usr-overlay.XXXXXX");
+  if (!glnx_mkdtempat (AT_FDCWD, bwrap->overlay_mnt, 0700, error))
+    {
+      g_clear_pointer (&bwrap->overlay_mnt, g_free);
+      return FALSE;
+    }
+
+  g_autofree char *lower_path = glnx_fdrel_abspath (bwrap->rootfs_fd, "usr");
+  g_autofree char *upper_path = glnx_fdrel_abspath (bwrap->overlay_parent_dfd, upperdir);
+  g_autofree char *work_path = glnx_fdrel_abspath (bwrap->overlay_parent_dfd, workdir);
+  g_autofree char *opts =
+    g_strdup_printf ("lowerdir=%s,upperdir=%s,workdir=%s", lower_path, upper_path, work_path);
+  /* We want plain copy-ups in the upper dir so they can be renamed into
+   * place; explicitly turn off metacopy and redirect_dir in case the module
+   * defaults them on, but older kernels don't know about these at all.
+   */
+  g_autofree char *opts_strict = g_strconcat (opts, ",redirect_dir=off,metacopy=off", NULL);
+  if (mount ("overlay", bwrap->overlay_mnt, "overlay", MS_NOSUID | MS_NODEV, opts_strict) < 0
+      && (errno != EINVAL ||
+          mount ("overlay", bwrap->overlay_mnt, "overlay", MS_NOSUID | MS_NODEV, opts) < 0))
+    {
+      const int mount_errno = errno;
+      (void) unlinkat (AT_FDCWD, bwrap->overlay_mnt, AT_REMOVEDIR);
+      g_clear_pointer (&bwrap->overlay_mnt, g_free);
+      if (!glnx_shutil_rm_rf_at (bwrap->overlay_parent_dfd, bwrap->overlay_tmpdir, NULL, error))
+        return FALSE;
+      g_clear_pointer (&bwrap->overlay_tmpdir, g_free);
+      if (required)
+        return glnx_throw (error, "Mounting overlayfs on /usr: %s", g_strerror (mount_errno));
+      *out_mounted = FALSE;
+      return TRUE;
+    }
+
+  rpmostree_bwrap_append_bwrap_argv (bwrap, "--bind", bwrap->overlay_mnt, "/usr", NULL);
+  *out_mounted = TRUE;
+  return TRUE;
+}
+
+/* Drop any overlayfs-private xattrs (origin, impure, opaque, ...) from a file
+ * in the upper dir, so they don't end up in the rootfs and then the commit. */
+static gboolean
+strip_overlay_xattrs_at (int          dfd,
+                         const char  *name,
+                         GError     **error)
+{
+  g_autofree char *path = glnx_fdrel_abspath (dfd, name);
+  ssize_t len = llistxattr (path, NULL, 0);
+  if (len < 0)
+    {
+      if (errno == ENOTSUP)
+        return TRUE;
+      return glnx_throw_errno_prefix (error, "llistxattr(%s)", name);
+    }
+  if (len == 0)
+    return TRUE;
+
+  g_autofree char *names = g_malloc (len);
+  len = llistxattr (path, names, len);
+  if (len < 0)
+    return glnx_throw_errno_prefix (error, "llistxattr(%s)", name);
+
+  for (const char *it = names; it < names + len; it += strlen (it) + 1)
+    {
+      if (!g_str_has_prefix (it, "trusted.overlay."))
+        continue;
+      if (lremovexattr (path, it) < 0 && errno != ENODATA)
+        return glnx_throw_errno_prefix (error, "lremovexattr(%s, %s)", name, it);
+    }
+
+  return TRUE;
+}
+
+/* Strip overlay xattrs from a new directory tree in the upper dir before it's
+ * moved into place wholesale; it shouldn't have whiteouts, but drop any. */
+static gboolean
+strip_overlay_xattrs_recurse (int            dfd,
+                              GCancellable  *cancellable,
+                              GError       **error)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  if (!glnx_dirfd_iterator_init_at (dfd, ".", FALSE, &dfd_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct dirent *dent = NULL;
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+
+      struct stat stbuf;
+      if (fstatat (dfd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) < 0)
+        return glnx_throw_errno_prefix (error, "fstatat(%s)", dent->d_name);
+
+      if (S_ISCHR (stbuf.st_mode) && stbuf.st_rdev == makedev (0, 0))
+        {
+          if (unlinkat (dfd, dent->d_name, 0) < 0)
+            return glnx_throw_errno_prefix (error, "unlinkat(%s)", dent->d_name);
+          continue;
+        }
+
+      if (!strip_overlay_xattrs_at (dfd, dent->d_name, error))
+        return FALSE;
+
+      if (S_ISDIR (stbuf.st_mode))
+        {
+          glnx_fd_close int child_dfd = -1;
+          if (!glnx_opendirat (dfd, dent->d_name, FALSE, &child_dfd, error))
+            return FALSE;
+          if (!strip_overlay_xattrs_recurse (child_dfd, cancellable, error))
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+static gboolean
+has_overlay_origin (int          dfd,
+                    const char  *name,
+                    gboolean    *out_has_origin,
+                    GError     **error)
+{
+  g_autofree char *path = glnx_fdrel_abspath (dfd, name);
+  if (lgetxattr (path, "trusted.overlay.origin", NULL, 0) < 0)
+    {
+      if (errno != ENODATA && errno != ENOTSUP)
+        return glnx_throw_errno_prefix (error, "lgetxattr(%s)", name);
+      *out_has_origin = FALSE;
+    }
+  else
+    *out_has_origin = TRUE;
+  return TRUE;
+}
+
+static gboolean
+dir_is_opaque (int      dfd,
+               gboolean *out_opaque)
+{
+  char value[1];
+  ssize_t len = fgetxattr (dfd, "trusted.overlay.opaque", value, sizeof (value));
+  if (len < 0)
+    {
+      if (errno != ENODATA && errno != ENOTSUP)
+        return FALSE;
+      *out_opaque = FALSE;
+    }
+  else
+    *out_opaque = (len == 1 && value[0] == 'y');
+  return TRUE;
+}
+
+/* Apply the overlay upper dir @upper_dfd onto @lower_dfd: whiteouts delete,
+ * opaque directories replace, and everything else is renamed over what was
+ * there.  Since the upper dir is on the same filesystem, nothing is copied.
+ * The metadata of merged directories is carried over, except that xattrs
+ * removed from a copied-up directory are lost (see copy_dir_metadata()).
+ */
+static gboolean
+merge_overlay_upper (int            upper_dfd,
+                     int            lower_dfd,
+                     GCancellable  *cancellable,
+                     GError       **error)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  if (!glnx_dirfd_iterator_init_at (upper_dfd, ".", FALSE, &dfd_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct dirent *dent = NULL;
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+
+      const char *name = dent->d_name;
+      struct stat stbuf;
+      if (fstatat (upper_dfd, name, &stbuf, AT_SYMLINK_NOFOLLOW) < 0)
+        return glnx_throw_errno_prefix (error, "fstatat(%s)", name);
+
+      struct stat lower_stbuf;
+      gboolean lower_exists = TRUE;
+      if (fstatat (lower_dfd, name, &lower_stbuf, AT_SYMLINK_NOFOLLOW) < 0)
+        {
+          if (errno != ENOENT)
+            return glnx_throw_errno_prefix (error, "fstatat(%s)", name);
+          lower_exists = FALSE;
+        }
+
+      if (S_ISCHR (stbuf.st_mode) && stbuf.st_rdev == makedev (0, 0))
+        {
+          /* Whiteout */
+          if (lower_exists && !glnx_shutil_rm_rf_at (lower_dfd, name, cancellable, error))
+            return FALSE;
+        }
+      else if (S_ISDIR (stbuf.st_mode))
+        {
+          glnx_fd_close int child_upper_dfd = -1;
+          if (!glnx_opendirat (upper_dfd, name, FALSE, &child_upper_dfd, error))
+            return FALSE;
+          gboolean opaque;
+          if (!dir_is_opaque (child_upper_dfd, &opaque))
+            return glnx_throw_errno_prefix (error, "fgetxattr(%s)", name);
+          if (!strip_overlay_xattrs_at (upper_dfd, name, error))
+            return FALSE;
+
+          if (lower_exists && (opaque || !S_ISDIR (lower_stbuf.st_mode)))
+            {
+              if (!glnx_shutil_rm_rf_at (lower_dfd, name, cancellable, error))
+                return FALSE;
+              lower_exists = FALSE;
+            }
+
+          if (!lower_exists)
+            {
+              /* Nothing to merge with; move the whole thing over */
+              if (!strip_overlay_xattrs_recurse (child_upper_dfd, cancellable, error))
+                return FALSE;
+              if (renameat (upper_dfd, name, lower_dfd, name) < 0)
+                return glnx_throw_errno_prefix (error, "renameat(%s)", name);
+              continue;
+            }
+
+          glnx_fd_close int child_lower_dfd = -1;
+          if (!glnx_opendirat (lower_dfd, name, FALSE, &child_lower_dfd, error))
+            return FALSE;
+
+          /* The directory was copied up; carry over any metadata changes */
+          if (!copy_dir_metadata (child_upper_dfd, child_lower_dfd, name,
+                                  cancellable, error))
+            return FALSE;
+
+          if (!merge_overlay_upper (child_upper_dfd, child_lower_dfd, cancellable, error))
+            return FALSE;
+        }
+      else
+        {
+          /* Like rofiles-fuse, don't allow mutating the (hardlinked) files
+           * in /usr; these only have an origin if they were copied up rather
+           * than created anew. */
+          if (lower_exists && S_ISREG (stbuf.st_mode) && S_ISREG (lower_stbuf.st_mode))
+            {
+              gboolean copied_up;
+              if (!has_overlay_origin (upper_dfd, name, &copied_up, error))
+                return FALSE;
+              if (copied_up)
+                return glnx_throw (error, "Modifying existing file %s in place is not supported", name);
+            }
+          if (!strip_overlay_xattrs_at (upper_dfd, name, error))
+            return FALSE;
+          if (lower_exists && S_ISDIR (lower_stbuf.st_mode))
+            {
+              if (!glnx_shutil_rm_rf_at (lower_dfd, name, cancellable, error))
+                return FALSE;
+            }
+          if (renameat (upper_dfd, name, lower_dfd, name) < 0)
+            return glnx_throw_errno_prefix (error, "renameat(%s)", name);
+        }
+    }
+
+  return TRUE;
+}
+
+/* Unmount the overlay and fold its upper dir back into the rootfs' /usr */
+static gboolean
+merge_overlay_usr (RpmOstreeBwrap *bwrap,
+                   GError        **error)
+{
+  g_assert (bwrap->overlay_mnt);
+
+  /* The container is gone, so nothing should be holding this; the upper
+   * dir must not be modified while it's still mounted. */
+  if (umount2 (bwrap->overlay_mnt, MNT_DETACH) < 0)
+    return glnx_throw_errno_prefix (error, "umount(%s)", bwrap->overlay_mnt);
+  (void) unlinkat (AT_FDCWD, bwrap->overlay_mnt, AT_REMOVEDIR);
+  g_clear_pointer (&bwrap->overlay_mnt, g_free);
+
+  const char *upperdir = glnx_strjoina (bwrap->overlay_tmpdir, "/upper");
+  glnx_fd_close int upper_dfd = -1;
+  if (!glnx_opendirat (bwrap->overlay_parent_dfd, upperdir, FALSE, &upper_dfd, error))
+    return FALSE;
+  glnx_fd_close int usr_dfd = -1;
+  if (!glnx_opendirat (bwrap->rootfs_fd, "usr", FALSE, &usr_dfd, error))
+    return FALSE;
+  /* /usr itself, like its subdirectories */
+  if (!strip_overlay_xattrs_at (upper_dfd, ".", error))
+    return FALSE;
+  if (!copy_dir_metadata (upper_dfd, usr_dfd, "usr", NULL, error))
+    return glnx_prefix_error (error, "Merging /usr overlay");
+  if (!merge_overlay_upper (upper_dfd, usr_dfd, NULL, error))
+    return glnx_prefix_error (error, "Merging /usr overlay");
+
+  if (!glnx_shutil_rm_rf_at (bwrap->overlay_parent_dfd, bwrap->overlay_tmpdir, NULL, error))
+    return FALSE;
+  g_clear_pointer (&bwrap->overlay_tmpdir, g_free);
+  return TRUE;
+}
+
+/* Protect the hardlinked /usr from in-place mutation.  We prefer overlayfs,
+ * and fall back to rofiles-fuse if we can't mount it.  For testing and
+ * benchmarking, RPMOSTREE_BWRAP_ROFILES=fuse|overlay forces one or the
+ * other.
+ */
+static gboolean
+setup_rofiles_usr (RpmOstreeBwrap *bwrap,
+                   GError **error)
+{
+  const char *backend = getenv ("RPMOSTREE_BWRAP_ROFILES");
+
+  if (g_strcmp0 (backend, "fuse") != 0)
+    {
+      gboolean mounted = FALSE;
+      if (!setup_overlay_usr (bwrap, g_strcmp0 (backend, "overlay") == 0, &mounted, error))
+        return FALSE;
+      if (mounted)
+        return TRUE;
+    }
+
+  return setup_rofiles_fuse_usr (bwrap, error);
+}
+
 /* nspawn by default doesn't give us CAP_NET_ADMIN; see
  * https://pagure.io/releng/issue/6602#comment-71214
  * https://pagure.io/koji/pull-request/344#comment-21060
@@ -206,6 +644,7 @@ rpmostree_bwrap_new (int rootfs_fd,
 
   ret->refcount = 1;
   ret->rootfs_fd = rootfs_fd;
+  ret->overlay_parent_dfd = -1;
   ret->argv = g_ptr_array_new_with_free_func (g_free);
 
   /* ⚠⚠⚠ If you change this, also update scripts/bwrap-script-shell.sh ⚠⚠⚠ */
@@ -346,6 +785,12 @@ rpmostree_bwrap_run (RpmOstreeBwrap *bwrap,
       }
   }
 
+  if (bwrap->overlay_mnt)
+    {
+      if (!merge_overlay_usr (bwrap, error))
+        return FALSE;
+    }
+
   return TRUE;
 }
 
@@ -21,6 +21,8 @@
 #include "config.h"
 
 #include <glib-unix.h>
+#include <libgen.h>
+#include <sys/syscall.h>
 #include <rpm/rpmsq.h>
 #include <rpm/rpmlib.h>
 #include <rpm/rpmlog.h>
@@ -49,6 +51,11 @@
 #define RPMOSTREE_DIR_CACHE_SOLV "solv"
 #define RPMOSTREE_DIR_LOCK "lock"
 
+/* Maps depsolve inputs to their solution; see
+ * rpmostree_context_lookup_cached_solution() */
+#define RPMOSTREE_DEPSOLVE_CACHE "extensions/rpmostree/depsolve-cache"
+#define RPMOSTREE_DEPSOLVE_CACHE_MAX_ENTRIES 16
+
 static OstreeRepo * get_pkgcache_repo (RpmOstreeContext *self);
 
 /***********************************************************
@@ -247,6 +254,16 @@ struct _RpmOstreeContext {
   GPtrArray *pkgs_to_import;
   GPtrArray *pkgs_to_relabel;
 
+  gboolean rpmmd_repos_refreshed; /* See refresh_rpmmd_repos() */
+  char *depsolve_key; /* See rpmostree_context_lookup_cached_solution() */
+  GVariant *solution; /* (a(sss)as); see goal_to_solution() */
+
+  gboolean layer_has_scripts; /* Set during assembly if the layer isn't script-free */
+
+  GHashTable *pkg_headers; /* nevra -> PkgHeader, loaded from the pkgcache */
+
+  RpmOstreeCopyupStats copyup_stats; /* See break_single_hardlink_at() */
+
   char *tmpdir_path;
   int tmpdir_fd;
 };
@@ -272,6 +289,11 @@ rpmostree_context_finalize (GObject *object)
   g_clear_pointer (&rctx->pkgs_to_import, g_ptr_array_unref);
   g_clear_pointer (&rctx->pkgs_to_relabel, g_ptr_array_unref);
 
+  g_clear_pointer (&rctx->depsolve_key, g_free);
+  g_clear_pointer (&rctx->solution, g_variant_unref);
+
+  g_clear_pointer (&rctx->pkg_headers, g_hash_table_unref);
+
   if (rctx->tmpdir_path)
     {
       (void) glnx_shutil_rm_rf_at (AT_FDCWD, rctx->tmpdir_path, NULL, NULL);
@@ -479,6 +501,12 @@ rpmostree_context_set_ignore_scripts (RpmOstreeContext *self,
     self->ignore_scripts = g_hash_table_ref (ignore_scripts);
 }
 
+const RpmOstreeCopyupStats *
+rpmostree_context_get_copyup_stats (RpmOstreeContext *self)
+{
+  return &self->copyup_stats;
+}
+
 DnfContext *
 rpmostree_context_get_hif (RpmOstreeContext *self)
 {
@@ -699,12 +727,6 @@ get_nevra_relpath (const char *nevra)
   return g_strdup_printf ("metarpm/%s.rpm", nevra);
 }
 
-static char *
-get_package_relpath (DnfPackage *pkg)
-{
-  return get_nevra_relpath (dnf_package_get_nevra (pkg));
-}
-
 static gboolean
 checkout_pkg_metadata (RpmOstreeContext *self,
                        const char       *nevra,
@@ -774,24 +796,6 @@ get_header_variant (OstreeRepo       *repo,
   return TRUE;
 }
 
-static gboolean
-checkout_pkg_metadata_by_dnfpkg (RpmOstreeContext *self,
-                                 DnfPackage       *pkg,
-                                 GCancellable     *cancellable,
-                                 GError          **error)
-{
-  const char *nevra = dnf_package_get_nevra (pkg);
-  g_autofree char *cachebranch = rpmostree_get_cache_branch_pkg (pkg);
-  OstreeRepo *pkgcache_repo = get_pkgcache_repo (self);
-  g_autoptr(GVariant) header = NULL;
-
-  if (!get_header_variant (pkgcache_repo, cachebranch, &header,
-                           cancellable, error))
-    return FALSE;
-
-  return checkout_pkg_metadata (self, nevra, header, cancellable, error);
-}
-
 gboolean
 rpmostree_pkgcache_find_pkg_header (OstreeRepo    *pkgcache,
                                     const char    *nevra,
@@ -870,12 +874,14 @@ checkout_pkg_metadata_by_nevra (RpmOstreeContext *self,
                                 cancellable, error);
 }
 
-gboolean
-rpmostree_context_download_metadata (RpmOstreeContext *self,
-                                     GCancellable     *cancellable,
-                                     GError          **error)
+/* Bring the rpm-md metadata of the enabled repos up to date, without loading
+ * it into the sack. */
+static gboolean
+refresh_rpmmd_repos (RpmOstreeContext *self,
+                     GError          **error)
 {
-  g_assert (!self->empty);
+  if (self->rpmmd_repos_refreshed)
+    return TRUE;
 
   g_autoptr(GPtrArray) rpmmd_repos = get_enabled_rpmmd_repos (self->hifctx, DNF_REPO_ENABLED_METADATA);
 
@@ -927,6 +933,20 @@ rpmostree_context_download_metadata (RpmOstreeContext *self,
                !did_update ? " (cached)" : "", repo_ts_str);
     }
 
+  self->rpmmd_repos_refreshed = TRUE;
+  return TRUE;
+}
+
+gboolean
+rpmostree_context_download_metadata (RpmOstreeContext *self,
+                                     GCancellable     *cancellable,
+                                     GError          **error)
+{
+  g_assert (!self->empty);
+
+  if (!refresh_rpmmd_repos (self, error))
+    return FALSE;
+
   { g_autoptr(DnfState) hifstate = dnf_state_new ();
     guint progress_sigid = g_signal_connect (hifstate, "percentage-changed",
                                              G_CALLBACK (on_hifstate_percentage_changed),
@@ -1044,18 +1064,11 @@ commit_has_matching_sepolicy (OstreeRepo     *repo,
 }
 
 static gboolean
-commit_has_matching_repodata_chksum_repr (OstreeRepo  *repo,
-                                          const char  *rev,
+commit_has_matching_repodata_chksum_repr (GVariant    *commit,
                                           const char  *expected,
                                           gboolean    *out_matches,
                                           GError     **error)
 {
-  g_autoptr(GVariant) commit = NULL;
-  if (!ostree_repo_load_commit (repo, rev, &commit, NULL, error))
-    return FALSE;
-
-  g_assert (commit);
-
   g_autofree char *actual = NULL;
   g_autoptr(GError) tmp_error = NULL;
   if (!get_commit_repodata_chksum_repr (commit, &actual, &tmp_error))
@@ -1090,8 +1103,26 @@ pkg_is_cached (DnfPackage *pkg)
   return g_file_test (dnf_package_get_filename (pkg), G_FILE_TEST_EXISTS);
 }
 
+/* The pkgcache is trimmed in LRU order on cleanup (see
+ * clean_pkgcache_orphans()), using the mtime of the branch's ref file as the
+ * last-use timestamp. This is only a hint, so errors are ignored.
+ */
+static void
+touch_pkgcache_branch (OstreeRepo *repo,
+                       const char *cachebranch)
+{
+  g_autofree char *refpath = g_strconcat ("refs/heads/", cachebranch, NULL);
+  (void) utimensat (ostree_repo_get_dfd (repo), refpath, NULL, 0);
+}
+
+/* Look up @pkg in the pkgcache. @cached_refs maps the "rpmostree/pkg" refs to
+ * their commit checksums, as returned by list_pkgcache_refs(); the cached
+ * commit is loaded at most once and both its repodata checksum and its SELinux
+ * policy checksum are checked against that single load.
+ */
 static gboolean
 find_pkg_in_ostree (OstreeRepo     *repo,
+                    GHashTable     *cached_refs,
                     DnfPackage     *pkg,
                     OstreeSePolicy *sepolicy,
                     gboolean       *out_in_ostree,
@@ -1100,20 +1131,21 @@ find_pkg_in_ostree (OstreeRepo     *repo,
 {
   gboolean in_ostree = FALSE;
   gboolean selinux_match = FALSE;
-  g_autofree char *cached_rev = NULL;
+  g_autoptr(GVariant) commit = NULL;
   g_autofree char *cachebranch = rpmostree_get_cache_branch_pkg (pkg);
 
   /* NB: we're not using a pkgcache yet in the compose path */
-  if (repo == NULL)
+  if (repo == NULL || cached_refs == NULL)
     goto done; /* Note early happy return */
 
-  if (!ostree_repo_resolve_rev (repo, cachebranch, TRUE,
-                                &cached_rev, error))
-    return FALSE;
-
+  const char *cached_rev = g_hash_table_lookup (cached_refs, cachebranch);
   if (!cached_rev)
     goto done; /* Note early happy return */
 
+  if (!ostree_repo_load_commit (repo, cached_rev, &commit, NULL, error))
+    return FALSE;
+  g_assert (commit);
+
   /* NB: we do an exception for LocalPackages here; we've already checked that
    * its cache is valid and matches what's in the origin. We never want to fetch
    * newer versions of LocalPackages from the repos. But we do want to check
@@ -1128,7 +1160,7 @@ find_pkg_in_ostree (OstreeRepo     *repo,
         return FALSE;
 
       gboolean same_pkg_chksum = FALSE;
-      if (!commit_has_matching_repodata_chksum_repr (repo, cached_rev,
+      if (!commit_has_matching_repodata_chksum_repr (commit,
                                                      expected_chksum_repr,
                                                      &same_pkg_chksum, error))
         return FALSE;
@@ -1138,11 +1170,14 @@ find_pkg_in_ostree (OstreeRepo     *repo,
     }
 
   in_ostree = TRUE;
+  touch_pkgcache_branch (repo, cachebranch);
   if (sepolicy)
     {
-      if (!commit_has_matching_sepolicy (repo, cached_rev, sepolicy,
-                                         &selinux_match, error))
+      g_autofree char *sepolicy_csum = NULL;
+      if (!get_commit_sepolicy_csum (commit, &sepolicy_csum, error))
         return FALSE;
+      selinux_match = g_str_equal (sepolicy_csum,
+                                   ostree_sepolicy_get_csum (sepolicy));
     }
 
 done:
@@ -1151,6 +1186,30 @@ done:
   return TRUE;
 }
 
+/* Return a map of all the "rpmostree/pkg" refs in @repo to their commit
+ * checksums, so that we only read the refs directory once rather than
+ * resolving each package's cache branch individually. */
+static gboolean
+list_pkgcache_refs (OstreeRepo    *repo,
+                    GHashTable   **out_refs,
+                    GCancellable  *cancellable,
+                    GError       **error)
+{
+  g_autoptr(GHashTable) refs = NULL;
+
+  /* NB: we're not using a pkgcache yet in the compose path */
+  if (repo != NULL)
+    {
+      if (!ostree_repo_list_refs_ext (repo, "rpmostree/pkg", &refs,
+                                      OSTREE_REPO_LIST_REFS_EXT_NONE,
+                                      cancellable, error))
+        return FALSE;
+    }
+
+  *out_refs = g_steal_pointer (&refs);
+  return TRUE;
+}
+
 /* determine of all the marked packages, which ones we'll need to download,
  * which ones we'll need to import, and which ones we'll need to relabel */
 static gboolean
@@ -1166,6 +1225,11 @@ sort_packages (RpmOstreeContext *self,
   g_assert (!self->pkgs_to_relabel);
   self->pkgs_to_relabel = g_ptr_array_new_with_free_func ((GDestroyNotify)g_object_unref);
 
+  OstreeRepo *pkgcache_repo = get_pkgcache_repo (self);
+  g_autoptr(GHashTable) cached_refs = NULL;
+  if (!list_pkgcache_refs (pkgcache_repo, &cached_refs, NULL, error))
+    return FALSE;
+
   GPtrArray *sources = dnf_context_get_repos (hifctx);
   g_autoptr(GPtrArray) packages = dnf_goal_get_packages (dnf_context_get_goal (hifctx),
                                                          DNF_PACKAGE_INFO_INSTALL, -1);
@@ -1208,8 +1272,9 @@ sort_packages (RpmOstreeContext *self,
         gboolean selinux_match = FALSE;
         gboolean cached = pkg_is_cached (pkg);
 
-        if (!find_pkg_in_ostree (get_pkgcache_repo (self), pkg, self->sepolicy,
-                                 &in_ostree, &selinux_match, error))
+        if (!find_pkg_in_ostree (pkgcache_repo, cached_refs, pkg,
+                                 self->sepolicy, &in_ostree, &selinux_match,
+                                 error))
           return FALSE;
 
         if (is_locally_cached)
@@ -1317,6 +1382,214 @@ check_goal_solution (HyGoal    goal,
   return TRUE;
 }
 
+static gint
+compare_pkgs (gconstpointer a,
+              gconstpointer b)
+{
+  DnfPackage **pkg_a = (gpointer)a;
+  DnfPackage **pkg_b = (gpointer)b;
+  return dnf_package_cmp (*pkg_a, *pkg_b);
+}
+
+/* The part of a solved goal that we hash and cache: the packages to install as
+ * (nevra, repodata checksum repr, reponame) in the order
+ * rpmostree_print_transaction() prints them, and the sorted NEVRAs of the base
+ * packages to remove. */
+static gboolean
+goal_to_solution (HyGoal     goal,
+                  GVariant **out_solution,
+                  GError   **error)
+{
+  GVariantBuilder installs;
+  GVariantBuilder removes;
+
+  g_variant_builder_init (&installs, G_VARIANT_TYPE ("a(sss)"));
+  g_autoptr(GPtrArray) pkglist = hy_goal_list_installs (goal, NULL);
+  g_assert (pkglist);
+  g_ptr_array_sort (pkglist, compare_pkgs);
+  for (guint i = 0; i < pkglist->len; i++)
+    {
+      DnfPackage *pkg = pkglist->pdata[i];
+      g_autofree char *chksum_repr = NULL;
+      if (!rpmostree_get_repodata_chksum_repr (pkg, &chksum_repr, error))
+        return FALSE;
+      g_variant_builder_add (&installs, "(sss)", dnf_package_get_nevra (pkg),
+                             chksum_repr, dnf_package_get_reponame (pkg));
+    }
+
+  g_variant_builder_init (&removes, G_VARIANT_TYPE ("as"));
+  g_autoptr(GPtrArray) removed =
+    dnf_goal_get_packages (goal, DNF_PACKAGE_INFO_REMOVE,
+                           DNF_PACKAGE_INFO_OBSOLETE, -1);
+  g_autoptr(GPtrArray) nevras = g_ptr_array_new ();
+  for (guint i = 0; i < removed->len; i++)
+    g_ptr_array_add (nevras, (gpointer)dnf_package_get_nevra (removed->pdata[i]));
+  g_ptr_array_sort (nevras, rpmostree_ptrarray_sort_compare_strings);
+  for (guint i = 0; i < nevras->len; i++)
+    g_variant_builder_add (&removes, "s", nevras->pdata[i]);
+
+  *out_solution = g_variant_ref_sink (g_variant_new ("(a(sss)as)", &installs, &removes));
+  return TRUE;
+}
+
+/* Hash the repo's section of its .repo file, so that changing e.g. exclude= or
+ * includepkgs= (which alter the solution without touching the metadata)
+ * invalidates the cache. */
+static gboolean
+checksum_update_from_repo_config (GChecksum  *checksum,
+                                  DnfRepo    *repo,
+                                  GError    **error)
+{
+  const char *id = dnf_repo_get_id (repo);
+  const char *filename = dnf_repo_get_filename (repo);
+  if (!filename)
+    return TRUE;
+
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+  if (!g_key_file_load_from_file (keyfile, filename, 0, error))
+    return glnx_prefix_error (error, "Loading %s", filename);
+
+  g_auto(GStrv) keys = g_key_file_get_keys (keyfile, id, NULL, NULL);
+  for (char **it = keys; it && *it; it++)
+    {
+      g_autofree char *value = g_key_file_get_value (keyfile, id, *it, NULL);
+      g_checksum_update (checksum, (guint8*)*it, strlen (*it) + 1);
+      if (value)
+        g_checksum_update (checksum, (guint8*)value, strlen (value));
+      g_checksum_update (checksum, (guint8*)"", 1);
+    }
+
+  return TRUE;
+}
+
+/* Everything a depsolve depends on: the base commit (and hence its rpmdb), the
+ * treespec with the requested packages and overrides, and the repomd.xml of
+ * each enabled rpm-md repo along with its .repo configuration. Sets *out_key
+ * to %NULL if a repo has no metadata cached yet. */
+static gboolean
+compute_depsolve_key (RpmOstreeContext *self,
+                      const char       *base_commit,
+                      char            **out_key,
+                      GError          **error)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+  *out_key = NULL;
+
+  /* include the NULs so that adjacent fields can't run into each other */
+  if (base_commit)
+    g_checksum_update (checksum, (guint8*)base_commit, strlen (base_commit));
+  g_checksum_update (checksum, (guint8*)"", 1);
+  g_checksum_update (checksum, g_variant_get_data (self->spec->spec),
+                     g_variant_get_size (self->spec->spec));
+
+  g_autoptr(GPtrArray) rpmmd_repos =
+    get_enabled_rpmmd_repos (self->hifctx, DNF_REPO_ENABLED_METADATA);
+  for (guint i = 0; i < rpmmd_repos->len; i++)
+    {
+      DnfRepo *repo = rpmmd_repos->pdata[i];
+      const char *id = dnf_repo_get_id (repo);
+      g_autofree char *repomd =
+        g_build_filename (dnf_repo_get_location (repo), "repodata", "repomd.xml", NULL);
+      g_autoptr(GError) local_error = NULL;
+      g_autofree char *contents = NULL;
+      gsize len;
+
+      if (!g_file_get_contents (repomd, &contents, &len, &local_error))
+        {
+          if (g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+            return TRUE; /* Note early return */
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
+        }
+
+      g_checksum_update (checksum, (guint8*)id, strlen (id) + 1);
+      g_checksum_update (checksum, (guint8*)contents, len);
+      if (!checksum_update_from_repo_config (checksum, repo, error))
+        return FALSE;
+    }
+
+  *out_key = g_strdup (g_checksum_get_string (checksum));
+  return TRUE;
+}
+
+/* Returns the a(s(a(sss)as)) cache, or %NULL if there is none (or it's
+ * unreadable; it's just a cache). */
+static GVariant *
+depsolve_cache_load (OstreeRepo *repo)
+{
+  g_autofree char *abspath =
+    glnx_fdrel_abspath (ostree_repo_get_dfd (repo), RPMOSTREE_DEPSOLVE_CACHE);
+  g_autoptr(GError) local_error = NULL;
+  char *contents;
+  gsize len;
+
+  if (!g_file_get_contents (abspath, &contents, &len, &local_error))
+    {
+      if (!g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_debug ("Ignoring depsolve cache: %s", local_error->message);
+      return NULL;
+    }
+
+  g_autoptr(GVariant) v =
+    g_variant_ref_sink (g_variant_new_from_data (G_VARIANT_TYPE ("a(s(a(sss)as))"),
+                                                 contents, len, FALSE, g_free, contents));
+  if (!g_variant_is_normal_form (v))
+    {
+      g_debug ("Ignoring corrupted depsolve cache");
+      return NULL;
+    }
+
+  return g_steal_pointer (&v);
+}
+
+/* Record our solution under the key computed by
+ * rpmostree_context_lookup_cached_solution(), keeping only the newest few. */
+static gboolean
+depsolve_cache_add (RpmOstreeContext *self,
+                    GCancellable     *cancellable,
+                    GError          **error)
+{
+  OstreeRepo *repo = self->ostreerepo;
+  g_autoptr(GVariant) cache = depsolve_cache_load (repo);
+  GVariantBuilder builder;
+  guint n_entries = 1;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(s(a(sss)as))"));
+  g_variant_builder_add (&builder, "(s@(a(sss)as))", self->depsolve_key, self->solution);
+
+  if (cache)
+    {
+      GVariantIter iter;
+      const char *key;
+      GVariant *solution;
+
+      g_variant_iter_init (&iter, cache);
+      while (n_entries < RPMOSTREE_DEPSOLVE_CACHE_MAX_ENTRIES &&
+             g_variant_iter_next (&iter, "(&s@(a(sss)as))", &key, &solution))
+        {
+          if (!g_str_equal (key, self->depsolve_key))
+            {
+              g_variant_builder_add (&builder, "(s@(a(sss)as))", key, solution);
+              n_entries++;
+            }
+          g_variant_unref (solution);
+        }
+    }
+
+  g_autoptr(GVariant) v = g_variant_ref_sink (g_variant_builder_end (&builder));
+  g_autofree char *dir = g_path_get_dirname (RPMOSTREE_DEPSOLVE_CACHE);
+  if (!glnx_shutil_mkdir_p_at (ostree_repo_get_dfd (repo), dir, 0755,
+                               cancellable, error))
+    return FALSE;
+  return glnx_file_replace_contents_at (ostree_repo_get_dfd (repo),
+                                        RPMOSTREE_DEPSOLVE_CACHE,
+                                        g_variant_get_data (v),
+                                        g_variant_get_size (v),
+                                        GLNX_FILE_REPLACE_NODATASYNC,
+                                        cancellable, error);
+}
+
 gboolean
 rpmostree_context_prepare (RpmOstreeContext *self,
                            GCancellable     *cancellable,
@@ -1436,11 +1709,113 @@ rpmostree_context_prepare (RpmOstreeContext *self,
   if (!sort_packages (self, error))
     return FALSE;
 
+  g_clear_pointer (&self->solution, g_variant_unref);
+  if (!goal_to_solution (goal, &self->solution, error))
+    return FALSE;
+
   rpmostree_output_task_end ("done");
 
+  if (self->depsolve_key)
+    {
+      /* The cache is just an optimization; don't fail over it */
+      g_autoptr(GError) local_error = NULL;
+      if (!depsolve_cache_add (self, cancellable, &local_error))
+        sd_journal_print (LOG_WARNING, "Failed to update depsolve cache: %s",
+                          local_error->message);
+    }
+
+  return TRUE;
+}
+
+/* If the same depsolve on top of @base_commit (%NULL if there is no base
+ * rpmdb) was done by an earlier rpmostree_context_prepare(), load its
+ * solution and set @out_found. This only refreshes the rpm-md metadata; the
+ * sack isn't loaded. On a hit, rpmostree_context_get_state_sha512() and
+ * rpmostree_context_get_input_hash() may be used without preparing, e.g. to
+ * find out that there is nothing to do. Otherwise, a subsequent prepare will
+ * record its solution.
+ */
+gboolean
+rpmostree_context_lookup_cached_solution (RpmOstreeContext *self,
+                                          const char       *base_commit,
+                                          gboolean         *out_found,
+                                          GCancellable     *cancellable,
+                                          GError          **error)
+{
+  g_assert (!self->empty);
+
+  *out_found = FALSE;
+
+  if (self->ostreerepo == NULL)
+    return TRUE;
+
+  if (!refresh_rpmmd_repos (self, error))
+    return FALSE;
+
+  g_clear_pointer (&self->depsolve_key, g_free);
+  if (!compute_depsolve_key (self, base_commit, &self->depsolve_key, error))
+    return FALSE;
+  if (!self->depsolve_key)
+    return TRUE;
+
+  g_autoptr(GVariant) cache = depsolve_cache_load (self->ostreerepo);
+  if (!cache)
+    return TRUE;
+
+  GVariantIter iter;
+  const char *key;
+  GVariant *solution;
+  g_variant_iter_init (&iter, cache);
+  while (g_variant_iter_next (&iter, "(&s@(a(sss)as))", &key, &solution))
+    {
+      if (g_str_equal (key, self->depsolve_key))
+        {
+          g_clear_pointer (&self->solution, g_variant_unref);
+          self->solution = solution;
+          *out_found = TRUE;
+          return TRUE;
+        }
+      g_variant_unref (solution);
+    }
+
   return TRUE;
 }
 
+/* Print a solution found by rpmostree_context_lookup_cached_solution(), when
+ * there is no goal to query, in the same format as
+ * rpmostree_print_transaction().
+ */
+void
+rpmostree_context_print_cached_solution (RpmOstreeContext *self)
+{
+  g_assert (self->solution);
+
+  g_autoptr(GVariant) installs = g_variant_get_child_value (self->solution, 0);
+  g_autoptr(GVariant) removes = g_variant_get_child_value (self->solution, 1);
+  GVariantBuilder installs_builder;
+  GVariantBuilder removes_builder;
+  GVariantIter iter;
+  const char *nevra;
+  const char *reponame;
+
+  g_variant_builder_init (&installs_builder, G_VARIANT_TYPE ("a(ss)"));
+  g_variant_iter_init (&iter, installs);
+  while (g_variant_iter_next (&iter, "(&s&s&s)", &nevra, NULL, &reponame))
+    g_variant_builder_add (&installs_builder, "(ss)", nevra, reponame);
+
+  /* These are all from the base rpmdb */
+  g_variant_builder_init (&removes_builder, G_VARIANT_TYPE ("a(ss)"));
+  g_variant_iter_init (&iter, removes);
+  while (g_variant_iter_next (&iter, "&s", &nevra))
+    g_variant_builder_add (&removes_builder, "(ss)", nevra, HY_SYSTEM_REPO_NAME);
+
+  g_autoptr(GVariant) installs_v =
+    g_variant_ref_sink (g_variant_builder_end (&installs_builder));
+  g_autoptr(GVariant) removes_v =
+    g_variant_ref_sink (g_variant_builder_end (&removes_builder));
+  rpmostree_print_package_changes (installs_v, removes_v);
+}
+
 /* Generate a checksum from a goal in a repeatable fashion -
  * we checksum an ordered array of the checksums of individual
  * packages.  We *used* to just checksum the NEVRAs but that
@@ -1480,6 +1855,32 @@ rpmostree_dnf_add_checksum_goal (GChecksum   *checksum,
     }
 }
 
+/* Same as rpmostree_dnf_add_checksum_goal(), but for a (possibly cached)
+ * solution. */
+static void
+add_checksum_solution (GChecksum *checksum,
+                       GVariant  *solution)
+{
+  g_autoptr(GVariant) installs = g_variant_get_child_value (solution, 0);
+  const guint n = g_variant_n_children (installs);
+  g_autoptr(GPtrArray) pkg_checksums = g_ptr_array_sized_new (n);
+
+  for (guint i = 0; i < n; i++)
+    {
+      const char *chksum_repr;
+      g_variant_get_child (installs, i, "(&s&s&s)", NULL, &chksum_repr, NULL);
+      g_ptr_array_add (pkg_checksums, (gpointer)chksum_repr);
+    }
+
+  g_ptr_array_sort (pkg_checksums, rpmostree_ptrarray_sort_compare_strings);
+
+  for (guint i = 0; i < pkg_checksums->len; i++)
+    {
+      const char *pkg_checksum = pkg_checksums->pdata[i];
+      g_checksum_update (checksum, (guint8*)pkg_checksum, strlen (pkg_checksum));
+    }
+}
+
 char *
 rpmostree_context_get_state_sha512 (RpmOstreeContext *self)
 {
@@ -1488,10 +1889,88 @@ rpmostree_context_get_state_sha512 (RpmOstreeContext *self)
                      g_variant_get_size (self->spec->spec));
 
   if (!self->empty)
-    rpmostree_dnf_add_checksum_goal (state_checksum, dnf_context_get_goal (self->hifctx));
+    {
+      g_assert (self->solution);
+      add_checksum_solution (state_checksum, self->solution);
+    }
   return g_strdup (g_checksum_get_string (state_checksum));
 }
 
+/* Hash the contents of @name in @passwd_dir; a missing file hashes
+ * differently from an empty one. */
+static gboolean
+checksum_update_from_passwd_file (GChecksum  *checksum,
+                                  const char *passwd_dir,
+                                  const char *name,
+                                  GError    **error)
+{
+  g_autofree char *path = g_build_filename (passwd_dir, name, NULL);
+  g_autoptr(GError) local_error = NULL;
+  g_autofree char *contents = NULL;
+  gsize len;
+
+  g_checksum_update (checksum, (guint8*)name, strlen (name) + 1);
+  if (!g_file_get_contents (path, &contents, &len, &local_error))
+    {
+      if (g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        return TRUE;
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  g_checksum_update (checksum, (guint8*)"+", 1);
+  g_checksum_update (checksum, (guint8*)contents, len);
+  return TRUE;
+}
+
+/* A canonical hash of everything that goes into a client layer on top of
+ * @base_commit: the treespec and resolved packages (see
+ * rpmostree_context_get_state_sha512()), the NEVRAs of removed base packages,
+ * the SELinux policy the packages are labeled with, and the passwd and group
+ * files (see rpmostree_context_set_passwd_dir()) that decide which uids and
+ * gids scripts and file ownership resolve to. Must be called after
+ * rpmostree_context_prepare() or a successful
+ * rpmostree_context_lookup_cached_solution().
+ */
+char *
+rpmostree_context_get_input_hash (RpmOstreeContext *self,
+                                  const char       *base_commit,
+                                  GError          **error)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autofree char *state_sha512 = rpmostree_context_get_state_sha512 (self);
+
+  /* include the NULs so that adjacent fields can't run into each other */
+  g_checksum_update (checksum, (guint8*)base_commit, strlen (base_commit) + 1);
+  g_checksum_update (checksum, (guint8*)state_sha512, strlen (state_sha512) + 1);
+
+  if (!self->empty)
+    {
+      /* already sorted; see goal_to_solution() */
+      g_autoptr(GVariant) removed = g_variant_get_child_value (self->solution, 1);
+      GVariantIter iter;
+      const char *nevra;
+      g_variant_iter_init (&iter, removed);
+      while (g_variant_iter_next (&iter, "&s", &nevra))
+        g_checksum_update (checksum, (guint8*)nevra, strlen (nevra) + 1);
+    }
+
+  const char *sepolicy_csum =
+    self->sepolicy ? ostree_sepolicy_get_csum (self->sepolicy) : NULL;
+  if (sepolicy_csum)
+    g_checksum_update (checksum, (guint8*)sepolicy_csum, strlen (sepolicy_csum) + 1);
+
+  if (self->passwd_dir)
+    {
+      if (!checksum_update_from_passwd_file (checksum, self->passwd_dir, "passwd", error))
+        return NULL;
+      if (!checksum_update_from_passwd_file (checksum, self->passwd_dir, "group", error))
+        return NULL;
+    }
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
 static GHashTable *
 gather_source_to_packages (RpmOstreeContext *self)
 {
@@ -1574,9 +2053,9 @@ rpmostree_context_download (RpmOstreeContext *self,
 
 static gboolean
 import_one_package (RpmOstreeContext *self,
-                    DnfContext     *hifctx,
                     DnfPackage     *pkg,
                     OstreeSePolicy *sepolicy,
+                    guint64        *inout_bytes_read,
                     GCancellable   *cancellable,
                     GError        **error)
 {
@@ -1600,8 +2079,10 @@ import_one_package (RpmOstreeContext *self,
                           "packages", glnx_basename (pkg_location), NULL);
     }
 
-  /* Verify signatures if enabled */
-  if (!dnf_transaction_gpgcheck_package (dnf_context_get_transaction (hifctx), pkg, error))
+  /* Verify signatures if enabled. This is a separate read of the RPM through
+   * libdnf, which owns the keyring; the unpacker's own read below only checks
+   * the header digest. */
+  if (!dnf_transaction_gpgcheck_package (dnf_context_get_transaction (self->hifctx), pkg, error))
     return FALSE;
 
   flags = RPMOSTREE_UNPACKER_FLAGS_OSTREE_CONVENTION;
@@ -1618,6 +2099,8 @@ import_one_package (RpmOstreeContext *self,
     return glnx_prefix_error (error, "Unpacking %s",
                               dnf_package_get_nevra (pkg));
 
+  *inout_bytes_read += rpmostree_unpacker_get_bytes_read (unpacker);
+
   if (!pkg_is_local (pkg))
     {
       if (TEMP_FAILURE_RETRY (unlinkat (AT_FDCWD, pkg_path, 0)) < 0)
@@ -1643,6 +2126,7 @@ rpmostree_context_import (RpmOstreeContext *self,
   DnfContext *hifctx = self->hifctx;
   guint progress_sigid;
   int n = self->pkgs_to_import->len;
+  guint64 bytes_read = 0;
 
   if (n == 0)
     return TRUE;
@@ -1662,8 +2146,8 @@ rpmostree_context_import (RpmOstreeContext *self,
     for (guint i = 0; i < self->pkgs_to_import->len; i++)
       {
         DnfPackage *pkg = self->pkgs_to_import->pdata[i];
-        if (!import_one_package (self, hifctx, pkg,
-                                 self->sepolicy, cancellable, error))
+        if (!import_one_package (self, pkg, self->sepolicy, &bytes_read,
+                                 cancellable, error))
           return FALSE;
         dnf_state_assert_done (hifstate);
       }
@@ -1672,10 +2156,18 @@ rpmostree_context_import (RpmOstreeContext *self,
     rpmostree_output_percent_progress_end ();
   }
 
+  /* The unpacker should read each package just once; compare the I/O it did
+   * with the size of the packages */
+  const guint64 pkgs_size = dnf_package_array_get_download_size (self->pkgs_to_import);
+  g_autofree char *bytes_read_str = g_format_size (bytes_read);
   sd_journal_send ("MESSAGE_ID=" SD_ID128_FORMAT_STR,
                    SD_ID128_FORMAT_VAL(RPMOSTREE_MESSAGE_PKG_IMPORT),
-                   "MESSAGE=Imported %u pkg%s", n, n > 1 ? "s" : "",
-                   "IMPORTED_N_PKGS=%u", n, NULL);
+                   "MESSAGE=Imported %u pkg%s (%s read)", n, n > 1 ? "s" : "",
+                   bytes_read_str,
+                   "IMPORTED_N_PKGS=%u", n,
+                   "IMPORTED_BYTES_READ=%" G_GUINT64_FORMAT, bytes_read,
+                   "IMPORTED_PKGS_SIZE=%" G_GUINT64_FORMAT, pkgs_size,
+                   NULL);
 
   return TRUE;
 }
@@ -1721,16 +2213,7 @@ checkout_package_into_root (RpmOstreeContext *self,
 {
   OstreeRepo *pkgcache_repo = get_pkgcache_repo (self);
 
-  if (pkgcache_repo != self->ostreerepo)
-    {
-      if (!rpmostree_pull_content_only (self->ostreerepo, pkgcache_repo, pkg_commit,
-                                        cancellable, error))
-        {
-          g_prefix_error (error, "Linking cached content for %s: ", dnf_package_get_nevra (pkg));
-          return FALSE;
-        }
-    }
-
+  /* NB: the content was already migrated by import_layered_content() */
   if (!checkout_package (pkgcache_repo, pkg, dfd, path,
                          devino_cache, pkg_commit,
                          cancellable, error))
@@ -1739,6 +2222,40 @@ checkout_package_into_root (RpmOstreeContext *self,
   return TRUE;
 }
 
+/* Make sure the content of all the layered packages in @pkg_to_ostree_commit
+ * is in the system repo, so it can be checked out with hardlinks. */
+static gboolean
+import_layered_content (RpmOstreeContext *self,
+                        GHashTable       *pkg_to_ostree_commit,
+                        GCancellable     *cancellable,
+                        GError          **error)
+{
+  OstreeRepo *pkgcache_repo = get_pkgcache_repo (self);
+
+  if (pkgcache_repo == self->ostreerepo)
+    return TRUE;
+
+  g_autoptr(GPtrArray) commits = g_ptr_array_new ();
+  GHashTableIter it;
+  gpointer v;
+  g_hash_table_iter_init (&it, pkg_to_ostree_commit);
+  while (g_hash_table_iter_next (&it, NULL, &v))
+    g_ptr_array_add (commits, v);
+
+  RpmOstreePullStats stats = { 0, };
+  if (!rpmostree_pull_content_only (self->ostreerepo, pkgcache_repo, commits,
+                                    &stats, cancellable, error))
+    return glnx_prefix_error (error, "Linking cached content: ");
+
+  sd_journal_send ("MESSAGE=Imported content for %u packages; objects skipped:%u linked:%u copied:%u",
+                   commits->len, stats.n_skipped, stats.n_linked, stats.n_copied,
+                   "RPMOSTREE_OBJECTS_SKIPPED=%u", stats.n_skipped,
+                   "RPMOSTREE_OBJECTS_LINKED=%u", stats.n_linked,
+                   "RPMOSTREE_OBJECTS_COPIED=%u", stats.n_copied,
+                   NULL);
+  return TRUE;
+}
+
 static Header
 get_rpmdb_pkg_header (rpmts rpmdb_ts,
                       DnfPackage *pkg,
@@ -1821,17 +2338,94 @@ delete_package_from_root (RpmOstreeContext *self,
   return TRUE;
 }
 
-/* Given a path to a file/symlink, make a copy (reflink if possible)
- * of it if it's a hard link.  We need this for three places right now:
- *  - The RPM database
+/* Copy the contents of @src_fd to @dest_fd (see rpmostree_copy_regfile_data()),
+ * recording in @stats which method we got.
+ */
+static gboolean
+copyup_regfile_contents (int                   src_fd,
+                         int                   dest_fd,
+                         off_t                 size,
+                         RpmOstreeCopyupStats *stats,
+                         GError              **error)
+{
+  RpmOstreeCopyMethod method;
+
+  if (!rpmostree_copy_regfile_data (src_fd, dest_fd, size, &method, error))
+    return FALSE;
+
+  switch (method)
+    {
+    case RPMOSTREE_COPY_METHOD_REFLINK:
+      stats->n_reflinked++;
+      stats->bytes_reflinked += size;
+      break;
+    case RPMOSTREE_COPY_METHOD_COPY_RANGE:
+      stats->n_copy_range++;
+      stats->bytes_copy_range += size;
+      break;
+    case RPMOSTREE_COPY_METHOD_COPY:
+      stats->n_copied++;
+      stats->bytes_copied += size;
+      break;
+    }
+  return TRUE;
+}
+
+/* Replace the regular file at @path with a private copy, with the same
+ * ownership, mode, xattrs and timestamps.
+ */
+static gboolean
+copyup_regfile_at (int                   dfd,
+                   const char           *path,
+                   RpmOstreeCopyupStats *stats,
+                   GCancellable         *cancellable,
+                   GError              **error)
+{
+  glnx_fd_close int src_fd = -1;
+  if (!glnx_openat_rdonly (dfd, path, FALSE, &src_fd, error))
+    return FALSE;
+  struct stat stbuf;
+  if (fstat (src_fd, &stbuf) < 0)
+    return glnx_throw_errno_prefix (error, "fstat(%s)", path);
+
+  g_auto(GLnxTmpfile) tmpf = { 0, };
+  if (!glnx_open_tmpfile_linkable_at (dfd, dirname (strdupa (path)), O_WRONLY | O_CLOEXEC,
+                                      &tmpf, error))
+    return FALSE;
+  if (!copyup_regfile_contents (src_fd, tmpf.fd, stbuf.st_size, stats, error))
+    return glnx_prefix_error (error, "Copying %s", path);
+
+  /* chown first since it drops setuid bits */
+  if (fchown (tmpf.fd, stbuf.st_uid, stbuf.st_gid) < 0)
+    return glnx_throw_errno_prefix (error, "fchown(%s)", path);
+  if (fchmod (tmpf.fd, stbuf.st_mode & 07777) < 0)
+    return glnx_throw_errno_prefix (error, "fchmod(%s)", path);
+  g_autoptr(GVariant) xattrs = NULL;
+  if (!glnx_fd_get_all_xattrs (src_fd, &xattrs, cancellable, error))
+    return FALSE;
+  if (!glnx_fd_set_all_xattrs (tmpf.fd, xattrs, cancellable, error))
+    return FALSE;
+  const struct timespec ts[2] = { stbuf.st_atim, stbuf.st_mtim };
+  if (futimens (tmpf.fd, ts) < 0)
+    return glnx_throw_errno_prefix (error, "futimens(%s)", path);
+
+  return glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_REPLACE, dfd, path, error);
+}
+
+/* Given a path to a file/symlink, make a copy (reflink if possible)
+ * of it if it's a hard link.  We need this for three places right now:
+ *  - The RPM database
  *  - SELinux policy "denormalization" where a label changes
  *  - Upon applying rpmfi overrides during assembly
+ *
+ * How regular files were copied is accumulated in @stats.
  */
 static gboolean
-break_single_hardlink_at (int           dfd,
-                          const char   *path,
-                          GCancellable *cancellable,
-                          GError      **error)
+break_single_hardlink_at (int                   dfd,
+                          const char           *path,
+                          RpmOstreeCopyupStats *stats,
+                          GCancellable         *cancellable,
+                          GError              **error)
 {
   struct stat stbuf;
 
@@ -1841,7 +2435,9 @@ break_single_hardlink_at (int           dfd,
   if (!S_ISLNK (stbuf.st_mode) && !S_ISREG (stbuf.st_mode))
     return glnx_throw (error, "Unsupported type for entry '%s'", path);
 
-  if (stbuf.st_nlink > 1)
+  if (stbuf.st_nlink > 1 && S_ISREG (stbuf.st_mode))
+    return copyup_regfile_at (dfd, path, stats, cancellable, error);
+  else if (stbuf.st_nlink > 1)
     {
       guint count;
       gboolean copy_success = FALSE;
@@ -1883,10 +2479,11 @@ break_single_hardlink_at (int           dfd,
 /* Given a directory referred to by @dfd and @dirpath, ensure that physical (or
  * reflink'd) copies of all files are done. */
 static gboolean
-break_hardlinks_at (int             dfd,
-                    const char     *dirpath,
-                    GCancellable   *cancellable,
-                    GError        **error)
+break_hardlinks_at (int                   dfd,
+                    const char           *dirpath,
+                    RpmOstreeCopyupStats *stats,
+                    GCancellable         *cancellable,
+                    GError              **error)
 {
   g_auto(GLnxDirFdIterator) dfd_iter = { FALSE, };
   if (!glnx_dirfd_iterator_init_at (dfd, dirpath, TRUE, &dfd_iter, error))
@@ -1899,7 +2496,7 @@ break_hardlinks_at (int             dfd,
         return FALSE;
       if (dent == NULL)
         break;
-      if (!break_single_hardlink_at (dfd_iter.fd, dent->d_name,
+      if (!break_single_hardlink_at (dfd_iter.fd, dent->d_name, stats,
                                      cancellable, error))
         return FALSE;
     }
@@ -1952,6 +2549,7 @@ relabel_dir_recurse_at (OstreeRepo        *repo,
                         const char        *prefix,
                         OstreeSePolicy    *sepolicy,
                         guint             *inout_n_changed,
+                        RpmOstreeCopyupStats *copyup_stats,
                         GCancellable      *cancellable,
                         GError           **error)
 {
@@ -2008,7 +2606,7 @@ relabel_dir_recurse_at (OstreeRepo        *repo,
       if (g_strcmp0 (cur_label, new_label) != 0)
         {
           if (dent->d_type != DT_DIR)
-            if (!break_single_hardlink_at (dfd_iter.fd, dent->d_name,
+            if (!break_single_hardlink_at (dfd_iter.fd, dent->d_name, copyup_stats,
                                            cancellable, error))
               return FALSE;
 
@@ -2023,7 +2621,8 @@ relabel_dir_recurse_at (OstreeRepo        *repo,
 
       if (dent->d_type == DT_DIR)
         if (!relabel_dir_recurse_at (repo, dfd_iter.fd, dent->d_name, fullpath,
-                                     sepolicy, inout_n_changed, cancellable, error))
+                                     sepolicy, inout_n_changed, copyup_stats,
+                                     cancellable, error))
           return FALSE;
     }
 
@@ -2035,13 +2634,14 @@ relabel_rootfs (OstreeRepo        *repo,
                 int                dfd,
                 OstreeSePolicy    *sepolicy,
                 guint             *inout_n_changed,
+                RpmOstreeCopyupStats *copyup_stats,
                 GCancellable      *cancellable,
                 GError           **error)
 {
   /* NB: this does mean that / itself will not be labeled properly, but that
    * doesn't matter since it will always exist during overlay */
   return relabel_dir_recurse_at (repo, dfd, ".", "/", sepolicy,
-                                 inout_n_changed, cancellable, error);
+                                 inout_n_changed, copyup_stats, cancellable, error);
 }
 
 static gboolean
@@ -2049,6 +2649,7 @@ relabel_one_package (OstreeRepo     *repo,
                      DnfPackage     *pkg,
                      OstreeSePolicy *sepolicy,
                      guint          *inout_n_changed,
+                     RpmOstreeCopyupStats *copyup_stats,
                      GCancellable   *cancellable,
                      GError        **error)
 {
@@ -2087,7 +2688,8 @@ relabel_one_package (OstreeRepo     *repo,
 
   /* This is where the magic happens. We traverse the tree and relabel stuff,
    * making sure to break hardlinks if needed. */
-  if (!relabel_rootfs (repo, tmprootfs_dfd, sepolicy, inout_n_changed, cancellable, error))
+  if (!relabel_rootfs (repo, tmprootfs_dfd, sepolicy, inout_n_changed, copyup_stats,
+                       cancellable, error))
     goto out;
 
   if (!ostree_repo_prepare_transaction (repo, NULL, cancellable, error))
@@ -2186,7 +2788,8 @@ rpmostree_context_relabel (RpmOstreeContext *self,
         DnfPackage *pkg = self->pkgs_to_relabel->pdata[i];
         guint pkg_n_changed = 0;
         if (!relabel_one_package (ostreerepo, pkg, self->sepolicy,
-                                  &pkg_n_changed, cancellable, error))
+                                  &pkg_n_changed, &self->copyup_stats,
+                                  cancellable, error))
           return FALSE;
         if (pkg_n_changed > 0)
           {
@@ -2208,6 +2811,108 @@ rpmostree_context_relabel (RpmOstreeContext *self,
   return TRUE;
 }
 
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+/* Package headers as stored in the pkgcache: the raw lead, signature and
+ * header which librpm wants to read from a "package" fd, and the parsed
+ * Header we hand to rpmts and rpmfi directly.
+ */
+typedef struct {
+  GVariant *metadata;
+  Header hdr;
+} PkgHeader;
+
+static void
+pkg_header_free (PkgHeader *pkghdr)
+{
+  g_variant_unref (pkghdr->metadata);
+  headerFree (pkghdr->hdr);
+  g_free (pkghdr);
+}
+
+/* Returns an fd for reading @metadata as if it were an .rpm file; this is
+ * backed by memory so we don't write anything to disk.
+ */
+static gboolean
+open_metadata_fd (GVariant *metadata,
+                  int      *out_fd,
+                  GError  **error)
+{
+  glnx_fd_close int fd = syscall (__NR_memfd_create, "rpmostree-metarpm", MFD_CLOEXEC);
+  if (fd < 0)
+    return glnx_throw_errno_prefix (error, "memfd_create");
+  if (glnx_loop_write (fd, g_variant_get_data (metadata), g_variant_get_size (metadata)) < 0)
+    return glnx_throw_errno_prefix (error, "write(memfd)");
+  if (lseek (fd, 0, SEEK_SET) < 0)
+    return glnx_throw_errno_prefix (error, "lseek(memfd)");
+  *out_fd = fd;
+  fd = -1;
+  return TRUE;
+}
+
+/* Load (once) the header of @pkg from the pkgcache */
+static PkgHeader *
+get_package_header (RpmOstreeContext *self,
+                    DnfPackage       *pkg,
+                    GError          **error)
+{
+  const char *nevra = dnf_package_get_nevra (pkg);
+  if (!self->pkg_headers)
+    self->pkg_headers = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                               (GDestroyNotify)pkg_header_free);
+
+  PkgHeader *pkghdr = g_hash_table_lookup (self->pkg_headers, nevra);
+  if (pkghdr)
+    return pkghdr;
+
+  g_autofree char *cachebranch = rpmostree_get_cache_branch_pkg (pkg);
+  g_autoptr(GVariant) metadata = NULL;
+  if (!get_header_variant (get_pkgcache_repo (self), cachebranch, &metadata,
+                           NULL, error))
+    return NULL;
+
+  glnx_fd_close int metadata_fd = -1;
+  if (!open_metadata_fd (metadata, &metadata_fd, error))
+    return NULL;
+  g_auto(Header) hdr = NULL;
+  if (!rpmostree_unpacker_read_metainfo (metadata_fd, &hdr, NULL, NULL, error))
+    {
+      g_prefix_error (error, "Reading header for %s: ", nevra);
+      return NULL;
+    }
+
+  pkghdr = g_new0 (PkgHeader, 1);
+  pkghdr->metadata = g_steal_pointer (&metadata);
+  pkghdr->hdr = g_steal_pointer (&hdr);
+  g_hash_table_insert (self->pkg_headers, g_strdup (nevra), pkghdr);
+  return pkghdr;
+}
+
+static gboolean
+get_package_metainfo (RpmOstreeContext *self,
+                      DnfPackage *pkg,
+                      Header *out_header,
+                      rpmfi *out_fi,
+                      GError **error)
+{
+  PkgHeader *pkghdr = get_package_header (self, pkg, error);
+  if (!pkghdr)
+    return FALSE;
+
+  if (out_header)
+    *out_header = headerLink (pkghdr->hdr);
+  if (out_fi)
+    {
+      /* The same flags as rpmostree_unpacker_read_metainfo() */
+      rpmfi fi = rpmfiNew (NULL, pkghdr->hdr, RPMTAG_BASENAMES,
+                           (RPMFI_NOHEADER | RPMFI_FLAGS_INSTALL));
+      *out_fi = rpmfiInit (fi, 0);
+    }
+  return TRUE;
+}
+
 typedef struct {
   FD_t current_trans_fd;
   RpmOstreeContext *ctx;
@@ -2228,12 +2933,19 @@ ts_callback (const void * h,
     case RPMCALLBACK_INST_OPEN_FILE:
       {
         DnfPackage *pkg = (void*)key;
-        /* just bypass fdrel_abspath here since we know the dfd is not ATCWD and
-         * it saves us an allocation */
-        g_autofree char *relpath = get_package_relpath (pkg);
-        g_autofree char *path = g_build_filename (tdata->ctx->tmpdir_path, relpath, NULL);
+        g_autoptr(GError) local_error = NULL;
+        /* librpm reads the header back from the "package"; we loaded it
+         * into memory already when adding the element */
+        PkgHeader *pkghdr = get_package_header (tdata->ctx, pkg, &local_error);
+        glnx_fd_close int fd = -1;
+        if (!pkghdr || !open_metadata_fd (pkghdr->metadata, &fd, &local_error))
+          {
+            sd_journal_print (LOG_WARNING, "Opening header for %s: %s",
+                              dnf_package_get_nevra (pkg), local_error->message);
+            return NULL;
+          }
         g_assert (tdata->current_trans_fd == NULL);
-        tdata->current_trans_fd = Fopen (path, "r.ufdio");
+        tdata->current_trans_fd = fdDup (fd);
         return tdata->current_trans_fd;
       }
       break;
@@ -2249,20 +2961,6 @@ ts_callback (const void * h,
   return NULL;
 }
 
-static gboolean
-get_package_metainfo (RpmOstreeContext *self,
-                      const char *path,
-                      Header *out_header,
-                      rpmfi *out_fi,
-                      GError **error)
-{
-  glnx_fd_close int metadata_fd = -1;
-  if ((metadata_fd = openat (self->tmpdir_fd, path, O_RDONLY | O_CLOEXEC)) < 0)
-    return glnx_throw_errno_prefix (error, "open(%s)", path);
-
-  return rpmostree_unpacker_read_metainfo (metadata_fd, out_header, NULL,
-                                           out_fi, error);
-}
 
 static gboolean
 rpmts_add_install (RpmOstreeContext *self,
@@ -2274,9 +2972,7 @@ rpmts_add_install (RpmOstreeContext *self,
                    GError **error)
 {
   g_auto(Header) hdr = NULL;
-  g_autofree char *path = get_package_relpath (pkg);
-
-  if (!get_package_metainfo (self, path, &hdr, NULL, error))
+  if (!get_package_metainfo (self, pkg, &hdr, NULL, error))
     return FALSE;
 
   if (!noscripts)
@@ -2312,201 +3008,271 @@ rpmts_add_erase (RpmOstreeContext *self,
 }
 
 static gboolean
-run_posttrans_sync (RpmOstreeContext *self,
-                    int rootfs_dfd,
-                    DnfPackage *pkg,
-                    GCancellable *cancellable,
-                    GError    **error)
+queue_posttrans (RpmOstreeContext *self,
+                 RpmOstreeScriptBatch *batch,
+                 DnfPackage *pkg,
+                 GError    **error)
 {
   g_auto(Header) hdr = NULL;
-  g_autofree char *path = get_package_relpath (pkg);
-
-  if (!get_package_metainfo (self, path, &hdr, NULL, error))
+  if (!get_package_metainfo (self, pkg, &hdr, NULL, error))
     return FALSE;
 
-  if (!rpmostree_posttrans_run_sync (pkg, hdr, self->ignore_scripts, rootfs_dfd,
-                                     cancellable, error))
+  if (!rpmostree_posttrans_queue (batch, pkg, hdr, self->ignore_scripts, error))
     return FALSE;
 
   return TRUE;
 }
 
 static gboolean
-run_pre_sync (RpmOstreeContext *self,
-              int rootfs_dfd,
-              DnfPackage *pkg,
-              GCancellable *cancellable,
-              GError    **error)
+queue_pre (RpmOstreeContext *self,
+           RpmOstreeScriptBatch *batch,
+           DnfPackage *pkg,
+           GError    **error)
 {
   g_auto(Header) hdr = NULL;
-  g_autofree char *path = get_package_relpath (pkg);
-
-  if (!get_package_metainfo (self, path, &hdr, NULL, error))
+  if (!get_package_metainfo (self, pkg, &hdr, NULL, error))
     return FALSE;
 
-  if (!rpmostree_pre_run_sync (pkg, hdr, self->ignore_scripts,
-                               rootfs_dfd, cancellable, error))
+  /* This is called for every overlay before any %post, so it's a convenient
+   * place to note whether the layer depends on scripts at all. */
+  if (rpmostree_script_pkg_has_scripts (pkg, hdr, self->ignore_scripts))
+    self->layer_has_scripts = TRUE;
+
+  if (!rpmostree_pre_queue (batch, pkg, hdr, self->ignore_scripts, error))
     return FALSE;
 
   return TRUE;
 }
 
+/* Apply the ownership from the rpm header (and file capabilities, which a
+ * chown clears) to one file of @pkg in the assembled root.
+ */
 static gboolean
-apply_rpmfi_overrides (RpmOstreeContext *self,
-                       int            tmprootfs_dfd,
-                       DnfPackage    *pkg,
-                       GHashTable    *passwdents,
-                       GHashTable    *groupents,
-                       GCancellable  *cancellable,
-                       GError       **error)
+apply_one_rpmfi_override (RpmOstreeContext *self,
+                          int            tmprootfs_dfd,
+                          DnfPackage    *pkg,
+                          const char    *fn,
+                          const char    *user,
+                          const char    *group,
+                          const char    *fcaps,
+                          rpm_mode_t     mode,
+                          rpmfileAttrs   fattrs,
+                          GHashTable    *passwdents,
+                          GHashTable    *groupents,
+                          gboolean      *inout_emitted_nonusr_warning,
+                          GCancellable  *cancellable,
+                          GError       **error)
 {
-  int i;
-  g_auto(rpmfi) fi = NULL;
-  gboolean emitted_nonusr_warning = FALSE;
-  g_autofree char *path = get_package_relpath (pkg);
+  g_autofree char *modified_fn = NULL;  /* May be used to override fn */
+  const gboolean is_ghost = fattrs & RPMFILE_GHOST;
+  struct stat stbuf;
+  uid_t uid = 0;
+  gid_t gid = 0;
 
-  if (!get_package_metainfo (self, path, NULL, &fi, error))
-    return FALSE;
+  if (g_str_equal (user, "root") &&
+      g_str_equal (group, "root"))
+    return TRUE;
 
-  while ((i = rpmfiNext (fi)) >= 0)
-    {
-      const char *fn = rpmfiFN (fi);
-      g_autofree char *modified_fn = NULL;  /* May be used to override fn */
-      const char *user = rpmfiFUser (fi) ?: "root";
-      const char *group = rpmfiFGroup (fi) ?: "root";
-      const char *fcaps = rpmfiFCaps (fi) ?: '\0';
-      rpm_mode_t mode = rpmfiFMode (fi);
-      rpmfileAttrs fattrs = rpmfiFFlags (fi);
-      const gboolean is_ghost = fattrs & RPMFILE_GHOST;
-      struct stat stbuf;
-      uid_t uid = 0;
-      gid_t gid = 0;
+  /* In theory, RPMs could contain block devices or FIFOs; we would normally
+   * have rejected that at the import time, but let's also be sure here.
+   */
+  if (!(S_ISREG (mode) ||
+        S_ISLNK (mode) ||
+        S_ISDIR (mode)))
+    return TRUE;
 
-      if (g_str_equal (user, "root") &&
-          g_str_equal (group, "root"))
-        continue;
+  g_assert (fn != NULL);
+  fn += strspn (fn, "/");
+  g_assert (fn[0]);
 
-      /* In theory, RPMs could contain block devices or FIFOs; we would normally
-       * have rejected that at the import time, but let's also be sure here.
+  /* /run and /var paths have already been translated to tmpfiles during
+   * unpacking */
+  if (g_str_has_prefix (fn, "run/") ||
+      g_str_has_prefix (fn, "var/"))
+    return TRUE;
+  else if (g_str_has_prefix (fn, "etc/"))
+    {
+      /* The tree uses usr/etc */
+      fn = modified_fn = g_strconcat ("usr/", fn, NULL);
+    }
+  else if (!g_str_has_prefix (fn, "usr/"))
+    {
+      /* TODO: query whether Fedora has anything in this category we care about */
+      if (!*inout_emitted_nonusr_warning)
+        {
+          sd_journal_print (LOG_WARNING, "Ignoring rpm mode for non-/usr content: %s", fn);
+          *inout_emitted_nonusr_warning = TRUE;
+        }
+      return TRUE;
+    }
+
+  if (fstatat (tmprootfs_dfd, fn, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+      /* Not early loop skip; in the ghost case, we expect it to not
+       * exist.
        */
-      if (!(S_ISREG (mode) ||
-            S_ISLNK (mode) ||
-            S_ISDIR (mode)))
-        continue;
+      if (errno == ENOENT && is_ghost)
+        return TRUE;
+      return glnx_throw_errno_prefix (error, "fstatat(%s)", fn);
+    }
 
-      g_assert (fn != NULL);
-      fn += strspn (fn, "/");
-      g_assert (fn[0]);
+  if ((S_IFMT & stbuf.st_mode) != (S_IFMT & mode))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Inconsistent file type between RPM and checkout "
+                   "for file '%s' in package '%s'", fn,
+                   dnf_package_get_name (pkg));
+      return FALSE;
+    }
 
-      /* /run and /var paths have already been translated to tmpfiles during
-       * unpacking */
-      if (g_str_has_prefix (fn, "run/") ||
-          g_str_has_prefix (fn, "var/"))
-        continue;
-      else if (g_str_has_prefix (fn, "etc/"))
-        {
-          /* The tree uses usr/etc */
-          fn = modified_fn = g_strconcat ("usr/", fn, NULL);
-        }
-      else if (!g_str_has_prefix (fn, "usr/"))
-        {
-          /* TODO: query whether Fedora has anything in this category we care about */
-          if (!emitted_nonusr_warning)
-            {
-              sd_journal_print (LOG_WARNING, "Ignoring rpm mode for non-/usr content: %s", fn);
-              emitted_nonusr_warning = TRUE;
-            }
-          continue;
-        }
+  if (!S_ISDIR (stbuf.st_mode))
+    {
+      if (!break_single_hardlink_at (tmprootfs_dfd, fn, &self->copyup_stats,
+                                     cancellable, error))
+        return FALSE;
+    }
 
-      if (fstatat (tmprootfs_dfd, fn, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
-        {
-          /* Not early loop skip; in the ghost case, we expect it to not
-           * exist.
-           */
-          if (errno == ENOENT && is_ghost)
-            continue;
-          return glnx_throw_errno_prefix (error, "fstatat(%s)", fn);
-        }
+  if ((!g_str_equal (user, "root") && !passwdents) ||
+      (!g_str_equal (group, "root") && !groupents))
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Missing passwd/group files for chown");
+      return FALSE;
+    }
 
-      if ((S_IFMT & stbuf.st_mode) != (S_IFMT & mode))
+  if (!g_str_equal (user, "root"))
+    {
+      struct conv_passwd_ent *passwdent =
+        g_hash_table_lookup (passwdents, user);
+
+      if (!passwdent)
         {
           g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                       "Inconsistent file type between RPM and checkout "
-                       "for file '%s' in package '%s'", fn,
-                       dnf_package_get_name (pkg));
+                       "Could not find user '%s' in passwd file", user);
           return FALSE;
         }
 
-      if (!S_ISDIR (stbuf.st_mode))
-        {
-          if (!break_single_hardlink_at (tmprootfs_dfd, fn, cancellable, error))
-            return FALSE;
-        }
+      uid = passwdent->uid;
+    }
+
+  if (!g_str_equal (group, "root"))
+    {
+      struct conv_group_ent *groupent =
+        g_hash_table_lookup (groupents, group);
 
-      if ((!g_str_equal (user, "root") && !passwdents) ||
-          (!g_str_equal (group, "root") && !groupents))
+      if (!groupent)
         {
-          g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                               "Missing passwd/group files for chown");
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Could not find group '%s' in group file",
+                       group);
           return FALSE;
         }
 
-      if (!g_str_equal (user, "root"))
-        {
-          struct conv_passwd_ent *passwdent =
-            g_hash_table_lookup (passwdents, user);
+      gid = groupent->gid;
+    }
 
-          if (!passwdent)
-            {
-              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                           "Could not find user '%s' in passwd file", user);
-              return FALSE;
-            }
+  if (fchownat (tmprootfs_dfd, fn, uid, gid, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+      glnx_set_prefix_error_from_errno (error, "fchownat: %s", fn);
+      return FALSE;
+    }
 
-          uid = passwdent->uid;
-        }
+  /* the chown clears away file caps, so reapply it here */
+  if (fcaps[0] != '\0')
+    {
+      g_autoptr(GVariant) xattrs = rpmostree_fcap_to_xattr_variant (fcaps);
+      if (!glnx_dfd_name_set_all_xattrs (tmprootfs_dfd, fn, xattrs,
+                                         cancellable, error))
+        return FALSE;
+    }
 
-      if (!g_str_equal (group, "root"))
+  /* also reapply chmod since e.g. at least the setuid gets taken off */
+  if (S_ISREG (stbuf.st_mode))
+    {
+      if (fchmodat (tmprootfs_dfd, fn, stbuf.st_mode, 0) != 0)
         {
-          struct conv_group_ent *groupent =
-            g_hash_table_lookup (groupents, group);
+          glnx_set_prefix_error_from_errno (error, "fchmodat: %s", fn);
+          return FALSE;
+        }
+    }
 
-          if (!groupent)
-            {
-              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                           "Could not find group '%s' in group file",
-                           group);
-              return FALSE;
-            }
+  return TRUE;
+}
 
-          gid = groupent->gid;
-        }
+/* Returns the override manifest the unpacker stored with @pkg's pkgcache
+ * commit, or %NULL if it was imported by an older version without one.
+ */
+static gboolean
+get_rpmfi_override_manifest (RpmOstreeContext *self,
+                             DnfPackage       *pkg,
+                             GVariant        **out_manifest,
+                             GError          **error)
+{
+  OstreeRepo *pkgcache_repo = get_pkgcache_repo (self);
+  g_autofree char *cachebranch = rpmostree_get_cache_branch_pkg (pkg);
+  g_autofree char *cached_rev = NULL;
+  g_autoptr(GVariant) commit = NULL;
 
-      if (fchownat (tmprootfs_dfd, fn, uid, gid, AT_SYMLINK_NOFOLLOW) != 0)
-        {
-          glnx_set_prefix_error_from_errno (error, "fchownat: %s", fn);
-          return FALSE;
-        }
+  if (!ostree_repo_resolve_rev (pkgcache_repo, cachebranch, FALSE,
+                                &cached_rev, error))
+    return FALSE;
+  if (!ostree_repo_load_variant (pkgcache_repo, OSTREE_OBJECT_TYPE_COMMIT,
+                                 cached_rev, &commit, error))
+    return FALSE;
+
+  g_autoptr(GVariant) meta = g_variant_get_child_value (commit, 0);
+  *out_manifest = g_variant_lookup_value (meta, "rpmostree.rpmfi_overrides",
+                                          (GVariantType*)"a(ssssuu)");
+  return TRUE;
+}
+
+static gboolean
+apply_rpmfi_overrides (RpmOstreeContext *self,
+                       int            tmprootfs_dfd,
+                       DnfPackage    *pkg,
+                       GHashTable    *passwdents,
+                       GHashTable    *groupents,
+                       GCancellable  *cancellable,
+                       GError       **error)
+{
+  gboolean emitted_nonusr_warning = FALSE;
 
-      /* the chown clears away file caps, so reapply it here */
-      if (fcaps[0] != '\0')
+  /* Newer pkgcache commits carry just the entries we need; most packages
+   * have none at all, and then we don't need to look at the header. */
+  g_autoptr(GVariant) manifest = NULL;
+  if (!get_rpmfi_override_manifest (self, pkg, &manifest, error))
+    return FALSE;
+  if (manifest)
+    {
+      const guint n = g_variant_n_children (manifest);
+      for (guint i = 0; i < n; i++)
         {
-          g_autoptr(GVariant) xattrs = rpmostree_fcap_to_xattr_variant (fcaps);
-          if (!glnx_dfd_name_set_all_xattrs (tmprootfs_dfd, fn, xattrs,
-                                             cancellable, error))
+          const char *fn, *user, *group, *fcaps;
+          guint32 mode, fattrs;
+          g_variant_get_child (manifest, i, "(&s&s&s&suu)", &fn, &user, &group,
+                               &fcaps, &mode, &fattrs);
+          if (!apply_one_rpmfi_override (self, tmprootfs_dfd, pkg, fn, user, group,
+                                         fcaps, mode, fattrs, passwdents, groupents,
+                                         &emitted_nonusr_warning, cancellable, error))
             return FALSE;
         }
+      return TRUE;
+    }
 
-      /* also reapply chmod since e.g. at least the setuid gets taken off */
-      if (S_ISREG (stbuf.st_mode))
-        {
-          if (fchmodat (tmprootfs_dfd, fn, stbuf.st_mode, 0) != 0)
-            {
-              glnx_set_prefix_error_from_errno (error, "fchmodat: %s", fn);
-              return FALSE;
-            }
-        }
+  g_auto(rpmfi) fi = NULL;
+  if (!get_package_metainfo (self, pkg, NULL, &fi, error))
+    return FALSE;
+
+  while (rpmfiNext (fi) >= 0)
+    {
+      if (!apply_one_rpmfi_override (self, tmprootfs_dfd, pkg, rpmfiFN (fi),
+                                     rpmfiFUser (fi) ?: "root",
+                                     rpmfiFGroup (fi) ?: "root",
+                                     rpmfiFCaps (fi) ?: "",
+                                     rpmfiFMode (fi), rpmfiFFlags (fi),
+                                     passwdents, groupents, &emitted_nonusr_warning,
+                                     cancellable, error))
+        return FALSE;
     }
 
   return TRUE;
@@ -2527,6 +3293,127 @@ checksum_version (GVariant *checksum)
   return g_strdup (ret);
 }
 
+/* Add @overlays to and remove @overrides_remove from the rpmdb at the
+ * current %_dbpath. */
+static gboolean
+run_rpmdb_ts (RpmOstreeContext *self,
+              GPtrArray        *overlays,
+              GPtrArray        *overrides_remove,
+              GCancellable     *cancellable,
+              GError          **error)
+{
+  TransactionData tdata = { 0, NULL };
+
+  g_auto(rpmts) rpmdb_ts = rpmtsCreate ();
+  rpmtsSetVSFlags (rpmdb_ts, _RPMVSF_NOSIGNATURES | _RPMVSF_NODIGESTS);
+  /* We only want the headers added to and removed from the db; skip
+   * computing file digests and SELinux contexts, which we never use here */
+  rpmtsSetFlags (rpmdb_ts, RPMTRANS_FLAG_JUSTDB | RPMTRANS_FLAG_NOFILEDIGEST |
+                 RPMTRANS_FLAG_NOCONTEXTS);
+
+  tdata.ctx = self;
+  rpmtsSetNotifyCallback (rpmdb_ts, ts_callback, &tdata);
+
+  for (guint i = 0; i < overlays->len; i++)
+    {
+      DnfPackage *pkg = overlays->pdata[i];
+
+      /* Set noscripts since we already validated them during assembly */
+      if (!rpmts_add_install (self, rpmdb_ts, pkg, TRUE, NULL,
+                              cancellable, error))
+        return FALSE;
+    }
+
+  /* and mark removed packages as such so they drop out of rpmdb */
+  for (guint i = 0; i < overrides_remove->len; i++)
+    {
+      DnfPackage *pkg = overrides_remove->pdata[i];
+      if (!rpmts_add_erase (self, rpmdb_ts, pkg, cancellable, error))
+        return FALSE;
+    }
+
+  rpmtsOrder (rpmdb_ts);
+
+  /* NB: Because we're using the real root here (see write_rpmdb() for why), rpm
+   * will see the read-only /usr mount and think that there isn't any disk space
+   * available for install. For now, we just tell rpm to ignore space
+   * calculations, but then we lose that nice check. What we could do is set a
+   * root dir at least if we have CAP_SYS_CHROOT, or maybe do the space req
+   * check ourselves if rpm makes that information easily accessible (doesn't
+   * look like it from a quick glance). */
+  int r = rpmtsRun (rpmdb_ts, NULL, RPMPROB_FILTER_DISKSPACE);
+  if (r < 0)
+    return glnx_throw (error, "Failed to update rpmdb (rpmtsRun code %d)", r);
+  if (r > 0)
+    {
+      if (!dnf_rpmts_look_for_problems (rpmdb_ts, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Write the rpmdb for the assembled root: the base rpmdb already in
+ * @tmprootfs_dfd, plus @overlays, minus @overrides_remove.
+ */
+static gboolean
+write_rpmdb (RpmOstreeContext *self,
+             int               tmprootfs_dfd,
+             GPtrArray        *overlays,
+             GPtrArray        *overrides_remove,
+             GCancellable     *cancellable,
+             GError          **error)
+{
+  const gint64 start_time = g_get_monotonic_time ();
+
+  rpmostree_output_task_begin ("Writing rpmdb");
+
+  if (!glnx_shutil_mkdir_p_at (tmprootfs_dfd, "usr/share/rpm", 0755,
+                               cancellable, error))
+    return FALSE;
+
+  /* Now, we use the separate rpmdb ts which *doesn't* have a rootdir set,
+   * because if it did rpmtsRun() would try to chroot which it won't be able to
+   * if we're unprivileged, even though we're not trying to run %post scripts
+   * now.
+   *
+   * Instead, this rpmts has the dbpath as absolute.
+   */
+  { g_autofree char *rpmdb_abspath = glnx_fdrel_abspath (tmprootfs_dfd,
+                                                         "usr/share/rpm");
+
+    /* if we were passed an existing tmprootfs, and that tmprootfs already has
+     * an rpmdb, we have to make sure to break its hardlinks as librpm mutates
+     * the db in place */
+    if (!break_hardlinks_at (AT_FDCWD, rpmdb_abspath, &self->copyup_stats,
+                             cancellable, error))
+      return FALSE;
+
+    set_rpm_macro_define ("_dbpath", rpmdb_abspath);
+  }
+
+  /* This rpmdb is going into a commit, which ostree syncs itself; fsyncing
+   * the Berkeley DB environment and every index as we update them only
+   * slows us down. Push that over the default config for as long as the db
+   * is open; the erase elements already open it when they're added.
+   */
+  { char *default_config = rpmExpand ("%{?_dbi_config}", NULL);
+    g_autofree char *dbi_config = g_strconcat (default_config, " nofsync", NULL);
+    free (default_config);
+    addMacro (NULL, "_dbi_config", NULL, dbi_config, -1);
+  }
+  const gboolean ok = run_rpmdb_ts (self, overlays, overrides_remove, cancellable, error);
+  delMacro (NULL, "_dbi_config");
+  if (!ok)
+    return FALSE;
+
+  rpmostree_output_task_end ("%u added, %u removed in %.1fs", overlays->len,
+                             overrides_remove->len,
+                             (g_get_monotonic_time () - start_time) / (double) G_USEC_PER_SEC);
+
+  return TRUE;
+}
+
 gboolean
 rpmostree_context_assemble_tmprootfs (RpmOstreeContext      *self,
                                       int                    tmprootfs_dfd,
@@ -2537,7 +3424,6 @@ rpmostree_context_assemble_tmprootfs (RpmOstreeContext      *self,
 {
   OstreeRepo *pkgcache_repo = get_pkgcache_repo (self);
   DnfContext *hifctx = self->hifctx;
-  TransactionData tdata = { 0, NULL };
   g_autoptr(GHashTable) pkg_to_ostree_commit =
     g_hash_table_new_full (NULL, NULL, (GDestroyNotify)g_object_unref, (GDestroyNotify)g_free);
   DnfPackage *filesystem_package = NULL;   /* It's special... */
@@ -2604,9 +3490,6 @@ rpmostree_context_assemble_tmprootfs (RpmOstreeContext      *self,
           g_assert (sepolicy_matches);
         }
 
-      if (!checkout_pkg_metadata_by_dnfpkg (self, pkg, cancellable, error))
-        return FALSE;
-
       if (!rpmts_add_install (self, ordering_ts, pkg,
                               noscripts, self->ignore_scripts,
                               cancellable, error))
@@ -2635,6 +3518,9 @@ rpmostree_context_assemble_tmprootfs (RpmOstreeContext      *self,
   guint n_rpmts_elements = (guint)rpmtsNElements (ordering_ts);
   g_assert (n_rpmts_elements > 0);
 
+  if (!import_layered_content (self, pkg_to_ostree_commit, cancellable, error))
+    return FALSE;
+
   /* Okay so what's going on in Fedora with incestuous relationship
    * between the `filesystem`, `setup`, `libgcc` RPMs is actively
    * ridiculous.  If we unpack libgcc first it writes to /lib64 which
@@ -2684,6 +3570,11 @@ rpmostree_context_assemble_tmprootfs (RpmOstreeContext      *self,
   if (!rpmostree_rootfs_prepare_links (tmprootfs_dfd, cancellable, error))
     return FALSE;
 
+  /* A layer assembled without its scripts can't be reused for a regular
+   * deployment later on, so flag it as if it had some. */
+  if (noscripts)
+    self->layer_has_scripts = TRUE;
+
   /* NB: we're not running scripts right now for removals, so this is only for
    * overlays */
   if (!noscripts && overlays->len > 0)
@@ -2731,7 +3622,11 @@ rpmostree_context_assemble_tmprootfs (RpmOstreeContext      *self,
        * highly doubt this should cause any issues. The advantage of doing it
        * this way is that we only need to read the passwd/group files once
        * before applying the overrides, rather than after each %pre.
+       *
+       * Each phase's scripts run in rpmts order in a single container, rather
+       * than paying for a container setup per script.
        */
+      g_autoptr(RpmOstreeScriptBatch) pre_batch = rpmostree_script_batch_new ();
       for (guint i = 0; i < n_rpmts_elements; i++)
         {
           rpmte te = rpmtsElement (ordering_ts, i);
@@ -2741,9 +3636,11 @@ rpmostree_context_assemble_tmprootfs (RpmOstreeContext      *self,
           DnfPackage *pkg = (void*)rpmteKey (te);
           g_assert (pkg);
 
-          if (!run_pre_sync (self, tmprootfs_dfd, pkg, cancellable, error))
+          if (!queue_pre (self, pre_batch, pkg, error))
             return FALSE;
         }
+      if (!rpmostree_script_batch_run (pre_batch, tmprootfs_dfd, cancellable, error))
+        return FALSE;
 
       if (have_passwd &&
           faccessat (tmprootfs_dfd, "usr/etc/passwd", F_OK, 0) == 0)
@@ -2779,6 +3676,9 @@ rpmostree_context_assemble_tmprootfs (RpmOstreeContext      *self,
             }
         }
 
+      /* Since we treat %post as %posttrans, all the overrides are applied
+       * before any of them run. */
+      g_autoptr(RpmOstreeScriptBatch) posttrans_batch = rpmostree_script_batch_new ();
       for (guint i = 0; i < n_rpmts_elements; i++)
         {
           rpmte te = rpmtsElement (ordering_ts, i);
@@ -2794,9 +3694,11 @@ rpmostree_context_assemble_tmprootfs (RpmOstreeContext      *self,
             return glnx_prefix_error (error, "While applying overrides for pkg %s: ",
                                       dnf_package_get_name (pkg));
 
-          if (!run_posttrans_sync (self, tmprootfs_dfd, pkg, cancellable, error))
+          if (!queue_posttrans (self, posttrans_batch, pkg, error))
             return FALSE;
         }
+      if (!rpmostree_script_batch_run (posttrans_batch, tmprootfs_dfd, cancellable, error))
+        return FALSE;
 
       if (have_systemctl)
         {
@@ -2814,76 +3716,315 @@ rpmostree_context_assemble_tmprootfs (RpmOstreeContext      *self,
 
   g_clear_pointer (&ordering_ts, rpmtsFree);
 
-  rpmostree_output_task_begin ("Writing rpmdb");
+  if (!write_rpmdb (self, tmprootfs_dfd, overlays, overrides_remove,
+                    cancellable, error))
+    return FALSE;
 
-  if (!glnx_shutil_mkdir_p_at (tmprootfs_dfd, "usr/share/rpm", 0755,
-                               cancellable, error))
+  return TRUE;
+}
+
+/* Returns the sorted NEVRAs of the packages the goal overlays. */
+static GPtrArray *
+get_layered_nevras (RpmOstreeContext *self)
+{
+  g_autoptr(GPtrArray) overlays =
+    dnf_goal_get_packages (dnf_context_get_goal (self->hifctx),
+                           DNF_PACKAGE_INFO_INSTALL, -1);
+  g_autoptr(GPtrArray) nevras = g_ptr_array_new_with_free_func (g_free);
+
+  for (guint i = 0; i < overlays->len; i++)
+    g_ptr_array_add (nevras, g_strdup (dnf_package_get_nevra (overlays->pdata[i])));
+  g_ptr_array_sort (nevras, rpmostree_ptrarray_sort_compare_strings);
+
+  return g_steal_pointer (&nevras);
+}
+
+/* The rpmdb is always rewritten, so it's never part of the layer delta. */
+static gboolean
+path_is_rpmdb (const char *path)
+{
+  return g_str_has_prefix (path, "/usr/share/rpm/") ||
+         g_str_equal (path, "/usr/share/rpm");
+}
+
+/* Overrides applied to layered files depend on these; any change in the base
+ * means we have to redo the full assembly. */
+static gboolean
+path_affects_file_ownership (const char *path)
+{
+  static const char *const paths[] = { "/usr/etc/passwd", "/usr/etc/group",
+                                       "/usr/lib/passwd", "/usr/lib/group",
+                                       NULL };
+  return g_strv_contains (paths, path);
+}
+
+/* Returns TRUE if @path or any of its parent directories is in @paths. */
+static gboolean
+path_or_parent_in_set (GHashTable *paths,
+                       const char *path)
+{
+  g_autofree char *buf = g_strdup (path);
+
+  while (TRUE)
+    {
+      if (g_hash_table_contains (paths, buf))
+        return TRUE;
+      char *slash = strrchr (buf, '/');
+      if (slash == NULL || slash == buf)
+        return FALSE;
+      *slash = '\0';
+    }
+}
+
+/* Diff @from_rev and @to_rev, returning the paths of added and modified files
+ * in @out_changed and of removed files in @out_removed (all as "/usr/..."). */
+static gboolean
+diff_commit_paths (OstreeRepo   *repo,
+                   const char   *from_rev,
+                   const char   *to_rev,
+                   GPtrArray   **out_changed,
+                   GPtrArray   **out_removed,
+                   GCancellable *cancellable,
+                   GError      **error)
+{
+  g_autoptr(GFile) from_tree = NULL;
+  if (!ostree_repo_read_commit (repo, from_rev, &from_tree, NULL, cancellable, error))
+    return FALSE;
+  g_autoptr(GFile) to_tree = NULL;
+  if (!ostree_repo_read_commit (repo, to_rev, &to_tree, NULL, cancellable, error))
     return FALSE;
 
-  /* Now, we use the separate rpmdb ts which *doesn't* have a rootdir set,
-   * because if it did rpmtsRun() would try to chroot which it won't be able to
-   * if we're unprivileged, even though we're not trying to run %post scripts
-   * now.
-   *
-   * Instead, this rpmts has the dbpath as absolute.
-   */
-  { g_autofree char *rpmdb_abspath = glnx_fdrel_abspath (tmprootfs_dfd,
-                                                         "usr/share/rpm");
+  g_autoptr(GPtrArray) modified = g_ptr_array_new_with_free_func ((GDestroyNotify) ostree_diff_item_unref);
+  g_autoptr(GPtrArray) removed = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+  g_autoptr(GPtrArray) added = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+  if (!ostree_diff_dirs (0, from_tree, to_tree, modified, removed, added,
+                         cancellable, error))
+    return FALSE;
 
-    /* if we were passed an existing tmprootfs, and that tmprootfs already has
-     * an rpmdb, we have to make sure to break its hardlinks as librpm mutates
-     * the db in place */
-    if (!break_hardlinks_at (AT_FDCWD, rpmdb_abspath, cancellable, error))
-      return FALSE;
+  g_autoptr(GPtrArray) changed = g_ptr_array_new_with_free_func (g_free);
+  for (guint i = 0; i < modified->len; i++)
+    {
+      OstreeDiffItem *diffitem = modified->pdata[i];
+      g_ptr_array_add (changed, g_strdup (gs_file_get_path_cached (diffitem->target)));
+    }
+  for (guint i = 0; i < added->len; i++)
+    g_ptr_array_add (changed, g_strdup (gs_file_get_path_cached (added->pdata[i])));
 
-    set_rpm_macro_define ("_dbpath", rpmdb_abspath);
-  }
+  g_autoptr(GPtrArray) removed_paths = g_ptr_array_new_with_free_func (g_free);
+  for (guint i = 0; i < removed->len; i++)
+    g_ptr_array_add (removed_paths, g_strdup (gs_file_get_path_cached (removed->pdata[i])));
 
-  g_auto(rpmts) rpmdb_ts = rpmtsCreate ();
-  rpmtsSetVSFlags (rpmdb_ts, _RPMVSF_NOSIGNATURES | _RPMVSF_NODIGESTS);
-  rpmtsSetFlags (rpmdb_ts, RPMTRANS_FLAG_JUSTDB);
+  *out_changed = g_steal_pointer (&changed);
+  *out_removed = g_steal_pointer (&removed_paths);
+  return TRUE;
+}
 
-  tdata.ctx = self;
-  rpmtsSetNotifyCallback (rpmdb_ts, ts_callback, &tdata);
+/* Figure out whether the layer in @prev_commit can be carried over as is onto
+ * @base_commit (already checked out). If so, @out_delta is set to the list of
+ * paths to copy from @prev_commit, otherwise to %NULL.
+ */
+static gboolean
+compute_rebasable_layer_delta (RpmOstreeContext *self,
+                               const char       *base_commit,
+                               const char       *prev_commit,
+                               GPtrArray       **out_delta,
+                               GCancellable     *cancellable,
+                               GError          **error)
+{
+  *out_delta = NULL;
 
-  for (guint i = 0; i < overlays->len; i++)
+  /* Removals and anything that still needs fetching or relabeling go through
+   * the full path */
+  g_autoptr(GPtrArray) overrides_remove =
+    dnf_goal_get_packages (dnf_context_get_goal (self->hifctx),
+                           DNF_PACKAGE_INFO_REMOVE,
+                           DNF_PACKAGE_INFO_OBSOLETE, -1);
+  if (overrides_remove->len > 0 ||
+      self->pkgs_to_download->len > 0 ||
+      self->pkgs_to_import->len > 0 ||
+      self->pkgs_to_relabel->len > 0)
+    return TRUE;
+
+  g_autoptr(GVariant) commit = NULL;
+  if (!ostree_repo_load_commit (self->ostreerepo, prev_commit, &commit, NULL, error))
+    return FALSE;
+
+  g_autoptr(GVariant) metadata = g_variant_get_child_value (commit, 0);
+  g_autoptr(GVariantDict) dict = g_variant_dict_new (metadata);
+
+  /* Layers whose scripts ran may have done anything, including things which
+   * depend on the content of the base. */
+  gboolean had_scripts = TRUE;
+  if (!g_variant_dict_lookup (dict, "rpmostree.layer-scripts", "b", &had_scripts) ||
+      had_scripts)
+    return TRUE;
+
+  g_autofree char **prev_nevras = NULL;
+  if (!g_variant_dict_lookup (dict, "rpmostree.layered-nevras", "^a&s", &prev_nevras))
+    return TRUE;
+
+  g_autoptr(GPtrArray) nevras = get_layered_nevras (self);
+  if (g_strv_length (prev_nevras) != nevras->len)
+    return TRUE;
+  for (guint i = 0; i < nevras->len; i++)
     {
-      DnfPackage *pkg = overlays->pdata[i];
+      if (!g_str_equal (prev_nevras[i], nevras->pdata[i]))
+        return TRUE;
+    }
 
-      /* Set noscripts since we already validated them above */
-      if (!rpmts_add_install (self, rpmdb_ts, pkg, TRUE, NULL,
-                              cancellable, error))
-        return FALSE;
+  const char *prev_sepolicy = NULL;
+  g_variant_dict_lookup (dict, "rpmostree.layer-sepolicy", "&s", &prev_sepolicy);
+  const char *sepolicy =
+    self->sepolicy ? ostree_sepolicy_get_csum (self->sepolicy) : NULL;
+  if (g_strcmp0 (prev_sepolicy, sepolicy) != 0)
+    return TRUE;
+
+  g_autofree char *prev_base = ostree_commit_get_parent (commit);
+  if (!prev_base)
+    return TRUE;
+
+  /* What the layer did on top of its base */
+  g_autoptr(GPtrArray) layer_changed = NULL;
+  g_autoptr(GPtrArray) layer_removed = NULL;
+  if (!diff_commit_paths (self->ostreerepo, prev_base, prev_commit,
+                          &layer_changed, &layer_removed, cancellable, error))
+    return FALSE;
+
+  for (guint i = 0; i < layer_removed->len; i++)
+    {
+      if (!path_is_rpmdb (layer_removed->pdata[i]))
+        return TRUE;
     }
 
-  /* and mark removed packages as such so they drop out of rpmdb */
-  for (guint i = 0; i < overrides_remove->len; i++)
+  g_autoptr(GPtrArray) delta = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GHashTable) delta_set = g_hash_table_new (g_str_hash, g_str_equal);
+  for (guint i = 0; i < layer_changed->len; i++)
     {
-      DnfPackage *pkg = overrides_remove->pdata[i];
-      if (!rpmts_add_erase (self, rpmdb_ts, pkg, cancellable, error))
-        return FALSE;
+      const char *path = layer_changed->pdata[i];
+      if (path_is_rpmdb (path))
+        continue;
+      g_hash_table_add (delta_set, (char*)path);
+      g_ptr_array_add (delta, g_strdup (path));
     }
 
-  rpmtsOrder (rpmdb_ts);
+  /* What changed in the base; none of it may overlap with the layer */
+  g_autoptr(GPtrArray) base_changed = NULL;
+  g_autoptr(GPtrArray) base_removed = NULL;
+  if (!diff_commit_paths (self->ostreerepo, prev_base, base_commit,
+                          &base_changed, &base_removed, cancellable, error))
+    return FALSE;
 
-  /* NB: Because we're using the real root here (see above for reason why), rpm
-   * will see the read-only /usr mount and think that there isn't any disk space
-   * available for install. For now, we just tell rpm to ignore space
-   * calculations, but then we lose that nice check. What we could do is set a
-   * root dir at least if we have CAP_SYS_CHROOT, or maybe do the space req
-   * check ourselves if rpm makes that information easily accessible (doesn't
-   * look like it from a quick glance). */
-  int r = rpmtsRun (rpmdb_ts, NULL, RPMPROB_FILTER_DISKSPACE);
-  if (r < 0)
-    return glnx_throw (error, "Failed to update rpmdb (rpmtsRun code %d)", r);
-  if (r > 0)
+  g_autoptr(GHashTable) base_set = g_hash_table_new (g_str_hash, g_str_equal);
+  GPtrArray *base_diffs[] = { base_changed, base_removed };
+  for (guint i = 0; i < G_N_ELEMENTS (base_diffs); i++)
     {
-      if (!dnf_rpmts_look_for_problems (rpmdb_ts, error))
-        return FALSE;
+      for (guint j = 0; j < base_diffs[i]->len; j++)
+        {
+          const char *path = base_diffs[i]->pdata[j];
+          if (path_affects_file_ownership (path))
+            return TRUE;
+          /* base path replaced by, or inside, a layered path */
+          if (path_or_parent_in_set (delta_set, path))
+            return TRUE;
+          g_hash_table_add (base_set, (char*)path);
+        }
+    }
+
+  /* layered path inside a changed base path */
+  for (guint i = 0; i < delta->len; i++)
+    {
+      if (path_or_parent_in_set (base_set, delta->pdata[i]))
+        return TRUE;
+    }
+
+  *out_delta = g_steal_pointer (&delta);
+  return TRUE;
+}
+
+/**
+ * rpmostree_context_rebase_layer:
+ *
+ * Incremental alternative to rpmostree_context_assemble_tmprootfs() for the
+ * common case of an upgrade where only the base commit changed. If the
+ * prepared goal resolves to exactly the packages layered in @prev_commit, the
+ * layer didn't run any scripts, and the changes between its base and
+ * @base_commit don't touch any of the paths it added or modified, then those
+ * paths are checked out from @prev_commit into @tmprootfs_dfd (which must be a
+ * checkout of @base_commit) and only the rpmdb is regenerated.
+ *
+ * Otherwise, @out_rebased is set to %FALSE, @tmprootfs_dfd is left untouched,
+ * and the caller should fall back to the full assembly.
+ */
+gboolean
+rpmostree_context_rebase_layer (RpmOstreeContext      *self,
+                                int                    tmprootfs_dfd,
+                                OstreeRepoDevInoCache *devino_cache,
+                                const char            *base_commit,
+                                const char            *prev_commit,
+                                gboolean              *out_rebased,
+                                GCancellable          *cancellable,
+                                GError               **error)
+{
+  *out_rebased = FALSE;
+
+  if (self->empty)
+    return TRUE;
+
+  g_autoptr(GPtrArray) delta = NULL;
+  if (!compute_rebasable_layer_delta (self, base_commit, prev_commit, &delta,
+                                      cancellable, error))
+    return FALSE;
+  if (!delta)
+    return TRUE;
+
+  g_autoptr(GPtrArray) overlays =
+    dnf_goal_get_packages (dnf_context_get_goal (self->hifctx),
+                           DNF_PACKAGE_INFO_INSTALL, -1);
+  g_autoptr(GPtrArray) no_removals = g_ptr_array_new ();
+
+  g_autoptr(GFile) prev_root = NULL;
+  if (!ostree_repo_read_commit (self->ostreerepo, prev_commit, &prev_root, NULL,
+                                cancellable, error))
+    return FALSE;
+
+  rpmostree_output_task_begin ("Reusing %u overlays from %.7s", overlays->len, prev_commit);
+
+  for (guint i = 0; i < delta->len; i++)
+    {
+      const char *path = delta->pdata[i];
+      const char *relpath = path + 1;
+      g_autoptr(GFile) f = g_file_resolve_relative_path (prev_root, relpath);
+      OstreeRepoCheckoutAtOptions opts = { .mode = OSTREE_REPO_CHECKOUT_MODE_NONE,
+                                           .overwrite_mode = OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_FILES,
+                                           .subpath = path,
+                                           .devino_to_csum_cache = devino_cache };
+
+      /* Added directories come through whole (their children aren't listed
+       * separately); a file subpath is checked out *into* its destination. */
+      g_autofree char *destination = NULL;
+      if (g_file_query_file_type (f, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                  cancellable) == G_FILE_TYPE_DIRECTORY)
+        destination = g_strdup (relpath);
+      else
+        destination = g_path_get_dirname (relpath);
+
+      if (!ostree_repo_checkout_at (self->ostreerepo, &opts, tmprootfs_dfd, destination,
+                                    prev_commit, cancellable, error))
+        return glnx_prefix_error (error, "Checking out %s", path);
     }
 
   rpmostree_output_task_end ("done");
 
+  if (!rpmostree_rootfs_prepare_links (tmprootfs_dfd, cancellable, error))
+    return FALSE;
+
+  if (!write_rpmdb (self, tmprootfs_dfd, overlays, no_removals, cancellable, error))
+    return FALSE;
+
+  /* We only get here if the layer had no scripts to begin with */
+  self->layer_has_scripts = FALSE;
+
+  *out_rebased = TRUE;
   return TRUE;
 }
 
@@ -2973,6 +4114,52 @@ rpmostree_context_commit_tmprootfs (RpmOstreeContext      *self,
                                    removed_base_pkgnevras->len));
         }
 
+        /* record what rpmostree_context_rebase_layer() needs to carry this
+         * layer over to a new base later on */
+        if (!self->empty)
+          {
+            g_autoptr(GPtrArray) nevras = get_layered_nevras (self);
+            g_variant_builder_add (&metadata_builder, "{sv}",
+                                   "rpmostree.layered-nevras",
+                                   g_variant_new_strv ((const char *const*)nevras->pdata,
+                                                       nevras->len));
+            g_variant_builder_add (&metadata_builder, "{sv}",
+                                   "rpmostree.layer-scripts",
+                                   g_variant_new_boolean (self->layer_has_scripts));
+            const char *sepolicy_csum =
+              self->sepolicy ? ostree_sepolicy_get_csum (self->sepolicy) : NULL;
+            if (sepolicy_csum)
+              g_variant_builder_add (&metadata_builder, "{sv}",
+                                     "rpmostree.layer-sepolicy",
+                                     g_variant_new_string (sepolicy_csum));
+          }
+
+        /* the pkgcache branches this layer was built from, so that cleanup can
+         * tell which ones are still needed without reading the rpmdb */
+        { g_autoptr(GPtrArray) cache_refs = g_ptr_array_new_with_free_func (g_free);
+          if (!self->empty)
+            {
+              g_autoptr(GPtrArray) overlays =
+                dnf_goal_get_packages (dnf_context_get_goal (self->hifctx),
+                                       DNF_PACKAGE_INFO_INSTALL, -1);
+              for (guint i = 0; i < overlays->len; i++)
+                g_ptr_array_add (cache_refs, rpmostree_get_cache_branch_pkg (overlays->pdata[i]));
+              g_ptr_array_sort (cache_refs, rpmostree_ptrarray_sort_compare_strings);
+            }
+          g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.pkgcache-refs",
+                                 g_variant_new_strv ((const char *const*)cache_refs->pdata,
+                                                     cache_refs->len));
+        }
+
+        /* lets the upgrader find this commit again for the same inputs */
+        { g_autofree char *input_hash =
+            rpmostree_context_get_input_hash (self, parent, error);
+          if (!input_hash)
+            return FALSE;
+          g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.inputhash",
+                                 g_variant_new_string (input_hash));
+        }
+
         /* be nice to our future selves */
         g_variant_builder_add (&metadata_builder, "{sv}",
                                "rpmostree.clientlayer_version",
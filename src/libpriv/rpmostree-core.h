@@ -47,6 +47,19 @@ RpmOstreeContext *rpmostree_context_new_unprivileged (int basedir_dfd,
 
 DnfContext * rpmostree_context_get_hif (RpmOstreeContext *self);
 
+/* How private copies of hardlinked files were made during relabeling and
+ * assembly; reflinks don't write any data. */
+typedef struct {
+  guint   n_reflinked;
+  guint   n_copy_range;
+  guint   n_copied;
+  guint64 bytes_reflinked;
+  guint64 bytes_copy_range;
+  guint64 bytes_copied;
+} RpmOstreeCopyupStats;
+
+const RpmOstreeCopyupStats *rpmostree_context_get_copyup_stats (RpmOstreeContext *self);
+
 RpmOstreeTreespec *rpmostree_treespec_new_from_keyfile (GKeyFile *keyfile, GError  **error);
 RpmOstreeTreespec *rpmostree_treespec_new_from_path (const char *path, GError  **error);
 RpmOstreeTreespec *rpmostree_treespec_new (GVariant   *variant);
@@ -77,6 +90,9 @@ void rpmostree_context_set_ignore_scripts (RpmOstreeContext *self,
 
 void rpmostree_dnf_add_checksum_goal (GChecksum *checksum, HyGoal goal);
 char *rpmostree_context_get_state_sha512 (RpmOstreeContext *self);
+char *rpmostree_context_get_input_hash (RpmOstreeContext *self,
+                                        const char       *base_commit,
+                                        GError          **error);
 
 char *rpmostree_get_cache_branch_header (Header hdr);
 char *rpmostree_get_cache_branch_pkg (DnfPackage *pkg);
@@ -98,6 +114,13 @@ gboolean rpmostree_context_prepare (RpmOstreeContext     *self,
                                     GCancellable   *cancellable,
                                     GError        **error);
 
+gboolean rpmostree_context_lookup_cached_solution (RpmOstreeContext *self,
+                                                   const char       *base_commit,
+                                                   gboolean         *out_found,
+                                                   GCancellable     *cancellable,
+                                                   GError          **error);
+void rpmostree_context_print_cached_solution (RpmOstreeContext *self);
+
 gboolean rpmostree_context_download (RpmOstreeContext *self,
                                      GCancellable     *cancellable,
                                      GError           **error);
@@ -123,6 +146,7 @@ gboolean rpmostree_context_assemble_tmprootfs (RpmOstreeContext      *self,
                                                gboolean               noscripts,
                                                GCancellable          *cancellable,
                                                GError               **error);
+
 gboolean rpmostree_context_commit_tmprootfs (RpmOstreeContext      *self,
                                              int                    tmprootfs_dfd,
                                              OstreeRepoDevInoCache *devino_cache,
@@ -141,3 +165,13 @@ gboolean rpmostree_context_assemble_commit (RpmOstreeContext      *self,
                                             char                 **out_commit,
                                             GCancellable          *cancellable,
                                             GError               **error);
+
+/* Alternative to assemble_tmprootfs() reusing a previous layer */
+gboolean rpmostree_context_rebase_layer (RpmOstreeContext      *self,
+                                         int                    tmprootfs_dfd,
+                                         OstreeRepoDevInoCache *devino_cache,
+                                         const char            *base_commit,
+                                         const char            *prev_commit,
+                                         gboolean              *out_rebased,
+                                         GCancellable          *cancellable,
+                                         GError               **error);
@@ -36,6 +36,7 @@
 
 #include "rpmostree-kernel.h"
 #include "rpmostree-bwrap.h"
+#include "rpmostree-rpm-util.h"
 #include "rpmostree-util.h"
 
 static gboolean
@@ -379,3 +380,427 @@ rpmostree_run_dracut (int     rootfs_dfd,
   (void) unlinkat (rootfs_dfd, rpmostree_dracut_wrapper_path, 0);
   return ret;
 }
+
+/* Bump this whenever the way we invoke dracut changes in a way that affects
+ * the generated image (e.g. the wrapper script in rpmostree_run_dracut()).
+ */
+#define RPMOSTREE_INITRAMFS_CACHE_VERSION "2"
+#define RPMOSTREE_INITRAMFS_CACHE_REF_PREFIX "rpmostree/initramfs"
+#define RPMOSTREE_INITRAMFS_CACHE_MAX_ENTRIES 3
+#define RPMOSTREE_INITRAMFS_CACHE_IMAGE "initramfs.img"
+
+/* The files in the host /etc that dracut is known to pick up when rebuilding
+ * an initramfs. Entries may be files or directories. Anything else has to be
+ * explicitly passed in via the initramfs args, e.g. `-I /etc/foo`.
+ */
+static const char *const initramfs_etc_inputs[] = {
+  "dracut.conf", "dracut.conf.d",
+  "crypttab", "fstab",
+  "vconsole.conf", "locale.conf", "hostname", "machine-id",
+  "modprobe.d", "modules-load.d", "cmdline.d",
+  "sysctl.conf", "sysctl.d",
+  "udev/udev.conf", "udev/rules.d",
+  "ld.so.conf", "ld.so.conf.d",
+  "lvm/lvm.conf", "mdadm.conf",
+  "multipath.conf", "multipath",
+  "iscsi", "systemd",
+  NULL
+};
+
+static void
+checksum_update_str (GChecksum  *checksum,
+                     const char *str)
+{
+  /* include the trailing NUL so that concatenated fields can't collide */
+  g_checksum_update (checksum, (const guint8*)str, strlen (str) + 1);
+}
+
+/* Feed the type, mode, and content of @path (recursively for directories) into
+ * @checksum. A missing path is recorded as such, so that creating it later
+ * invalidates the key.
+ */
+static gboolean
+checksum_update_from_path (GChecksum    *checksum,
+                           int           dfd,
+                           const char   *path,
+                           GCancellable *cancellable,
+                           GError      **error)
+{
+  struct stat stbuf;
+
+  checksum_update_str (checksum, path);
+
+  if (fstatat (dfd, path, &stbuf, AT_SYMLINK_NOFOLLOW) < 0)
+    {
+      if (errno != ENOENT)
+        return glnx_throw_errno_prefix (error, "fstatat(%s)", path);
+      checksum_update_str (checksum, "missing");
+      return TRUE;
+    }
+
+  { guint32 mode = GUINT32_TO_BE (stbuf.st_mode);
+    g_checksum_update (checksum, (const guint8*)&mode, sizeof (mode));
+  }
+
+  if (S_ISREG (stbuf.st_mode))
+    {
+      if (!_rpmostree_util_update_checksum_from_file (checksum, dfd, path,
+                                                      cancellable, error))
+        return FALSE;
+    }
+  else if (S_ISLNK (stbuf.st_mode))
+    {
+      g_autofree char *target = glnx_readlinkat_malloc (dfd, path, cancellable, error);
+      if (!target)
+        return FALSE;
+      checksum_update_str (checksum, target);
+    }
+  else if (S_ISDIR (stbuf.st_mode))
+    {
+      g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+      g_autoptr(GPtrArray) children = g_ptr_array_new_with_free_func (g_free);
+
+      if (!glnx_dirfd_iterator_init_at (dfd, path, FALSE, &dfd_iter, error))
+        return FALSE;
+
+      while (TRUE)
+        {
+          struct dirent *dent = NULL;
+
+          if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+            return FALSE;
+          if (!dent)
+            break;
+
+          g_ptr_array_add (children, g_strconcat (path, "/", dent->d_name, NULL));
+        }
+
+      /* readdir() order is arbitrary; make the key stable */
+      g_ptr_array_sort (children, rpmostree_ptrarray_sort_compare_strings);
+      for (guint i = 0; i < children->len; i++)
+        {
+          if (!checksum_update_from_path (checksum, dfd, children->pdata[i],
+                                          cancellable, error))
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Add the NEVRA and pkgid of every installed package owning files matching
+ * @file_glob in the sack, in a stable order.
+ */
+static void
+checksum_update_from_pkgs_owning (GChecksum  *checksum,
+                                  DnfSack    *sack,
+                                  const char *file_glob)
+{
+  hy_autoquery HyQuery query = hy_query_create (sack);
+  hy_query_filter (query, HY_PKG_FILE, HY_GLOB, file_glob);
+  g_autoptr(GPtrArray) pkgs = hy_query_run (query);
+  g_autoptr(GPtrArray) nevras = g_ptr_array_new_with_free_func (g_free);
+
+  for (guint i = 0; i < pkgs->len; i++)
+    {
+      DnfPackage *pkg = pkgs->pdata[i];
+      g_ptr_array_add (nevras, g_strdup_printf ("%s:%s", dnf_package_get_nevra (pkg),
+                                                dnf_package_get_pkgid (pkg) ?: ""));
+    }
+
+  g_ptr_array_sort (nevras, rpmostree_ptrarray_sort_compare_strings);
+  checksum_update_str (checksum, file_glob);
+  for (guint i = 0; i < nevras->len; i++)
+    checksum_update_str (checksum, nevras->pdata[i]);
+}
+
+/* Compute the initramfs cache key for the kernel @kver found at @kernel_path
+ * in @rootfs_dfd, when regenerating from the initramfs at @initramfs_path with
+ * the extra dracut args @argv. The key covers:
+ *  - the kernel image itself
+ *  - the input initramfs; it's built from the same tree, so any binaries
+ *    dracut modules copy in from packages which don't ship dracut modules
+ *    themselves change it too
+ *  - the packages providing the kernel modules and the dracut modules, as
+ *    recorded in the rpmdb of @rootfs_dfd
+ *  - the dracut args
+ *  - the host /etc files dracut pulls in (see initramfs_etc_inputs), plus any
+ *    /etc paths referenced in @argv
+ */
+char *
+rpmostree_initramfs_cache_compute_key (int                rootfs_dfd,
+                                       const char        *kver,
+                                       const char        *kernel_path,
+                                       const char        *initramfs_path,
+                                       const char *const *argv,
+                                       GCancellable      *cancellable,
+                                       GError           **error)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+  checksum_update_str (checksum, RPMOSTREE_INITRAMFS_CACHE_VERSION);
+  checksum_update_str (checksum, kver);
+
+  if (!_rpmostree_util_update_checksum_from_file (checksum, rootfs_dfd, kernel_path,
+                                                  cancellable, error))
+    return NULL;
+  if (!_rpmostree_util_update_checksum_from_file (checksum, rootfs_dfd, initramfs_path,
+                                                  cancellable, error))
+    return NULL;
+
+  g_autoptr(RpmOstreeRefSack) rsack =
+    rpmostree_get_refsack_for_root (rootfs_dfd, ".", cancellable, error);
+  if (!rsack)
+    return NULL;
+
+  g_autofree char *modules_glob = g_strdup_printf ("/usr/lib/modules/%s/*", kver);
+  checksum_update_from_pkgs_owning (checksum, rsack->sack, modules_glob);
+  checksum_update_from_pkgs_owning (checksum, rsack->sack, "/usr/lib/dracut/*");
+
+  checksum_update_str (checksum, "args");
+  for (const char *const *iter = argv; iter && *iter; iter++)
+    checksum_update_str (checksum, *iter);
+
+  /* dracut is run with the host /etc bind-mounted in; see rpmostree_run_dracut() */
+  glnx_fd_close int etc_dfd = -1;
+  if (!glnx_opendirat (AT_FDCWD, "/etc", TRUE, &etc_dfd, error))
+    return NULL;
+
+  for (const char *const *iter = initramfs_etc_inputs; *iter; iter++)
+    {
+      if (!checksum_update_from_path (checksum, etc_dfd, *iter, cancellable, error))
+        return NULL;
+    }
+
+  for (const char *const *iter = argv; iter && *iter; iter++)
+    {
+      const char *arg = *iter;
+      if (!g_str_has_prefix (arg, "/etc/"))
+        continue;
+      if (!checksum_update_from_path (checksum, etc_dfd, arg + strlen ("/etc/"),
+                                      cancellable, error))
+        return NULL;
+    }
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+static char *
+initramfs_cache_ref (const char *key)
+{
+  return g_strconcat (RPMOSTREE_INITRAMFS_CACHE_REF_PREFIX, "/", key, NULL);
+}
+
+/* Look up @key in the initramfs cache of @repo. On a hit, the cached image is
+ * copied into a new tmpfile in @rootfs_dfd, ready to be handed to
+ * rpmostree_finalize_kernel(). On a miss, @out_found is set to %FALSE and
+ * @out_initramfs_tmpf is left untouched.
+ */
+gboolean
+rpmostree_initramfs_cache_lookup (OstreeRepo   *repo,
+                                  const char   *key,
+                                  int           rootfs_dfd,
+                                  gboolean     *out_found,
+                                  GLnxTmpfile  *out_initramfs_tmpf,
+                                  GCancellable *cancellable,
+                                  GError      **error)
+{
+  g_autofree char *ref = initramfs_cache_ref (key);
+  g_autofree char *commit = NULL;
+
+  *out_found = FALSE;
+
+  if (!ostree_repo_resolve_rev (repo, ref, TRUE, &commit, error))
+    return FALSE;
+  if (!commit)
+    return TRUE;
+
+  g_autoptr(GFile) root = NULL;
+  if (!ostree_repo_read_commit (repo, commit, &root, NULL, cancellable, error))
+    return FALSE;
+
+  g_autoptr(GFile) image = g_file_get_child (root, RPMOSTREE_INITRAMFS_CACHE_IMAGE);
+  g_autoptr(GInputStream) in = (GInputStream*)g_file_read (image, cancellable, error);
+  if (!in)
+    return FALSE;
+
+  /* Same location as rpmostree_run_dracut() uses for its output */
+  g_auto(GLnxTmpfile) tmpf = { 0, };
+  if (!glnx_open_tmpfile_linkable_at (rootfs_dfd, ".", O_RDWR | O_CLOEXEC,
+                                      &tmpf, error))
+    return FALSE;
+
+  g_autoptr(GOutputStream) out = g_unix_output_stream_new (tmpf.fd, FALSE);
+  if (g_output_stream_splice (out, in, G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
+                              cancellable, error) < 0)
+    return FALSE;
+
+  *out_found = TRUE;
+  *out_initramfs_tmpf = tmpf; tmpf.initialized = FALSE; /* Transfer */
+  return TRUE;
+}
+
+static gint
+compare_entries_newest_first (gconstpointer ap,
+                              gconstpointer bp)
+{
+  guint64 a, b;
+  g_variant_get_child (*(GVariant**)ap, 0, "t", &a);
+  g_variant_get_child (*(GVariant**)bp, 0, "t", &b);
+  return (a < b) - (a > b);
+}
+
+/* Drop all but the newest entries; must be called in a transaction. The entry
+ * being added in the current transaction isn't listed yet, so it always
+ * survives.
+ */
+static gboolean
+initramfs_cache_prune (OstreeRepo   *repo,
+                       GCancellable *cancellable,
+                       GError      **error)
+{
+  g_autoptr(GHashTable) refs = NULL;
+  if (!ostree_repo_list_refs_ext (repo, RPMOSTREE_INITRAMFS_CACHE_REF_PREFIX, &refs,
+                                  OSTREE_REPO_LIST_REFS_EXT_NONE,
+                                  cancellable, error))
+    return FALSE;
+
+  if (g_hash_table_size (refs) < RPMOSTREE_INITRAMFS_CACHE_MAX_ENTRIES)
+    return TRUE;
+
+  /* (st): commit timestamp and ref */
+  g_autoptr(GPtrArray) entries =
+    g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
+
+  GHashTableIter it;
+  gpointer k, v;
+  g_hash_table_iter_init (&it, refs);
+  while (g_hash_table_iter_next (&it, &k, &v))
+    {
+      g_autoptr(GVariant) commit = NULL;
+      guint64 timestamp = 0;
+
+      if (!ostree_repo_load_commit (repo, v, &commit, NULL, error))
+        return FALSE;
+      timestamp = ostree_commit_get_timestamp (commit);
+      g_ptr_array_add (entries, g_variant_ref_sink (g_variant_new ("(ts)", timestamp, k)));
+    }
+
+  g_ptr_array_sort (entries, compare_entries_newest_first);
+
+  for (guint i = RPMOSTREE_INITRAMFS_CACHE_MAX_ENTRIES - 1; i < entries->len; i++)
+    {
+      const char *ref;
+      g_variant_get_child (entries->pdata[i], 1, "&s", &ref);
+      ostree_repo_transaction_set_refspec (repo, ref, NULL);
+    }
+
+  return TRUE;
+}
+
+static gboolean
+initramfs_cache_write (OstreeRepo   *repo,
+                       const char   *key,
+                       const char   *kver,
+                       int           initramfs_fd,
+                       GCancellable *cancellable,
+                       GError      **error)
+{
+  struct stat stbuf;
+  if (fstat (initramfs_fd, &stbuf) < 0)
+    return glnx_throw_errno_prefix (error, "fstat");
+
+  g_autoptr(GFileInfo) finfo = g_file_info_new ();
+  g_file_info_set_file_type (finfo, G_FILE_TYPE_REGULAR);
+  g_file_info_set_size (finfo, stbuf.st_size);
+  g_file_info_set_attribute_uint32 (finfo, "unix::uid", 0);
+  g_file_info_set_attribute_uint32 (finfo, "unix::gid", 0);
+  g_file_info_set_attribute_uint32 (finfo, "unix::mode", S_IFREG | 0644);
+
+  /* dracut left the offset at the end; rpmostree_finalize_kernel() mmap()s
+   * the fd so it doesn't care where we leave it */
+  if (lseek (initramfs_fd, 0, SEEK_SET) < 0)
+    return glnx_throw_errno_prefix (error, "lseek");
+
+  g_autoptr(GInputStream) raw_in = g_unix_input_stream_new (initramfs_fd, FALSE);
+  g_autoptr(GInputStream) content_in = NULL;
+  guint64 content_len;
+  if (!ostree_raw_file_to_content_stream (raw_in, finfo, NULL, &content_in,
+                                          &content_len, cancellable, error))
+    return FALSE;
+
+  g_autofree guchar *content_csum_raw = NULL;
+  if (!ostree_repo_write_content (repo, NULL, content_in, content_len,
+                                  &content_csum_raw, cancellable, error))
+    return FALSE;
+  g_autofree char *content_csum = ostree_checksum_from_bytes (content_csum_raw);
+
+  g_autoptr(GFileInfo) dirinfo = g_file_info_new ();
+  g_file_info_set_file_type (dirinfo, G_FILE_TYPE_DIRECTORY);
+  g_file_info_set_attribute_uint32 (dirinfo, "unix::uid", 0);
+  g_file_info_set_attribute_uint32 (dirinfo, "unix::gid", 0);
+  g_file_info_set_attribute_uint32 (dirinfo, "unix::mode", S_IFDIR | 0755);
+  g_autoptr(GVariant) dirmeta =
+    g_variant_ref_sink (ostree_create_directory_metadata (dirinfo, NULL));
+
+  g_autofree guchar *dirmeta_csum_raw = NULL;
+  if (!ostree_repo_write_metadata (repo, OSTREE_OBJECT_TYPE_DIR_META, NULL,
+                                   dirmeta, &dirmeta_csum_raw,
+                                   cancellable, error))
+    return FALSE;
+  g_autofree char *dirmeta_csum = ostree_checksum_from_bytes (dirmeta_csum_raw);
+
+  glnx_unref_object OstreeMutableTree *mtree = ostree_mutable_tree_new ();
+  ostree_mutable_tree_set_metadata_checksum (mtree, dirmeta_csum);
+  if (!ostree_mutable_tree_replace_file (mtree, RPMOSTREE_INITRAMFS_CACHE_IMAGE,
+                                         content_csum, error))
+    return FALSE;
+
+  g_autoptr(GFile) root = NULL;
+  if (!ostree_repo_write_mtree (repo, mtree, &root, cancellable, error))
+    return FALSE;
+
+  g_autoptr(GVariantDict) meta_dict = g_variant_dict_new (NULL);
+  g_variant_dict_insert (meta_dict, "rpmostree.initramfs.kver", "s", kver);
+
+  g_autofree char *commit = NULL;
+  if (!ostree_repo_write_commit (repo, NULL, "", "",
+                                 g_variant_dict_end (meta_dict),
+                                 OSTREE_REPO_FILE (root), &commit,
+                                 cancellable, error))
+    return FALSE;
+
+  if (!initramfs_cache_prune (repo, cancellable, error))
+    return FALSE;
+
+  g_autofree char *ref = initramfs_cache_ref (key);
+  ostree_repo_transaction_set_ref (repo, NULL, ref, commit);
+  return TRUE;
+}
+
+/* Store the freshly generated initramfs in @initramfs_tmpf in the cache of
+ * @repo under @key. Only the newest few entries are kept.
+ */
+gboolean
+rpmostree_initramfs_cache_store (OstreeRepo   *repo,
+                                 const char   *key,
+                                 const char   *kver,
+                                 GLnxTmpfile  *initramfs_tmpf,
+                                 GCancellable *cancellable,
+                                 GError      **error)
+{
+  if (!ostree_repo_prepare_transaction (repo, NULL, cancellable, error))
+    return FALSE;
+
+  if (!initramfs_cache_write (repo, key, kver, initramfs_tmpf->fd,
+                              cancellable, error))
+    {
+      (void) ostree_repo_abort_transaction (repo, cancellable, NULL);
+      return FALSE;
+    }
+
+  if (!ostree_repo_commit_transaction (repo, NULL, cancellable, error))
+    return FALSE;
+
+  return TRUE;
+}
@@ -44,3 +44,29 @@ rpmostree_run_dracut (int     rootfs_dfd,
                       GLnxTmpfile *out_initramfs_tmpf,
                       GCancellable  *cancellable,
                       GError **error);
+
+char *
+rpmostree_initramfs_cache_compute_key (int                rootfs_dfd,
+                                       const char        *kver,
+                                       const char        *kernel_path,
+                                       const char        *initramfs_path,
+                                       const char *const *argv,
+                                       GCancellable      *cancellable,
+                                       GError           **error);
+
+gboolean
+rpmostree_initramfs_cache_lookup (OstreeRepo   *repo,
+                                  const char   *key,
+                                  int           rootfs_dfd,
+                                  gboolean     *out_found,
+                                  GLnxTmpfile  *out_initramfs_tmpf,
+                                  GCancellable *cancellable,
+                                  GError      **error);
+
+gboolean
+rpmostree_initramfs_cache_store (OstreeRepo   *repo,
+                                 const char   *key,
+                                 const char   *kver,
+                                 GLnxTmpfile  *initramfs_tmpf,
+                                 GCancellable *cancellable,
+                                 GError      **error);
@@ -34,10 +34,6 @@
 #include "rpmostree-json-parsing.h"
 #include "rpmostree-passwd-util.h"
 
-/* FIXME: */
-#define OSTREE_GIO_FAST_QUERYINFO ("standard::name,standard::type,standard::size,standard::is-symlink,standard::symlink-target," \
-                                   "unix::device,unix::inode,unix::mode,unix::uid,unix::gid,unix::rdev")
-
 #include "libglnx.h"
 
 static inline void
@@ -49,127 +45,91 @@ cleanup_stdio_file (FILE **filep)
 }
 #define _cleanup_stdio_file_ __attribute__((cleanup(cleanup_stdio_file)))
 
-static gboolean
-ptrarray_contains_str (GPtrArray *haystack, const char *needle)
-{
-  /* faster if sorted+bsearch ... but probably doesn't matter */
-  guint i;
-
-  if (!haystack || !needle)
-    return FALSE;
-
-  for (i = 0; i < haystack->len; i++)
-    {
-      const char *data = haystack->pdata[i];
+/* The uids and gids owning any file in a rootfs; used to check whether a
+ * removed user or group still owns anything. Scanned at most once, on first
+ * use.
+ */
+typedef struct {
+  gboolean scanned;
+  GHashTable *uids; /* Set<uid_t> */
+  GHashTable *gids; /* Set<gid_t> */
+} RootfsOwners;
 
-      if (g_str_equal (data, needle))
-        return TRUE;
-    }
+static void
+rootfs_owners_clear (RootfsOwners *owners)
+{
+  g_clear_pointer (&owners->uids, g_hash_table_unref);
+  g_clear_pointer (&owners->gids, g_hash_table_unref);
+}
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC(RootfsOwners, rootfs_owners_clear);
 
-  return FALSE;
+static void
+rootfs_owners_add (RootfsOwners *owners,
+                   struct stat  *stbuf)
+{
+  g_hash_table_add (owners->uids, GUINT_TO_POINTER (stbuf->st_uid));
+  g_hash_table_add (owners->gids, GUINT_TO_POINTER (stbuf->st_gid));
 }
 
 static gboolean
-dir_contains_uid_or_gid (GFile         *root,
-                         guint32        id,
-                         const char    *attr,
-                         gboolean      *out_found_match,
-                         GCancellable  *cancellable,
-                         GError       **error)
+rootfs_owners_scan_recurse (RootfsOwners  *owners,
+                            int            dfd,
+                            const char    *path,
+                            GCancellable  *cancellable,
+                            GError       **error)
 {
-  gboolean ret = FALSE;
-  g_autoptr(GFileInfo) file_info = NULL;
-  guint32 type;
-  guint32 tid;
-  gboolean found_match = FALSE;
-
-  /* zero it out, just to be sure */
-  *out_found_match = found_match;
-
-  file_info = g_file_query_info (root, OSTREE_GIO_FAST_QUERYINFO,
-                                 G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                 cancellable, error);
-  if (!file_info)
-    goto out;
-
-  type = g_file_info_get_file_type (file_info);
-
-  switch (type)
-    {
-    case G_FILE_TYPE_DIRECTORY:
-    case G_FILE_TYPE_SYMBOLIC_LINK:
-    case G_FILE_TYPE_REGULAR:
-    case G_FILE_TYPE_SPECIAL:
-      tid = g_file_info_get_attribute_uint32 (file_info, attr);
-      if (tid == id)
-        found_match = TRUE;
-      break;
-
-    case G_FILE_TYPE_UNKNOWN:
-    case G_FILE_TYPE_SHORTCUT:
-    case G_FILE_TYPE_MOUNTABLE:
-      g_assert_not_reached ();
-      break;
-    }
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  if (!glnx_dirfd_iterator_init_at (dfd, path, FALSE, &dfd_iter, error))
+    return FALSE;
 
-  /* Now recurse for dirs. */
-  if (!found_match && type == G_FILE_TYPE_DIRECTORY)
+  while (TRUE)
     {
-      g_autoptr(GFileEnumerator) dir_enum = NULL;
-
-      dir_enum = g_file_enumerate_children (root, OSTREE_GIO_FAST_QUERYINFO, 
-                                            G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                            NULL, 
-                                            error);
-      if (!dir_enum)
-        goto out;
-  
-      while (TRUE)
-        {
-          GFileInfo *file_info;
-          GFile *child;
+      struct dirent *dent = NULL;
+      struct stat stbuf;
 
-          if (!g_file_enumerator_iterate (dir_enum, &file_info, &child,
-                                          cancellable, error))
-            goto out;
-          if (!file_info)
-            break;
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (!dent)
+        break;
 
-          if (!dir_contains_uid_or_gid (child, id, attr, &found_match,
-                                        cancellable, error))
-            goto out;
+      if (fstatat (dfd_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+        return glnx_throw_errno_prefix (error, "fstatat(%s)", dent->d_name);
+      rootfs_owners_add (owners, &stbuf);
 
-          if (found_match)
-            break;
+      if (S_ISDIR (stbuf.st_mode))
+        {
+          if (!rootfs_owners_scan_recurse (owners, dfd_iter.fd, dent->d_name,
+                                           cancellable, error))
+            return FALSE;
         }
     }
-  
-  ret = TRUE;
-  *out_found_match = found_match;
- out:
-  return ret;
-}
 
-static gboolean
-dir_contains_uid (GFile           *yumroot,
-                  uid_t            uid,
-                  gboolean        *out_found_match,
-                  GCancellable    *cancellable,
-                  GError         **error)
-{
-  return dir_contains_uid_or_gid (yumroot, uid, "unix::uid",
-                                  out_found_match, cancellable, error);
+  return TRUE;
 }
 
 static gboolean
-dir_contains_gid (GFile           *yumroot,
-                  gid_t            gid,
-                  gboolean        *out_found_match,
-                  GCancellable    *cancellable,
-                  GError         **error)
+rootfs_owners_ensure (RootfsOwners  *owners,
+                      GFile         *yumroot,
+                      GCancellable  *cancellable,
+                      GError       **error)
 {
-  return dir_contains_uid_or_gid (yumroot, gid, "unix::gid",
-                                  out_found_match, cancellable, error);
+  const char *rootpath = gs_file_get_path_cached (yumroot);
+  struct stat stbuf;
+
+  if (owners->scanned)
+    return TRUE;
+
+  owners->uids = g_hash_table_new (NULL, NULL);
+  owners->gids = g_hash_table_new (NULL, NULL);
+
+  if (fstatat (AT_FDCWD, rootpath, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+    return glnx_throw_errno_prefix (error, "fstatat(%s)", rootpath);
+  rootfs_owners_add (owners, &stbuf);
+  if (!rootfs_owners_scan_recurse (owners, AT_FDCWD, rootpath, cancellable, error))
+    return FALSE;
+
+  owners->scanned = TRUE;
+  return TRUE;
 }
 
 static void
@@ -259,6 +219,15 @@ compare_group_ents (gconstpointer a, gconstpointer b)
   return strcmp ((*sa)->name, (*sb)->name);
 }
 
+static const char *
+conv_ent_name (gboolean passwd,
+               gconstpointer ent)
+{
+  if (passwd)
+    return ((const struct conv_passwd_ent *)ent)->name;
+  return ((const struct conv_group_ent *)ent)->name;
+}
+
 /* See "man 5 passwd" We just make sure the name and uid/gid match,
    and that none are missing. don't care about GECOS/dir/shell.
 */
@@ -280,14 +249,15 @@ rpmostree_check_passwd_groups (gboolean         passwd,
   const char *json_conf_ign   = passwd ? "ignore-removed-users" : "ignore-removed-groups";
   g_autoptr(GFile) old_path = NULL;
   g_autoptr(GFile) new_path = g_file_resolve_relative_path (yumroot, commit_filepath);
-  g_autoptr(GPtrArray) ignore_removed_ents = NULL;
+  g_autoptr(GHashTable) ignore_removed = g_hash_table_new (g_str_hash, g_str_equal);
   gboolean ignore_all_removed = FALSE;
   g_autofree char *old_contents = NULL;
   g_autofree char *new_contents = NULL;
   g_autoptr(GPtrArray) old_ents = NULL;
   g_autoptr(GPtrArray) new_ents = NULL;
-  unsigned int oiter = 0;
-  unsigned int niter = 0;
+  g_autoptr(GHashTable) old_by_name = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr(GHashTable) new_by_name = g_hash_table_new (g_str_hash, g_str_equal);
+  g_auto(RootfsOwners) owners = { 0, };
 
   if (json_object_has_member (treedata, json_conf_name))
     {
@@ -448,13 +418,15 @@ rpmostree_check_passwd_groups (gboolean         passwd,
 
   if (json_object_has_member (treedata, json_conf_ign))
     {
-      ignore_removed_ents = g_ptr_array_new ();
+      g_autoptr(GPtrArray) ignore_removed_ents = g_ptr_array_new ();
       if (!_rpmostree_jsonutil_append_string_array_to (treedata, json_conf_ign,
                                                        ignore_removed_ents,
                                                        error))
         goto out;
+      for (guint i = 0; i < ignore_removed_ents->len; i++)
+        g_hash_table_add (ignore_removed, ignore_removed_ents->pdata[i]);
     }
-  ignore_all_removed = ptrarray_contains_str (ignore_removed_ents, "*");
+  ignore_all_removed = g_hash_table_contains (ignore_removed, "*");
 
   if (passwd)
     {
@@ -467,16 +439,23 @@ rpmostree_check_passwd_groups (gboolean         passwd,
       g_ptr_array_sort (new_ents, compare_group_ents);
     }
 
-  while ((oiter < old_ents->len) && (niter < new_ents->len))
+  /* Index both sides by name; the arrays are still sorted so our output is
+   * stable.
+   */
+  for (guint i = 0; i < old_ents->len; i++)
+    g_hash_table_insert (old_by_name, (char*)conv_ent_name (passwd, old_ents->pdata[i]),
+                         old_ents->pdata[i]);
+  for (guint i = 0; i < new_ents->len; i++)
+    g_hash_table_insert (new_by_name, (char*)conv_ent_name (passwd, new_ents->pdata[i]),
+                         new_ents->pdata[i]);
+
+  for (guint i = 0; i < old_ents->len; i++)
     if (passwd)
     {
-      struct conv_passwd_ent *odata = old_ents->pdata[oiter];
-      struct conv_passwd_ent *ndata = new_ents->pdata[niter];
-      int cmp = 0;
-
-      cmp = g_strcmp0 (odata->name, ndata->name);
+      struct conv_passwd_ent *odata = old_ents->pdata[i];
+      struct conv_passwd_ent *ndata = g_hash_table_lookup (new_by_name, odata->name);
 
-      if (cmp == 0)
+      if (ndata)
         {
           if (odata->uid != ndata->uid)
             {
@@ -492,27 +471,21 @@ rpmostree_check_passwd_groups (gboolean         passwd,
                            odata->name, (guint)odata->gid, (guint)ndata->gid);
               goto out;
             }
-
-          ++oiter;
-          ++niter;
         }
-      else if (cmp < 0) /* Missing value from new passwd */
+      else /* Missing value from new passwd */
         {
-          gboolean found_matching_uid;
-
           if (ignore_all_removed ||
-              ptrarray_contains_str (ignore_removed_ents, odata->name))
+              g_hash_table_contains (ignore_removed, odata->name))
             {
               g_print ("Ignored user missing from new passwd file: %s\n",
                        odata->name);
             }
           else
             {
-              if (!dir_contains_uid (yumroot, odata->uid, &found_matching_uid,
-                                     cancellable, error))
+              if (!rootfs_owners_ensure (&owners, yumroot, cancellable, error))
                 goto out;
 
-              if (found_matching_uid)
+              if (g_hash_table_contains (owners.uids, GUINT_TO_POINTER (odata->uid)))
                 {
                   g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
                                "User missing from new passwd file: %s", odata->name);
@@ -522,24 +495,14 @@ rpmostree_check_passwd_groups (gboolean         passwd,
                 g_print ("User removed from new passwd file: %s\n",
                          odata->name);
             }
-
-          ++oiter;
-        }
-      else
-        {
-          g_print ("New passwd entry: %s\n", ndata->name);
-          ++niter;
         }
     }
     else
     {
-      struct conv_group_ent *odata = old_ents->pdata[oiter];
-      struct conv_group_ent *ndata = new_ents->pdata[niter];
-      int cmp = 0;
+      struct conv_group_ent *odata = old_ents->pdata[i];
+      struct conv_group_ent *ndata = g_hash_table_lookup (new_by_name, odata->name);
 
-      cmp = g_strcmp0 (odata->name, ndata->name);
-
-      if (cmp == 0)
+      if (ndata)
         {
           if (odata->gid != ndata->gid)
             {
@@ -548,29 +511,21 @@ rpmostree_check_passwd_groups (gboolean         passwd,
                            odata->name, (guint)odata->gid, (guint)ndata->gid);
               goto out;
             }
-
-          ++oiter;
-          ++niter;
-          continue;
         }
-      else if (cmp < 0) /* Missing value from new group */
+      else /* Missing value from new group */
         {
-
           if (ignore_all_removed ||
-              ptrarray_contains_str (ignore_removed_ents, odata->name))
+              g_hash_table_contains (ignore_removed, odata->name))
             {
               g_print ("Ignored group missing from new group file: %s\n",
                        odata->name);
             }
           else
             {
-              gboolean found_gid;
-
-              if (!dir_contains_gid (yumroot, odata->gid, &found_gid,
-                                     cancellable, error))
+              if (!rootfs_owners_ensure (&owners, yumroot, cancellable, error))
                 goto out;
 
-              if (found_gid)
+              if (g_hash_table_contains (owners.gids, GUINT_TO_POINTER (odata->gid)))
                 {
                   g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
                        "Group missing from new group file: %s", odata->name);
@@ -580,53 +535,15 @@ rpmostree_check_passwd_groups (gboolean         passwd,
                 g_print ("Group removed from new passwd file: %s\n",
                          odata->name);
             }
-
-          ++oiter;
-        }
-      else
-        {
-          g_print ("New group entry: %s\n", ndata->name);
-          ++niter;
         }
     }
 
-  if (passwd)
+  for (guint i = 0; i < new_ents->len; i++)
     {
-      if (oiter < old_ents->len)
-        {
-          struct conv_passwd_ent *odata = old_ents->pdata[oiter];
-
-          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                       "User missing from new passwd file: %s", odata->name);
-          goto out;
-        }
-
-      while (niter < new_ents->len)
-        {
-          struct conv_passwd_ent *ndata = new_ents->pdata[niter];
+      const char *name = conv_ent_name (passwd, new_ents->pdata[i]);
 
-          g_print ("New passwd entry: %s\n", ndata->name);
-          ++niter;
-        }
-    }
-  else
-    {
-      if (oiter < old_ents->len)
-        {
-          struct conv_group_ent *odata = old_ents->pdata[oiter];
-
-          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                       "Group missing from new group file: %s", odata->name);
-          goto out;
-        }
-
-      while (niter < new_ents->len)
-        {
-          struct conv_group_ent *ndata = new_ents->pdata[niter];
-
-          g_print ("New group entry: %s\n", ndata->name);
-          ++niter;
-        }
+      if (!g_hash_table_contains (old_by_name, name))
+        g_print ("New %s entry: %s\n", passwd ? "passwd" : "group", name);
     }
 
   ret = TRUE;
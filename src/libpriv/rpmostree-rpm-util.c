@@ -323,7 +323,7 @@ rpmhdrs_diff_new (void)
  return ret;
 }
 
-static void
+void
 rpmhdrs_diff_free (struct RpmHeadersDiff *diff)
 {
   g_ptr_array_free (diff->hs_add, TRUE);
@@ -812,6 +812,12 @@ get_sack_for_root (int               dfd,
   g_autoptr(DnfSack) sack = dnf_sack_new ();
   dnf_sack_set_rootdir (sack, fullpath);
 
+  /* Loading the system repo reads the rpmdb through librpm; the daemon does
+   * this from its diff worker threads. Queries on the loaded sack only use
+   * its own libsolv pool. */
+  g_auto(RpmOstreeLibrpmLocker) rpmlock = { 0, };
+  rpmostree_librpm_lock (&rpmlock);
+
   if (!dnf_sack_setup (sack, DNF_SACK_LOAD_FLAG_BUILD_CACHE, error))
     return FALSE;
 
@@ -923,6 +929,25 @@ rpmostree_get_pkglist_for_root (int               dfd,
   return TRUE;
 }
 
+static GMutex librpm_lock;
+
+void
+rpmostree_librpm_lock (RpmOstreeLibrpmLocker *locker)
+{
+  g_assert (!locker->locked);
+  g_mutex_lock (&librpm_lock);
+  locker->locked = TRUE;
+}
+
+void
+rpmostree_librpm_unlock (RpmOstreeLibrpmLocker *locker)
+{
+  if (!locker->locked)
+    return;
+  g_mutex_unlock (&librpm_lock);
+  locker->locked = FALSE;
+}
+
 static gint
 pkg_array_compare (DnfPackage **p_pkg1,
                    DnfPackage **p_pkg2)
@@ -942,56 +967,76 @@ rpmostree_sighandler_reset_cleanup (RpmSighandlerResetCleanup *cleanup)
 #endif
 }
 
-static void
-print_pkglist (GPtrArray *pkglist)
+/* Returns the (nevra, reponame) of @pkglist as a(ss), in the order
+ * rpmostree_print_package_changes() expects. */
+static GVariant *
+pkglist_to_variant (GPtrArray *pkglist)
 {
+  GVariantBuilder builder;
+
   g_ptr_array_sort (pkglist, (GCompareFunc) pkg_array_compare);
 
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ss)"));
   for (guint i = 0; i < pkglist->len; i++)
     {
       DnfPackage *pkg = pkglist->pdata[i];
-      g_print ("  %s (%s)\n", dnf_package_get_nevra (pkg),
-                              dnf_package_get_reponame (pkg));
+      g_variant_builder_add (&builder, "(ss)", dnf_package_get_nevra (pkg),
+                             dnf_package_get_reponame (pkg));
     }
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
 }
 
-void
-rpmostree_print_transaction (DnfContext   *hifctx)
+static void
+print_pkglist (GVariant *pkglist)
 {
-  gboolean empty = TRUE;
-
-  { g_autoptr(GPtrArray) packages = NULL;
-    packages = dnf_goal_get_packages (dnf_context_get_goal (hifctx),
-                                      DNF_PACKAGE_INFO_INSTALL,
-                                      DNF_PACKAGE_INFO_REINSTALL,
-                                      DNF_PACKAGE_INFO_DOWNGRADE,
-                                      DNF_PACKAGE_INFO_UPDATE,
-                                      -1);
+  GVariantIter iter;
+  const char *nevra;
+  const char *reponame;
 
-    if (packages->len > 0)
-      empty = FALSE;
-
-    g_print ("Installing %u packages:\n", packages->len);
-    print_pkglist (packages);
-  }
-
-  { g_autoptr(GPtrArray) packages = NULL;
-    packages = dnf_goal_get_packages (dnf_context_get_goal (hifctx),
-                                    DNF_PACKAGE_INFO_REMOVE,
-                                    DNF_PACKAGE_INFO_OBSOLETE,
-                                      -1);
+  g_variant_iter_init (&iter, pkglist);
+  while (g_variant_iter_next (&iter, "(&s&s)", &nevra, &reponame))
+    g_print ("  %s (%s)\n", nevra, reponame);
+}
 
-    if (packages->len > 0)
-      empty = FALSE;
+/* Print the packages to install and remove, both a(ss) of (nevra, reponame)
+ * sorted like dnf_package_cmp(). This is the format of
+ * rpmostree_print_transaction(), for callers without a goal to query.
+ */
+void
+rpmostree_print_package_changes (GVariant *installs,
+                                 GVariant *removes)
+{
+  g_print ("Installing %u packages:\n", (guint) g_variant_n_children (installs));
+  print_pkglist (installs);
 
-    g_print ("Removing %u packages:\n", packages->len);
-    print_pkglist (packages);
-  }
+  g_print ("Removing %u packages:\n", (guint) g_variant_n_children (removes));
+  print_pkglist (removes);
 
-  if (empty)
+  if (g_variant_n_children (installs) == 0 && g_variant_n_children (removes) == 0)
     g_print ("Empty transaction\n");
 }
 
+void
+rpmostree_print_transaction (DnfContext   *hifctx)
+{
+  g_autoptr(GPtrArray) installs =
+    dnf_goal_get_packages (dnf_context_get_goal (hifctx),
+                           DNF_PACKAGE_INFO_INSTALL,
+                           DNF_PACKAGE_INFO_REINSTALL,
+                           DNF_PACKAGE_INFO_DOWNGRADE,
+                           DNF_PACKAGE_INFO_UPDATE,
+                           -1);
+  g_autoptr(GPtrArray) removes =
+    dnf_goal_get_packages (dnf_context_get_goal (hifctx),
+                           DNF_PACKAGE_INFO_REMOVE,
+                           DNF_PACKAGE_INFO_OBSOLETE,
+                           -1);
+  g_autoptr(GVariant) installs_v = pkglist_to_variant (installs);
+  g_autoptr(GVariant) removes_v = pkglist_to_variant (removes);
+
+  rpmostree_print_package_changes (installs_v, removes_v);
+}
+
 struct _cap_struct {
     struct __user_cap_header_struct head;
     union {
@@ -52,6 +52,9 @@ struct RpmHeadersDiff *
 rpmhdrs_diff (struct RpmHeaders *l1,
               struct RpmHeaders *l2);
 
+void
+rpmhdrs_diff_free (struct RpmHeadersDiff *diff);
+
 void
 rpmhdrs_list (struct RpmHeaders *l1);
 
@@ -128,6 +131,10 @@ rpmostree_get_pkglist_for_root (int               dfd,
 void
 rpmostree_print_transaction (DnfContext   *context);
 
+void
+rpmostree_print_package_changes (GVariant *installs,
+                                 GVariant *removes);
+
 
 /* This cleanup struct wraps _rpmostree_reset_rpm_sighandlers(). We have a dummy
  * variable to pacify clang's unused variable detection.
@@ -140,6 +147,18 @@ G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC(RpmSighandlerResetCleanup, rpmostree_sighandler
 
 #define DECLARE_RPMSIGHANDLER_RESET __attribute__((unused)) g_auto(RpmSighandlerResetCleanup) sigcleanup = { 0, };
 
+/* librpm keeps process-wide state (macros, the rpmdb backend, signal
+ * handlers) and doesn't document which of its entry points are thread-safe.
+ * Code which may run on several threads at once holds this lock around its
+ * librpm calls; the cleanup releases it if it's held.
+ */
+typedef struct {
+  gboolean locked;
+} RpmOstreeLibrpmLocker;
+void rpmostree_librpm_lock (RpmOstreeLibrpmLocker *locker);
+void rpmostree_librpm_unlock (RpmOstreeLibrpmLocker *locker);
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC(RpmOstreeLibrpmLocker, rpmostree_librpm_unlock);
+
 GVariant *
 rpmostree_fcap_to_xattr_variant (const char *fcap);
 
@@ -136,38 +136,151 @@ rpmostree_script_txn_validate (DnfPackage    *package,
   return ret;
 }
 
+typedef struct {
+  char *pkgname;
+  const char *desc;
+  char *script;
+} QueuedScript;
+
+static void
+queued_script_free (QueuedScript *qs)
+{
+  g_free (qs->pkgname);
+  g_free (qs->script);
+  g_free (qs);
+}
+
+struct RpmOstreeScriptBatch {
+  GPtrArray *scripts; /* QueuedScript */
+};
+
+RpmOstreeScriptBatch *
+rpmostree_script_batch_new (void)
+{
+  RpmOstreeScriptBatch *batch = g_new0 (RpmOstreeScriptBatch, 1);
+  batch->scripts = g_ptr_array_new_with_free_func ((GDestroyNotify)queued_script_free);
+  return batch;
+}
+
+void
+rpmostree_script_batch_free (RpmOstreeScriptBatch *batch)
+{
+  g_ptr_array_unref (batch->scripts);
+  g_free (batch);
+}
+
+/* The runner executes each script of the batch in order, like we used to do
+ * with one container per script, and stops at the first failure.  It reports
+ * through a status file rather than its exit code, since the latter would
+ * make rpmostree_bwrap_run() throw away an overlayfs /usr before we could
+ * look at it.
+ */
+static char *
+generate_script_runner (RpmOstreeScriptBatch *batch)
+{
+  GString *buf = g_string_new ("#!/bin/sh\n"
+                               "# Generated by rpm-ostree\n"
+                               "dir=$1\n"
+                               "for script in");
+  for (guint i = 0; i < batch->scripts->len; i++)
+    {
+      QueuedScript *qs = batch->scripts->pdata[i];
+      const char *pkg_script = glnx_strjoina (qs->pkgname, ".", qs->desc+1);
+      g_autofree char *quoted = g_shell_quote (pkg_script);
+      g_string_append_printf (buf, " %s", quoted);
+    }
+  /* http://www.rpm.org/max-rpm/s1-rpm-inside-scripts.html#S3-RPM-INSIDE-PRE-SCRIPT */
+  g_string_append (buf, "; do\n"
+                        "  (cd / && exec \"$dir/$script\" 1)\n"
+                        "  rc=$?\n"
+                        "  if [ $rc -ne 0 ]; then\n"
+                        "    echo \"$script $rc\" > \"$dir/status\"\n"
+                        "    exit 0\n"
+                        "  fi\n"
+                        "done\n"
+                        "echo ok > \"$dir/status\"\n");
+  return g_string_free (buf, FALSE);
+}
+
 static gboolean
-run_script_in_bwrap_container (int rootfs_fd,
-                               const char *name,
-                               const char *scriptdesc,
-                               const char *script,
-                               GCancellable  *cancellable,
-                               GError       **error)
+check_script_runner_status (RpmOstreeScriptBatch *batch,
+                            int                   scripts_dfd,
+                            GCancellable         *cancellable,
+                            GError              **error)
+{
+  g_autofree char *status =
+    glnx_file_get_contents_utf8_at (scripts_dfd, "status", NULL, cancellable, error);
+  if (!status)
+    return glnx_prefix_error (error, "Script runner didn't complete");
+  g_strchomp (status);
+  if (g_str_equal (status, "ok"))
+    return TRUE;
+
+  const char *rc = strrchr (status, ' ');
+  if (!rc)
+    return glnx_throw (error, "Invalid script runner status '%s'", status);
+  g_autofree char *failed = g_strndup (status, rc - status);
+  for (guint i = 0; i < batch->scripts->len; i++)
+    {
+      QueuedScript *qs = batch->scripts->pdata[i];
+      const char *pkg_script = glnx_strjoina (qs->pkgname, ".", qs->desc+1);
+      if (g_str_equal (pkg_script, failed))
+        return glnx_throw (error, "Running %s for %s: Child process exited with code %s",
+                           qs->desc, qs->pkgname, rc + 1);
+    }
+  return glnx_throw (error, "Running %s: Child process exited with code %s", failed, rc + 1);
+}
+
+/* Run all of @batch's scripts, in the order they were queued, in a single
+ * bwrap container. */
+gboolean
+rpmostree_script_batch_run (RpmOstreeScriptBatch *batch,
+                            int                   rootfs_fd,
+                            GCancellable         *cancellable,
+                            GError              **error)
 {
   gboolean ret = FALSE;
-  const char *pkg_script = glnx_strjoina (name, ".", scriptdesc+1);
-  const char *postscript_name = glnx_strjoina ("/", pkg_script);
-  const char *postscript_path_container = glnx_strjoina ("/usr", postscript_name);
-  const char *postscript_path_host = postscript_path_container + 1;
   g_autoptr(RpmOstreeBwrap) bwrap = NULL;
   gboolean created_var_tmp = FALSE;
+  g_autofree char *scripts_dir = NULL;
+  glnx_fd_close int scripts_dfd = -1;
+
+  if (batch->scripts->len == 0)
+    return TRUE;
 
-  /* TODO - Create a pipe and send this to bwrap so it's inside the
-   * tmpfs.  Note the +1 on the path to skip the leading /.
+  /* TODO - Create a pipe and send these to bwrap so they're inside the
+   * tmpfs.
    */
-  if (!glnx_file_replace_contents_at (rootfs_fd, postscript_path_host,
-                                      (guint8*)script, -1,
-                                      GLNX_FILE_REPLACE_NODATASYNC,
-                                      NULL, error))
+  scripts_dir = g_strdup ("usr/.rpmostree-scripts.XXXXXX");
+  if (!glnx_mkdtempat (rootfs_fd, scripts_dir, 0755, error))
+    goto out;
+  if (!glnx_opendirat (rootfs_fd, scripts_dir, TRUE, &scripts_dfd, error))
+    goto out;
+
+  for (guint i = 0; i < batch->scripts->len; i++)
     {
-      g_prefix_error (error, "Writing script to %s: ", postscript_path_host);
-      goto out;
+      QueuedScript *qs = batch->scripts->pdata[i];
+      const char *pkg_script = glnx_strjoina (qs->pkgname, ".", qs->desc+1);
+
+      if (!glnx_file_replace_contents_with_perms_at (scripts_dfd, pkg_script,
+                                                     (guint8*)qs->script, -1,
+                                                     0755, (uid_t) -1, (gid_t) -1,
+                                                     GLNX_FILE_REPLACE_NODATASYNC,
+                                                     cancellable, error))
+        {
+          g_prefix_error (error, "Writing script to %s/%s: ", scripts_dir, pkg_script);
+          goto out;
+        }
     }
-  if (fchmodat (rootfs_fd, postscript_path_host, 0755, 0) != 0)
-    {
-      glnx_set_error_from_errno (error);
+
+  { g_autofree char *runner = generate_script_runner (batch);
+    if (!glnx_file_replace_contents_with_perms_at (scripts_dfd, "runner",
+                                                   (guint8*)runner, -1,
+                                                   0755, (uid_t) -1, (gid_t) -1,
+                                                   GLNX_FILE_REPLACE_NODATASYNC,
+                                                   cancellable, error))
       goto out;
-    }
+  }
 
   /* We need to make the mount point in the case where we're doing
    * package layering, since the host `/var` tree is empty.  We
@@ -209,30 +322,34 @@ run_script_in_bwrap_container (int rootfs_fd,
   if (!bwrap)
     goto out;
 
-  rpmostree_bwrap_append_child_argv (bwrap,
-                                     postscript_path_container,
-                                     /* http://www.rpm.org/max-rpm/s1-rpm-inside-scripts.html#S3-RPM-INSIDE-PRE-SCRIPT */
-                                     "1",
-                                     NULL);
+  { const char *scripts_dir_container = glnx_strjoina ("/", scripts_dir);
+    const char *runner_container = glnx_strjoina (scripts_dir_container, "/runner");
+    rpmostree_bwrap_append_child_argv (bwrap, "/bin/sh", runner_container,
+                                       scripts_dir_container, NULL);
+  }
 
   if (!rpmostree_bwrap_run (bwrap, error))
     goto out;
 
+  if (!check_script_runner_status (batch, scripts_dfd, cancellable, error))
+    goto out;
+
   ret = TRUE;
  out:
   if (created_var_tmp)
     (void) unlinkat (rootfs_fd, "var/tmp", AT_REMOVEDIR);
+  if (scripts_dir)
+    (void) glnx_shutil_rm_rf_at (rootfs_fd, scripts_dir, NULL, NULL);
   return ret;
 }
 
 static gboolean
-run_known_rpm_script (const KnownRpmScriptKind *rpmscript,
-                      DnfPackage    *pkg,
-                      Header         hdr,
-                      GHashTable    *ignore_scripts,
-                      int            rootfs_fd,
-                      GCancellable  *cancellable,
-                      GError       **error)
+queue_known_rpm_script (RpmOstreeScriptBatch     *batch,
+                        const KnownRpmScriptKind *rpmscript,
+                        DnfPackage    *pkg,
+                        Header         hdr,
+                        GHashTable    *ignore_scripts,
+                        GError       **error)
 {
   const char *desc = rpmscript->desc;
   rpmTagVal tagval = rpmscript->tag;
@@ -265,12 +382,11 @@ run_known_rpm_script (const KnownRpmScriptKind *rpmscript,
                          dnf_package_get_name (pkg), lua, desc);
             return FALSE;
           }
-        if (!run_script_in_bwrap_container (rootfs_fd, dnf_package_get_name (pkg), desc, script,
-                                            cancellable, error))
-          {
-            g_prefix_error (error, "Running %s for %s: ", desc, dnf_package_get_name (pkg));
-            return FALSE;
-          }
+        QueuedScript *qs = g_new0 (QueuedScript, 1);
+        qs->pkgname = g_strdup (dnf_package_get_name (pkg));
+        qs->desc = desc;
+        qs->script = g_strdup (script);
+        g_ptr_array_add (batch->scripts, qs);
         break;
       }
     case RPMOSTREE_SCRIPT_ACTION_IGNORE:
@@ -280,42 +396,69 @@ run_known_rpm_script (const KnownRpmScriptKind *rpmscript,
   return TRUE;
 }
 
+/* Queue @pkg's %post and %posttrans scripts onto @batch */
 gboolean
-rpmostree_posttrans_run_sync (DnfPackage    *pkg,
-                              Header         hdr,
-                              GHashTable    *ignore_scripts,
-                              int            rootfs_fd,
-                              GCancellable  *cancellable,
-                              GError       **error)
+rpmostree_posttrans_queue (RpmOstreeScriptBatch *batch,
+                           DnfPackage    *pkg,
+                           Header         hdr,
+                           GHashTable    *ignore_scripts,
+                           GError       **error)
 {
   for (guint i = 0; i < G_N_ELEMENTS (posttrans_scripts); i++)
     {
-      if (!run_known_rpm_script (&posttrans_scripts[i], pkg, hdr, ignore_scripts,
-                                 rootfs_fd, cancellable, error))
+      if (!queue_known_rpm_script (batch, &posttrans_scripts[i], pkg, hdr,
+                                   ignore_scripts, error))
         return FALSE;
     }
 
   return TRUE;
 }
 
+/* Queue @pkg's %pre script onto @batch */
 gboolean
-rpmostree_pre_run_sync (DnfPackage    *pkg,
-                        Header         hdr,
-                        GHashTable    *ignore_scripts,
-                        int            rootfs_fd,
-                        GCancellable  *cancellable,
-                        GError       **error)
+rpmostree_pre_queue (RpmOstreeScriptBatch *batch,
+                     DnfPackage    *pkg,
+                     Header         hdr,
+                     GHashTable    *ignore_scripts,
+                     GError       **error)
 {
   for (guint i = 0; i < G_N_ELEMENTS (pre_scripts); i++)
     {
-      if (!run_known_rpm_script (&pre_scripts[i], pkg, hdr, ignore_scripts,
-                                 rootfs_fd, cancellable, error))
+      if (!queue_known_rpm_script (batch, &pre_scripts[i], pkg, hdr,
+                                   ignore_scripts, error))
         return FALSE;
     }
 
   return TRUE;
 }
 
+/* Returns %TRUE if installing @pkg would run any %pre or %post/%posttrans
+ * scriptlet, i.e. one which exists and isn't ignored.
+ */
+gboolean
+rpmostree_script_pkg_has_scripts (DnfPackage    *pkg,
+                                  Header         hdr,
+                                  GHashTable    *ignore_scripts)
+{
+  const KnownRpmScriptKind *kinds[] = { &pre_scripts[0],
+                                        &posttrans_scripts[0],
+                                        &posttrans_scripts[1] };
+  G_STATIC_ASSERT (G_N_ELEMENTS (pre_scripts) + G_N_ELEMENTS (posttrans_scripts) ==
+                   G_N_ELEMENTS (kinds));
+
+  for (guint i = 0; i < G_N_ELEMENTS (kinds); i++)
+    {
+      if (!headerGetString (hdr, kinds[i]->tag))
+        continue;
+      if (lookup_script_action (pkg, ignore_scripts, kinds[i]->desc) ==
+          RPMOSTREE_SCRIPT_ACTION_IGNORE)
+        continue;
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
 gboolean
 rpmostree_script_ignore_hash_from_strv (const char *const *strv,
                                         GHashTable **out_hash,
@@ -57,17 +57,31 @@ rpmostree_script_txn_validate (DnfPackage    *package,
                                GError       **error);
 
 gboolean
-rpmostree_posttrans_run_sync (DnfPackage    *pkg,
-                              Header         hdr,
-                              GHashTable    *ignore_scripts,
-                              int            rootfs_fd,
-                              GCancellable  *cancellable,
-                              GError       **error);
+rpmostree_script_pkg_has_scripts (DnfPackage    *pkg,
+                                  Header         hdr,
+                                  GHashTable    *ignore_scripts);
+
+typedef struct RpmOstreeScriptBatch RpmOstreeScriptBatch;
+RpmOstreeScriptBatch *rpmostree_script_batch_new (void);
+void rpmostree_script_batch_free (RpmOstreeScriptBatch *batch);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RpmOstreeScriptBatch, rpmostree_script_batch_free)
+
+gboolean
+rpmostree_posttrans_queue (RpmOstreeScriptBatch *batch,
+                           DnfPackage    *pkg,
+                           Header         hdr,
+                           GHashTable    *ignore_scripts,
+                           GError       **error);
+
+gboolean
+rpmostree_pre_queue (RpmOstreeScriptBatch *batch,
+                     DnfPackage    *pkg,
+                     Header         hdr,
+                     GHashTable    *ignore_scripts,
+                     GError       **error);
 
 gboolean
-rpmostree_pre_run_sync (DnfPackage    *pkg,
-                        Header         hdr,
-                        GHashTable    *ignore_scripts,
-                        int            rootfs_fd,
-                        GCancellable  *cancellable,
-                        GError       **error);
+rpmostree_script_batch_run (RpmOstreeScriptBatch *batch,
+                            int                   rootfs_fd,
+                            GCancellable         *cancellable,
+                            GError              **error);
@@ -20,11 +20,11 @@
  */
 
 /**
- * Implements unpacking an RPM.  The design here is to reuse
- * libarchive's RPM support for most of it.  We do however need to
- * look at file capabilities, which are part of the header.
- *
- * Hence we end up with two file descriptors open.
+ * Implements unpacking an RPM.  The lead, signature and header are read
+ * once into memory, where we checksum them, parse the header (we need
+ * e.g. file capabilities from it), and keep them to store in the
+ * commit.  libarchive is then handed just the payload, starting at
+ * the end of the header.
  */
 
 #include "config.h"
@@ -46,6 +46,15 @@
 #include <string.h>
 #include <stdlib.h>
 
+#define RPM_LEAD_SIZE 96
+/* Enough for the lead, signature and header of most RPMs, so that we can
+ * usually read them all with a single pread() */
+#define RPM_METADATA_READAHEAD (64 * 1024)
+#define RPM_PAYLOAD_BUFSIZE (64 * 1024)
+
+static const guint8 rpm_lead_magic[] = { 0xed, 0xab, 0xee, 0xdb };
+static const guint8 rpm_header_magic[] = { 0x8e, 0xad, 0xe8, 0x01 };
+
 typedef GObjectClass RpmOstreeUnpackerClass;
 
 struct RpmOstreeUnpacker
@@ -61,8 +70,16 @@ struct RpmOstreeUnpacker
   GString *tmpfiles_d;
   RpmOstreeUnpackerFlags flags;
   DnfPackage *pkg;
+  GBytes *hdr_bytes; /* Lead, signature and header; see read_rpm_metadata() */
   char *hdr_sha256;
 
+  /* The payload stream; see payload_read_cb() */
+  GBytes *payload_head; /* Payload bytes we got along with the header */
+  gboolean payload_head_pending;
+  off_t payload_offset;
+  guint8 *payload_buf;
+  guint64 bytes_read;
+
   char *ostree_branch;
 };
 
@@ -93,7 +110,10 @@ rpmostree_unpacker_finalize (GObject *object)
 
   g_hash_table_unref (self->rpmfi_overrides);
 
+  g_clear_pointer (&self->hdr_bytes, g_bytes_unref);
   g_free (self->hdr_sha256);
+  g_clear_pointer (&self->payload_head, g_bytes_unref);
+  g_free (self->payload_buf);
 
   G_OBJECT_CLASS (rpmostree_unpacker_parent_class)->finalize (object);
 }
@@ -116,17 +136,256 @@ rpmostree_unpacker_init (RpmOstreeUnpacker *self)
 
 typedef int(*archive_setup_func)(struct archive *);
 
-/**
- * rpmostree_rpm2cpio:
- * @fd: An open file descriptor for an RPM package
- * @error: GError
- *
- * Parse CPIO content of @fd via libarchive.  Note that the CPIO data
+/* Make sure the first @want bytes of the file are in *@buf, growing it and
+ * reading more if needed. */
+static gboolean
+ensure_read (RpmOstreeUnpacker *self,
+             guint8           **buf,
+             gsize             *buf_len,
+             gsize              want,
+             GError           **error)
+{
+  if (want <= *buf_len)
+    return TRUE;
+
+  *buf = g_realloc (*buf, want);
+  while (*buf_len < want)
+    {
+      ssize_t n = TEMP_FAILURE_RETRY (pread (self->fd, *buf + *buf_len,
+                                             want - *buf_len, *buf_len));
+      if (n < 0)
+        return glnx_throw_errno_prefix (error, "pread");
+      if (n == 0)
+        return glnx_throw (error, "Truncated RPM: expected at least %" G_GSIZE_FORMAT " bytes",
+                           want);
+      *buf_len += n;
+      self->bytes_read += n;
+    }
+
+  return TRUE;
+}
+
+/* Returns the size of the header structure (signature or main header) at
+ * @offset, not including any padding. */
+static gboolean
+get_header_size (const guint8 *buf,
+                 gsize         offset,
+                 gsize        *out_size,
+                 GError      **error)
+{
+  guint32 il, dl;
+
+  if (memcmp (buf + offset, rpm_header_magic, sizeof (rpm_header_magic)) != 0)
+    return glnx_throw (error, "Bad header magic at offset %" G_GSIZE_FORMAT, offset);
+
+  memcpy (&il, buf + offset + 8, sizeof (il));
+  memcpy (&dl, buf + offset + 12, sizeof (dl));
+  il = GUINT32_FROM_BE (il);
+  dl = GUINT32_FROM_BE (dl);
+
+  /* Same limits as librpm */
+  if (il > 0xffff || dl > 0x0fffffff)
+    return glnx_throw (error, "Header at offset %" G_GSIZE_FORMAT " too large", offset);
+
+  *out_size = 16 + (gsize)il * 16 + dl;
+  return TRUE;
+}
+
+/* Check the digest of the main header recorded in the signature header, as
+ * librpm does when reading the package: SHA256 if there is one, otherwise
+ * SHA1. Like librpm, a package with neither is accepted; only a mismatch is an
+ * error. */
+static gboolean
+verify_header_digest (Header        sigh,
+                      const guint8 *buf,
+                      gsize         hdr_offset,
+                      gsize         hdr_size,
+                      GError      **error)
+{
+  GChecksumType type = G_CHECKSUM_SHA1;
+  const char *name = "SHA1";
+  const char *expected = NULL;
+#if BUILDOPT_HAVE_RPMSIGTAG_SHA256
+  expected = headerGetString (sigh, RPMSIGTAG_SHA256);
+  if (expected != NULL)
+    {
+      type = G_CHECKSUM_SHA256;
+      name = "SHA256";
+    }
+#endif
+  if (expected == NULL)
+    expected = headerGetString (sigh, RPMSIGTAG_SHA1);
+  if (expected == NULL)
+    return TRUE;
+
+  g_autoptr(GChecksum) checksum = g_checksum_new (type);
+  g_checksum_update (checksum, buf + hdr_offset, hdr_size);
+  if (!g_str_equal (expected, g_checksum_get_string (checksum)))
+    return glnx_throw (error, "Header %s digest mismatch", name);
+
+  return TRUE;
+}
+
+/* What librpm's (private) headerMergeLegacySigs() copies from the signature
+ * header into the main header when reading a package. */
+static const struct {
+  rpmTagVal sigtag;
+  rpmTagVal tag;
+} legacy_sig_tags[] = {
+  { RPMSIGTAG_SIZE, RPMTAG_SIGSIZE },
+  { RPMSIGTAG_PGP, RPMTAG_SIGPGP },
+  { RPMSIGTAG_MD5, RPMTAG_SIGMD5 },
+  { RPMSIGTAG_GPG, RPMTAG_SIGGPG },
+  { RPMSIGTAG_PAYLOADSIZE, RPMTAG_ARCHIVESIZE },
+  { RPMSIGTAG_DSA, RPMTAG_DSAHEADER },
+  { RPMSIGTAG_RSA, RPMTAG_RSAHEADER },
+  { RPMSIGTAG_SHA1, RPMTAG_SHA1HEADER },
+#if BUILDOPT_HAVE_RPMSIGTAG_SHA256
+  { RPMSIGTAG_SHA256, RPMTAG_SHA256HEADER },
+#endif
+  { RPMSIGTAG_LONGSIZE, RPMTAG_LONGSIGSIZE },
+  { RPMSIGTAG_LONGARCHIVESIZE, RPMTAG_LONGARCHIVESIZE },
+};
+
+/* Nothing in rpm-ostree reads these from the header today, but keep our
+ * Header the same as the one rpmReadPackageFile() would have returned. */
+static void
+merge_legacy_sigs (Header hdr,
+                   Header sigh)
+{
+  for (guint i = 0; i < G_N_ELEMENTS (legacy_sig_tags); i++)
+    {
+      struct rpmtd_s td;
+
+      if (headerIsEntry (hdr, legacy_sig_tags[i].tag))
+        continue;
+      if (!headerGet (sigh, legacy_sig_tags[i].sigtag, &td, HEADERGET_MINMEM))
+        continue;
+      td.tag = legacy_sig_tags[i].tag;
+      (void) headerPut (hdr, &td, HEADERPUT_DEFAULT);
+      rpmtdFreeData (&td);
+    }
+}
+
+/* Read the lead, signature and header in one go (usually a single pread()),
+ * checksum them, and parse the header from memory. Anything we read past the
+ * header is kept as the start of the payload. */
+static gboolean
+read_rpm_metadata (RpmOstreeUnpacker *self,
+                   GError           **error)
+{
+  g_autofree guint8 *buf = g_malloc (RPM_METADATA_READAHEAD);
+  gsize buf_len = 0;
+  gsize sig_size, hdr_size;
+
+  /* Read ahead, but don't fail on small files; ensure_read() will */
+  { ssize_t n = TEMP_FAILURE_RETRY (pread (self->fd, buf, RPM_METADATA_READAHEAD, 0));
+    if (n < 0)
+      return glnx_throw_errno_prefix (error, "pread");
+    buf_len = n;
+    self->bytes_read += n;
+  }
+
+  if (!ensure_read (self, &buf, &buf_len, RPM_LEAD_SIZE + 16, error))
+    return FALSE;
+  if (memcmp (buf, rpm_lead_magic, sizeof (rpm_lead_magic)) != 0)
+    return glnx_throw (error, "Not an RPM (bad lead magic)");
+
+  const gsize sig_offset = RPM_LEAD_SIZE;
+  if (!get_header_size (buf, sig_offset, &sig_size, error))
+    return glnx_prefix_error (error, "Reading signature");
+  /* The signature header is padded to a multiple of 8 bytes */
+  const gsize hdr_offset = sig_offset + sig_size + ((8 - (sig_size % 8)) % 8);
+
+  if (!ensure_read (self, &buf, &buf_len, hdr_offset + 16, error))
+    return FALSE;
+  if (!get_header_size (buf, hdr_offset, &hdr_size, error))
+    return glnx_prefix_error (error, "Reading header");
+
+  const gsize cpio_offset = hdr_offset + hdr_size;
+  if (!ensure_read (self, &buf, &buf_len, cpio_offset, error))
+    return FALSE;
+
+  g_auto(Header) sigh = headerImport ((void*)(buf + sig_offset + 8), sig_size - 8,
+                                      HEADERIMPORT_COPY);
+  if (sigh == NULL)
+    return glnx_throw (error, "Failed to parse signature header");
+  if (!verify_header_digest (sigh, buf, hdr_offset, hdr_size, error))
+    return FALSE;
+
+  g_auto(Header) hdr = headerImport (buf + hdr_offset + 8, hdr_size - 8,
+                                     HEADERIMPORT_COPY);
+  if (hdr == NULL)
+    return glnx_throw (error, "Failed to parse header");
+  merge_legacy_sigs (hdr, sigh);
+  /* Like librpm does for old packages; the lead's major version */
+  if (buf[4] < 4)
+    (void) headerConvert (hdr, HEADERCONV_RETROFIT_V3);
+
+  g_autoptr(GChecksum) pkg_checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_checksum_update (pkg_checksum, buf, cpio_offset);
+  self->hdr_sha256 = g_strdup (g_checksum_get_string (pkg_checksum));
+
+  if (buf_len > cpio_offset)
+    {
+      self->payload_head = g_bytes_new (buf + cpio_offset, buf_len - cpio_offset);
+      self->payload_head_pending = TRUE;
+    }
+  self->payload_offset = buf_len;
+
+  self->hdr = g_steal_pointer (&hdr);
+  self->cpio_offset = cpio_offset;
+  self->hdr_bytes = g_bytes_new_take (g_realloc (g_steal_pointer (&buf), cpio_offset),
+                                      cpio_offset);
+  return TRUE;
+}
+
+/* libarchive read callback for the payload: first whatever we read along with
+ * the header, then the rest of the file. We pread() so that we don't depend on
+ * (or change) the file offset. */
+static ssize_t
+payload_read_cb (struct archive *a,
+                 void           *user_data,
+                 const void    **out_buf)
+{
+  RpmOstreeUnpacker *self = user_data;
+
+  if (self->payload_head_pending)
+    {
+      gsize len;
+      self->payload_head_pending = FALSE;
+      *out_buf = g_bytes_get_data (self->payload_head, &len);
+      return len;
+    }
+  /* libarchive is done with the previous buffer now */
+  g_clear_pointer (&self->payload_head, g_bytes_unref);
+
+  if (self->payload_buf == NULL)
+    self->payload_buf = g_malloc (RPM_PAYLOAD_BUFSIZE);
+
+  ssize_t n = TEMP_FAILURE_RETRY (pread (self->fd, self->payload_buf,
+                                         RPM_PAYLOAD_BUFSIZE, self->payload_offset));
+  if (n < 0)
+    {
+      const int errsv = errno;
+      archive_set_error (a, errsv, "pread: %s", g_strerror (errsv));
+      return -1;
+    }
+
+  self->payload_offset += n;
+  self->bytes_read += n;
+  *out_buf = self->payload_buf;
+  return n;
+}
+
+/*
+ * Parse the CPIO payload via libarchive.  Note that the CPIO data
  * does not capture all relevant filesystem content; for example,
  * filesystem capabilities are part of a separate header, etc.
  */
 static struct archive *
-rpm2cpio (int fd, GError **error)
+open_payload (RpmOstreeUnpacker *self,
+              GError           **error)
 {
   gboolean success = FALSE;
   struct archive *ret = NULL;
@@ -135,10 +394,9 @@ rpm2cpio (int fd, GError **error)
   ret = archive_read_new ();
   g_assert (ret);
 
-  /* We only do the subset necessary for RPM */
+  /* We only do the subset necessary for RPM payloads */
   { archive_setup_func archive_setup_funcs[] =
-      { archive_read_support_filter_rpm,
-        archive_read_support_filter_lzma,
+      { archive_read_support_filter_lzma,
         archive_read_support_filter_gzip,
         archive_read_support_filter_xz,
         archive_read_support_filter_bzip2,
@@ -154,7 +412,7 @@ rpm2cpio (int fd, GError **error)
       }
   }
 
-  if (archive_read_open_fd (ret, fd, 10240) != ARCHIVE_OK)
+  if (archive_read_open (ret, self, NULL, payload_read_cb, NULL) != ARCHIVE_OK)
     {
       propagate_libarchive_error (error, ret);
       goto out;
@@ -187,7 +445,9 @@ rpmostree_unpacker_read_metainfo (int fd,
   g_auto(rpmfi) ret_fi = NULL;
   gsize ret_cpio_offset;
   g_autofree char *abspath = g_strdup_printf ("/proc/self/fd/%d", fd);
+  g_auto(RpmOstreeLibrpmLocker) rpmlock = { 0, };
 
+  rpmostree_librpm_lock (&rpmlock);
   DECLARE_RPMSIGHANDLER_RESET;
   ts = rpmtsCreate ();
   rpmtsSetVSFlags (ts, _RPMVSF_NOSIGNATURES);
@@ -286,36 +546,35 @@ rpmostree_unpacker_new_fd (int fd,
                            RpmOstreeUnpackerFlags flags,
                            GError **error)
 {
-  RpmOstreeUnpacker *ret = NULL;
-  g_auto(Header) hdr = NULL;
-  rpmfi fi = NULL;
-  struct archive *archive;
-  gsize cpio_offset;
-
-  archive = rpm2cpio (fd, error);
-  if (archive == NULL)
-    goto out;
-
-  if (!rpmostree_unpacker_read_metainfo (fd, &hdr, &cpio_offset, &fi, error))
-    goto out;
-
-  ret = g_object_new (RPMOSTREE_TYPE_UNPACKER, NULL);
+  g_autoptr(RpmOstreeUnpacker) ret = g_object_new (RPMOSTREE_TYPE_UNPACKER, NULL);
   ret->fd = fd;
-  ret->fi = g_steal_pointer (&fi);
-  ret->archive = g_steal_pointer (&archive);
   ret->flags = flags;
-  ret->hdr = g_steal_pointer (&hdr);
-  ret->cpio_offset = cpio_offset;
   ret->pkg = pkg ? g_object_ref (pkg) : NULL;
 
-  build_rpmfi_overrides (ret);
+  /* Unpackers are created from several threads at once (see `ex unpack`), so
+   * serialize the parts that go through librpm's shared state (tag tables,
+   * string pools, digest setup). Once built, the header and rpmfi belong to
+   * this unpacker alone.
+   */
+  {
+    g_auto(RpmOstreeLibrpmLocker) rpmlock = { 0, };
+    rpmostree_librpm_lock (&rpmlock);
 
- out:
-  if (archive)
-    archive_read_free (archive);
-  if (fi)
-    rpmfiFree (fi);
-  return ret;
+    if (!read_rpm_metadata (ret, error))
+      return NULL;
+
+    ret->fi = rpmfiNew (NULL, ret->hdr, RPMTAG_BASENAMES,
+                        (RPMFI_NOHEADER | RPMFI_FLAGS_INSTALL));
+    ret->fi = rpmfiInit (ret->fi, 0);
+
+    build_rpmfi_overrides (ret);
+  }
+
+  ret->archive = open_payload (ret, error);
+  if (ret->archive == NULL)
+    return NULL;
+
+  return g_steal_pointer (&ret);
 }
 
 /*
@@ -391,53 +650,6 @@ rpmostree_unpacker_get_ostree_branch (RpmOstreeUnpacker *self)
   return self->ostree_branch;
 }
 
-static gboolean
-get_lead_sig_header_as_bytes (RpmOstreeUnpacker *self,
-                              GBytes  **out_metadata,
-                              GCancellable *cancellable,
-                              GError  **error)
-{
-  gboolean ret = FALSE;
-  g_autofree char *buf = NULL;
-  char *bufp;
-  size_t bytes_remaining;
-
-  /* Inline a pread() based reader here to avoid affecting the file
-   * offset since both librpm and libarchive have references.
-   */
-  buf = g_malloc (self->cpio_offset);
-  bufp = buf;
-  bytes_remaining = self->cpio_offset;
-  while (bytes_remaining > 0)
-    {
-      ssize_t bytes_read;
-      do
-        bytes_read = pread (self->fd, bufp, bytes_remaining, bufp - buf);
-      while (bytes_read < 0 && errno == EINTR);
-      if (bytes_read < 0)
-        {
-          glnx_set_error_from_errno (error);
-          goto out;
-        }
-      if (bytes_read == 0)
-        break;
-      bufp += bytes_read;
-      bytes_remaining -= bytes_read;
-    }
-  if (bytes_remaining > 0)
-    {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                   "Failed to read %" G_GSIZE_FORMAT " bytes of metadata",
-                   bytes_remaining);
-      goto out;
-    }
-
-  ret = TRUE;
-  *out_metadata = g_bytes_new_take (g_steal_pointer (&buf), self->cpio_offset);
- out:
-  return ret;
-}
-
 static GVariant *
 repo_metadata_to_variant (DnfRepo *repo)
 {
@@ -453,6 +665,38 @@ repo_metadata_to_variant (DnfRepo *repo)
   return g_variant_builder_end (&builder);
 }
 
+/* Everything assembly needs to apply ownership overrides for this package
+ * (see apply_rpmfi_overrides() in rpmostree-core.c) without reading the
+ * header again: the files not owned by root:root, as
+ * a(path, user, group, fcaps, mode, fileflags).
+ */
+static GVariant *
+build_rpmfi_override_manifest (RpmOstreeUnpacker *self)
+{
+  g_auto(GVariantBuilder) builder;
+  g_variant_builder_init (&builder, (GVariantType*)"a(ssssuu)");
+
+  rpmfiInit (self->fi, 0);
+  while (rpmfiNext (self->fi) >= 0)
+    {
+      const char *user = rpmfiFUser (self->fi) ?: "root";
+      const char *group = rpmfiFGroup (self->fi) ?: "root";
+      const char *fcaps = rpmfiFCaps (self->fi) ?: "";
+      const char *fn = rpmfiFN (self->fi);
+      rpm_mode_t mode = rpmfiFMode (self->fi);
+
+      if (g_str_equal (user, "root") && g_str_equal (group, "root"))
+        continue;
+      if (!(S_ISREG (mode) || S_ISLNK (mode) || S_ISDIR (mode)))
+        continue;
+
+      g_variant_builder_add (&builder, "(ssssuu)", fn, user, group, fcaps,
+                             (guint32) mode, (guint32) rpmfiFFlags (self->fi));
+    }
+
+  return g_variant_builder_end (&builder);
+}
+
 static gboolean
 build_metadata_variant (RpmOstreeUnpacker *self,
                         OstreeSePolicy    *sepolicy,
@@ -460,7 +704,6 @@ build_metadata_variant (RpmOstreeUnpacker *self,
                         GCancellable      *cancellable,
                         GError           **error)
 {
-  g_autoptr(GChecksum) pkg_checksum = g_checksum_new (G_CHECKSUM_SHA256);
   g_auto(GVariantBuilder) metadata_builder;
   g_variant_builder_init (&metadata_builder, (GVariantType*)"a{sv}");
 
@@ -472,19 +715,9 @@ build_metadata_variant (RpmOstreeUnpacker *self,
    *      rpmostree_context_prepare())
    */
   {
-    g_autoptr(GBytes) metadata = NULL;
-
-    if (!get_lead_sig_header_as_bytes (self, &metadata, cancellable, error))
-      return FALSE;
-
     g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.metadata",
                            g_variant_new_from_bytes ((GVariantType*)"ay",
-                                                     metadata, TRUE));
-
-    g_checksum_update (pkg_checksum, g_bytes_get_data (metadata, NULL),
-                                     g_bytes_get_size (metadata));
-
-    self->hdr_sha256 = g_strdup (g_checksum_get_string (pkg_checksum));
+                                                     self->hdr_bytes, TRUE));
 
     g_variant_builder_add (&metadata_builder, "{sv}",
                            "rpmostree.metadata_sha256",
@@ -499,15 +732,18 @@ build_metadata_variant (RpmOstreeUnpacker *self,
                            g_variant_new_string
                              (ostree_sepolicy_get_csum (sepolicy)));
 
+  g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.rpmfi_overrides",
+                         build_rpmfi_override_manifest (self));
+
   /* let's be nice to our future selves just in case */
   g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.unpack_version",
                          g_variant_new_uint32 (1));
 
   /* Originally we just had unpack_version = 1, let's add a minor version for
-   * compatible increments.
+   * compatible increments.  4 added rpmostree.rpmfi_overrides.
    */
   g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.unpack_minor_version",
-                         g_variant_new_uint32 (3));
+                         g_variant_new_uint32 (4));
 
   if (self->pkg)
     {
@@ -814,6 +1050,25 @@ out:
   return ret;
 }
 
+/*
+ * rpmostree_unpacker_write_commit:
+ *
+ * Like rpmostree_unpacker_unpack_to_ostree(), but writes the commit as part of
+ * a transaction on @repo that the caller already prepared, and doesn't set the
+ * branch ref. Multiple unpackers may do this from different threads in the
+ * same transaction.
+ */
+gboolean
+rpmostree_unpacker_write_commit (RpmOstreeUnpacker *self,
+                                 OstreeRepo        *repo,
+                                 OstreeSePolicy    *sepolicy,
+                                 char             **out_csum,
+                                 GCancellable      *cancellable,
+                                 GError           **error)
+{
+  return import_rpm_to_repo (self, repo, sepolicy, out_csum, cancellable, error);
+}
+
 gboolean
 rpmostree_unpacker_unpack_to_ostree (RpmOstreeUnpacker *self,
                                      OstreeRepo        *repo,
@@ -829,7 +1084,8 @@ rpmostree_unpacker_unpack_to_ostree (RpmOstreeUnpacker *self,
   if (!ostree_repo_prepare_transaction (repo, NULL, cancellable, error))
     goto out;
 
-  if (!import_rpm_to_repo (self, repo, sepolicy, &csum, cancellable, error))
+  if (!rpmostree_unpacker_write_commit (self, repo, sepolicy, &csum,
+                                        cancellable, error))
     goto out;
 
   branch = rpmostree_unpacker_get_ostree_branch (self);
@@ -863,3 +1119,15 @@ rpmostree_unpacker_get_header_sha256 (RpmOstreeUnpacker *self)
 {
   return self->hdr_sha256;
 }
+
+/*
+ * rpmostree_unpacker_get_bytes_read:
+ *
+ * How much of the RPM was read from disk so far; after unpacking, this
+ * should be just the size of the file.
+ */
+guint64
+rpmostree_unpacker_get_bytes_read (RpmOstreeUnpacker *self)
+{
+  return self->bytes_read;
+}
@@ -77,8 +77,19 @@ rpmostree_unpacker_unpack_to_ostree (RpmOstreeUnpacker *unpacker,
                                      GCancellable      *cancellable,
                                      GError           **error);
 
+gboolean
+rpmostree_unpacker_write_commit (RpmOstreeUnpacker *unpacker,
+                                 OstreeRepo        *repo,
+                                 OstreeSePolicy    *sepolicy,
+                                 char             **out_commit,
+                                 GCancellable      *cancellable,
+                                 GError           **error);
+
 char *
 rpmostree_unpacker_get_nevra (RpmOstreeUnpacker *self);
 
 const char *
 rpmostree_unpacker_get_header_sha256 (RpmOstreeUnpacker *self);
+
+guint64
+rpmostree_unpacker_get_bytes_read (RpmOstreeUnpacker *self);
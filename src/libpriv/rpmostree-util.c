@@ -22,6 +22,9 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <libgen.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <glib-unix.h>
 #include <json-glib/json-glib.h>
 #include <gio/gunixoutputstream.h>
@@ -293,12 +296,14 @@ rpmostree_str_replace (const char  *buf,
   return g_regex_replace_literal (regex, buf, -1, 0, new, 0, error);
 }
 
+/* Gather the checksums of all content objects reachable from @iter into
+ * @out_checksums (a set). */
 static gboolean
-pull_content_only_recurse (OstreeRepo  *dest,
-                           OstreeRepo  *src,
-                           OstreeRepoCommitTraverseIter *iter,
-                           GCancellable *cancellable,
-                           GError      **error)
+collect_content_objects_recurse (OstreeRepo  *src,
+                                 OstreeRepoCommitTraverseIter *iter,
+                                 GHashTable  *out_checksums,
+                                 GCancellable *cancellable,
+                                 GError      **error)
 {
   gboolean done = FALSE;
 
@@ -320,10 +325,7 @@ pull_content_only_recurse (OstreeRepo  *dest,
             char *checksum;
 
             ostree_repo_commit_traverse_iter_get_file (iter, &name, &checksum);
-
-            if (!ostree_repo_import_object_from (dest, src, OSTREE_OBJECT_TYPE_FILE,
-                                                 checksum, cancellable, error))
-              return FALSE;
+            g_hash_table_add (out_checksums, g_strdup (checksum));
           }
           break;
         case OSTREE_REPO_COMMIT_ITER_RESULT_DIR:
@@ -347,7 +349,8 @@ pull_content_only_recurse (OstreeRepo  *dest,
                                                                 error))
               return FALSE;
 
-            if (!pull_content_only_recurse (dest, src, &subiter, cancellable, error))
+            if (!collect_content_objects_recurse (src, &subiter, out_checksums,
+                                                  cancellable, error))
               return FALSE;
           }
           break;
@@ -357,31 +360,422 @@ pull_content_only_recurse (OstreeRepo  *dest,
   return TRUE;
 }
 
-/* Migrate only the content (.file) objects from src+src_commit into dest.
- * Used for package layering.
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+/**
+ * rpmostree_copy_regfile_data:
+ * @src_fd: Source regular file, positioned at the start
+ * @dest_fd: Empty destination file
+ * @size: Size of @src_fd
+ * @out_method: (out): How the data was copied
+ * @error: Error
+ *
+ * Copy the contents of @src_fd to @dest_fd, trying a reflink first, then an
+ * in-kernel copy_file_range(), and finally a copy through userspace.  Only
+ * the data is copied; ownership, mode and xattrs are up to the caller.
  */
 gboolean
-rpmostree_pull_content_only (OstreeRepo  *dest,
-                             OstreeRepo  *src,
-                             const char  *src_commit,
-                             GCancellable *cancellable,
-                             GError      **error)
+rpmostree_copy_regfile_data (int                  src_fd,
+                             int                  dest_fd,
+                             off_t                size,
+                             RpmOstreeCopyMethod *out_method,
+                             GError             **error)
 {
-  g_autoptr(GVariant) commitdata = NULL;
-  ostree_cleanup_repo_commit_traverse_iter
-    OstreeRepoCommitTraverseIter iter = { 0, };
+  if (ioctl (dest_fd, FICLONE, src_fd) == 0)
+    {
+      *out_method = RPMOSTREE_COPY_METHOD_REFLINK;
+      return TRUE;
+    }
+  if (!G_IN_SET (errno, EOPNOTSUPP, ENOTTY, EXDEV, EINVAL))
+    return glnx_throw_errno_prefix (error, "ioctl(FICLONE)");
+
+#ifdef __NR_copy_file_range
+  off_t copied = 0;
+  while (copied < size)
+    {
+      ssize_t n = syscall (__NR_copy_file_range, src_fd, NULL, dest_fd, NULL,
+                           (size_t)(size - copied), 0);
+      if (n < 0)
+        {
+          /* Only fall back if nothing was copied yet, so the file offsets
+           * are still at the start */
+          if (copied == 0 && G_IN_SET (errno, ENOSYS, EXDEV, EOPNOTSUPP, EINVAL))
+            break;
+          return glnx_throw_errno_prefix (error, "copy_file_range");
+        }
+      if (n == 0)
+        return glnx_throw (error, "copy_file_range: Unexpected EOF");
+      copied += n;
+    }
+  if (copied == size && size > 0)
+    {
+      *out_method = RPMOSTREE_COPY_METHOD_COPY_RANGE;
+      return TRUE;
+    }
+#endif
 
-  if (!ostree_repo_load_commit (src, src_commit, &commitdata, NULL, error))
+  if (glnx_regfile_copy_bytes (src_fd, dest_fd, (off_t) -1) < 0)
+    return glnx_throw_errno_prefix (error, "regfile copy");
+  *out_method = RPMOSTREE_COPY_METHOD_COPY;
+  return TRUE;
+}
+
+typedef struct {
+  RpmOstreeParallelFunc func;
+  gpointer user_data;
+  guint n_items;
+  GCancellable *cancellable;
+
+  volatile gint next_item;
+
+  GMutex error_lock;
+  GError *error; /* First error; makes the other workers stop */
+} ParallelData;
+
+static gpointer
+parallel_worker_thread (gpointer user_data)
+{
+  ParallelData *data = user_data;
+
+  while (TRUE)
+    {
+      g_autoptr(GError) local_error = NULL;
+      guint i = g_atomic_int_add (&data->next_item, 1);
+
+      if (i >= data->n_items)
+        break;
+
+      /* Another worker failed; no point in going on */
+      g_mutex_lock (&data->error_lock);
+      gboolean failed = (data->error != NULL);
+      g_mutex_unlock (&data->error_lock);
+      if (failed)
+        break;
+
+      if (!g_cancellable_set_error_if_cancelled (data->cancellable, &local_error))
+        (void) data->func (i, data->user_data, data->cancellable, &local_error);
+
+      if (local_error)
+        {
+          g_mutex_lock (&data->error_lock);
+          if (!data->error)
+            data->error = g_steal_pointer (&local_error);
+          g_mutex_unlock (&data->error_lock);
+          break;
+        }
+    }
+
+  return NULL;
+}
+
+/**
+ * rpmostree_run_parallel:
+ * @name: Name for the worker threads
+ * @n_items: Number of items
+ * @max_threads: Upper bound on the number of workers
+ * @func: Called once for each item index in [0, @n_items)
+ * @user_data: Passed to @func
+ *
+ * Call @func for every item from a pool of up to @max_threads workers (fewer
+ * if there are fewer CPUs or items), the calling thread being one of them.
+ * Items are handed out in order, but may complete in any order. The first
+ * error stops the workers from picking up new items and is returned once all
+ * of them are done. @func must be safe to call concurrently.
+ */
+gboolean
+rpmostree_run_parallel (const char            *name,
+                        guint                  n_items,
+                        guint                  max_threads,
+                        RpmOstreeParallelFunc  func,
+                        gpointer               user_data,
+                        GCancellable          *cancellable,
+                        GError               **error)
+{
+  ParallelData data = { .func = func, .user_data = user_data,
+                        .n_items = n_items, .cancellable = cancellable, };
+  const guint n_threads = CLAMP (MIN (g_get_num_processors (), n_items),
+                                 1, max_threads);
+  g_autoptr(GPtrArray) threads = g_ptr_array_new ();
+
+  g_mutex_init (&data.error_lock);
+  for (guint i = 1; i < n_threads; i++)
+    g_ptr_array_add (threads, g_thread_new (name, parallel_worker_thread, &data));
+  /* The calling thread is a worker too */
+  parallel_worker_thread (&data);
+  for (guint i = 0; i < threads->len; i++)
+    g_thread_join (threads->pdata[i]);
+  g_mutex_clear (&data.error_lock);
+
+  if (data.error)
+    {
+      g_propagate_error (error, data.error);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/* Number of objects each worker checks for existence at a time */
+#define PULL_CONTENT_BATCH_SIZE 64
+#define PULL_CONTENT_MAX_THREADS 8
+
+typedef enum {
+  IMPORT_RESULT_SKIPPED,
+  IMPORT_RESULT_LINKED,
+  IMPORT_RESULT_COPIED,
+} ImportResult;
+
+typedef struct {
+  OstreeRepo *dest;
+  OstreeRepo *src;
+  gboolean both_bare; /* Objects are plain files we can link/clone directly */
+  GPtrArray *checksums;
+  GCancellable *cancellable;
+
+  volatile gint n_skipped;
+  volatile gint n_linked;
+  volatile gint n_copied;
+} PullContentData;
+
+/* Copy the bare object at @objpath into @dest_dfd, along with its ownership,
+ * mode and xattrs, sharing the data via a reflink if possible (see
+ * rpmostree_copy_regfile_data()). Symlinks are stored as such in bare repos;
+ * for those, @out_copied is left %FALSE so the caller can fall back to a
+ * regular import. */
+static gboolean
+copy_bare_regfile_object (int                  src_dfd,
+                          int                  dest_dfd,
+                          const char          *objpath,
+                          gboolean            *out_copied,
+                          RpmOstreeCopyMethod *out_method,
+                          GCancellable        *cancellable,
+                          GError             **error)
+{
+  g_auto(GLnxTmpfile) tmpf = { 0, };
+  glnx_fd_close int src_fd = -1;
+  g_autoptr(GVariant) xattrs = NULL;
+  struct stat stbuf;
+
+  *out_copied = FALSE;
+
+  if (fstatat (src_dfd, objpath, &stbuf, AT_SYMLINK_NOFOLLOW) < 0)
+    return glnx_throw_errno_prefix (error, "fstatat(%s)", objpath);
+  if (!S_ISREG (stbuf.st_mode))
+    return TRUE;
+
+  if (!glnx_openat_rdonly (src_dfd, objpath, FALSE, &src_fd, error))
+    return FALSE;
+  if (!glnx_open_tmpfile_linkable_at (dest_dfd, "tmp", O_WRONLY | O_CLOEXEC,
+                                      &tmpf, error))
+    return FALSE;
+  if (!rpmostree_copy_regfile_data (src_fd, tmpf.fd, stbuf.st_size, out_method, error))
+    return glnx_prefix_error (error, "Copying %s", objpath);
+
+  /* Bare objects carry their metadata on the file itself; chown first since
+   * it drops setuid bits */
+  if (fchown (tmpf.fd, stbuf.st_uid, stbuf.st_gid) < 0)
+    return glnx_throw_errno_prefix (error, "fchown");
+  if (fchmod (tmpf.fd, stbuf.st_mode & 07777) < 0)
+    return glnx_throw_errno_prefix (error, "fchmod");
+  if (!glnx_fd_get_all_xattrs (src_fd, &xattrs, cancellable, error))
+    return FALSE;
+  if (!glnx_fd_set_all_xattrs (tmpf.fd, xattrs, cancellable, error))
     return FALSE;
 
-  if (!ostree_repo_commit_traverse_iter_init_commit (&iter, src, commitdata,
-                                                     OSTREE_REPO_COMMIT_TRAVERSE_FLAG_NONE,
-                                                     error))
+  if (!glnx_shutil_mkdir_p_at (dest_dfd, dirname (strdupa (objpath)), 0755,
+                               cancellable, error))
     return FALSE;
+  if (!glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_NOREPLACE_IGNORE_EXIST,
+                             dest_dfd, objpath, error))
+    return FALSE;
+
+  *out_copied = TRUE;
+  return TRUE;
+}
 
-  if (!pull_content_only_recurse (dest, src, &iter, cancellable, error))
+static gboolean
+import_one_content_object (PullContentData *data,
+                           const char      *checksum,
+                           ImportResult    *out_result,
+                           GError         **error)
+{
+  if (data->both_bare)
+    {
+      g_autofree char *objpath =
+        ostree_get_relative_object_path (checksum, OSTREE_OBJECT_TYPE_FILE, TRUE);
+      int src_dfd = ostree_repo_get_dfd (data->src);
+      int dest_dfd = ostree_repo_get_dfd (data->dest);
+
+      if (linkat (src_dfd, objpath, dest_dfd, objpath, 0) == 0)
+        {
+          *out_result = IMPORT_RESULT_LINKED;
+          return TRUE;
+        }
+      else if (errno == EEXIST)
+        {
+          *out_result = IMPORT_RESULT_SKIPPED;
+          return TRUE;
+        }
+      else if (errno == ENOENT)
+        {
+          /* Likely just the first object in this prefix dir */
+          if (!glnx_shutil_mkdir_p_at (dest_dfd, dirname (strdupa (objpath)), 0755,
+                                       data->cancellable, error))
+            return FALSE;
+          if (linkat (src_dfd, objpath, dest_dfd, objpath, 0) == 0)
+            {
+              *out_result = IMPORT_RESULT_LINKED;
+              return TRUE;
+            }
+        }
+
+      /* EXDEV, EMLINK and friends; try to at least share the data */
+      gboolean copied = FALSE;
+      RpmOstreeCopyMethod method;
+      if (!copy_bare_regfile_object (src_dfd, dest_dfd, objpath, &copied, &method,
+                                     data->cancellable, error))
+        return FALSE;
+      if (copied)
+        {
+          *out_result = (method == RPMOSTREE_COPY_METHOD_REFLINK) ?
+            IMPORT_RESULT_LINKED : IMPORT_RESULT_COPIED;
+          return TRUE;
+        }
+    }
+
+  if (!ostree_repo_import_object_from (data->dest, data->src, OSTREE_OBJECT_TYPE_FILE,
+                                       checksum, data->cancellable, error))
+    return FALSE;
+
+  *out_result = IMPORT_RESULT_COPIED;
+  return TRUE;
+}
+
+static gboolean
+pull_content_batch (PullContentData *data,
+                    guint            start,
+                    guint            end,
+                    GError         **error)
+{
+  gboolean exists[PULL_CONTENT_BATCH_SIZE];
+
+  /* First, find out what we actually need */
+  for (guint i = start; i < end; i++)
+    {
+      if (!ostree_repo_has_object (data->dest, OSTREE_OBJECT_TYPE_FILE,
+                                   data->checksums->pdata[i], &exists[i - start],
+                                   data->cancellable, error))
+        return FALSE;
+    }
+
+  for (guint i = start; i < end; i++)
+    {
+      ImportResult result = IMPORT_RESULT_SKIPPED;
+
+      if (!exists[i - start])
+        {
+          if (!import_one_content_object (data, data->checksums->pdata[i],
+                                          &result, error))
+            return FALSE;
+        }
+
+      switch (result)
+        {
+        case IMPORT_RESULT_SKIPPED:
+          g_atomic_int_inc (&data->n_skipped);
+          break;
+        case IMPORT_RESULT_LINKED:
+          g_atomic_int_inc (&data->n_linked);
+          break;
+        case IMPORT_RESULT_COPIED:
+          g_atomic_int_inc (&data->n_copied);
+          break;
+        }
+    }
+
+  return TRUE;
+}
+
+static gboolean
+pull_content_batch_func (guint          batch,
+                         gpointer       user_data,
+                         GCancellable  *cancellable,
+                         GError       **error)
+{
+  PullContentData *data = user_data;
+  guint start = batch * PULL_CONTENT_BATCH_SIZE;
+  guint end = MIN (start + PULL_CONTENT_BATCH_SIZE, data->checksums->len);
+  return pull_content_batch (data, start, end, error);
+}
+
+/**
+ * rpmostree_pull_content_only:
+ * @dest: Destination repo
+ * @src: Source repo
+ * @src_commits: Commits in @src to migrate
+ * @out_stats: (allow-none): Counts of what was done
+ *
+ * Migrate only the content (.file) objects from all of @src_commits into
+ * @dest. Objects are deduplicated across commits, objects @dest already has
+ * are skipped, and the rest are imported in parallel. Where both repos are
+ * bare, objects are hardlinked, or failing that reflinked, rather than copied.
+ * Used for package layering.
+ */
+gboolean
+rpmostree_pull_content_only (OstreeRepo          *dest,
+                             OstreeRepo          *src,
+                             GPtrArray           *src_commits,
+                             RpmOstreePullStats  *out_stats,
+                             GCancellable        *cancellable,
+                             GError             **error)
+{
+  g_autoptr(GHashTable) checksums_set =
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  for (guint i = 0; i < src_commits->len; i++)
+    {
+      const char *src_commit = src_commits->pdata[i];
+      g_autoptr(GVariant) commitdata = NULL;
+      ostree_cleanup_repo_commit_traverse_iter
+        OstreeRepoCommitTraverseIter iter = { 0, };
+
+      if (!ostree_repo_load_commit (src, src_commit, &commitdata, NULL, error))
+        return FALSE;
+
+      if (!ostree_repo_commit_traverse_iter_init_commit (&iter, src, commitdata,
+                                                         OSTREE_REPO_COMMIT_TRAVERSE_FLAG_NONE,
+                                                         error))
+        return FALSE;
+
+      if (!collect_content_objects_recurse (src, &iter, checksums_set,
+                                            cancellable, error))
+        return FALSE;
+    }
+
+  g_autofree char **checksums_v =
+    (char**)g_hash_table_get_keys_as_array (checksums_set, NULL);
+  g_autoptr(GPtrArray) checksums = g_ptr_array_new ();
+  for (char **it = checksums_v; it && *it; it++)
+    g_ptr_array_add (checksums, *it);
+
+  PullContentData data = { .dest = dest, .src = src, .checksums = checksums,
+                           .cancellable = cancellable, };
+  data.both_bare = (ostree_repo_get_mode (dest) == OSTREE_REPO_MODE_BARE &&
+                    ostree_repo_get_mode (src) == OSTREE_REPO_MODE_BARE);
+  const guint n_batches =
+    (checksums->len + PULL_CONTENT_BATCH_SIZE - 1) / PULL_CONTENT_BATCH_SIZE;
+  if (!rpmostree_run_parallel ("pull-content", n_batches, PULL_CONTENT_MAX_THREADS,
+                               pull_content_batch_func, &data, cancellable, error))
     return FALSE;
 
+  if (out_stats)
+    {
+      out_stats->n_skipped = data.n_skipped;
+      out_stats->n_linked = data.n_linked;
+      out_stats->n_copied = data.n_copied;
+    }
+
   return TRUE;
 }
 
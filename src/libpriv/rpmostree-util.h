@@ -69,12 +69,46 @@ rpmostree_str_replace (const char  *buf,
                        GError     **error);
 
 
+typedef enum {
+  RPMOSTREE_COPY_METHOD_REFLINK,
+  RPMOSTREE_COPY_METHOD_COPY_RANGE,
+  RPMOSTREE_COPY_METHOD_COPY,
+} RpmOstreeCopyMethod;
+
 gboolean
-rpmostree_pull_content_only (OstreeRepo  *dest,
-                             OstreeRepo  *src,
-                             const char  *src_commit,
-                             GCancellable *cancellable,
-                             GError      **error);
+rpmostree_copy_regfile_data (int                  src_fd,
+                             int                  dest_fd,
+                             off_t                size,
+                             RpmOstreeCopyMethod *out_method,
+                             GError             **error);
+
+typedef gboolean (*RpmOstreeParallelFunc) (guint          i,
+                                            gpointer       user_data,
+                                            GCancellable  *cancellable,
+                                            GError       **error);
+
+gboolean
+rpmostree_run_parallel (const char            *name,
+                        guint                  n_items,
+                        guint                  max_threads,
+                        RpmOstreeParallelFunc  func,
+                        gpointer               user_data,
+                        GCancellable          *cancellable,
+                        GError               **error);
+
+typedef struct {
+  guint n_skipped; /* Already in the destination */
+  guint n_linked;  /* Hardlinked or reflinked */
+  guint n_copied;
+} RpmOstreePullStats;
+
+gboolean
+rpmostree_pull_content_only (OstreeRepo          *dest,
+                             OstreeRepo          *src,
+                             GPtrArray           *src_commits,
+                             RpmOstreePullStats  *out_stats,
+                             GCancellable        *cancellable,
+                             GError             **error);
 const char *
 rpmostree_file_get_path_cached (GFile *file);
 
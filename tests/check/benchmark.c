@@ -0,0 +1,711 @@
+/* Microbenchmarks for the package import, relabel, assembly and commit paths.
+ *
+ * Everything runs offline against synthetic RPMs generated with rpmbuild and a
+ * local rpm-md repo made with createrepo_c, in an unprivileged container-style
+ * userroot (see `rpm-ostree ex container`). Results are printed as JSON so
+ * they can be compared between releases; use `make benchmark`.
+ *
+ * The rpmdb write done at the end of assembly is timed with the default
+ * %_dbi_config and with "nofsync" appended, as rpm-ostree does.
+ *
+ * When run as root, we also time a script in a mutable bwrap container with
+ * /usr protected by rofiles-fuse and by overlayfs.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib-unix.h>
+#include <json-glib/json-glib.h>
+#include <rpm/rpmmacro.h>
+#include <rpm/rpmts.h>
+#include "libglnx.h"
+#include "rpmostree-bwrap.h"
+#include "rpmostree-core.h"
+#include "rpmostree-postprocess.h"
+#include "rpmostree-rpm-util.h"
+#include "rpmostree-unpacker.h"
+
+static int opt_packages = 20;
+static int opt_files = 200;
+static int opt_file_size = 4096;
+static int opt_diff_iterations = 100;
+static int opt_script_iterations = 1000;
+static char *opt_scripts_usr = "/usr";
+static char *opt_output;
+static gboolean opt_keep;
+
+static GOptionEntry option_entries[] = {
+  { "packages", 0, 0, G_OPTION_ARG_INT, &opt_packages, "Number of synthetic packages (default: 20)", "N" },
+  { "files", 0, 0, G_OPTION_ARG_INT, &opt_files, "Files per package (default: 200)", "N" },
+  { "file-size", 0, 0, G_OPTION_ARG_INT, &opt_file_size, "Size of each file in bytes (default: 4096)", "BYTES" },
+  { "diff-iterations", 0, 0, G_OPTION_ARG_INT, &opt_diff_iterations, "Number of rpmdb diffs to time (default: 100)", "N" },
+  { "script-iterations", 0, 0, G_OPTION_ARG_INT, &opt_script_iterations, "Files the benchmark script creates (default: 1000)", "N" },
+  { "scripts-usr", 0, 0, G_OPTION_ARG_FILENAME, &opt_scripts_usr, "Copy of /usr to run scripts against (default: /usr)", "PATH" },
+  { "output", 'o', 0, G_OPTION_ARG_FILENAME, &opt_output, "Write results to FILE instead of stdout", "FILE" },
+  { "keep", 0, 0, G_OPTION_ARG_NONE, &opt_keep, "Don't delete the working directory", NULL },
+  { NULL }
+};
+
+typedef struct {
+  const char *name;
+  gint64 elapsed_usec;
+  guint64 n_items;   /* What the rate is computed over; packages, or iterations */
+  const char *skipped; /* Reason, if this wasn't run */
+  guint64 bytes_read; /* If measured, the I/O done... */
+  guint64 bytes_in;   /* ...and the size of the inputs */
+} BenchResult;
+
+typedef struct {
+  char *workdir;
+  int workdir_dfd;
+  GPtrArray *pkgnames;
+  GArray *results; /* Array<BenchResult> */
+} Bench;
+
+static void
+bench_clear (Bench *bench)
+{
+  if (bench->workdir && !opt_keep)
+    (void) glnx_shutil_rm_rf_at (AT_FDCWD, bench->workdir, NULL, NULL);
+  g_free (bench->workdir);
+  if (bench->workdir_dfd != -1)
+    (void) close (bench->workdir_dfd);
+  g_clear_pointer (&bench->pkgnames, g_ptr_array_unref);
+  g_clear_pointer (&bench->results, g_array_unref);
+}
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC(Bench, bench_clear)
+
+static void
+bench_add_result (Bench      *bench,
+                  const char *name,
+                  gint64      start_time,
+                  guint64     n_items)
+{
+  BenchResult result = { name, g_get_monotonic_time () - start_time, n_items, NULL };
+  g_array_append_val (bench->results, result);
+}
+
+/* Record the I/O of the last result */
+static void
+bench_set_io (Bench   *bench,
+              guint64  bytes_read,
+              guint64  bytes_in)
+{
+  BenchResult *result = &g_array_index (bench->results, BenchResult, bench->results->len - 1);
+  result->bytes_read = bytes_read;
+  result->bytes_in = bytes_in;
+}
+
+static void
+bench_add_skipped (Bench      *bench,
+                   const char *name,
+                   const char *reason)
+{
+  BenchResult result = { name, 0, 0, reason };
+  g_array_append_val (bench->results, result);
+}
+
+static gboolean
+spawn_sync (const char *const *argv,
+            GError           **error)
+{
+  int estatus;
+  if (!g_spawn_sync (NULL, (char**)argv, NULL, G_SPAWN_SEARCH_PATH | G_SPAWN_STDOUT_TO_DEV_NULL,
+                     NULL, NULL, NULL, NULL, &estatus, error))
+    return FALSE;
+  if (!g_spawn_check_exit_status (estatus, error))
+    return g_prefix_error (error, "%s: ", argv[0]), FALSE;
+  return TRUE;
+}
+
+/* Build the synthetic packages bench-pkg<N>, each with opt_files files of
+ * random data, and an rpm-md repo for them.
+ */
+static gboolean
+generate_packages (Bench         *bench,
+                   GCancellable  *cancellable,
+                   GError       **error)
+{
+  const char *topdir = glnx_strjoina (bench->workdir, "/rpmbuild");
+  const char *yumdir = glnx_strjoina (bench->workdir, "/yum");
+
+  if (!glnx_shutil_mkdir_p_at (bench->workdir_dfd, "rpmbuild", 0755, cancellable, error))
+    return FALSE;
+  if (!glnx_shutil_mkdir_p_at (bench->workdir_dfd, "yum/packages", 0755, cancellable, error))
+    return FALSE;
+
+  for (int i = 0; i < opt_packages; i++)
+    {
+      g_autofree char *name = g_strdup_printf ("bench-pkg%d", i);
+      g_autofree char *spec =
+        g_strdup_printf ("Name: %s\n"
+                         "Version: 1.0\n"
+                         "Release: 1\n"
+                         "Summary: Synthetic rpm-ostree benchmark package\n"
+                         "License: GPLv2+\n"
+                         "BuildArch: noarch\n"
+                         "%%description\n"
+                         "Synthetic package with %d files of %d bytes each.\n"
+                         "%%install\n"
+                         "mkdir -p %%{buildroot}/usr/share/%s\n"
+                         "for i in $(seq %d); do\n"
+                         "  head -c %d /dev/urandom > %%{buildroot}/usr/share/%s/file$i\n"
+                         "done\n"
+                         "%%files\n"
+                         "/usr/share/%s\n",
+                         name, opt_files, opt_file_size,
+                         name, opt_files, opt_file_size, name, name);
+      g_autofree char *specpath = g_strdup_printf ("%s/%s.spec", topdir, name);
+      if (!glnx_file_replace_contents_at (AT_FDCWD, specpath, (guint8*)spec, -1,
+                                          GLNX_FILE_REPLACE_NODATASYNC, cancellable, error))
+        return FALSE;
+
+      g_autofree char *topdir_def = g_strconcat ("_topdir ", topdir, NULL);
+      g_autofree char *rpmdir_def = g_strconcat ("_rpmdir ", yumdir, "/packages", NULL);
+      const char *argv[] = { "rpmbuild", "-bb", "--quiet",
+                             "--define", topdir_def, "--define", rpmdir_def,
+                             /* Skip the brp-* scripts; we just want the payload */
+                             "--define", "__os_install_post %{nil}",
+                             specpath, NULL };
+      if (!spawn_sync (argv, error))
+        return FALSE;
+
+      g_ptr_array_add (bench->pkgnames, g_steal_pointer (&name));
+    }
+
+  { const char *argv[] = { "createrepo_c", "--no-database", yumdir, NULL };
+    if (!spawn_sync (argv, error))
+      return FALSE;
+  }
+
+  g_autofree char *repofile =
+    g_strdup_printf ("[bench]\nname=bench\nbaseurl=file://%s\nenabled=1\ngpgcheck=0\n", yumdir);
+  if (!glnx_file_replace_contents_at (bench->workdir_dfd, "rpmmd.repos.d/bench.repo",
+                                      (guint8*)repofile, -1, GLNX_FILE_REPLACE_NODATASYNC,
+                                      cancellable, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Time rpmostree_unpacker_unpack_to_ostree() on each package, into a scratch
+ * repo so the context benchmarks below start from an empty cache.
+ */
+static gboolean
+bench_unpack (Bench         *bench,
+              GCancellable  *cancellable,
+              GError       **error)
+{
+  g_autofree char *repopath = g_strconcat (bench->workdir, "/unpack-repo", NULL);
+  g_autoptr(GFile) repofile = g_file_new_for_path (repopath);
+  g_autoptr(OstreeRepo) repo = ostree_repo_new (repofile);
+  if (!ostree_repo_create (repo, OSTREE_REPO_MODE_BARE_USER, cancellable, error))
+    return FALSE;
+
+  glnx_fd_close int pkgdir_dfd = -1;
+  if (!glnx_opendirat (bench->workdir_dfd, "yum/packages/noarch", TRUE, &pkgdir_dfd, error))
+    return FALSE;
+
+  guint64 bytes_read = 0;
+  guint64 bytes_in = 0;
+  const gint64 start_time = g_get_monotonic_time ();
+  for (guint i = 0; i < bench->pkgnames->len; i++)
+    {
+      g_autofree char *rpm = g_strconcat (bench->pkgnames->pdata[i], "-1.0-1.noarch.rpm", NULL);
+      struct stat stbuf;
+      if (fstatat (pkgdir_dfd, rpm, &stbuf, 0) < 0)
+        return glnx_throw_errno_prefix (error, "fstatat(%s)", rpm);
+      bytes_in += stbuf.st_size;
+
+      g_autoptr(RpmOstreeUnpacker) unpacker =
+        rpmostree_unpacker_new_at (pkgdir_dfd, rpm, NULL,
+                                   RPMOSTREE_UNPACKER_FLAGS_OSTREE_CONVENTION |
+                                   RPMOSTREE_UNPACKER_FLAGS_UNPRIVILEGED,
+                                   error);
+      if (!unpacker)
+        return FALSE;
+
+      g_autofree char *commit = NULL;
+      if (!rpmostree_unpacker_unpack_to_ostree (unpacker, repo, NULL, &commit,
+                                                cancellable, error))
+        return FALSE;
+      bytes_read += rpmostree_unpacker_get_bytes_read (unpacker);
+    }
+  bench_add_result (bench, "unpack", start_time, bench->pkgnames->len);
+  bench_set_io (bench, bytes_read, bytes_in);
+
+  return TRUE;
+}
+
+static RpmOstreeContext *
+new_context (Bench             *bench,
+             RpmOstreeTreespec *treespec,
+             OstreeSePolicy    *sepolicy,
+             GCancellable      *cancellable,
+             GError           **error)
+{
+  g_autoptr(RpmOstreeContext) ctx =
+    rpmostree_context_new_unprivileged (bench->workdir_dfd, cancellable, error);
+  if (!ctx)
+    return NULL;
+  if (sepolicy)
+    rpmostree_context_set_sepolicy (ctx, sepolicy);
+  if (!rpmostree_context_setup (ctx, NULL, "/", treespec, cancellable, error))
+    return NULL;
+  if (!rpmostree_context_prepare (ctx, cancellable, error))
+    return NULL;
+  return g_steal_pointer (&ctx);
+}
+
+/* Import all packages through a context, then time relabeling them against
+ * the host policy, assembling a rootfs from them, committing it, and diffing
+ * its rpmdb against a subset of itself.
+ */
+static gboolean
+bench_context (Bench         *bench,
+               GCancellable  *cancellable,
+               GError       **error)
+{
+  g_autoptr(GKeyFile) kf = g_key_file_new ();
+  g_key_file_set_string (kf, "tree", "ref", "bench");
+  g_key_file_set_string_list (kf, "tree", "packages",
+                              (const char *const*)bench->pkgnames->pdata,
+                              bench->pkgnames->len);
+  g_key_file_set_string (kf, "tree", "repos", "bench");
+  g_autoptr(RpmOstreeTreespec) treespec = rpmostree_treespec_new_from_keyfile (kf, error);
+  if (!treespec)
+    return FALSE;
+
+  g_autoptr(RpmOstreeContext) ctx = new_context (bench, treespec, NULL, cancellable, error);
+  if (!ctx)
+    return FALSE;
+  if (!rpmostree_context_download (ctx, cancellable, error))
+    return FALSE;
+  gint64 start_time = g_get_monotonic_time ();
+  if (!rpmostree_context_import (ctx, cancellable, error))
+    return FALSE;
+  bench_add_result (bench, "import", start_time, bench->pkgnames->len);
+
+  /* The packages were imported without a policy, so they all need relabeling */
+  g_autoptr(GFile) host_root = g_file_new_for_path ("/");
+  g_autoptr(OstreeSePolicy) sepolicy = ostree_sepolicy_new (host_root, cancellable, error);
+  if (!sepolicy)
+    return FALSE;
+  if (ostree_sepolicy_get_name (sepolicy) == NULL)
+    bench_add_skipped (bench, "relabel", "no SELinux policy on the host");
+  else
+    {
+      g_autoptr(RpmOstreeContext) relabel_ctx =
+        new_context (bench, treespec, sepolicy, cancellable, error);
+      if (!relabel_ctx)
+        return FALSE;
+      start_time = g_get_monotonic_time ();
+      if (!rpmostree_context_relabel (relabel_ctx, cancellable, error))
+        return FALSE;
+      bench_add_result (bench, "relabel", start_time, bench->pkgnames->len);
+    }
+
+  g_autoptr(OstreeRepo) repo = NULL;
+  { g_autofree char *repopath = g_strconcat (bench->workdir, "/repo", NULL);
+    g_autoptr(GFile) repofile = g_file_new_for_path (repopath);
+    repo = ostree_repo_new (repofile);
+    if (!ostree_repo_open (repo, cancellable, error))
+      return FALSE;
+  }
+
+  g_autoptr(OstreeRepoDevInoCache) devino_cache = ostree_repo_devino_cache_new ();
+  g_autofree char *tmprootfs = g_strdup ("tmp/rpmostree-bench-XXXXXX");
+  if (!glnx_mkdtempat (bench->workdir_dfd, tmprootfs, 0755, error))
+    return FALSE;
+  glnx_fd_close int tmprootfs_dfd = -1;
+  if (!glnx_opendirat (bench->workdir_dfd, tmprootfs, TRUE, &tmprootfs_dfd, error))
+    return FALSE;
+
+  /* The synthetic packages don't have scripts; skipping them avoids needing
+   * bwrap here */
+  start_time = g_get_monotonic_time ();
+  if (!rpmostree_context_assemble_tmprootfs (ctx, tmprootfs_dfd, devino_cache, TRUE,
+                                             cancellable, error))
+    return FALSE;
+  bench_add_result (bench, "assemble", start_time, bench->pkgnames->len);
+
+  g_autofree char *rev = NULL;
+  start_time = g_get_monotonic_time ();
+  if (!rpmostree_commit (tmprootfs_dfd, repo, "bench", NULL, NULL, NULL, FALSE,
+                         devino_cache, &rev, cancellable, error))
+    return FALSE;
+  bench_add_result (bench, "commit", start_time, bench->pkgnames->len);
+
+  /* Diff the full rpmdb against every other package of it */
+  g_autoptr(GPtrArray) subset = g_ptr_array_new ();
+  for (guint i = 0; i < bench->pkgnames->len; i += 2)
+    g_ptr_array_add (subset, bench->pkgnames->pdata[i]);
+  g_autoptr(RpmRevisionData) rev_full = rpmrev_new (repo, rev, NULL, cancellable, error);
+  if (!rev_full)
+    return FALSE;
+  g_autoptr(RpmRevisionData) rev_subset = rpmrev_new (repo, rev, subset, cancellable, error);
+  if (!rev_subset)
+    return FALSE;
+
+  start_time = g_get_monotonic_time ();
+  for (int i = 0; i < opt_diff_iterations; i++)
+    rpmhdrs_diff_free (rpmhdrs_diff (rpmrev_get_headers (rev_full),
+                                     rpmrev_get_headers (rev_subset)));
+  bench_add_result (bench, "rpmhdrs-diff", start_time, opt_diff_iterations);
+
+  return TRUE;
+}
+
+/* librpm reads the header back from the package when adding it to the db */
+static void *
+rpmdb_write_callback (const void         *h,
+                      const rpmCallbackType what,
+                      const rpm_loff_t    amount,
+                      const rpm_loff_t    total,
+                      fnpyKey             key,
+                      rpmCallbackData     data)
+{
+  FD_t *fdp = data;
+
+  switch (what)
+    {
+    case RPMCALLBACK_INST_OPEN_FILE:
+      g_assert (*fdp == NULL);
+      *fdp = Fopen (key, "r.ufdio");
+      return *fdp;
+    case RPMCALLBACK_INST_CLOSE_FILE:
+      g_clear_pointer (fdp, Fclose);
+      break;
+    default:
+      break;
+    }
+
+  return NULL;
+}
+
+/* Time writing a new rpmdb with all the packages in a JUSTDB transaction,
+ * like write_rpmdb() in rpmostree-core.c, with the default %_dbi_config and
+ * with "nofsync" appended to it.
+ */
+static gboolean
+bench_rpmdb_write (Bench         *bench,
+                   GCancellable  *cancellable,
+                   GError       **error)
+{
+  static const char *names[] = { "rpmdb-write-default", "rpmdb-write-nofsync" };
+  static const char *extra_config[] = { NULL, " nofsync" };
+  g_autofree char *pkgdir = g_strconcat (bench->workdir, "/yum/packages/noarch", NULL);
+
+  for (guint i = 0; i < G_N_ELEMENTS (names); i++)
+    {
+      g_autofree char *dbpath = g_strdup_printf ("%s/tmp/rpmdb-%u", bench->workdir, i);
+      if (!glnx_shutil_mkdir_p_at (AT_FDCWD, dbpath, 0755, cancellable, error))
+        return FALSE;
+
+      g_auto(rpmts) ts = rpmtsCreate ();
+      rpmtsSetVSFlags (ts, _RPMVSF_NOSIGNATURES | _RPMVSF_NODIGESTS);
+      rpmtsSetFlags (ts, RPMTRANS_FLAG_JUSTDB | RPMTRANS_FLAG_NOFILEDIGEST |
+                     RPMTRANS_FLAG_NOCONTEXTS);
+      FD_t fd = NULL;
+      rpmtsSetNotifyCallback (ts, rpmdb_write_callback, &fd);
+
+      /* Read the headers before the clock starts */
+      g_autoptr(GPtrArray) paths = g_ptr_array_new_with_free_func (g_free);
+      for (guint j = 0; j < bench->pkgnames->len; j++)
+        {
+          char *path = g_strconcat (pkgdir, "/", bench->pkgnames->pdata[j],
+                                    "-1.0-1.noarch.rpm", NULL);
+          g_ptr_array_add (paths, path);
+
+          g_auto(Header) hdr = NULL;
+          FD_t pkgfd = Fopen (path, "r.ufdio");
+          if (pkgfd == NULL || Ferror (pkgfd))
+            {
+              if (pkgfd)
+                Fclose (pkgfd);
+              return glnx_throw (error, "Opening %s", path);
+            }
+          rpmRC rc = rpmReadPackageFile (ts, pkgfd, path, &hdr);
+          Fclose (pkgfd);
+          if (rc != RPMRC_OK)
+            return glnx_throw (error, "Reading header of %s", path);
+          if (rpmtsAddInstallElement (ts, hdr, path, 0, NULL) != 0)
+            return glnx_throw (error, "Adding %s to transaction", path);
+        }
+      rpmtsOrder (ts);
+
+      addMacro (NULL, "_dbpath", NULL, dbpath, -1);
+      if (extra_config[i])
+        {
+          char *default_config = rpmExpand ("%{?_dbi_config}", NULL);
+          g_autofree char *dbi_config = g_strconcat (default_config, extra_config[i], NULL);
+          free (default_config);
+          addMacro (NULL, "_dbi_config", NULL, dbi_config, -1);
+        }
+
+      const gint64 start_time = g_get_monotonic_time ();
+      const int r = rpmtsRun (ts, NULL, RPMPROB_FILTER_DISKSPACE);
+      /* Close the db while the macros still point at it */
+      rpmtsCloseDB (ts);
+      if (r == 0)
+        bench_add_result (bench, names[i], start_time, bench->pkgnames->len);
+
+      if (extra_config[i])
+        delMacro (NULL, "_dbi_config");
+      delMacro (NULL, "_dbpath");
+      if (r != 0)
+        return glnx_throw (error, "%s: rpmtsRun code %d", names[i], r);
+    }
+
+  return TRUE;
+}
+
+/* Like a %post regenerating a cache: walk /usr, then create and rename a
+ * bunch of files in it. The previous run's files are deleted first. */
+static gboolean
+run_bench_script (int            rootfs_dfd,
+                  const char    *backend,
+                  GError       **error)
+{
+  g_autofree char *script =
+    g_strdup_printf ("rm -f /usr/lib/.bench-*; find /usr/lib /usr/share -type f >/dev/null; "
+                     "i=0; while [ $i -lt %d ]; do "
+                     "echo $i > /usr/lib/.bench-$i && mv /usr/lib/.bench-$i /usr/lib/.bench-$i.done; "
+                     "i=$((i+1)); done", opt_script_iterations);
+
+  g_setenv ("RPMOSTREE_BWRAP_ROFILES", backend, TRUE);
+  g_autoptr(RpmOstreeBwrap) bwrap =
+    rpmostree_bwrap_new (rootfs_dfd, RPMOSTREE_BWRAP_MUTATE_ROFILES, error, NULL);
+  g_unsetenv ("RPMOSTREE_BWRAP_ROFILES");
+  if (!bwrap)
+    return FALSE;
+  rpmostree_bwrap_append_child_argv (bwrap, "/usr/bin/sh", "-c", script, NULL);
+  if (!rpmostree_bwrap_run (bwrap, error))
+    return FALSE;
+
+  /* Make sure the changes landed in the rootfs */
+  g_autofree char *last = g_strdup_printf ("usr/lib/.bench-%d.done", opt_script_iterations - 1);
+  struct stat stbuf;
+  if (opt_script_iterations > 0 && fstatat (rootfs_dfd, last, &stbuf, 0) < 0)
+    return glnx_throw_errno_prefix (error, "%s: fstatat(%s)", backend, last);
+
+  return TRUE;
+}
+
+/* Time running the same script with each /usr protection backend */
+static gboolean
+bench_scripts (Bench         *bench,
+               GCancellable  *cancellable,
+               GError       **error)
+{
+  static const char *names[] = { "scripts-rofiles-fuse", "scripts-overlayfs" };
+  static const char *backends[] = { "fuse", "overlay" };
+
+  g_autofree char *rofiles = g_find_program_in_path ("rofiles-fuse");
+  const char *skip_reason = NULL;
+  if (getuid () != 0)
+    skip_reason = "requires root";
+  else if (!rofiles)
+    skip_reason = "rofiles-fuse not found";
+  if (skip_reason)
+    {
+      for (guint i = 0; i < G_N_ELEMENTS (names); i++)
+        bench_add_skipped (bench, names[i], skip_reason);
+      return TRUE;
+    }
+
+  /* Scripts run against a hardlinked /usr in practice; fall back to a copy
+   * if it's on another filesystem. */
+  g_autofree char *rootfs = g_strconcat (bench->workdir, "/tmp/scripts-rootfs", NULL);
+  g_autofree char *usr = g_strconcat (rootfs, "/usr", NULL);
+  if (!glnx_shutil_mkdir_p_at (AT_FDCWD, rootfs, 0755, cancellable, error))
+    return FALSE;
+  { const char *argv[] = { "cp", "-al", opt_scripts_usr, usr, NULL };
+    g_autoptr(GError) local_error = NULL;
+    if (!spawn_sync (argv, &local_error))
+      {
+        const char *copy_argv[] = { "cp", "-a", "--reflink=auto", opt_scripts_usr, usr, NULL };
+        if (!glnx_shutil_rm_rf_at (AT_FDCWD, usr, cancellable, error))
+          return FALSE;
+        if (!spawn_sync (copy_argv, error))
+          return FALSE;
+      }
+  }
+
+  glnx_fd_close int rootfs_dfd = -1;
+  if (!glnx_opendirat (AT_FDCWD, rootfs, TRUE, &rootfs_dfd, error))
+    return FALSE;
+  /* Mirror the host's /lib -> usr/lib style links */
+  static const char *usr_links[] = {"lib", "lib64", "bin", "sbin"};
+  for (guint i = 0; i < G_N_ELEMENTS (usr_links); i++)
+    {
+      g_autofree char *hostpath = g_strconcat ("/", usr_links[i], NULL);
+      g_autofree char *target = glnx_readlinkat_malloc (AT_FDCWD, hostpath, NULL, NULL);
+      if (target && symlinkat (target, rootfs_dfd, usr_links[i]) < 0)
+        return glnx_throw_errno_prefix (error, "symlinkat(%s)", usr_links[i]);
+    }
+
+  for (guint i = 0; i < G_N_ELEMENTS (backends); i++)
+    {
+      const gint64 start_time = g_get_monotonic_time ();
+      if (!run_bench_script (rootfs_dfd, backends[i], error))
+        return FALSE;
+      bench_add_result (bench, names[i], start_time, opt_script_iterations);
+    }
+
+  return TRUE;
+}
+
+static char *
+results_to_json (Bench *bench)
+{
+  glnx_unref_object JsonBuilder *builder = json_builder_new ();
+
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "version");
+  json_builder_add_string_value (builder, PACKAGE_VERSION);
+  json_builder_set_member_name (builder, "parameters");
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "packages");
+  json_builder_add_int_value (builder, opt_packages);
+  json_builder_set_member_name (builder, "files-per-package");
+  json_builder_add_int_value (builder, opt_files);
+  json_builder_set_member_name (builder, "file-size");
+  json_builder_add_int_value (builder, opt_file_size);
+  json_builder_set_member_name (builder, "script-iterations");
+  json_builder_add_int_value (builder, opt_script_iterations);
+  json_builder_end_object (builder);
+
+  json_builder_set_member_name (builder, "results");
+  json_builder_begin_array (builder);
+  for (guint i = 0; i < bench->results->len; i++)
+    {
+      BenchResult *result = &g_array_index (bench->results, BenchResult, i);
+      const double seconds = result->elapsed_usec / (double) G_USEC_PER_SEC;
+
+      json_builder_begin_object (builder);
+      json_builder_set_member_name (builder, "name");
+      json_builder_add_string_value (builder, result->name);
+      if (result->skipped)
+        {
+          json_builder_set_member_name (builder, "skipped");
+          json_builder_add_string_value (builder, result->skipped);
+        }
+      else
+        {
+          json_builder_set_member_name (builder, "seconds");
+          json_builder_add_double_value (builder, seconds);
+          json_builder_set_member_name (builder, "items");
+          json_builder_add_int_value (builder, result->n_items);
+          json_builder_set_member_name (builder, "items-per-second");
+          json_builder_add_double_value (builder, seconds > 0 ? result->n_items / seconds : 0);
+          if (result->bytes_in > 0)
+            {
+              json_builder_set_member_name (builder, "bytes-read");
+              json_builder_add_int_value (builder, result->bytes_read);
+              json_builder_set_member_name (builder, "bytes-read-per-input-byte");
+              json_builder_add_double_value (builder, result->bytes_read / (double) result->bytes_in);
+            }
+        }
+      json_builder_end_object (builder);
+    }
+  json_builder_end_array (builder);
+  json_builder_end_object (builder);
+
+  glnx_unref_object JsonGenerator *generator = json_generator_new ();
+  JsonNode *root = json_builder_get_root (builder);
+  json_generator_set_root (generator, root);
+  json_generator_set_pretty (generator, TRUE);
+  char *ret = json_generator_to_data (generator, NULL);
+  json_node_free (root);
+  return ret;
+}
+
+static gboolean
+run (GCancellable  *cancellable,
+     GError       **error)
+{
+  g_auto(Bench) bench = { .workdir_dfd = -1, };
+  static const char *const directories[] = { "repo", "rpmmd.repos.d", "cache/rpm-md", "tmp" };
+
+  bench.pkgnames = g_ptr_array_new_with_free_func (g_free);
+  bench.results = g_array_new (FALSE, FALSE, sizeof (BenchResult));
+
+  bench.workdir = g_dir_make_tmp ("rpmostree-bench-XXXXXX", error);
+  if (!bench.workdir)
+    return FALSE;
+  if (!glnx_opendirat (AT_FDCWD, bench.workdir, TRUE, &bench.workdir_dfd, error))
+    return FALSE;
+  for (guint i = 0; i < G_N_ELEMENTS (directories); i++)
+    {
+      if (!glnx_shutil_mkdir_p_at (bench.workdir_dfd, directories[i], 0755, cancellable, error))
+        return FALSE;
+    }
+  { g_autofree char *repopath = g_strconcat (bench.workdir, "/repo", NULL);
+    g_autoptr(GFile) repofile = g_file_new_for_path (repopath);
+    g_autoptr(OstreeRepo) repo = ostree_repo_new (repofile);
+    if (!ostree_repo_create (repo, OSTREE_REPO_MODE_BARE_USER, cancellable, error))
+      return FALSE;
+  }
+
+  g_autofree char *rpmbuild = g_find_program_in_path ("rpmbuild");
+  g_autofree char *createrepo = g_find_program_in_path ("createrepo_c");
+  if (!rpmbuild || !createrepo)
+    {
+      const char *names[] = { "unpack", "import", "relabel", "assemble", "commit", "rpmhdrs-diff",
+                              "rpmdb-write-default", "rpmdb-write-nofsync" };
+      for (guint i = 0; i < G_N_ELEMENTS (names); i++)
+        bench_add_skipped (&bench, names[i], "rpmbuild or createrepo_c not found");
+    }
+  else
+    {
+      if (!generate_packages (&bench, cancellable, error))
+        return FALSE;
+      if (!bench_unpack (&bench, cancellable, error))
+        return FALSE;
+      if (!bench_context (&bench, cancellable, error))
+        return FALSE;
+      if (!bench_rpmdb_write (&bench, cancellable, error))
+        return FALSE;
+    }
+
+  if (!bench_scripts (&bench, cancellable, error))
+    return FALSE;
+
+  g_autofree char *json = results_to_json (&bench);
+  if (opt_output)
+    {
+      if (!glnx_file_replace_contents_at (AT_FDCWD, opt_output, (guint8*)json, -1,
+                                          GLNX_FILE_REPLACE_NODATASYNC, cancellable, error))
+        return FALSE;
+    }
+  else
+    g_print ("%s\n", json);
+
+  if (opt_keep)
+    g_printerr ("Kept working directory %s\n", bench.workdir);
+
+  return TRUE;
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(GOptionContext) context = g_option_context_new ("- benchmark rpm-ostree internals");
+
+  g_option_context_add_main_entries (context, option_entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &local_error) ||
+      !run (NULL, &local_error))
+    {
+      g_printerr ("error: %s\n", local_error->message);
+      return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
@@ -21,7 +21,7 @@ set -euo pipefail
 
 . ${commondir}/libtest.sh
 
-echo "1..2"
+echo "1..5"
 
 rpm-ostree ex container init
 if test -n "${OSTREE_NO_XATTRS:-}"; then
@@ -81,3 +81,48 @@ if rpm-ostree ex container assemble notfound.conf 2>err.txt; then
 fi
 
 echo "ok error conditions"
+
+pkgdir=${commondir}/compose/yum/repo/packages/x86_64
+ostree init --repo=unpack-repo --mode=archive-z2
+rpm-ostree ex unpack unpack-repo ${pkgdir}/foo-1.0-1.x86_64.rpm \
+  ${pkgdir}/bar-1.0-1.x86_64.rpm > unpack.txt
+assert_file_has_content unpack.txt '^Imported .*/foo-1.0-1.x86_64.rpm to rpmostree/pkg/foo/1.0-1.x86__64 -> '
+assert_file_has_content unpack.txt '^Imported .*/bar-1.0-1.x86_64.rpm to rpmostree/pkg/bar/1.0-1.x86__64 -> '
+assert_file_has_content unpack.txt '^Imported 2 RPMs (.*) in .*; 0 skipped;'
+ostree --repo=unpack-repo ls rpmostree/pkg/foo/1.0-1.x86__64 /usr/bin/foo
+ostree --repo=unpack-repo fsck
+echo "ok ex unpack multiple RPMs"
+
+# Directories are scanned for RPMs; the ones already imported are skipped
+mkdir unpack-dir
+cp ${pkgdir}/{foo,bar,empty}-1.0-1.x86_64.rpm unpack-dir
+echo "not an RPM" > unpack-dir/README
+foo_rev=$(ostree --repo=unpack-repo rev-parse rpmostree/pkg/foo/1.0-1.x86__64)
+rpm-ostree ex unpack unpack-repo unpack-dir > unpack.txt
+assert_file_has_content unpack.txt '^Skipped unpack-dir/foo-1.0-1.x86_64.rpm: rpmostree/pkg/foo/1.0-1.x86__64 is up to date'
+assert_file_has_content unpack.txt '^Skipped unpack-dir/bar-1.0-1.x86_64.rpm: rpmostree/pkg/bar/1.0-1.x86__64 is up to date'
+assert_file_has_content unpack.txt '^Imported unpack-dir/empty-1.0-1.x86_64.rpm to rpmostree/pkg/empty/1.0-1.x86__64 -> '
+assert_file_has_content unpack.txt '^Imported 1 RPM (.*) in .*; 2 skipped;'
+assert_not_file_has_content unpack.txt README
+assert_streq "$(ostree --repo=unpack-repo rev-parse rpmostree/pkg/foo/1.0-1.x86__64)" ${foo_rev}
+echo "ok ex unpack directory"
+
+# Like librpm, accept a package whose signature header has no header digest.
+# Renumber the SHA1 and SHA256 entries so that they aren't found.
+python -c '
+import struct, sys
+data = bytearray(open(sys.argv[1], "rb").read())
+il = struct.unpack(">I", bytes(data[96 + 8:96 + 12]))[0]
+for i in range(il):
+    off = 96 + 16 + i * 16
+    tag = struct.unpack(">I", bytes(data[off:off + 4]))[0]
+    if tag in (269, 273):
+        data[off:off + 4] = struct.pack(">I", tag + 2000)
+open(sys.argv[2], "wb").write(data)
+' ${pkgdir}/foo-1.0-1.x86_64.rpm foo-nodigest.rpm
+rpm -qp foo-nodigest.rpm
+ostree init --repo=nodigest-repo --mode=archive-z2
+rpm-ostree ex unpack nodigest-repo foo-nodigest.rpm > unpack.txt
+assert_file_has_content unpack.txt '^Imported foo-nodigest.rpm to rpmostree/pkg/foo/1.0-1.x86__64 -> '
+ostree --repo=nodigest-repo ls rpmostree/pkg/foo/1.0-1.x86__64 /usr/bin/foo
+echo "ok ex unpack RPM without header digest"
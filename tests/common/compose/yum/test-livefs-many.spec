@@ -0,0 +1,31 @@
+Name: test-livefs-many
+Summary: %{name}
+Version: 1.0
+Release: 1
+License: GPL+
+Group: Development/Tools
+URL: http://foo.bar.com
+BuildArch: x86_64
+
+%description
+%{summary}
+
+%prep
+
+%build
+for i in $(seq 20); do
+    echo "data file ${i}" > data-${i}.txt
+done
+cat > %{name}.conf <<EOF
+A config file for %{name}
+EOF
+
+%install
+mkdir -p %{buildroot}/usr/share/%{name}
+install -m 0644 data-*.txt %{buildroot}/usr/share/%{name}
+mkdir -p %{buildroot}/etc
+install -m 0644 %{name}.conf %{buildroot}/etc
+
+%files
+/usr/share/%{name}
+/etc/%{name}.conf
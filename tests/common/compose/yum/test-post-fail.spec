@@ -0,0 +1,33 @@
+Summary: Test failure of a %post run alongside others
+Name: test-post-fail
+Version: 1.0
+Release: 1
+License: GPLv2+
+Group: Development/Tools
+URL: http://example.com
+BuildArch: x86_64
+
+%description
+%{summary}
+
+%prep
+
+%build
+cat > test-post-fail << EOF
+#!/bin/sh
+echo "Hello!"
+EOF
+chmod a+x test-post-fail
+
+%post
+exit 3
+
+%install
+mkdir -p %{buildroot}/usr/bin
+install test-post-fail %{buildroot}/usr/bin
+
+%clean
+rm -rf %{buildroot}
+
+%files
+/usr/bin/test-post-fail
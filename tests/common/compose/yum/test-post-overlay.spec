@@ -0,0 +1,37 @@
+Summary: Test merging back a %post's changes to /usr
+Name: test-post-overlay
+Version: 1.0
+Release: 1
+License: GPLv2+
+Group: Development/Tools
+URL: http://example.com
+BuildArch: x86_64
+
+%description
+%{summary}
+
+%prep
+
+%build
+
+%post
+# A whiteout in the /usr overlay upper dir
+rm /usr/share/test-post-overlay/remove-me
+# An opaque directory replacing one that has content in the lower dir
+rm -rf /usr/share/test-post-overlay/replace-me
+mkdir /usr/share/test-post-overlay/replace-me
+echo new > /usr/share/test-post-overlay/replace-me/new
+# A copied-up directory with new metadata
+chmod 0700 /usr/share/test-post-overlay/chmod-me
+
+%install
+mkdir -p %{buildroot}/usr/share/test-post-overlay/{replace-me,chmod-me}
+echo remove > %{buildroot}/usr/share/test-post-overlay/remove-me
+echo old > %{buildroot}/usr/share/test-post-overlay/replace-me/old
+echo keep > %{buildroot}/usr/share/test-post-overlay/chmod-me/keep
+
+%clean
+rm -rf %{buildroot}
+
+%files
+/usr/share/test-post-overlay
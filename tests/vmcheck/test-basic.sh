@@ -45,3 +45,51 @@ echo "ok layering requires root"
 # Assert that we can do status as non-root
 vm_cmd "runuser -u bin rpm-ostree status"
 echo "ok status doesn't require root"
+
+# The read-only diff methods are handled in worker threads; make sure
+# several of them can be in flight at once and that the daemon keeps
+# answering other requests in the meantime.
+ospath=$(vm_cmd gdbus call --system --dest org.projectatomic.rpmostree1 \
+           --object-path /org/projectatomic/rpmostree1/Sysroot \
+           --method org.projectatomic.rpmostree1.Sysroot.GetOS '""' | \
+         sed -e "s,^(objectpath '\([^']*\)',)\$,\1,")
+booted_id=$(vm_get_booted_deployment_info id)
+vm_cmd "for i in \$(seq 8); do
+          gdbus call --system --dest org.projectatomic.rpmostree1 --object-path $ospath \
+            --method org.projectatomic.rpmostree1.OS.GetDeploymentsRpmDiff \
+            \"'$booted_id'\" \"'$booted_id'\" > /dev/null &
+        done
+        time timeout 30s rpm-ostree status > /dev/null
+        wait"
+echo "ok concurrent diff queries"
+
+# A reload needs the writer lock; it has to wait for the diff queries
+# without stalling the main loop, so status keeps working meanwhile.
+vm_cmd "for i in \$(seq 8); do
+          gdbus call --system --dest org.projectatomic.rpmostree1 --object-path $ospath \
+            --method org.projectatomic.rpmostree1.OS.GetDeploymentsRpmDiff \
+            \"'$booted_id'\" \"'$booted_id'\" > /dev/null &
+        done
+        timeout 60s rpm-ostree reload &
+        reload_pid=\$!
+        timeout 30s rpm-ostree status > /dev/null
+        wait \$reload_pid
+        wait"
+echo "ok reload concurrent with diff queries"
+
+# New diff queries wait while a reload is pending, so that a steady stream of
+# them can't starve it of the writer lock.
+vm_cmd "stop=\$((\$(date +%s) + 40))
+        for i in \$(seq 4); do
+          (while [ \$(date +%s) -lt \$stop ]; do
+             gdbus call --system --dest org.projectatomic.rpmostree1 --object-path $ospath \
+               --method org.projectatomic.rpmostree1.OS.GetDeploymentsRpmDiff \
+               \"'$booted_id'\" \"'$booted_id'\" > /dev/null
+           done) &
+        done
+        sleep 3
+        rc=0
+        timeout 20s rpm-ostree reload || rc=\$?
+        wait
+        exit \$rc"
+echo "ok reload not starved by a stream of diff queries"
@@ -115,3 +115,28 @@ vm_cmd lsinitrd $initramfs > lsinitrd.txt
 assert_not_file_has_content lsinitrd.txt /etc/rpmostree-initramfs-testing
 
 echo "ok initramfs args"
+
+# The initramfs cache is keyed on the input initramfs too, which changes
+# whenever the base updates a package dracut copies binaries from, even
+# one that doesn't ship dracut modules itself.
+vm_rpmostree initramfs --enable > initramfs.txt
+assert_file_has_content initramfs.txt "Generating initramfs.*cache miss"
+vm_rpmostree initramfs --disable
+vm_rpmostree initramfs --enable > initramfs.txt
+assert_file_has_content initramfs.txt "Generating initramfs.*cache hit"
+echo "ok initramfs cache hit"
+
+# Synthesize such an update by padding the base initramfs
+vm_cmd "rm -rf /var/tmp/initramfs-tree && mkdir -p /var/tmp/initramfs-tree/usr/lib &&
+        ostree checkout --subpath=/usr/lib/ostree-boot vmcheck \
+          /var/tmp/initramfs-tree/usr/lib/ostree-boot &&
+        cd /var/tmp/initramfs-tree/usr/lib/ostree-boot &&
+        f=\$(ls initramfs-*) && cat \$f > \$f.new &&
+        head -c 512 /dev/zero >> \$f.new && mv \$f.new \$f"
+vm_cmd ostree commit -b vmcheck --tree=ref=vmcheck --tree=dir=/var/tmp/initramfs-tree
+vm_rpmostree upgrade > upgrade.txt
+assert_file_has_content upgrade.txt "Generating initramfs.*cache miss"
+vm_cmd rm -rf /var/tmp/initramfs-tree
+vm_rpmostree cleanup -p
+vm_rpmostree initramfs --disable
+echo "ok initramfs cache miss on changed input initramfs"
@@ -118,3 +118,95 @@ vm_send_test_repo
 vm_rpmostree upgrade | tee output.txt
 assert_file_has_content output.txt '^Importing:'
 echo "ok invalidate pkgcache from RPM chksum"
+
+# Redeploying an identical layer on the same base reuses the commit
+# assembled before, unless the users and groups it resolves against changed
+vm_reboot
+vm_assert_layered_pkg foo present
+vm_rpmostree install bar
+vm_rpmostree uninstall bar | tee output.txt
+assert_file_has_content output.txt '^Reusing assembled commit'
+assert_not_file_has_content output.txt '^Importing:'
+vm_assert_status_jq \
+  '.deployments[0]["checksum"] == .deployments[1]["checksum"]'
+echo "ok reuse assembled commit"
+
+vm_rpmostree cleanup -p
+vm_cmd groupadd -r rpmostree-assembled-test
+vm_rpmostree install bar
+vm_rpmostree uninstall bar | tee output.txt
+assert_not_file_has_content output.txt '^Reusing assembled commit'
+vm_cmd groupdel rpmostree-assembled-test
+vm_rpmostree cleanup -p
+echo "ok no assembled commit reuse after group change"
+
+# With a pkgcache budget, unused packages are retained, and the least recently
+# used ones get evicted once they no longer fit
+pkgcache=/sysroot/ostree/repo/extensions/rpmostree/pkgcache
+vm_cmd ostree --repo=/sysroot/ostree/repo config set rpmostree.pkgcache-max-packages 2
+vm_rpmostree install bar
+vm_rpmostree cleanup -p | tee output.txt
+assert_not_file_has_content output.txt 'Evicting'
+vm_cmd ostree --repo=${pkgcache} refs > refs.txt
+assert_file_has_content refs.txt '/bar/'
+echo "ok pkgcache retains unused package within budget"
+
+# Make sure bar is the least recently used one
+barref=$(grep /bar/ refs.txt)
+barcommit=$(vm_cmd ostree --repo=${pkgcache} rev-parse ${barref})
+vm_cmd touch -d "'1 day ago'" ${pkgcache}/refs/heads/${barref}
+vm_rpmostree install empty
+vm_rpmostree cleanup -p | tee output.txt
+assert_file_has_content output.txt 'Evicting least recently used pkgcache branches'
+assert_file_has_content output.txt '1 evicted (.*), 1 unused retained'
+assert_file_has_content output.txt '^Freed pkgcache branches: 1 size:'
+vm_cmd ostree --repo=${pkgcache} refs > refs.txt
+assert_not_file_has_content refs.txt '/bar/'
+assert_file_has_content refs.txt '/empty/'
+assert_file_has_content refs.txt '/foo/'
+# The prune only walked what changed, but still freed bar's objects
+vm_cmd test -f ${pkgcache}/rpmostree-prune-index
+if vm_cmd ostree --repo=${pkgcache} show ${barcommit}; then
+    assert_not_reached "evicted commit ${barcommit} still in pkgcache"
+fi
+vm_cmd ostree --repo=${pkgcache} fsck
+echo "ok pkgcache evicts least recently used package"
+
+# A size budget smaller than what the deployments use evicts everything else
+vm_cmd ostree --repo=/sysroot/ostree/repo config set rpmostree.pkgcache-max-packages 0
+vm_cmd ostree --repo=/sysroot/ostree/repo config set rpmostree.pkgcache-max-size 1
+vm_rpmostree cleanup -b | tee output.txt
+assert_file_has_content output.txt '1 evicted (.*), 0 unused retained'
+vm_cmd ostree --repo=${pkgcache} refs > refs.txt
+assert_not_file_has_content refs.txt '/empty/'
+assert_file_has_content refs.txt '/foo/'
+vm_cmd ostree --repo=/sysroot/ostree/repo config set rpmostree.pkgcache-max-size 0
+rm -f refs.txt
+echo "ok pkgcache size budget"
+
+# A repeated dry run reuses the cached depsolve, and prints the same
+# transaction as the one that computed it
+vm_rpmostree cleanup -p
+vm_cmd rm -f /sysroot/ostree/repo/extensions/rpmostree/depsolve-cache
+vm_rpmostree install bar --dry-run | tee output-miss.txt
+assert_not_file_has_content output-miss.txt 'cache hit'
+vm_rpmostree install bar --dry-run | tee output-hit.txt
+assert_file_has_content output-hit.txt '^Resolving dependencies.*done (cache hit)'
+grep -E '^(Installing|Removing|Empty|  )' output-miss.txt > txn-miss.txt
+grep -E '^(Installing|Removing|Empty|  )' output-hit.txt > txn-hit.txt
+assert_file_has_content txn-hit.txt '^  bar-1.0-1.x86_64 (.*)$'
+diff -u txn-miss.txt txn-hit.txt
+echo "ok depsolve cache hit"
+
+# Different requested packages, or new repo metadata, invalidate it
+vm_rpmostree install bar empty --dry-run | tee output.txt
+assert_not_file_has_content output.txt 'cache hit'
+touch ${commondir}/compose/yum/bar.spec
+make -C ${builddir} tests/common/compose/yum/repo/repodata/repomd.xml
+vm_send_test_repo
+vm_rpmostree install bar --dry-run | tee output.txt
+assert_not_file_has_content output.txt 'cache hit'
+vm_rpmostree install bar --dry-run | tee output.txt
+assert_file_has_content output.txt 'cache hit'
+rm -f output*.txt txn-*.txt
+echo "ok depsolve cache invalidation"
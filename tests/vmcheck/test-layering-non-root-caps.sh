@@ -87,24 +87,52 @@ check_file() {
   check_fcap $1 $4
 }
 
-check_file /usr/bin/nrc-none.sh root root ""
-check_file /usr/bin/nrc-user.sh nrcuser root ""
-check_file /usr/bin/nrc-user-link.sh nrcuser root ""
-check_file /usr/bin/nrc-group.sh root nrcgroup ""
-check_file /usr/bin/nrc-caps.sh root root "cap_net_bind_service+ep"
-check_file /usr/bin/nrc-caps-setuid.sh root root "cap_net_bind_service+ep"
-vm_cmd test -u /usr/bin/nrc-caps-setuid.sh
-check_file /usr/bin/nrc-usergroup.sh nrcuser nrcgroup ""
-check_file /usr/bin/nrc-usergroupcaps.sh nrcuser nrcgroup "cap_net_bind_service+ep"
-check_file /usr/bin/nrc-usergroupcaps-setuid.sh nrcuser nrcgroup "cap_net_bind_service+ep"
-vm_cmd test -u /usr/bin/nrc-usergroupcaps-setuid.sh
-check_file /var/lib/nonrootcap nrcuser nrcgroup
-check_file /run/nonrootcap nrcuser nrcgroup
-check_file /var/lib/nonrootcap-rootowned root root
-check_file /run/nonrootcap-rootowned root root
-check_file /etc/nrc.conf nrcuser root
-check_file /etc/nrc-link.conf nrcuser root
+check_all_files() {
+  check_file /usr/bin/nrc-none.sh root root ""
+  check_file /usr/bin/nrc-user.sh nrcuser root ""
+  check_file /usr/bin/nrc-user-link.sh nrcuser root ""
+  check_file /usr/bin/nrc-group.sh root nrcgroup ""
+  check_file /usr/bin/nrc-caps.sh root root "cap_net_bind_service+ep"
+  check_file /usr/bin/nrc-caps-setuid.sh root root "cap_net_bind_service+ep"
+  vm_cmd test -u /usr/bin/nrc-caps-setuid.sh
+  check_file /usr/bin/nrc-usergroup.sh nrcuser nrcgroup ""
+  check_file /usr/bin/nrc-usergroupcaps.sh nrcuser nrcgroup "cap_net_bind_service+ep"
+  check_file /usr/bin/nrc-usergroupcaps-setuid.sh nrcuser nrcgroup "cap_net_bind_service+ep"
+  vm_cmd test -u /usr/bin/nrc-usergroupcaps-setuid.sh
+  check_file /var/lib/nonrootcap nrcuser nrcgroup
+  check_file /run/nonrootcap nrcuser nrcgroup
+  check_file /var/lib/nonrootcap-rootowned root root
+  check_file /run/nonrootcap-rootowned root root
+  check_file /etc/nrc.conf nrcuser root
+  check_file /etc/nrc-link.conf nrcuser root
+}
+
+check_all_files
 echo "ok correct user/group and fcaps"
 
 vm_cmd ostree fsck
 echo "ok fsck"
+
+# Assembling again from the pkgcache, without re-importing, must give the same
+# result; the ownership, setuid bits and fcaps then come from the manifest in
+# the cached commit's metadata
+pkgcache=/sysroot/ostree/repo/extensions/rpmostree/pkgcache
+nrcref=$(vm_cmd ostree --repo=${pkgcache} refs | grep /nonrootcap/)
+vm_cmd ostree --repo=${pkgcache} show --print-metadata-key rpmostree.unpack_minor_version ${nrcref} > minor.txt
+assert_file_has_content minor.txt 'uint32 4'
+vm_cmd ostree --repo=${pkgcache} show --print-metadata-key rpmostree.rpmfi_overrides ${nrcref} > overrides.txt
+assert_file_has_content overrides.txt nrc-usergroupcaps-setuid.sh
+vm_rpmostree uninstall nonrootcap
+vm_rpmostree cleanup -p
+# Don't let it just reuse the commit assembled before
+vm_cmd rm -f /sysroot/ostree/repo/extensions/rpmostree/assembled-index
+vm_rpmostree install nonrootcap | tee output.txt
+assert_not_file_has_content output.txt '^Importing:'
+assert_not_file_has_content output.txt '^Reusing assembled commit'
+vm_reboot
+vm_assert_layered_pkg nonrootcap present
+check_all_files
+vm_cmd stat -c '%a' /usr/bin/nrc-usergroupcaps-setuid.sh > mode.txt
+assert_file_has_content mode.txt '^4775$'
+rm -f minor.txt overrides.txt output.txt mode.txt
+echo "ok correct user/group and fcaps from pkgcache"
@@ -73,6 +73,40 @@ echo "ok upgrade"
 vm_assert_layered_pkg foo present
 echo "ok pkg foo relayered on upgrade"
 
+# A base change that doesn't touch the layer's paths lets us reuse the layer
+# as is rather than redoing the assembly
+vm_cmd "rm -rf /var/tmp/relayer-tree &&
+        mkdir -p /var/tmp/relayer-tree/usr/share/relayer-test &&
+        echo unrelated > /var/tmp/relayer-tree/usr/share/relayer-test/unrelated"
+commit=$(vm_cmd ostree commit -b vmcheck --tree=ref=vmcheck \
+           --tree=dir=/var/tmp/relayer-tree)
+vm_rpmostree upgrade > upgrade.txt
+assert_file_has_content upgrade.txt "Reusing 1 overlays from"
+reboot_and_assert_base $commit
+vm_assert_layered_pkg foo present
+vm_cmd cat /usr/share/relayer-test/unrelated > unrelated.txt
+assert_file_has_content unrelated.txt unrelated
+vm_cmd /usr/bin/foo > foo.txt
+assert_file_has_content foo.txt "Happy foobing"
+echo "ok pkg foo relayered onto new base"
+
+# But if the base changes a layered path, we redo the assembly, and the
+# package still wins
+vm_cmd "rm -rf /var/tmp/relayer-tree &&
+        mkdir -p /var/tmp/relayer-tree/usr/bin &&
+        printf '#!/bin/sh\necho from the base\n' > /var/tmp/relayer-tree/usr/bin/foo &&
+        chmod a+x /var/tmp/relayer-tree/usr/bin/foo"
+commit=$(vm_cmd ostree commit -b vmcheck --tree=ref=vmcheck \
+           --tree=dir=/var/tmp/relayer-tree)
+vm_cmd rm -rf /var/tmp/relayer-tree
+vm_rpmostree upgrade > upgrade.txt
+assert_not_file_has_content upgrade.txt "Reusing .* overlays"
+reboot_and_assert_base $commit
+vm_assert_layered_pkg foo present
+vm_cmd /usr/bin/foo > foo.txt
+assert_file_has_content foo.txt "Happy foobing"
+echo "ok pkg foo reassembled when base changes its paths"
+
 # DEPLOY
 
 commit=$(vm_cmd ostree commit -b vmcheck \
@@ -49,3 +49,35 @@ echo "ok group scriptpkg1 active"
 if vm_rpmostree install test-post-rofiles-violation; then
     assert_not_reached "installed test-post-rofiles-violation!"
 fi
+echo "ok script modifying /usr in place fails"
+
+# See test-post-overlay.spec; its %post changes to /usr are merged back from
+# the overlay upper dir
+vm_rpmostree install test-post-overlay
+vm_reboot
+vm_assert_layered_pkg test-post-overlay present
+vm_cmd test ! -e /usr/share/test-post-overlay/remove-me
+vm_cmd test ! -e /usr/share/test-post-overlay/replace-me/old
+vm_cmd test -f /usr/share/test-post-overlay/replace-me/new
+vm_cmd test -f /usr/share/test-post-overlay/chmod-me/keep
+vm_cmd stat -c %a /usr/share/test-post-overlay/chmod-me > mode.txt
+assert_file_has_content mode.txt '^700$'
+vm_cmd getfattr -R -d -m '^trusted\.overlay\.' --absolute-names /usr/share/test-post-overlay > xattrs.txt
+assert_not_file_has_content xattrs.txt 'trusted\.overlay'
+# The overlay's scratch dir lives outside the rootfs, and is gone afterwards
+vm_cmd ostree ls -R $(vm_get_booted_csum) / > ls.txt
+assert_not_file_has_content ls.txt 'rpmostree-usr-overlay'
+if vm_cmd ls -d /ostree/repo/tmp/rpmostree-usr-overlay.* 2>/dev/null; then
+    assert_not_reached "overlay scratch dir left behind"
+fi
+echo "ok script whiteouts, opaque dirs and metadata merged"
+
+# All of a phase's scripts run in one container; a failure in the middle of
+# the batch should still be attributed to the right package
+if vm_rpmostree install test-post-fail 2>err.txt; then
+    assert_not_reached "installed test-post-fail!"
+fi
+assert_file_has_content err.txt 'Running %post for test-post-fail: .*exited with code 3'
+assert_not_file_has_content err.txt 'for test-post-overlay'
+vm_assert_status_jq '.deployments[0].booted'
+echo "ok failing script in a batch names its package"
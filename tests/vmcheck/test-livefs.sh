@@ -130,3 +130,21 @@ vm_assert_status_jq '.deployments|length == 2' '.deployments[0]["live-replaced"]
                     '.deployments[1]["live-replaced"]|not'
 assert_file_has_content livefs-analysis.txt 'live updates not currently supported for modifications'
 echo "ok no modifications"
+
+# Many new files under one /usr directory, plus a new config file; also check
+# the /usr, rpmdb and /etc stages are timed separately
+reset
+vm_rpmostree install /tmp/vmcheck/repo/packages/x86_64/test-livefs-many-1.0-1.x86_64.rpm
+assert_livefs_ok
+vm_rpmostree ex livefs
+vm_cmd rpm -q test-livefs-many > rpmq.txt
+assert_file_has_content rpmq.txt test-livefs-many-1.0-1
+vm_cmd ls /usr/share/test-livefs-many > ls.txt
+assert_streq "$(wc -l < ls.txt)" 20
+vm_cmd cat /usr/share/test-livefs-many/data-20.txt > data.txt
+assert_file_has_content data.txt "data file 20"
+vm_cmd cat /etc/test-livefs-many.conf > test-livefs-many.conf
+assert_file_has_content test-livefs-many.conf "A config file for test-livefs-many"
+vm_cmd journalctl -b -o cat MESSAGE_ID=d68ab4d9d1324a328ff8c6241c6eb3c3 | tail -1 > livefs-journal.txt
+assert_file_has_content livefs-journal.txt '/usr: [0-9]* paths in .*s, rpmdb: .*s, /etc: .*s'
+echo "ok livefs many files in one directory"